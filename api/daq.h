@@ -70,6 +70,16 @@ DAQ_LINKAGE int daq_acquire(const DAQ_Module_t *module, void *handle, int cnt, D
 DAQ_LINKAGE int daq_acquire_with_meta(const DAQ_Module_t *module, void *handle, int cnt,
                                       DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback,
                                       void *user);
+DAQ_LINKAGE int daq_acquire_batch(const DAQ_Module_t *module, void *handle, int cnt,
+                                  DAQ_Analysis_Batch_Func_t callback, DAQ_Meta_Func_t metaback,
+                                  void *user);
+DAQ_LINKAGE int daq_acquire_deferred(const DAQ_Module_t *module, void *handle, int cnt,
+                                     DAQ_Analysis_Deferred_Func_t callback, DAQ_Meta_Func_t metaback,
+                                     void *user);
+DAQ_LINKAGE int daq_acquire_ex(const DAQ_Module_t *module, void *handle, int cnt,
+                               const DAQ_AcquireCtx_t *ctx);
+DAQ_LINKAGE int daq_set_verdict(const DAQ_Module_t *module, void *handle, uint32_t token,
+                                DAQ_Verdict verdict);
 DAQ_LINKAGE int daq_inject(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse);
 DAQ_LINKAGE int daq_breakloop(const DAQ_Module_t *module, void *handle);
 DAQ_LINKAGE int daq_stop(const DAQ_Module_t *module, void *handle);
@@ -84,10 +94,28 @@ DAQ_LINKAGE const char *daq_get_error(const DAQ_Module_t *module, void *handle);
 DAQ_LINKAGE void daq_clear_error(const DAQ_Module_t *module, void *handle);
 DAQ_LINKAGE int daq_modify_flow(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr, const DAQ_ModFlow_t *modify);
 DAQ_LINKAGE int daq_query_flow(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr, DAQ_QueryFlow_t *query);
+DAQ_LINKAGE int daq_get_perf_stats(const DAQ_Module_t *module, void *handle, DAQ_PerfStats_t *perf_stats);
 DAQ_LINKAGE int daq_hup_prep(const DAQ_Module_t *module, void *handle, void **new_config);
 DAQ_LINKAGE int daq_hup_apply(const DAQ_Module_t *module, void *handle, void *new_config, void **old_config);
 DAQ_LINKAGE int daq_hup_post(const DAQ_Module_t *module, void *handle, void *old_config);
 DAQ_LINKAGE int daq_dp_add_dc(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr, DAQ_DP_key_t *dp_key,
         const uint8_t *packet_data, DAQ_Data_Channel_Params_t *params);
 
+/* DAQ Module Instance Group functions.
+ * A group stands up N cooperating instances of a multi-instance module from
+ * one shared configuration (e.g. afpacket fanout workers) and aggregates
+ * their statistics into a single coherent view. */
+typedef struct _daq_instance_group DAQ_InstanceGroup_t;
+
+DAQ_LINKAGE int daq_group_initialize(const DAQ_Module_t *module, const DAQ_Config_t *config,
+                                     unsigned count, DAQ_InstanceGroup_t **group,
+                                     char *errbuf, size_t len);
+DAQ_LINKAGE unsigned daq_group_size(const DAQ_InstanceGroup_t *group);
+DAQ_LINKAGE void *daq_group_handle(const DAQ_InstanceGroup_t *group, unsigned index);
+DAQ_LINKAGE int daq_group_start(const DAQ_InstanceGroup_t *group);
+DAQ_LINKAGE int daq_group_stop(const DAQ_InstanceGroup_t *group);
+DAQ_LINKAGE int daq_group_get_stats(const DAQ_InstanceGroup_t *group, DAQ_Stats_t *stats);
+DAQ_LINKAGE void daq_group_reset_stats(const DAQ_InstanceGroup_t *group);
+DAQ_LINKAGE int daq_group_shutdown(DAQ_InstanceGroup_t *group);
+
 #endif /* _DAQ_H */
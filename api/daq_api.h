@@ -101,9 +101,30 @@ struct _daq_module
                       const uint8_t *packet_data, DAQ_Data_Channel_Params_t *params);
     /* Query a flow */
     int (*query_flow) (void *handle, const DAQ_PktHdr_t *hdr, DAQ_QueryFlow_t *query);
+    /* Acquire up to <cnt> packets like acquire(), but deliver them to <callback> in batches
+       of parallel header/data arrays and read back one verdict per packet, amortizing the
+       callback dispatch overhead.  Optional - modules that can't gather packets in bursts
+       should leave this NULL. */
+    int (*acquire_batch) (void *handle, int cnt, DAQ_Analysis_Batch_Func_t callback, DAQ_Meta_Func_t metaback, void *user);
+    /* Acquire up to <cnt> packets like acquire(), but tag each packet handed to <callback> with
+       an opaque token instead of demanding a synchronous verdict.  The application posts the
+       verdict for each token later through set_verdict() - potentially from another thread -
+       while the acquire loop keeps draining packets.  Optional. */
+    int (*acquire_deferred) (void *handle, int cnt, DAQ_Analysis_Deferred_Func_t callback, DAQ_Meta_Func_t metaback, void *user);
+    /* Post the verdict for a packet previously delivered through acquire_deferred(). */
+    int (*set_verdict) (void *handle, uint32_t token, DAQ_Verdict verdict);
+    /* Retrieve the opt-in acquire-loop latency histograms (see DAQ_PerfStats_t).
+       Optional - modules without instrumentation, or instances that weren't
+       configured to collect it, should leave this NULL or return
+       DAQ_ERROR_NOTSUP. */
+    int (*get_perf_stats) (void *handle, DAQ_PerfStats_t *perf_stats);
 };
 
-#define DAQ_API_VERSION    0x00010007
+/* 0x0001000a - Optional get_perf_stats operation for acquire-loop latency
+ *              histograms.
+ * 0x00010009 - Compact v2 DAQ_PktHdr_t layout; real-address block moved to
+ *              DAQ_RealAddr_t, reached via priv_ptr. */
+#define DAQ_API_VERSION    0x0001000a
 
 #define DAQ_ERRBUF_SIZE 256
 /* This is a convenience macro for safely printing to DAQ error buffers.  It must be called on a known-size character array. */
@@ -107,6 +107,18 @@ typedef struct _daq_list_node
 static DAQ_ListNode_t *module_list = NULL;
 static int num_modules = 0;
 
+/* Modules discovered by daq_load_modules() but not yet dlopen()'d.  A sensor
+   uses exactly one module, so the rest are left on this list and only opened
+   if daq_find_module() or daq_get_module_list() actually asks for them. */
+typedef struct _daq_pending_node
+{
+    char *name;
+    char *path;
+    struct _daq_pending_node *next;
+} DAQ_PendingNode_t;
+
+static DAQ_PendingNode_t *pending_list = NULL;
+
 static const char *daq_verdict_strings[MAX_DAQ_VERDICT] = {
     "pass",         // DAQ_VERDICT_PASS
     "block",        // DAQ_VERDICT_BLOCK
@@ -155,6 +167,8 @@ DAQ_LINKAGE const char *daq_state_string(DAQ_State state)
     return daq_state_strings[state];
 }
 
+static int daq_load_pending(const char *name);
+
 DAQ_LINKAGE const DAQ_Module_t *daq_find_module(const char *name)
 {
     DAQ_ListNode_t *node;
@@ -165,6 +179,16 @@ DAQ_LINKAGE const DAQ_Module_t *daq_find_module(const char *name)
             return node->module;
     }
 
+    /* Not loaded yet - try the deferred list populated by daq_load_modules(). */
+    if (daq_load_pending(name) == DAQ_SUCCESS)
+    {
+        for (node = module_list; node; node = node->next)
+        {
+            if (!strcmp(name, node->module->name))
+                return node->module;
+        }
+    }
+
     return NULL;
 }
 
@@ -267,6 +291,191 @@ static int daq_load_module(const char *filename)
     return DAQ_SUCCESS;
 }
 
+static int pending_add(const char *name, const char *path)
+{
+    DAQ_PendingNode_t *node;
+
+    node = calloc(1, sizeof(DAQ_PendingNode_t));
+    if (!node)
+        return DAQ_ERROR_NOMEM;
+    node->name = strdup(name);
+    node->path = strdup(path);
+    if (!node->name || !node->path)
+    {
+        free(node->name);
+        free(node->path);
+        free(node);
+        return DAQ_ERROR_NOMEM;
+    }
+    node->next = pending_list;
+    pending_list = node;
+
+    return DAQ_SUCCESS;
+}
+
+/* Load (and unlink) every deferred module whose name matches, or all of them
+   if name is NULL.  Duplicate names are all loaded so that register_module()
+   can arbitrate between versions like it always has. */
+static int daq_load_pending(const char *name)
+{
+    DAQ_PendingNode_t *node, **prev;
+    int loaded = 0;
+
+    prev = &pending_list;
+    while ((node = *prev) != NULL)
+    {
+        if (name && strcmp(name, node->name))
+        {
+            prev = &node->next;
+            continue;
+        }
+        if (daq_load_module(node->path) == DAQ_SUCCESS)
+            loaded++;
+        *prev = node->next;
+        free(node->name);
+        free(node->path);
+        free(node);
+    }
+
+    return loaded ? DAQ_SUCCESS : DAQ_ERROR;
+}
+
+/* Dynamic modules in this tree all follow the daq_<name>.so naming convention,
+   which lets us learn the module name without paying for a dlopen(). */
+static int module_name_from_filename(const char *filename, char *name, size_t len)
+{
+    const char *ext;
+    size_t n;
+
+    if (strncmp(filename, "daq_", 4))
+        return DAQ_ERROR;
+    ext = strrchr(filename, '.');
+    if (!ext || ext <= filename + 4)
+        return DAQ_ERROR;
+    n = ext - (filename + 4);
+    if (n >= len)
+        return DAQ_ERROR;
+    memcpy(name, filename + 4, n);
+    name[n] = '\0';
+
+    return DAQ_SUCCESS;
+}
+
+/* Fallback for unconventionally named modules - crack the library open just
+   long enough to read its name out of DAQ_MODULE_DATA. */
+static int probe_module_name(const char *path, char *name, size_t len)
+{
+    const DAQ_Module_t *dm;
+    void *dl_handle;
+
+    if ((dl_handle = dlopen(path, RTLD_NOW)) == NULL)
+    {
+        fprintf(stderr, "%s: %s: %s\n", path, dlopen_func_name, dlerror());
+        return DAQ_ERROR;
+    }
+
+    if ((dm = (const DAQ_Module_t*)dlsym(dl_handle, "DAQ_MODULE_DATA")) == NULL)
+    {
+        fprintf(stderr, "%s: %s: %s\n", path, dlsym_func_name, dlerror());
+        dlclose(dl_handle);
+        return DAQ_ERROR;
+    }
+
+    snprintf(name, len, "%s", dm->name);
+    dlclose(dl_handle);
+
+    return DAQ_SUCCESS;
+}
+
+#define MODULE_MANIFEST ".daq_manifest"
+
+/* Populate the deferred list from a manifest left behind by a previous scan
+   of this directory.  The first line holds the directory's mtime at the time
+   the manifest was written; a mismatch means the manifest is stale and the
+   caller should fall back to a full scan. */
+static int manifest_read(const char *directory)
+{
+    char manifest[NAME_SIZE];
+    char line[NAME_SIZE * 2];
+    char path[NAME_SIZE];
+    char *name, *filename, *nl;
+    struct stat fs;
+    long mtime;
+    FILE *fp;
+
+    if (stat(directory, &fs) != 0)
+        return DAQ_ERROR;
+
+    snprintf(manifest, sizeof(manifest), "%s/%s", directory, MODULE_MANIFEST);
+    if ((fp = fopen(manifest, "r")) == NULL)
+        return DAQ_ERROR;
+
+    if (!fgets(line, sizeof(line), fp) || sscanf(line, "%ld", &mtime) != 1 ||
+        mtime != (long) fs.st_mtime)
+    {
+        fclose(fp);
+        return DAQ_ERROR;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if ((nl = strchr(line, '\n')) != NULL)
+            *nl = '\0';
+        name = line;
+        filename = strchr(line, '\t');
+        if (!filename)
+            continue;
+        *filename++ = '\0';
+        if (!*name || !*filename)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, filename);
+        if (pending_add(name, path) == DAQ_ERROR_NOMEM)
+        {
+            fclose(fp);
+            return DAQ_ERROR_NOMEM;
+        }
+    }
+    fclose(fp);
+
+    return DAQ_SUCCESS;
+}
+
+/* Record the entries added to the deferred list by the scan that just
+   finished (everything from the head of the list down to 'until').  This is
+   strictly best effort - failing to write just means the next startup pays
+   for another scan. */
+static void manifest_write(const char *directory, DAQ_PendingNode_t *until)
+{
+    char manifest[NAME_SIZE];
+    DAQ_PendingNode_t *node;
+    const char *filename;
+    struct stat fs;
+    FILE *fp;
+
+    snprintf(manifest, sizeof(manifest), "%s/%s", directory, MODULE_MANIFEST);
+    if ((fp = fopen(manifest, "w")) == NULL)
+        return;
+
+    /* Stat the directory after creating the manifest so that the stored mtime
+       reflects the manifest's own directory entry. */
+    if (stat(directory, &fs) != 0)
+    {
+        fclose(fp);
+        unlink(manifest);
+        return;
+    }
+
+    fprintf(fp, "%ld\n", (long) fs.st_mtime);
+    for (node = pending_list; node && node != until; node = node->next)
+    {
+        filename = strrchr(node->path, '/');
+        fprintf(fp, "%s\t%s\n", node->name, filename ? filename + 1 : node->path);
+    }
+
+    if (fclose(fp) != 0)
+        unlink(manifest);
+}
+
 #ifdef STATIC_MODULE_LIST
 static void load_static_modules(void)
 {
@@ -299,16 +508,32 @@ DAQ_LINKAGE int daq_load_modules(const char *directory_list[])
 
     for (; directory_list && *directory_list; directory_list++)
     {
+        DAQ_PendingNode_t *scanned;
+        char name[NAME_SIZE];
+
         if (!(**directory_list))
             continue;
+
+        /* If a fresh manifest from a previous scan is available, use it to
+           populate the deferred list without touching the modules at all. */
+        ret = manifest_read(*directory_list);
+        if (ret == DAQ_SUCCESS)
+        {
+            DEBUG("Using module manifest in: %s\n", *directory_list);
+            continue;
+        }
+        if (ret == DAQ_ERROR_NOMEM)
+            return DAQ_ERROR_NOMEM;
+
         if ((dirp = opendir(*directory_list)) == NULL)
         {
             fprintf(stderr,"Unable to open directory \"%s\"\n", *directory_list);
             continue;
         }
 
-        DEBUG("Loading modules in: %s\n", *directory_list);
+        DEBUG("Scanning modules in: %s\n", *directory_list);
 
+        scanned = pending_list;
         while((de = readdir(dirp)) != NULL)
         {
             p = strrchr(de->d_name, '.');
@@ -316,7 +541,11 @@ DAQ_LINKAGE int daq_load_modules(const char *directory_list[])
                 continue;
             snprintf(dirpath, sizeof(dirpath), "%s/%s", *directory_list, de->d_name);
 
-            ret = daq_load_module(dirpath);
+            if (module_name_from_filename(de->d_name, name, sizeof(name)) != DAQ_SUCCESS &&
+                probe_module_name(dirpath, name, sizeof(name)) != DAQ_SUCCESS)
+                continue;
+
+            ret = pending_add(name, dirpath);
             if (ret == DAQ_SUCCESS)
             {
                 DEBUG("Found module %s\n", de->d_name);
@@ -328,6 +557,8 @@ DAQ_LINKAGE int daq_load_modules(const char *directory_list[])
             }
         }
         closedir(dirp);
+
+        manifest_write(*directory_list, scanned);
     }
 #else
     /* Find all shared library files in path */
@@ -406,6 +637,7 @@ DAQ_LINKAGE int daq_load_modules(const char *directory_list[])
 DAQ_LINKAGE void daq_unload_modules(void)
 {
     DAQ_ListNode_t *node;
+    DAQ_PendingNode_t *pnode;
 
     while (module_list)
     {
@@ -418,6 +650,15 @@ DAQ_LINKAGE void daq_unload_modules(void)
         free(node);
         num_modules--;
     }
+
+    while (pending_list)
+    {
+        pnode = pending_list;
+        pending_list = pnode->next;
+        free(pnode->name);
+        free(pnode->path);
+        free(pnode);
+    }
 }
 
 DAQ_LINKAGE void daq_print_stats(DAQ_Stats_t *stats, FILE *fp)
@@ -451,6 +692,10 @@ DAQ_LINKAGE int daq_get_module_list(DAQ_Module_Info_t *list[])
     if (!list)
         return DAQ_ERROR_INVAL;
 
+    /* Anything still deferred has to be loaded before we can report on it. */
+    if (pending_list)
+        daq_load_pending(NULL);
+
     info = calloc(num_modules, sizeof(DAQ_Module_Info_t));
     if (!info)
         return DAQ_ERROR_NOMEM;
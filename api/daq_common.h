@@ -106,8 +106,24 @@
 #define DAQ_PKT_FLAG_TRACE_ENABLED      0x080000 /* Tracing due to packet trace or capture with trace */
 #define DAQ_PKT_FLAG_SIMULATED          0x100000 /* Packet is simulated/virtual */
 
+/* Real (pre-NAT) address information for a packet.  Only meaningful when
+ * DAQ_PKT_FLAG_REAL_ADDRESSES is set in the packet header flags, in which
+ * case the header's priv_ptr points to this structure. */
+typedef struct _daq_real_addr
+{
+    struct in6_addr real_sIP;
+    struct in6_addr real_dIP;
+    uint16_t n_real_sPort;
+    uint16_t n_real_dPort;
+} DAQ_RealAddr_t;
+
 /* The DAQ packet header structure passed to DAQ Analysis Functions.
- * This should NEVER be modified by user applications. */
+ * This should NEVER be modified by user applications.
+ *
+ * Version 2 layout: the fields touched on every packet come first so that
+ * they all land in a single cache line, and the rarely-valid real-address
+ * block for NAT'ed connections has been moved out into the optional
+ * DAQ_RealAddr_t structure above. */
 #define DAQ_PKTHDR_UNKNOWN  -1  /* Ingress or Egress not known */
 #define DAQ_PKTHDR_FLOOD    -2  /* Egress is flooding */
 typedef struct _daq_pkthdr
@@ -115,22 +131,18 @@ typedef struct _daq_pkthdr
     struct timeval ts;      /* Timestamp */
     uint32_t caplen;        /* Length of the portion present */
     uint32_t pktlen;        /* Length of this packet (off wire) */
+    uint32_t flags;         /* Flags for the packet (DAQ_PKT_FLAG_*) */
+    uint32_t flow_id;       /* Flow ID value provided from the DAQ module or underlying hardware. */
+    uint32_t opaque;        /* Opaque context value from the DAQ module or underlying hardware.
+                               Directly related to the opaque value in FlowStats. */
     int32_t ingress_index;  /* Index of the inbound interface. */
     int32_t egress_index;   /* Index of the outbound interface. */
     int32_t ingress_group;  /* Index of the inbound group. */
     int32_t egress_group;   /* Index of the outbound group. */
-    uint32_t flags;         /* Flags for the packet (DAQ_PKT_FLAG_*) */
-    uint32_t opaque;        /* Opaque context value from the DAQ module or underlying hardware.
-                               Directly related to the opaque value in FlowStats. */
-    void *priv_ptr;         /* Private data pointer */
-    uint32_t flow_id;       /* Flow ID value provided from the DAQ module or underlying hardware. */
     uint16_t address_space_id; /* Unique ID of the address space */
-
-    /* Real values for NAT'ed connections */
-    struct in6_addr real_sIP;
-    struct in6_addr real_dIP;
-    uint16_t n_real_sPort;
-    uint16_t n_real_dPort;
+    uint16_t reserved;      /* Unused, for alignment */
+    void *priv_ptr;         /* Private data pointer (DAQ_RealAddr_t when
+                               DAQ_PKT_FLAG_REAL_ADDRESSES is set) */
 } DAQ_PktHdr_t;
 
 
@@ -296,6 +308,27 @@ typedef enum {
 
 typedef DAQ_Verdict (*DAQ_Analysis_Func_t)(void *user, const DAQ_PktHdr_t *hdr, const uint8_t *data);
 typedef int (*DAQ_Meta_Func_t)(void *user, const DAQ_MetaHdr_t *hdr, const uint8_t *data);
+/* Vectorized analysis callback invoked once per batch of packets delivered by a module's
+    acquire_batch() operation.  The callback must fill in one entry in <verdicts> for each
+    of the <count> packets described by the parallel <hdrs> and <data> arrays. */
+typedef void (*DAQ_Analysis_Batch_Func_t)(void *user, const DAQ_PktHdr_t **hdrs, const uint8_t **data,
+                                          unsigned count, DAQ_Verdict *verdicts);
+/* Deferred analysis callback invoked by a module's acquire_deferred() operation.  Unlike
+    DAQ_Analysis_Func_t, no verdict is returned; the application must eventually post one
+    for <token> through the module's set_verdict() operation. */
+typedef void (*DAQ_Analysis_Deferred_Func_t)(void *user, const DAQ_PktHdr_t *hdr, const uint8_t *data,
+                                             uint32_t token);
+
+/* Callback context for daq_acquire_ex().  Applications that define one of these
+    as static const hand the compiler a constant callback pointer, so under LTO
+    the acquire loop of a single-module build can be inlined with the callback
+    itself rather than calling through a pointer loaded per packet. */
+typedef struct _daq_acquire_ctx
+{
+    DAQ_Analysis_Func_t analysis_func;  /* Per-packet analysis callback (required) */
+    DAQ_Meta_Func_t meta_func;          /* Metadata callback (may be NULL) */
+    void *user;                         /* Opaque pointer passed to the callbacks */
+} DAQ_AcquireCtx_t;
 
 typedef enum {
     DAQ_MODE_PASSIVE,
@@ -328,6 +361,19 @@ typedef enum {
     MAX_DAQ_STATE
 } DAQ_State;
 
+#define DAQ_CACHELINE_SIZE 64
+
+#ifdef __GNUC__
+#define DAQ_ALIGNED(x) __attribute__((aligned(x)))
+#else
+#define DAQ_ALIGNED(x)
+#endif
+
+/* Each module instance owns one DAQ_Stats_t and its acquire loop is the only
+   writer, so instances are natural counter shards.  The structure is aligned
+   to a cache line so co-located instances (e.g. fanout workers) never false
+   share, and readers should snapshot it with daq_stats_snapshot() so polling
+   from a telemetry thread neither tears a counter nor stalls acquisition. */
 typedef struct _daq_stats
 {
     uint64_t hw_packets_received;       /* Packets received by the hardware */
@@ -336,7 +382,82 @@ typedef struct _daq_stats
     uint64_t packets_filtered;          /* Packets filtered by this instance's BPF */
     uint64_t packets_injected;          /* Packets injected by this instance */
     uint64_t verdicts[MAX_DAQ_VERDICT]; /* Counters of packets handled per-verdict. */
-} DAQ_Stats_t;
+} DAQ_ALIGNED(DAQ_CACHELINE_SIZE) DAQ_Stats_t;
+
+static inline void daq_stats_snapshot(const DAQ_Stats_t *src, DAQ_Stats_t *dst)
+{
+    int i;
+
+#ifdef __GNUC__
+    dst->hw_packets_received = __atomic_load_n(&src->hw_packets_received, __ATOMIC_RELAXED);
+    dst->hw_packets_dropped = __atomic_load_n(&src->hw_packets_dropped, __ATOMIC_RELAXED);
+    dst->packets_received = __atomic_load_n(&src->packets_received, __ATOMIC_RELAXED);
+    dst->packets_filtered = __atomic_load_n(&src->packets_filtered, __ATOMIC_RELAXED);
+    dst->packets_injected = __atomic_load_n(&src->packets_injected, __ATOMIC_RELAXED);
+    for (i = 0; i < MAX_DAQ_VERDICT; i++)
+        dst->verdicts[i] = __atomic_load_n(&src->verdicts[i], __ATOMIC_RELAXED);
+#else
+    *dst = *src;
+    (void) i;
+#endif
+}
+
+/* Opt-in acquire-loop latency instrumentation.  Modules that support it
+   collect per-stage cycle histograms into a preallocated per-instance
+   DAQ_PerfStats_t and expose them through the get_perf_stats operation.
+   Buckets are log2 of the cycle count, so bucket N covers [2^N, 2^(N+1))
+   cycles, with the last bucket absorbing everything larger. */
+typedef enum {
+    DAQ_PERF_STAGE_WAIT = 0,    /* Waiting on the kernel/ring for packets */
+    DAQ_PERF_STAGE_FILTER,      /* BPF evaluation */
+    DAQ_PERF_STAGE_CALLBACK,    /* Analysis callback */
+    DAQ_PERF_STAGE_VERDICT,     /* Verdict application / transmit */
+    MAX_DAQ_PERF_STAGE
+} DAQ_PerfStage;
+
+#define DAQ_PERF_BUCKETS 24
+
+typedef struct _daq_perf_stats
+{
+    uint64_t buckets[MAX_DAQ_PERF_STAGE][DAQ_PERF_BUCKETS];
+    uint64_t total_cycles[MAX_DAQ_PERF_STAGE];
+    uint64_t samples[MAX_DAQ_PERF_STAGE];
+} DAQ_PerfStats_t;
+
+/* Cheap monotonic cycle counter for the instrumentation above; falls back to
+   0 on architectures without a userspace counter, which disables collection
+   gracefully. */
+static inline uint64_t daq_perf_cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+#elif defined(__GNUC__) && defined(__aarch64__)
+    uint64_t cntvct;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (cntvct));
+    return cntvct;
+#else
+    return 0;
+#endif
+}
+
+static inline void daq_perf_record(DAQ_PerfStats_t *perf, DAQ_PerfStage stage, uint64_t cycles)
+{
+    uint64_t c = cycles;
+    int bucket = 0;
+
+    while (c > 1 && bucket < DAQ_PERF_BUCKETS - 1)
+    {
+        c >>= 1;
+        bucket++;
+    }
+    perf->buckets[stage][bucket]++;
+    perf->total_cycles[stage] += cycles;
+    perf->samples[stage]++;
+}
 
 #define DAQ_DP_TUNNEL_TYPE_NON_TUNNEL 0
 #define DAQ_DP_TUNNEL_TYPE_GTP_TUNNEL 1
@@ -0,0 +1,295 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+** Copyright (C) 2010-2013 Sourcefire, Inc.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _DAQ_FLOW_CACHE_H
+#define _DAQ_FLOW_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <daq_common.h>
+
+/*
+ * Software flow fastpath cache for modules without hardware flow offload.
+ *
+ * Modules whose acquire loops cannot push WHITELIST/BLACKLIST verdicts down
+ * into hardware can use this open-addressing 5-tuple hash table to
+ * short-circuit the rest of such flows before the analysis callback, the
+ * same way they already apply sfbpf_filter() inline.  Everything is
+ * implemented here as static inline functions so that a module picks it up
+ * with a plain #include and no new link dependency.
+ *
+ * Each cache belongs to exactly one module context and is only ever touched
+ * from that context's acquire loop, so no locking or atomics are needed on
+ * the per-packet path.
+ */
+
+#define DAQ_FLOW_CACHE_PROBE_LIMIT 8
+
+typedef struct _daq_flow_key
+{
+    uint8_t addr[2][16];        /* IPv4 addresses are zero-padded */
+    uint16_t port[2];
+    uint8_t proto;
+    uint8_t family;             /* 4 or 6 */
+} DAQ_FlowKey_t;
+
+typedef struct _daq_flow_cache_entry
+{
+    DAQ_FlowKey_t key;
+    uint32_t hash;
+    uint8_t verdict;            /* DAQ_VERDICT_WHITELIST or _BLACKLIST */
+    uint8_t in_use;
+} DAQ_FlowCacheEntry_t;
+
+typedef struct _daq_flow_cache
+{
+    DAQ_FlowCacheEntry_t *entries;
+    uint32_t mask;              /* entry count - 1 (power of two) */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} DAQ_FlowCache_t;
+
+static inline int daq_flow_cache_init(DAQ_FlowCache_t *cache, uint32_t size)
+{
+    uint32_t entries = 1;
+
+    if (!size)
+        return -1;
+
+    while (entries < size)
+        entries <<= 1;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->entries = calloc(entries, sizeof(*cache->entries));
+    if (!cache->entries)
+        return -1;
+    cache->mask = entries - 1;
+
+    return 0;
+}
+
+static inline void daq_flow_cache_cleanup(DAQ_FlowCache_t *cache)
+{
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->mask = 0;
+}
+
+static inline uint32_t daq_flow_key_hash(const DAQ_FlowKey_t *key)
+{
+    const uint8_t *data = (const uint8_t *) key;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Extract a direction-independent 5-tuple key starting at an IP header,
+ * with the version taken from the version nibble.  This is the piece shared
+ * between plain Ethernet frames and the inner headers of decapsulated
+ * tunnels, which arrive as bare IP.  Returns 0 on success or -1 for traffic
+ * the cache does not handle (non-IP, fragments, non-TCP/UDP). */
+static inline int daq_flow_key_extract_ip(const uint8_t *data, uint32_t len, DAQ_FlowKey_t *key)
+{
+    uint32_t offset;
+    const uint8_t *ports;
+    int swap;
+
+    memset(key, 0, sizeof(*key));
+
+    if (len < 20)
+        return -1;
+
+    if ((data[0] >> 4) == 4)    /* IPv4 */
+    {
+        /* Skip fragments - their 5-tuple is not reliable past the first. */
+        if ((data[6] & 0x3f) || data[7])
+            return -1;
+
+        key->proto = data[9];
+        memcpy(&key->addr[0], &data[12], 4);
+        memcpy(&key->addr[1], &data[16], 4);
+        key->family = 4;
+
+        offset = (data[0] & 0x0f) * 4;
+    }
+    else if ((data[0] >> 4) == 6)   /* IPv6 */
+    {
+        if (len < 40)
+            return -1;
+
+        key->proto = data[6];
+        memcpy(&key->addr[0], &data[8], 16);
+        memcpy(&key->addr[1], &data[24], 16);
+        key->family = 6;
+
+        offset = 40;
+    }
+    else
+        return -1;
+
+    if (key->proto != 6 && key->proto != 17)    /* TCP or UDP */
+        return -1;
+    if (len < offset + 4)
+        return -1;
+
+    ports = &data[offset];
+    key->port[0] = (ports[0] << 8) | ports[1];
+    key->port[1] = (ports[2] << 8) | ports[3];
+
+    /* Canonicalize so that both directions of a flow map to one key. */
+    swap = memcmp(&key->addr[0], &key->addr[1], sizeof(key->addr[0]));
+    if (swap > 0 || (swap == 0 && key->port[0] > key->port[1]))
+    {
+        uint8_t addr[16];
+        uint16_t port;
+
+        memcpy(addr, &key->addr[0], 16);
+        memcpy(&key->addr[0], &key->addr[1], 16);
+        memcpy(&key->addr[1], addr, 16);
+        port = key->port[0];
+        key->port[0] = key->port[1];
+        key->port[1] = port;
+    }
+
+    return 0;
+}
+
+/* Extract a direction-independent 5-tuple key from an Ethernet frame.
+ * Returns 0 on success or -1 for traffic the cache does not handle
+ * (non-IP, fragments, non-TCP/UDP). */
+static inline int daq_flow_key_extract(const uint8_t *data, uint32_t len, DAQ_FlowKey_t *key)
+{
+    uint32_t offset = 12;
+    uint16_t ethertype;
+
+    if (len < 14)
+        return -1;
+
+    ethertype = (data[offset] << 8) | data[offset + 1];
+    while (ethertype == 0x8100 || ethertype == 0x88a8)  /* VLAN tags */
+    {
+        offset += 4;
+        if (len < offset + 2)
+            return -1;
+        ethertype = (data[offset] << 8) | data[offset + 1];
+    }
+    offset += 2;
+
+    if (ethertype != 0x0800 && ethertype != 0x86dd)
+        return -1;
+
+    return daq_flow_key_extract_ip(data + offset, len - offset, key);
+}
+
+/* Look an already-extracted key up in the cache.  Returns 1 and fills
+ * *verdict on a hit, 0 on a miss. */
+static inline int daq_flow_cache_check_key(DAQ_FlowCache_t *cache, const DAQ_FlowKey_t *key,
+                                           uint32_t hash, DAQ_Verdict *verdict)
+{
+    uint32_t slot, i;
+
+    for (i = 0; i < DAQ_FLOW_CACHE_PROBE_LIMIT; i++)
+    {
+        slot = (hash + i) & cache->mask;
+        if (!cache->entries[slot].in_use)
+            break;
+        if (cache->entries[slot].hash == hash &&
+            memcmp(&cache->entries[slot].key, key, sizeof(*key)) == 0)
+        {
+            *verdict = (DAQ_Verdict) cache->entries[slot].verdict;
+            cache->hits++;
+            return 1;
+        }
+    }
+    cache->misses++;
+
+    return 0;
+}
+
+/* Look a packet up in the cache.  Returns 1 and fills *verdict on a hit,
+ * 0 on a miss or uncacheable traffic. */
+static inline int daq_flow_cache_check(DAQ_FlowCache_t *cache, const uint8_t *data,
+                                       uint32_t len, DAQ_Verdict *verdict)
+{
+    DAQ_FlowKey_t key;
+
+    if (daq_flow_key_extract(data, len, &key) != 0)
+        return 0;
+
+    return daq_flow_cache_check_key(cache, &key, daq_flow_key_hash(&key), verdict);
+}
+
+/* Record a flow-wide verdict against an already-extracted key.  Only
+ * WHITELIST and BLACKLIST are cached; everything else is ignored. */
+static inline void daq_flow_cache_update_key(DAQ_FlowCache_t *cache, const DAQ_FlowKey_t *key,
+                                             uint32_t hash, DAQ_Verdict verdict)
+{
+    uint32_t slot, i;
+
+    if (verdict != DAQ_VERDICT_WHITELIST && verdict != DAQ_VERDICT_BLACKLIST)
+        return;
+
+    for (i = 0; i < DAQ_FLOW_CACHE_PROBE_LIMIT; i++)
+    {
+        slot = (hash + i) & cache->mask;
+        if (!cache->entries[slot].in_use ||
+            (cache->entries[slot].hash == hash &&
+             memcmp(&cache->entries[slot].key, key, sizeof(*key)) == 0))
+            break;
+    }
+    if (i == DAQ_FLOW_CACHE_PROBE_LIMIT)
+    {
+        /* All probed slots busy with other flows - evict the last one. */
+        slot = (hash + DAQ_FLOW_CACHE_PROBE_LIMIT - 1) & cache->mask;
+        cache->evictions++;
+    }
+
+    cache->entries[slot].key = *key;
+    cache->entries[slot].hash = hash;
+    cache->entries[slot].verdict = (uint8_t) verdict;
+    cache->entries[slot].in_use = 1;
+}
+
+/* Record a flow-wide verdict for the flow this packet belongs to. */
+static inline void daq_flow_cache_update(DAQ_FlowCache_t *cache, const uint8_t *data,
+                                         uint32_t len, DAQ_Verdict verdict)
+{
+    DAQ_FlowKey_t key;
+
+    if (verdict != DAQ_VERDICT_WHITELIST && verdict != DAQ_VERDICT_BLACKLIST)
+        return;
+
+    if (daq_flow_key_extract(data, len, &key) != 0)
+        return;
+
+    daq_flow_cache_update_key(cache, &key, daq_flow_key_hash(&key), verdict);
+}
+
+#endif /* _DAQ_FLOW_CACHE_H */
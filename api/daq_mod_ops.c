@@ -23,12 +23,32 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "daq.h"
 #include "daq_api.h"
 
 /*
  * Functions that apply to instances of DAQ modules go here.
+ *
+ * Dispatch normally goes through the function-pointer table the caller
+ * passes in.  For appliance-style builds where the static module list is
+ * known to contain exactly one module, defining DAQ_SINGLE_MODULE to that
+ * module's name (e.g. -DDAQ_SINGLE_MODULE=afpacket via
+ * --enable-single-module) reroutes every wrapper through that module's
+ * const vtable instead.  Its initializer is then visible to the compiler,
+ * so building the library and application with -flto turns the indirect
+ * branches into direct calls and lets the module's acquire loop be inlined
+ * together with the application callback.
  */
+#ifdef DAQ_SINGLE_MODULE
+#define DAQ_MODULE_DATA_SYM_(name) name ## _daq_module_data
+#define DAQ_MODULE_DATA_SYM(name) DAQ_MODULE_DATA_SYM_(name)
+extern const DAQ_Module_t DAQ_MODULE_DATA_SYM(DAQ_SINGLE_MODULE);
+#define DAQ_RESOLVE(module) (&DAQ_MODULE_DATA_SYM(DAQ_SINGLE_MODULE))
+#else
+#define DAQ_RESOLVE(module) (module)
+#endif
 DAQ_LINKAGE int daq_initialize(const DAQ_Module_t *module, const DAQ_Config_t *config, void **handle, char *errbuf, size_t len)
 {
     /* Don't do this. */
@@ -50,16 +70,16 @@ DAQ_LINKAGE int daq_initialize(const DAQ_Module_t *module, const DAQ_Config_t *c
         return DAQ_ERROR_INVAL;
     }
 
-    if ((config->mode == DAQ_MODE_PASSIVE && !(module->type & DAQ_TYPE_INTF_CAPABLE)) ||
-        (config->mode == DAQ_MODE_INLINE && !(module->type & DAQ_TYPE_INLINE_CAPABLE)) ||
-        (config->mode == DAQ_MODE_READ_FILE && !(module->type & DAQ_TYPE_FILE_CAPABLE)))
+    if ((config->mode == DAQ_MODE_PASSIVE && !(DAQ_RESOLVE(module)->type & DAQ_TYPE_INTF_CAPABLE)) ||
+        (config->mode == DAQ_MODE_INLINE && !(DAQ_RESOLVE(module)->type & DAQ_TYPE_INLINE_CAPABLE)) ||
+        (config->mode == DAQ_MODE_READ_FILE && !(DAQ_RESOLVE(module)->type & DAQ_TYPE_FILE_CAPABLE)))
     {
-        snprintf(errbuf, len, "The %s DAQ module does not support %s mode!", module->name, daq_mode_string(config->mode));
+        snprintf(errbuf, len, "The %s DAQ module does not support %s mode!", DAQ_RESOLVE(module)->name, daq_mode_string(config->mode));
         return DAQ_ERROR_INVAL;
     }
 
 
-    return module->initialize(config, handle, errbuf, len);
+    return DAQ_RESOLVE(module)->initialize(config, handle, errbuf, len);
 }
 
 DAQ_LINKAGE int daq_set_filter(const DAQ_Module_t *module, void *handle, const char *filter)
@@ -72,11 +92,11 @@ DAQ_LINKAGE int daq_set_filter(const DAQ_Module_t *module, void *handle, const c
 
     if (!filter)
     {
-        module->set_errbuf(handle, "No filter string specified!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "No filter string specified!");
         return DAQ_ERROR_INVAL;
     }
 
-    return module->set_filter(handle, filter);
+    return DAQ_RESOLVE(module)->set_filter(handle, filter);
 }
 
 DAQ_LINKAGE int daq_start(const DAQ_Module_t *module, void *handle)
@@ -87,13 +107,13 @@ DAQ_LINKAGE int daq_start(const DAQ_Module_t *module, void *handle)
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (module->check_status(handle) != DAQ_STATE_INITIALIZED)
+    if (DAQ_RESOLVE(module)->check_status(handle) != DAQ_STATE_INITIALIZED)
     {
-        module->set_errbuf(handle, "Can't start an instance that isn't initialized!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "Can't start an instance that isn't initialized!");
         return DAQ_ERROR;
     }
 
-    return module->start(handle);
+    return DAQ_RESOLVE(module)->start(handle);
 }
 
 DAQ_LINKAGE int daq_acquire(const DAQ_Module_t *module, void *handle, int cnt,
@@ -105,13 +125,13 @@ DAQ_LINKAGE int daq_acquire(const DAQ_Module_t *module, void *handle, int cnt,
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (module->check_status(handle) != DAQ_STATE_STARTED)
+    if (DAQ_RESOLVE(module)->check_status(handle) != DAQ_STATE_STARTED)
     {
-        module->set_errbuf(handle, "Can't acquire packets from an instance that isn't started!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "Can't acquire packets from an instance that isn't started!");
         return DAQ_ERROR;
     }
 
-    return module->acquire(handle, cnt, callback, NULL, user);
+    return DAQ_RESOLVE(module)->acquire(handle, cnt, callback, NULL, user);
 }
 
 DAQ_LINKAGE int daq_acquire_with_meta(const DAQ_Module_t *module, void *handle, int cnt,
@@ -124,13 +144,93 @@ DAQ_LINKAGE int daq_acquire_with_meta(const DAQ_Module_t *module, void *handle,
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (module->check_status(handle) != DAQ_STATE_STARTED)
+    if (DAQ_RESOLVE(module)->check_status(handle) != DAQ_STATE_STARTED)
+    {
+        DAQ_RESOLVE(module)->set_errbuf(handle, "Can't acquire packets from an instance that isn't started!");
+        return DAQ_ERROR;
+    }
+
+    return DAQ_RESOLVE(module)->acquire(handle, cnt, callback, metaback, user);
+}
+
+DAQ_LINKAGE int daq_acquire_batch(const DAQ_Module_t *module, void *handle, int cnt,
+                                  DAQ_Analysis_Batch_Func_t callback,
+                                  DAQ_Meta_Func_t metaback, void *user)
+{
+    if (!module)
+        return DAQ_ERROR_NOMOD;
+
+    if (!handle)
+        return DAQ_ERROR_NOCTX;
+
+    if (!DAQ_RESOLVE(module)->acquire_batch)
+        return DAQ_ERROR_NOTSUP;
+
+    if (DAQ_RESOLVE(module)->check_status(handle) != DAQ_STATE_STARTED)
     {
-        module->set_errbuf(handle, "Can't acquire packets from an instance that isn't started!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "Can't acquire packets from an instance that isn't started!");
         return DAQ_ERROR;
     }
 
-    return module->acquire(handle, cnt, callback, metaback, user);
+    return DAQ_RESOLVE(module)->acquire_batch(handle, cnt, callback, metaback, user);
+}
+
+DAQ_LINKAGE int daq_acquire_deferred(const DAQ_Module_t *module, void *handle, int cnt,
+                                     DAQ_Analysis_Deferred_Func_t callback,
+                                     DAQ_Meta_Func_t metaback, void *user)
+{
+    if (!module)
+        return DAQ_ERROR_NOMOD;
+
+    if (!handle)
+        return DAQ_ERROR_NOCTX;
+
+    if (!DAQ_RESOLVE(module)->acquire_deferred || !DAQ_RESOLVE(module)->set_verdict)
+        return DAQ_ERROR_NOTSUP;
+
+    if (DAQ_RESOLVE(module)->check_status(handle) != DAQ_STATE_STARTED)
+    {
+        DAQ_RESOLVE(module)->set_errbuf(handle, "Can't acquire packets from an instance that isn't started!");
+        return DAQ_ERROR;
+    }
+
+    return DAQ_RESOLVE(module)->acquire_deferred(handle, cnt, callback, metaback, user);
+}
+
+DAQ_LINKAGE int daq_acquire_ex(const DAQ_Module_t *module, void *handle, int cnt,
+                               const DAQ_AcquireCtx_t *ctx)
+{
+    if (!module)
+        return DAQ_ERROR_NOMOD;
+
+    if (!handle)
+        return DAQ_ERROR_NOCTX;
+
+    if (!ctx || !ctx->analysis_func)
+        return DAQ_ERROR_INVAL;
+
+    if (DAQ_RESOLVE(module)->check_status(handle) != DAQ_STATE_STARTED)
+    {
+        DAQ_RESOLVE(module)->set_errbuf(handle, "Can't acquire packets from an instance that isn't started!");
+        return DAQ_ERROR;
+    }
+
+    return DAQ_RESOLVE(module)->acquire(handle, cnt, ctx->analysis_func, ctx->meta_func, ctx->user);
+}
+
+DAQ_LINKAGE int daq_set_verdict(const DAQ_Module_t *module, void *handle, uint32_t token,
+                                DAQ_Verdict verdict)
+{
+    if (!module)
+        return DAQ_ERROR_NOMOD;
+
+    if (!handle)
+        return DAQ_ERROR_NOCTX;
+
+    if (!DAQ_RESOLVE(module)->set_verdict)
+        return DAQ_ERROR_NOTSUP;
+
+    return DAQ_RESOLVE(module)->set_verdict(handle, token, verdict);
 }
 
 DAQ_LINKAGE int daq_inject(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse)
@@ -143,17 +243,17 @@ DAQ_LINKAGE int daq_inject(const DAQ_Module_t *module, void *handle, const DAQ_P
 
     if (!hdr)
     {
-        module->set_errbuf(handle, "No originating packet header specified!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "No originating packet header specified!");
         return DAQ_ERROR_INVAL;
     }
 
     if (!packet_data)
     {
-        module->set_errbuf(handle, "No packet data specified!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "No packet data specified!");
         return DAQ_ERROR_INVAL;
     }
 
-    return module->inject(handle, hdr, packet_data, len, reverse);
+    return DAQ_RESOLVE(module)->inject(handle, hdr, packet_data, len, reverse);
 }
 
 DAQ_LINKAGE int daq_breakloop(const DAQ_Module_t *module, void *handle)
@@ -164,7 +264,7 @@ DAQ_LINKAGE int daq_breakloop(const DAQ_Module_t *module, void *handle)
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    return module->breakloop(handle);
+    return DAQ_RESOLVE(module)->breakloop(handle);
 }
 
 DAQ_LINKAGE int daq_stop(const DAQ_Module_t *module, void *handle)
@@ -175,13 +275,13 @@ DAQ_LINKAGE int daq_stop(const DAQ_Module_t *module, void *handle)
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (module->check_status(handle) != DAQ_STATE_STARTED)
+    if (DAQ_RESOLVE(module)->check_status(handle) != DAQ_STATE_STARTED)
     {
-        module->set_errbuf(handle, "Can't stop an instance that hasn't started!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "Can't stop an instance that hasn't started!");
         return DAQ_ERROR;
     }
 
-    return module->stop(handle);
+    return DAQ_RESOLVE(module)->stop(handle);
 }
 
 DAQ_LINKAGE int daq_shutdown(const DAQ_Module_t *module, void *handle)
@@ -191,7 +291,7 @@ DAQ_LINKAGE int daq_shutdown(const DAQ_Module_t *module, void *handle)
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    module->shutdown(handle);
+    DAQ_RESOLVE(module)->shutdown(handle);
 
     return DAQ_SUCCESS;
 }
@@ -201,7 +301,7 @@ DAQ_LINKAGE DAQ_State daq_check_status(const DAQ_Module_t *module, void *handle)
     if (!module || !handle)
         return DAQ_STATE_UNKNOWN;
 
-    return module->check_status(handle);
+    return DAQ_RESOLVE(module)->check_status(handle);
 }
 
 DAQ_LINKAGE int daq_get_stats(const DAQ_Module_t *module, void *handle, DAQ_Stats_t *stats)
@@ -214,17 +314,17 @@ DAQ_LINKAGE int daq_get_stats(const DAQ_Module_t *module, void *handle, DAQ_Stat
 
     if (!stats)
     {
-        module->set_errbuf(handle, "No place to put the statistics!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "No place to put the statistics!");
         return DAQ_ERROR_INVAL;
     }
 
-    return module->get_stats(handle, stats);
+    return DAQ_RESOLVE(module)->get_stats(handle, stats);
 }
 
 DAQ_LINKAGE void daq_reset_stats(const DAQ_Module_t *module, void *handle)
 {
     if (module && handle)
-        module->reset_stats(handle);
+        DAQ_RESOLVE(module)->reset_stats(handle);
 }
 
 DAQ_LINKAGE int daq_get_snaplen(const DAQ_Module_t *module, void *handle)
@@ -235,7 +335,7 @@ DAQ_LINKAGE int daq_get_snaplen(const DAQ_Module_t *module, void *handle)
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    return module->get_snaplen(handle);
+    return DAQ_RESOLVE(module)->get_snaplen(handle);
 }
 
 DAQ_LINKAGE uint32_t daq_get_capabilities(const DAQ_Module_t *module, void *handle)
@@ -246,7 +346,7 @@ DAQ_LINKAGE uint32_t daq_get_capabilities(const DAQ_Module_t *module, void *hand
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    return module->get_capabilities(handle);
+    return DAQ_RESOLVE(module)->get_capabilities(handle);
 }
 
 DAQ_LINKAGE int daq_get_datalink_type(const DAQ_Module_t *module, void *handle)
@@ -257,7 +357,7 @@ DAQ_LINKAGE int daq_get_datalink_type(const DAQ_Module_t *module, void *handle)
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    return module->get_datalink_type(handle);
+    return DAQ_RESOLVE(module)->get_datalink_type(handle);
 }
 
 DAQ_LINKAGE const char *daq_get_error(const DAQ_Module_t *module, void *handle)
@@ -265,7 +365,7 @@ DAQ_LINKAGE const char *daq_get_error(const DAQ_Module_t *module, void *handle)
     if (!module || !handle)
         return NULL;
 
-    return module->get_errbuf(handle);
+    return DAQ_RESOLVE(module)->get_errbuf(handle);
 }
 
 DAQ_LINKAGE void daq_clear_error(const DAQ_Module_t *module, void *handle)
@@ -273,7 +373,7 @@ DAQ_LINKAGE void daq_clear_error(const DAQ_Module_t *module, void *handle)
     if (!module || !handle)
         return;
 
-    module->set_errbuf(handle, "");
+    DAQ_RESOLVE(module)->set_errbuf(handle, "");
 }
 
 DAQ_LINKAGE int daq_get_device_index(const DAQ_Module_t *module, void *handle, const char *device)
@@ -286,11 +386,11 @@ DAQ_LINKAGE int daq_get_device_index(const DAQ_Module_t *module, void *handle, c
 
     if (!device)
     {
-        module->set_errbuf(handle, "No device name to find the index of!");
+        DAQ_RESOLVE(module)->set_errbuf(handle, "No device name to find the index of!");
         return DAQ_ERROR_INVAL;
     }
 
-    return module->get_device_index(handle, device);
+    return DAQ_RESOLVE(module)->get_device_index(handle, device);
 }
 
 DAQ_LINKAGE int daq_hup_prep(const DAQ_Module_t *module, void *handle, void **new_config)
@@ -301,14 +401,14 @@ DAQ_LINKAGE int daq_hup_prep(const DAQ_Module_t *module, void *handle, void **ne
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (!module->hup_prep)
+    if (!DAQ_RESOLVE(module)->hup_prep)
     {
-        if (!module->hup_apply)
+        if (!DAQ_RESOLVE(module)->hup_apply)
             return 1;
         return DAQ_SUCCESS;
     }
 
-    return module->hup_prep(handle, new_config);
+    return DAQ_RESOLVE(module)->hup_prep(handle, new_config);
 }
 
 DAQ_LINKAGE int daq_hup_apply(const DAQ_Module_t *module, void *handle, void *new_config, void **old_config)
@@ -319,10 +419,10 @@ DAQ_LINKAGE int daq_hup_apply(const DAQ_Module_t *module, void *handle, void *ne
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (!module->hup_apply)
+    if (!DAQ_RESOLVE(module)->hup_apply)
         return DAQ_SUCCESS;
 
-    return module->hup_apply(handle, new_config, old_config);
+    return DAQ_RESOLVE(module)->hup_apply(handle, new_config, old_config);
 }
 
 DAQ_LINKAGE int daq_hup_post(const DAQ_Module_t *module, void *handle, void *old_config)
@@ -333,10 +433,10 @@ DAQ_LINKAGE int daq_hup_post(const DAQ_Module_t *module, void *handle, void *old
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (!module->hup_post)
+    if (!DAQ_RESOLVE(module)->hup_post)
         return DAQ_SUCCESS;
 
-    return module->hup_post(handle, old_config);
+    return DAQ_RESOLVE(module)->hup_post(handle, old_config);
 }
 
 DAQ_LINKAGE int daq_modify_flow(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr, const DAQ_ModFlow_t *modify)
@@ -344,10 +444,10 @@ DAQ_LINKAGE int daq_modify_flow(const DAQ_Module_t *module, void *handle, const
     if (!module)
         return DAQ_ERROR_NOMOD;
 
-    if (!module->modify_flow)
+    if (!DAQ_RESOLVE(module)->modify_flow)
         return DAQ_SUCCESS;
 
-    return module->modify_flow(handle, hdr, modify);
+    return DAQ_RESOLVE(module)->modify_flow(handle, hdr, modify);
 }
 
 DAQ_LINKAGE int daq_query_flow(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr, DAQ_QueryFlow_t *query)
@@ -355,10 +455,21 @@ DAQ_LINKAGE int daq_query_flow(const DAQ_Module_t *module, void *handle, const D
     if (!module)
         return DAQ_ERROR_NOMOD;
 
-    if (!module->query_flow)
+    if (!DAQ_RESOLVE(module)->query_flow)
+        return DAQ_ERROR_NOTSUP;
+
+    return DAQ_RESOLVE(module)->query_flow(handle, hdr, query);
+}
+
+DAQ_LINKAGE int daq_get_perf_stats(const DAQ_Module_t *module, void *handle, DAQ_PerfStats_t *perf_stats)
+{
+    if (!module)
+        return DAQ_ERROR_NOMOD;
+
+    if (!DAQ_RESOLVE(module)->get_perf_stats)
         return DAQ_ERROR_NOTSUP;
 
-    return module->query_flow(handle, hdr, query);
+    return DAQ_RESOLVE(module)->get_perf_stats(handle, perf_stats);
 }
 
 /*
@@ -369,7 +480,7 @@ DAQ_LINKAGE const char *daq_get_name(const DAQ_Module_t *module)
     if (!module)
         return NULL;
 
-    return module->name;
+    return DAQ_RESOLVE(module)->name;
 }
 
 DAQ_LINKAGE uint32_t daq_get_type(const DAQ_Module_t *module)
@@ -377,7 +488,7 @@ DAQ_LINKAGE uint32_t daq_get_type(const DAQ_Module_t *module)
     if (!module)
         return DAQ_ERROR_NOMOD;
 
-    return module->type;
+    return DAQ_RESOLVE(module)->type;
 }
 
 DAQ_LINKAGE int daq_dp_add_dc(const DAQ_Module_t *module, void *handle, const DAQ_PktHdr_t *hdr,
@@ -389,8 +500,206 @@ DAQ_LINKAGE int daq_dp_add_dc(const DAQ_Module_t *module, void *handle, const DA
     if (!handle)
         return DAQ_ERROR_NOCTX;
 
-    if (!module->dp_add_dc)
+    if (!DAQ_RESOLVE(module)->dp_add_dc)
         return DAQ_SUCCESS;
 
-    return module->dp_add_dc(handle, hdr, dp_key, packet_data, params);
+    return DAQ_RESOLVE(module)->dp_add_dc(handle, hdr, dp_key, packet_data, params);
+}
+
+/*
+ * Functions that apply to groups of cooperating module instances go here.
+ *
+ * A group stands up N instances of a multi-instance module from a single
+ * shared configuration in one call.  Modules that support kernel-side load
+ * balancing (e.g. afpacket packet fanout) derive a common group identity
+ * from the shared configuration, so all instances land in the same fanout
+ * group without any extra plumbing by the application.
+ */
+struct _daq_instance_group
+{
+    const DAQ_Module_t *module;
+    unsigned count;
+    void **handles;
+};
+
+DAQ_LINKAGE int daq_group_initialize(const DAQ_Module_t *module, const DAQ_Config_t *config,
+                                     unsigned count, DAQ_InstanceGroup_t **group,
+                                     char *errbuf, size_t len)
+{
+    DAQ_InstanceGroup_t *grp;
+    unsigned i;
+    int rval;
+
+    /* Don't do this. */
+    if (!errbuf)
+        return DAQ_ERROR;
+
+    if (!module)
+        return DAQ_ERROR_NOMOD;
+
+    if (!count || !group)
+    {
+        snprintf(errbuf, len, "Can't initialize a group without a size and a group pointer!");
+        return DAQ_ERROR_INVAL;
+    }
+
+    if (count > 1 && !(DAQ_RESOLVE(module)->type & DAQ_TYPE_MULTI_INSTANCE))
+    {
+        snprintf(errbuf, len, "The %s DAQ module does not support multiple instances!", DAQ_RESOLVE(module)->name);
+        return DAQ_ERROR_INVAL;
+    }
+
+    grp = calloc(1, sizeof(*grp));
+    if (!grp)
+    {
+        snprintf(errbuf, len, "Couldn't allocate a new instance group!");
+        return DAQ_ERROR_NOMEM;
+    }
+
+    grp->handles = calloc(count, sizeof(*grp->handles));
+    if (!grp->handles)
+    {
+        snprintf(errbuf, len, "Couldn't allocate the instance group handle table!");
+        free(grp);
+        return DAQ_ERROR_NOMEM;
+    }
+    grp->module = module;
+
+    for (i = 0; i < count; i++)
+    {
+        rval = daq_initialize(module, config, &grp->handles[i], errbuf, len);
+        if (rval != DAQ_SUCCESS)
+        {
+            while (i-- > 0)
+                DAQ_RESOLVE(module)->shutdown(grp->handles[i]);
+            free(grp->handles);
+            free(grp);
+            return rval;
+        }
+        grp->count++;
+    }
+
+    *group = grp;
+    return DAQ_SUCCESS;
+}
+
+DAQ_LINKAGE unsigned daq_group_size(const DAQ_InstanceGroup_t *group)
+{
+    if (!group)
+        return 0;
+
+    return group->count;
+}
+
+DAQ_LINKAGE void *daq_group_handle(const DAQ_InstanceGroup_t *group, unsigned index)
+{
+    if (!group || index >= group->count)
+        return NULL;
+
+    return group->handles[index];
+}
+
+DAQ_LINKAGE int daq_group_start(const DAQ_InstanceGroup_t *group)
+{
+    unsigned i;
+    int rval;
+
+    if (!group)
+        return DAQ_ERROR_NOCTX;
+
+    for (i = 0; i < group->count; i++)
+    {
+        rval = daq_start(group->module, group->handles[i]);
+        if (rval != DAQ_SUCCESS)
+        {
+            while (i-- > 0)
+                group->module->stop(group->handles[i]);
+            return rval;
+        }
+    }
+
+    return DAQ_SUCCESS;
+}
+
+DAQ_LINKAGE int daq_group_stop(const DAQ_InstanceGroup_t *group)
+{
+    unsigned i;
+    int rval, err = DAQ_SUCCESS;
+
+    if (!group)
+        return DAQ_ERROR_NOCTX;
+
+    for (i = 0; i < group->count; i++)
+    {
+        rval = daq_stop(group->module, group->handles[i]);
+        if (rval != DAQ_SUCCESS)
+            err = rval;
+    }
+
+    return err;
+}
+
+DAQ_LINKAGE int daq_group_get_stats(const DAQ_InstanceGroup_t *group, DAQ_Stats_t *stats)
+{
+    DAQ_Stats_t instance_stats;
+    unsigned i;
+    int j, rval;
+
+    if (!group)
+        return DAQ_ERROR_NOCTX;
+
+    if (!stats)
+        return DAQ_ERROR_INVAL;
+
+    memset(stats, 0, sizeof(*stats));
+
+    /* Each module reports its own coherent per-instance view; summing those
+       here gives the application a single group-wide aggregate. */
+    for (i = 0; i < group->count; i++)
+    {
+        rval = daq_get_stats(group->module, group->handles[i], &instance_stats);
+        if (rval != DAQ_SUCCESS)
+            return rval;
+
+        stats->hw_packets_received += instance_stats.hw_packets_received;
+        stats->hw_packets_dropped += instance_stats.hw_packets_dropped;
+        stats->packets_received += instance_stats.packets_received;
+        stats->packets_filtered += instance_stats.packets_filtered;
+        stats->packets_injected += instance_stats.packets_injected;
+        for (j = 0; j < MAX_DAQ_VERDICT; j++)
+            stats->verdicts[j] += instance_stats.verdicts[j];
+    }
+
+    return DAQ_SUCCESS;
+}
+
+DAQ_LINKAGE void daq_group_reset_stats(const DAQ_InstanceGroup_t *group)
+{
+    unsigned i;
+
+    if (!group)
+        return;
+
+    for (i = 0; i < group->count; i++)
+        daq_reset_stats(group->module, group->handles[i]);
+}
+
+DAQ_LINKAGE int daq_group_shutdown(DAQ_InstanceGroup_t *group)
+{
+    unsigned i;
+    int rval, err = DAQ_SUCCESS;
+
+    if (!group)
+        return DAQ_ERROR_NOCTX;
+
+    for (i = 0; i < group->count; i++)
+    {
+        rval = daq_shutdown(group->module, group->handles[i]);
+        if (rval != DAQ_SUCCESS)
+            err = rval;
+    }
+
+    free(group->handles);
+    free(group);
+    return err;
 }
@@ -0,0 +1,273 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+** Copyright (C) 2010-2013 Sourcefire, Inc.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _DAQ_RETRY_WHEEL_H
+#define _DAQ_RETRY_WHEEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <daq_common.h>
+
+/*
+ * Timing wheel for implementing DAQ_VERDICT_RETRY.
+ *
+ * A RETRY verdict asks the module to hold on to a copy of the packet briefly
+ * and then resend it through the acquire callback with
+ * DAQ_PKT_FLAG_RETRY_PACKET set.  Held packets live in a preallocated pool of
+ * fixed-size entries (so the amount of memory a flood of RETRY verdicts can
+ * pin is strictly bounded, and the per-packet path never touches the
+ * allocator) and are scheduled on a two-level hashed timing wheel with O(1)
+ * insertion and amortized O(1) expiry - a timer per held packet would fall
+ * over under a SYN flood.
+ *
+ * The inner level resolves individual milliseconds; the outer level holds
+ * entries further out than one inner rotation and cascades them back into
+ * the inner wheel as time advances.  Delays are clamped to the wheel's span.
+ *
+ * Like the flow cache, a wheel belongs to exactly one module context and is
+ * only ever touched from that context's acquire loop, so no locking is
+ * needed.
+ */
+
+#define DAQ_RETRY_WHEEL_SLOT_BITS   6
+#define DAQ_RETRY_WHEEL_SLOTS       (1 << DAQ_RETRY_WHEEL_SLOT_BITS)
+#define DAQ_RETRY_WHEEL_MASK        (DAQ_RETRY_WHEEL_SLOTS - 1)
+/* Maximum schedulable delay: one full outer rotation (64 * 64 ms). */
+#define DAQ_RETRY_WHEEL_SPAN_MS     (DAQ_RETRY_WHEEL_SLOTS * DAQ_RETRY_WHEEL_SLOTS)
+
+typedef struct _daq_retry_entry
+{
+    struct _daq_retry_entry *next;
+    uint64_t due_ms;
+    DAQ_PktHdr_t hdr;
+    uint32_t token;             /* module-private cookie (e.g. instance index or packet ID) */
+    uint8_t data[];             /* snaplen bytes of copied packet */
+} DAQ_RetryEntry_t;
+
+typedef struct _daq_retry_wheel
+{
+    DAQ_RetryEntry_t *slots[2][DAQ_RETRY_WHEEL_SLOTS];
+    DAQ_RetryEntry_t *free_list;
+    uint8_t *pool;
+    uint32_t num_entries;
+    uint32_t snaplen;
+    uint32_t delay_ms;
+    uint64_t now_ms;            /* last tick the wheel was advanced to */
+    uint32_t held;
+    uint64_t queued;
+    uint64_t overflows;         /* RETRY verdicts refused because the pool was empty */
+} DAQ_RetryWheel_t;
+
+/* Millisecond timestamp on the monotonic clock for feeding the wheel. */
+static inline uint64_t daq_retry_wheel_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int daq_retry_wheel_init(DAQ_RetryWheel_t *wheel, uint32_t num_entries,
+                                       uint32_t snaplen, uint32_t delay_ms)
+{
+    size_t entry_size;
+    uint32_t i;
+
+    memset(wheel, 0, sizeof(*wheel));
+    entry_size = sizeof(DAQ_RetryEntry_t) + snaplen;
+    wheel->pool = calloc(num_entries, entry_size);
+    if (!wheel->pool)
+        return -1;
+    for (i = 0; i < num_entries; i++)
+    {
+        DAQ_RetryEntry_t *entry = (DAQ_RetryEntry_t *) (wheel->pool + (size_t) i * entry_size);
+        entry->next = wheel->free_list;
+        wheel->free_list = entry;
+    }
+    wheel->num_entries = num_entries;
+    wheel->snaplen = snaplen;
+    if (delay_ms >= DAQ_RETRY_WHEEL_SPAN_MS)
+        delay_ms = DAQ_RETRY_WHEEL_SPAN_MS - 1;
+    wheel->delay_ms = delay_ms;
+    wheel->now_ms = daq_retry_wheel_now();
+    return 0;
+}
+
+static inline void daq_retry_wheel_cleanup(DAQ_RetryWheel_t *wheel)
+{
+    free(wheel->pool);
+    memset(wheel, 0, sizeof(*wheel));
+}
+
+/* Schedule an entry on the level its expiry falls in.  Slots are indexed by
+   absolute time, so no re-hashing is needed when the cursors advance. */
+static inline void daq_retry_wheel_place(DAQ_RetryWheel_t *wheel, DAQ_RetryEntry_t *entry)
+{
+    uint64_t due = entry->due_ms;
+    DAQ_RetryEntry_t **slot;
+
+    /* Already (over)due entries go out on the very next tick. */
+    if (due <= wheel->now_ms)
+        slot = &wheel->slots[0][(wheel->now_ms + 1) & DAQ_RETRY_WHEEL_MASK];
+    else if (due - wheel->now_ms < DAQ_RETRY_WHEEL_SLOTS)
+        slot = &wheel->slots[0][due & DAQ_RETRY_WHEEL_MASK];
+    else
+        slot = &wheel->slots[1][(due >> DAQ_RETRY_WHEEL_SLOT_BITS) & DAQ_RETRY_WHEEL_MASK];
+    entry->next = *slot;
+    *slot = entry;
+}
+
+/* Copy a packet into the wheel to be redelivered delay_ms from now.  Returns
+   the held entry, or NULL if the pool is exhausted (the caller should fall
+   back to treating the verdict as BLOCK). */
+static inline DAQ_RetryEntry_t *daq_retry_wheel_queue(DAQ_RetryWheel_t *wheel,
+                                                      const DAQ_PktHdr_t *hdr,
+                                                      const uint8_t *data, uint32_t token)
+{
+    DAQ_RetryEntry_t *entry = wheel->free_list;
+
+    if (!entry)
+    {
+        wheel->overflows++;
+        return NULL;
+    }
+    wheel->free_list = entry->next;
+
+    entry->hdr = *hdr;
+    if (entry->hdr.caplen > wheel->snaplen)
+        entry->hdr.caplen = wheel->snaplen;
+    memcpy(entry->data, data, entry->hdr.caplen);
+    entry->hdr.flags |= DAQ_PKT_FLAG_RETRY_PACKET;
+    entry->token = token;
+    entry->due_ms = wheel->now_ms + wheel->delay_ms;
+
+    daq_retry_wheel_place(wheel, entry);
+    wheel->held++;
+    wheel->queued++;
+    return entry;
+}
+
+/* Advance the wheel to now_ms and unlink everything that has come due,
+   returned as a list in roughly expiry order.  The caller redelivers each
+   entry and hands it back with daq_retry_wheel_release(). */
+static inline DAQ_RetryEntry_t *daq_retry_wheel_expire(DAQ_RetryWheel_t *wheel, uint64_t now_ms)
+{
+    DAQ_RetryEntry_t *due = NULL, **due_tail = &due;
+    DAQ_RetryEntry_t *entry, *next;
+
+    if (!wheel->held)
+    {
+        wheel->now_ms = now_ms;
+        return NULL;
+    }
+
+    /* After an idle gap longer than the wheel's span, everything is due. */
+    if (now_ms - wheel->now_ms >= DAQ_RETRY_WHEEL_SPAN_MS)
+        wheel->now_ms = now_ms - DAQ_RETRY_WHEEL_SPAN_MS;
+
+    while (wheel->now_ms < now_ms)
+    {
+        wheel->now_ms++;
+
+        /* Cascade the outer slot for this inner rotation before draining.  Anything
+           in it that is due by this very tick goes straight out rather than being
+           re-placed, which would push it past its deadline. */
+        if ((wheel->now_ms & DAQ_RETRY_WHEEL_MASK) == 0)
+        {
+            uint32_t outer = (wheel->now_ms >> DAQ_RETRY_WHEEL_SLOT_BITS) & DAQ_RETRY_WHEEL_MASK;
+
+            entry = wheel->slots[1][outer];
+            wheel->slots[1][outer] = NULL;
+            for (; entry; entry = next)
+            {
+                next = entry->next;
+                if (entry->due_ms <= wheel->now_ms)
+                {
+                    entry->next = NULL;
+                    *due_tail = entry;
+                    due_tail = &entry->next;
+                    wheel->held--;
+                }
+                else
+                    daq_retry_wheel_place(wheel, entry);
+            }
+        }
+
+        entry = wheel->slots[0][wheel->now_ms & DAQ_RETRY_WHEEL_MASK];
+        wheel->slots[0][wheel->now_ms & DAQ_RETRY_WHEEL_MASK] = NULL;
+        for (; entry; entry = next)
+        {
+            next = entry->next;
+            entry->next = NULL;
+            *due_tail = entry;
+            due_tail = &entry->next;
+            wheel->held--;
+        }
+    }
+
+    return due;
+}
+
+/* Unlink every held entry regardless of expiry (module stop/teardown). */
+static inline DAQ_RetryEntry_t *daq_retry_wheel_drain(DAQ_RetryWheel_t *wheel)
+{
+    DAQ_RetryEntry_t *all = NULL;
+    DAQ_RetryEntry_t *entry, *next;
+    int level;
+    uint32_t i;
+
+    for (level = 0; level < 2; level++)
+    {
+        for (i = 0; i < DAQ_RETRY_WHEEL_SLOTS; i++)
+        {
+            for (entry = wheel->slots[level][i]; entry; entry = next)
+            {
+                next = entry->next;
+                entry->next = all;
+                all = entry;
+                wheel->held--;
+            }
+            wheel->slots[level][i] = NULL;
+        }
+    }
+    return all;
+}
+
+static inline void daq_retry_wheel_release(DAQ_RetryWheel_t *wheel, DAQ_RetryEntry_t *entry)
+{
+    entry->next = wheel->free_list;
+    wheel->free_list = entry;
+}
+
+/* Clamp a module's poll/select timeout (in ms, -1 for infinite) so held
+   packets are redelivered on time even when the link goes quiet. */
+static inline int daq_retry_wheel_timeout(DAQ_RetryWheel_t *wheel, int timeout_ms)
+{
+    if (!wheel->held)
+        return timeout_ms;
+    if (timeout_ms < 0 || (uint32_t) timeout_ms > wheel->delay_ms)
+        timeout_ms = (int) wheel->delay_ms;
+    return (timeout_ms > 0) ? timeout_ms : 1;
+}
+
+#endif /* _DAQ_RETRY_WHEEL_H */
@@ -0,0 +1,334 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+** Copyright (C) 2010-2013 Sourcefire, Inc.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _DAQ_SHMEM_H
+#define _DAQ_SHMEM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <daq_common.h>
+#include <daq_flow_cache.h>
+
+/*
+ * Shared-memory packet transport for splitting capture and analysis into
+ * separate processes.  A pinned capture process (the producer) owns the NIC
+ * and publishes packets into a POSIX shared memory ring of fixed-size slots;
+ * an analysis process (the consumer, normally the shmem DAQ module) reads
+ * them in place and posts verdicts back through a companion ring.
+ *
+ * Both rings are single-producer/single-consumer with free-running indices,
+ * so neither side ever takes a lock; each index is written by exactly one
+ * process and the pairs live on separate cache lines to avoid false sharing.
+ * Because the indices live in the region itself, a consumer that restarts
+ * simply reattaches and picks up at the slot it left off - packets published
+ * in the interim are still sitting in the ring (up to one ring's worth; past
+ * that the producer counts drops rather than blocking the capture loop).
+ *
+ * The producer can't retroactively block a packet it already forwarded, so
+ * verdicts are applied at flow granularity: WHITELIST/BLACKLIST verdicts
+ * drained from the verdict ring are fed into a producer-side flow cache that
+ * daq_shmem_producer_callback() consults before publishing.  That callback
+ * has the DAQ_Analysis_Func_t signature, so a capture process can bridge any
+ * existing module by passing it directly to daq_acquire().
+ */
+
+#define DAQ_SHMEM_MAGIC     0x53484d51      /* "SHMQ" */
+#define DAQ_SHMEM_VERSION   1
+
+#define DAQ_SHMEM_DEFAULT_SLOTS     4096
+#define DAQ_SHMEM_CACHELINE         64
+
+typedef struct _daq_shmem_slot
+{
+    DAQ_PktHdr_t hdr;
+    uint8_t data[];             /* snaplen bytes, read in place by the consumer */
+} DAQ_ShmemSlot_t;
+
+typedef struct _daq_shmem_verdict
+{
+    uint32_t slot;              /* index of the packet slot the verdict is for */
+    uint32_t verdict;           /* DAQ_Verdict */
+} DAQ_ShmemVerdict_t;
+
+typedef struct _daq_shmem_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;         /* power of two */
+    uint32_t slot_stride;       /* aligned size of one packet slot */
+    uint32_t snaplen;
+
+    /* Producer-written indices. */
+    volatile uint32_t pkt_head __attribute__((aligned(DAQ_SHMEM_CACHELINE)));
+    volatile uint32_t vd_tail;
+    volatile uint64_t drops;    /* publishes refused because the ring was full */
+
+    /* Consumer-written indices. */
+    volatile uint32_t pkt_tail __attribute__((aligned(DAQ_SHMEM_CACHELINE)));
+    volatile uint32_t vd_head;
+
+    /* Verdict ring (num_slots entries), then the packet slots. */
+    uint8_t rings[] __attribute__((aligned(DAQ_SHMEM_CACHELINE)));
+} DAQ_ShmemHeader_t;
+
+static inline DAQ_ShmemVerdict_t *daq_shmem_verdict_ring(DAQ_ShmemHeader_t *shm)
+{
+    return (DAQ_ShmemVerdict_t *) shm->rings;
+}
+
+static inline DAQ_ShmemSlot_t *daq_shmem_slot(DAQ_ShmemHeader_t *shm, uint32_t index)
+{
+    uint8_t *slots = shm->rings + (size_t) shm->num_slots * sizeof(DAQ_ShmemVerdict_t);
+
+    return (DAQ_ShmemSlot_t *) (slots + (size_t) index * shm->slot_stride);
+}
+
+static inline size_t daq_shmem_region_size(uint32_t num_slots, uint32_t slot_stride)
+{
+    return sizeof(DAQ_ShmemHeader_t) + (size_t) num_slots * sizeof(DAQ_ShmemVerdict_t) +
+           (size_t) num_slots * slot_stride;
+}
+
+static inline uint32_t daq_shmem_slot_stride(uint32_t snaplen)
+{
+    size_t stride = sizeof(DAQ_ShmemSlot_t) + snaplen;
+
+    return (uint32_t) ((stride + DAQ_SHMEM_CACHELINE - 1) & ~(size_t) (DAQ_SHMEM_CACHELINE - 1));
+}
+
+/* Map an existing region by name and sanity check it.  Returns NULL on any
+   failure with errno left from the failing call. */
+static inline DAQ_ShmemHeader_t *daq_shmem_attach(const char *name, size_t *map_size)
+{
+    DAQ_ShmemHeader_t *shm;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(DAQ_ShmemHeader_t))
+    {
+        close(fd);
+        return NULL;
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+    if (shm->magic != DAQ_SHMEM_MAGIC || shm->version != DAQ_SHMEM_VERSION ||
+        (size_t) st.st_size < daq_shmem_region_size(shm->num_slots, shm->slot_stride))
+    {
+        munmap(shm, st.st_size);
+        return NULL;
+    }
+    *map_size = st.st_size;
+    return shm;
+}
+
+static inline void daq_shmem_detach(DAQ_ShmemHeader_t *shm, size_t map_size)
+{
+    munmap(shm, map_size);
+}
+
+/*
+ * Consumer side.  The packet slot returned by peek() stays valid until
+ * release() advances the ring, so the callback reads it with zero copies.
+ */
+
+static inline DAQ_ShmemSlot_t *daq_shmem_consumer_peek(DAQ_ShmemHeader_t *shm)
+{
+    if (shm->pkt_tail == __atomic_load_n(&shm->pkt_head, __ATOMIC_ACQUIRE))
+        return NULL;
+    return daq_shmem_slot(shm, shm->pkt_tail & (shm->num_slots - 1));
+}
+
+/* Post the verdict for the slot last returned by peek() and hand the slot
+   back to the producer.  The verdict is posted before the slot is released
+   so the producer always sees it while the packet data is still intact. */
+static inline void daq_shmem_consumer_release(DAQ_ShmemHeader_t *shm, DAQ_Verdict verdict)
+{
+    uint32_t mask = shm->num_slots - 1;
+    uint32_t vd_head = shm->vd_head;
+    DAQ_ShmemVerdict_t *vd = &daq_shmem_verdict_ring(shm)[vd_head & mask];
+
+    vd->slot = shm->pkt_tail & mask;
+    vd->verdict = verdict;
+    __atomic_store_n(&shm->vd_head, vd_head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm->pkt_tail, shm->pkt_tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Producer side.
+ */
+
+typedef struct _daq_shmem_producer
+{
+    DAQ_ShmemHeader_t *shm;
+    size_t map_size;
+    char name[64];
+    DAQ_FlowCache_t feedback;   /* flow verdicts learned from the consumer */
+    uint64_t published;
+    uint64_t fastpathed;        /* packets short-circuited by a learned flow verdict */
+} DAQ_ShmemProducer_t;
+
+/* Create and initialize a region.  feedback_flows sizes the producer-side
+   flow cache consumer verdicts are learned into; 0 disables the fastpath. */
+static inline int daq_shmem_producer_create(DAQ_ShmemProducer_t *producer, const char *name,
+                                            uint32_t num_slots, uint32_t snaplen,
+                                            uint32_t feedback_flows)
+{
+    uint32_t stride = daq_shmem_slot_stride(snaplen);
+    DAQ_ShmemHeader_t *shm;
+    size_t size;
+    int fd;
+
+    /* Round the slot count up to a power of two for mask indexing. */
+    if (num_slots < 2)
+        num_slots = 2;
+    while (num_slots & (num_slots - 1))
+        num_slots += num_slots & ~(num_slots - 1);
+
+    memset(producer, 0, sizeof(*producer));
+    snprintf(producer->name, sizeof(producer->name), "%s", name);
+
+    size = daq_shmem_region_size(num_slots, stride);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return -1;
+    }
+    shm->num_slots = num_slots;
+    shm->slot_stride = stride;
+    shm->snaplen = snaplen;
+    shm->version = DAQ_SHMEM_VERSION;
+    /* The magic is published last so a racing attach never sees a
+       half-initialized header. */
+    __atomic_store_n(&shm->magic, DAQ_SHMEM_MAGIC, __ATOMIC_RELEASE);
+
+    if (feedback_flows && daq_flow_cache_init(&producer->feedback, feedback_flows) != 0)
+    {
+        munmap(shm, size);
+        shm_unlink(name);
+        return -1;
+    }
+
+    producer->shm = shm;
+    producer->map_size = size;
+    return 0;
+}
+
+static inline void daq_shmem_producer_destroy(DAQ_ShmemProducer_t *producer)
+{
+    if (!producer->shm)
+        return;
+    munmap(producer->shm, producer->map_size);
+    shm_unlink(producer->name);
+    if (producer->feedback.entries)
+        daq_flow_cache_cleanup(&producer->feedback);
+    producer->shm = NULL;
+}
+
+/* Drain verdicts the consumer has posted into the feedback flow cache.  The
+   referenced slots are still intact: a slot can only be reused after the
+   consumer advances the packet ring past it, which happens after the verdict
+   is posted, and the producer drains before every publish. */
+static inline void daq_shmem_producer_poll(DAQ_ShmemProducer_t *producer)
+{
+    DAQ_ShmemHeader_t *shm = producer->shm;
+    uint32_t mask = shm->num_slots - 1;
+    uint32_t vd_head = __atomic_load_n(&shm->vd_head, __ATOMIC_ACQUIRE);
+
+    while (shm->vd_tail != vd_head)
+    {
+        DAQ_ShmemVerdict_t *vd = &daq_shmem_verdict_ring(shm)[shm->vd_tail & mask];
+
+        if (producer->feedback.entries && vd->verdict < MAX_DAQ_VERDICT)
+        {
+            DAQ_ShmemSlot_t *slot = daq_shmem_slot(shm, vd->slot);
+
+            daq_flow_cache_update(&producer->feedback, slot->data, slot->hdr.caplen,
+                                  (DAQ_Verdict) vd->verdict);
+        }
+        __atomic_store_n(&shm->vd_tail, shm->vd_tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* DAQ_Analysis_Func_t-shaped entry point for the capture process: pass this
+   as the acquire callback (with the producer as the user data) on any DAQ
+   module to bridge its traffic into the ring.  Returns the verdict learned
+   from consumer feedback for the packet's flow, or PASS. */
+static inline DAQ_Verdict daq_shmem_producer_callback(void *user, const DAQ_PktHdr_t *hdr,
+                                                      const uint8_t *data)
+{
+    DAQ_ShmemProducer_t *producer = (DAQ_ShmemProducer_t *) user;
+    DAQ_ShmemHeader_t *shm = producer->shm;
+    DAQ_Verdict verdict;
+    DAQ_ShmemSlot_t *slot;
+    uint32_t head, tail;
+
+    /* The tail is loaded before draining so that the verdict for any slot
+       about to be reused is guaranteed to have been seen. */
+    tail = __atomic_load_n(&shm->pkt_tail, __ATOMIC_ACQUIRE);
+    daq_shmem_producer_poll(producer);
+
+    if (producer->feedback.entries &&
+        daq_flow_cache_check(&producer->feedback, data, hdr->caplen, &verdict))
+    {
+        producer->fastpathed++;
+        return verdict;
+    }
+
+    head = shm->pkt_head;
+    if (head - tail >= shm->num_slots)
+    {
+        shm->drops++;
+        return DAQ_VERDICT_PASS;
+    }
+
+    slot = daq_shmem_slot(shm, head & (shm->num_slots - 1));
+    slot->hdr = *hdr;
+    if (slot->hdr.caplen > shm->snaplen)
+        slot->hdr.caplen = shm->snaplen;
+    memcpy(slot->data, data, slot->hdr.caplen);
+    __atomic_store_n(&shm->pkt_head, head + 1, __ATOMIC_RELEASE);
+    producer->published++;
+
+    return DAQ_VERDICT_PASS;
+}
+
+#endif /* _DAQ_SHMEM_H */
@@ -0,0 +1,214 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+** Copyright (C) 2010-2013 Sourcefire, Inc.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _DAQ_TIMESTAMP_H
+#define _DAQ_TIMESTAMP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+/*
+ * Selectable packet timestamp source.
+ *
+ * Modules that have to stamp packets themselves (no ring or kernel metadata
+ * to copy from) traditionally call gettimeofday() once per packet.  Even
+ * through the vdso that is measurable at high packet rates, and different
+ * modules doing it differently makes latency analytics across capture
+ * methods painful.  This header gives every module the same knob:
+ *
+ *   gettimeofday - one vdso clock read per packet (the historical behavior)
+ *   coarse       - CLOCK_REALTIME_COARSE, tick granularity (1-4 ms) but just
+ *                  a memory read, periodically corrected with a full clock
+ *                  read so timestamps never lag a stale tick
+ *   tsc          - the raw cycle counter scaled by a calibration against
+ *                  CLOCK_MONOTONIC that is refreshed about once a second,
+ *                  giving microsecond resolution for the cost of one rdtsc
+ *
+ * A source belongs to one module context and is only stamped from its
+ * acquire loop, so the calibration state needs no locking.  Modules whose
+ * packets already carry kernel or NIC timestamps should keep using those;
+ * this is only for the stamp-it-yourself paths.
+ */
+
+/* The BSDs spell the tick-granularity clock differently. */
+#ifndef CLOCK_REALTIME_COARSE
+#ifdef CLOCK_REALTIME_FAST
+#define CLOCK_REALTIME_COARSE CLOCK_REALTIME_FAST
+#else
+#define CLOCK_REALTIME_COARSE CLOCK_REALTIME
+#endif
+#endif
+
+#define DAQ_TS_GETTIMEOFDAY     0
+#define DAQ_TS_COARSE           1
+#define DAQ_TS_TSC              2
+
+/* Take a full clock read every this many coarse stamps. */
+#define DAQ_TS_COARSE_REFRESH   1024
+/* Recalibrate the TSC when roughly this many microseconds have passed. */
+#define DAQ_TS_TSC_RECAL_USECS  1000000
+
+typedef struct _daq_ts_source
+{
+    int mode;
+    /* coarse */
+    uint32_t refresh_countdown;
+    struct timeval last_full;   /* most recent full clock read */
+    /* tsc */
+    uint64_t cal_tsc;           /* cycle count at last calibration */
+    uint64_t cal_mono_ns;       /* CLOCK_MONOTONIC at last calibration */
+    struct timeval cal_tv;      /* wall clock at last calibration */
+    double usecs_per_cycle;     /* 0.0 until the second calibration point */
+    uint64_t recal_cycles;      /* cycles between recalibrations */
+} DAQ_TsSource_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DAQ_TS_HAVE_TSC 1
+static inline uint64_t daq_ts_rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+#endif
+
+static inline uint64_t daq_ts_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Parse a timestamp source name ("gettimeofday", "coarse" or "tsc") and set
+ * up the calibration state.  Returns 0 on success or -1 for an unknown name
+ * or a source this build cannot provide. */
+static inline int daq_ts_source_init(DAQ_TsSource_t *src, const char *name)
+{
+    memset(src, 0, sizeof(*src));
+
+    if (!name || !strcmp(name, "gettimeofday") || !strcmp(name, "tod"))
+    {
+        src->mode = DAQ_TS_GETTIMEOFDAY;
+        return 0;
+    }
+    if (!strcmp(name, "coarse"))
+    {
+        src->mode = DAQ_TS_COARSE;
+        gettimeofday(&src->last_full, NULL);
+        return 0;
+    }
+    if (!strcmp(name, "tsc"))
+    {
+#ifdef DAQ_TS_HAVE_TSC
+        src->mode = DAQ_TS_TSC;
+        gettimeofday(&src->cal_tv, NULL);
+        src->cal_mono_ns = daq_ts_mono_ns();
+        src->cal_tsc = daq_ts_rdtsc();
+        /* The rate is unknown until enough time has passed to measure it;
+           stamps fall back to gettimeofday() in the interim. */
+        src->usecs_per_cycle = 0.0;
+        src->recal_cycles = 1;
+        return 0;
+#else
+        return -1;
+#endif
+    }
+    return -1;
+}
+
+#ifdef DAQ_TS_HAVE_TSC
+static inline void daq_ts_tsc_recalibrate(DAQ_TsSource_t *src, uint64_t tsc)
+{
+    uint64_t mono_ns = daq_ts_mono_ns();
+    uint64_t dcycles = tsc - src->cal_tsc;
+    uint64_t dns = mono_ns - src->cal_mono_ns;
+
+    /* Wait until the measurement interval is long enough (1 ms) for the
+       rate to be trustworthy. */
+    if (dns < 1000000)
+        return;
+
+    src->usecs_per_cycle = (double) dns / 1000.0 / (double) dcycles;
+    src->recal_cycles = (uint64_t) (DAQ_TS_TSC_RECAL_USECS / src->usecs_per_cycle);
+    gettimeofday(&src->cal_tv, NULL);
+    src->cal_mono_ns = daq_ts_mono_ns();
+    /* Anchor to the caller's reading - a fresh rdtsc() here would be newer
+       than the tsc the caller is about to scale, and the unsigned
+       (tsc - cal_tsc) would underflow into a far-future stamp.  The clock
+       reads above land within a microsecond of the caller's tsc. */
+    src->cal_tsc = tsc;
+}
+#endif
+
+/* Fill *tv from the configured source.  One predictable branch plus the
+ * source's own cost on the per-packet path. */
+static inline void daq_ts_stamp(DAQ_TsSource_t *src, struct timeval *tv)
+{
+    switch (src->mode)
+    {
+        case DAQ_TS_COARSE:
+        {
+            struct timespec ts;
+
+            if (src->refresh_countdown == 0)
+            {
+                src->refresh_countdown = DAQ_TS_COARSE_REFRESH;
+                gettimeofday(&src->last_full, NULL);
+                *tv = src->last_full;
+                return;
+            }
+            src->refresh_countdown--;
+            clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+            tv->tv_sec = ts.tv_sec;
+            tv->tv_usec = ts.tv_nsec / 1000;
+            /* Never step backwards past the last full read. */
+            if (tv->tv_sec < src->last_full.tv_sec ||
+                (tv->tv_sec == src->last_full.tv_sec && tv->tv_usec < src->last_full.tv_usec))
+                *tv = src->last_full;
+            return;
+        }
+#ifdef DAQ_TS_HAVE_TSC
+        case DAQ_TS_TSC:
+        {
+            uint64_t tsc = daq_ts_rdtsc();
+            uint64_t usecs;
+
+            if (tsc - src->cal_tsc >= src->recal_cycles)
+                daq_ts_tsc_recalibrate(src, tsc);
+            if (src->usecs_per_cycle == 0.0)
+                break;
+
+            usecs = (uint64_t) ((double) (tsc - src->cal_tsc) * src->usecs_per_cycle);
+            tv->tv_sec = src->cal_tv.tv_sec + (usecs + src->cal_tv.tv_usec) / 1000000;
+            tv->tv_usec = (usecs + src->cal_tv.tv_usec) % 1000000;
+            return;
+        }
+#endif
+        default:
+            break;
+    }
+    gettimeofday(tv, NULL);
+}
+
+#endif /* _DAQ_TIMESTAMP_H */
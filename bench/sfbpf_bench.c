@@ -0,0 +1,418 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+** sfbpf_bench - BPF filter microbenchmark and corpus runner for libsfbpf.
+**
+** Compiles a set of filter expressions with sfbpf_compile() and runs each
+** one over a packet corpus read from a pcap file, reporting per expression:
+** compile time, optimized instruction count, match rate and filter
+** cycles/packet through sfbpf_filter().  This gives optimizer changes in
+** sf_optimize.c and interpreter changes in sf_bpf_filter.c hard numbers to
+** stand on instead of eyeballed tcpdump -d output.
+**
+** Expressions come from a file (one per line, '#' comments ignored) or a
+** directory (one expression per file).  The corpus is parsed directly from
+** the pcap file format so the tool depends only on libsfbpf.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "daq_common.h"     /* For daq_perf_cycles() */
+#include "sfbpf.h"
+
+#define CORPUS_PCAP_MAGIC               0xa1b2c3d4
+#define CORPUS_PCAP_MAGIC_SWAPPED       0xd4c3b2a1
+#define CORPUS_PCAP_MAGIC_NSEC          0xa1b23c4d
+#define CORPUS_PCAP_MAGIC_NSEC_SWAPPED  0x4d3cb2a1
+
+typedef struct _corpus_packet
+{
+    uint8_t *data;
+    uint32_t caplen;
+    uint32_t pktlen;
+} CorpusPacket;
+
+typedef struct _corpus
+{
+    CorpusPacket *packets;
+    unsigned count;
+    int linktype;
+    int snaplen;
+} Corpus;
+
+typedef struct _filter_expr
+{
+    char *name;
+    char *expr;
+    struct _filter_expr *next;
+} FilterExpr;
+
+static uint32_t corpus_swap32(uint32_t val, int swapped)
+{
+    if (!swapped)
+        return val;
+    return ((val & 0x000000ff) << 24) | ((val & 0x0000ff00) << 8) |
+           ((val & 0x00ff0000) >> 8) | ((val & 0xff000000) >> 24);
+}
+
+static int corpus_load(Corpus *corpus, const char *filename)
+{
+    FILE *fp;
+    uint32_t hdr[6], rec[4];
+    uint32_t caplen;
+    unsigned capacity = 1024;
+    int swapped;
+
+    fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Couldn't open corpus file %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+    {
+        fprintf(stderr, "Couldn't read the pcap file header from %s!\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    switch (hdr[0])
+    {
+        case CORPUS_PCAP_MAGIC:
+        case CORPUS_PCAP_MAGIC_NSEC:
+            swapped = 0;
+            break;
+        case CORPUS_PCAP_MAGIC_SWAPPED:
+        case CORPUS_PCAP_MAGIC_NSEC_SWAPPED:
+            swapped = 1;
+            break;
+        default:
+            fprintf(stderr, "%s is not a pcap file (magic 0x%08x)!\n", filename, hdr[0]);
+            fclose(fp);
+            return -1;
+    }
+    corpus->snaplen = corpus_swap32(hdr[4], swapped);
+    corpus->linktype = corpus_swap32(hdr[5], swapped);
+
+    corpus->packets = calloc(capacity, sizeof(CorpusPacket));
+    if (!corpus->packets)
+    {
+        fclose(fp);
+        return -1;
+    }
+    while (fread(rec, sizeof(rec), 1, fp) == 1)
+    {
+        CorpusPacket *cp;
+
+        caplen = corpus_swap32(rec[2], swapped);
+        if (corpus->count == capacity)
+        {
+            CorpusPacket *tmp = realloc(corpus->packets, capacity * 2 * sizeof(CorpusPacket));
+            if (!tmp)
+                break;
+            corpus->packets = tmp;
+            capacity *= 2;
+        }
+        cp = &corpus->packets[corpus->count];
+        cp->data = malloc(caplen);
+        if (!cp->data)
+            break;
+        if (fread(cp->data, 1, caplen, fp) != caplen)
+        {
+            free(cp->data);
+            break;
+        }
+        cp->caplen = caplen;
+        cp->pktlen = corpus_swap32(rec[3], swapped);
+        corpus->count++;
+    }
+    fclose(fp);
+    if (!corpus->count)
+    {
+        fprintf(stderr, "No packets found in %s!\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+static char *read_trimmed_file(const char *path)
+{
+    FILE *fp;
+    char *buf;
+    long size;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (!buf)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    size = fread(buf, 1, size, fp);
+    fclose(fp);
+    buf[size] = '\0';
+    /* Collapse the expression onto one line and trim trailing whitespace. */
+    while (size > 0 && strchr(" \t\r\n", buf[size - 1]))
+        buf[--size] = '\0';
+    for (; size > 0; size--)
+    {
+        if (buf[size - 1] == '\n' || buf[size - 1] == '\r')
+            buf[size - 1] = ' ';
+    }
+    return buf;
+}
+
+static FilterExpr *filter_expr_new(const char *name, const char *expr)
+{
+    FilterExpr *fe;
+
+    fe = calloc(1, sizeof(FilterExpr));
+    if (!fe)
+        return NULL;
+    fe->name = strdup(name);
+    fe->expr = strdup(expr);
+    if (!fe->name || !fe->expr)
+    {
+        free(fe->name);
+        free(fe->expr);
+        free(fe);
+        return NULL;
+    }
+    return fe;
+}
+
+static FilterExpr *filters_load(const char *path)
+{
+    FilterExpr *head = NULL, *tail = NULL, *fe;
+    struct stat sb;
+
+    if (stat(path, &sb) != 0)
+    {
+        fprintf(stderr, "Couldn't stat %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (S_ISDIR(sb.st_mode))
+    {
+        DIR *dir = opendir(path);
+        struct dirent *de;
+        char filepath[4096];
+        char *expr;
+
+        if (!dir)
+        {
+            fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        while ((de = readdir(dir)) != NULL)
+        {
+            if (de->d_name[0] == '.')
+                continue;
+            snprintf(filepath, sizeof(filepath), "%s/%s", path, de->d_name);
+            if (stat(filepath, &sb) != 0 || !S_ISREG(sb.st_mode))
+                continue;
+            expr = read_trimmed_file(filepath);
+            if (!expr || !*expr)
+            {
+                free(expr);
+                continue;
+            }
+            fe = filter_expr_new(de->d_name, expr);
+            free(expr);
+            if (!fe)
+                continue;
+            if (tail)
+                tail->next = fe;
+            else
+                head = fe;
+            tail = fe;
+        }
+        closedir(dir);
+    }
+    else
+    {
+        FILE *fp = fopen(path, "r");
+        char line[4096], name[32];
+        unsigned lineno = 0;
+        size_t len;
+
+        if (!fp)
+        {
+            fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        while (fgets(line, sizeof(line), fp))
+        {
+            lineno++;
+            len = strlen(line);
+            while (len > 0 && strchr(" \t\r\n", line[len - 1]))
+                line[--len] = '\0';
+            if (!len || line[0] == '#')
+                continue;
+            snprintf(name, sizeof(name), "line %u", lineno);
+            fe = filter_expr_new(name, line);
+            if (!fe)
+                continue;
+            if (tail)
+                tail->next = fe;
+            else
+                head = fe;
+            tail = fe;
+        }
+        fclose(fp);
+    }
+
+    if (!head)
+        fprintf(stderr, "No filter expressions found in %s!\n", path);
+    return head;
+}
+
+static void bench_usage(void)
+{
+    printf("Usage: sfbpf_bench -f <filters> -c <corpus.pcap> [options]\n");
+    printf("  -f <path>     Filter expressions: a file (one per line, # comments)\n");
+    printf("                or a directory (one expression per file)\n");
+    printf("  -c <pcap>     Packet corpus to run the filters over\n");
+    printf("  -n <iters>    Passes over the corpus per filter (default 10)\n");
+    printf("  -O            Disable the sf_optimize.c optimizer pass\n");
+    printf("  -h            Display this help text\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Corpus corpus;
+    FilterExpr *filters, *fe, *next;
+    const char *filter_path = NULL, *corpus_path = NULL;
+    unsigned iterations = 10;
+    int optimize = 1;
+    unsigned i, n;
+    int ch;
+
+    memset(&corpus, 0, sizeof(corpus));
+
+    while ((ch = getopt(argc, argv, "f:c:n:Oh")) != -1)
+    {
+        switch (ch)
+        {
+            case 'f':
+                filter_path = optarg;
+                break;
+            case 'c':
+                corpus_path = optarg;
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 'O':
+                optimize = 0;
+                break;
+            case 'h':
+                bench_usage();
+                return 0;
+            default:
+                bench_usage();
+                return 1;
+        }
+    }
+
+    if (!filter_path || !corpus_path || !iterations)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    if (corpus_load(&corpus, corpus_path) != 0)
+        return 1;
+    filters = filters_load(filter_path);
+    if (!filters)
+        return 1;
+
+    printf("Corpus: %u packets, linktype %d, snaplen %d, %u passes per filter\n\n",
+           corpus.count, corpus.linktype, corpus.snaplen, iterations);
+    printf("%-24s %10s %6s %10s %12s %10s\n",
+           "filter", "compile_us", "insns", "matches", "cycles/pkt", "match%");
+
+    for (fe = filters; fe; fe = fe->next)
+    {
+        struct sfbpf_program fcode;
+        struct timespec t0, t1;
+        uint64_t c0, c1, matches = 0, total;
+        double compile_us;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (sfbpf_compile(corpus.snaplen, corpus.linktype, &fcode, fe->expr, optimize, 0) < 0)
+        {
+            printf("%-24s COMPILE FAILED (%s)\n", fe->name, fe->expr);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        compile_us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+
+        c0 = daq_perf_cycles();
+        for (n = 0; n < iterations; n++)
+        {
+            for (i = 0; i < corpus.count; i++)
+            {
+                const CorpusPacket *cp = &corpus.packets[i];
+
+                if (sfbpf_filter(fcode.bf_insns, cp->data, cp->pktlen, cp->caplen) != 0)
+                    matches++;
+            }
+        }
+        c1 = daq_perf_cycles();
+        total = (uint64_t) corpus.count * iterations;
+
+        printf("%-24s %10.1f %6u %10llu %12.1f %9.1f%%\n",
+               fe->name, compile_us, fcode.bf_len,
+               (unsigned long long) (matches / iterations),
+               (double) (c1 - c0) / total,
+               100.0 * matches / total);
+
+        sfbpf_freecode(&fcode);
+    }
+
+    for (fe = filters; fe; fe = next)
+    {
+        next = fe->next;
+        free(fe->name);
+        free(fe->expr);
+        free(fe);
+    }
+    for (i = 0; i < corpus.count; i++)
+        free(corpus.packets[i].data);
+    free(corpus.packets);
+    return 0;
+}
@@ -27,6 +27,10 @@
 #include <limits.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#ifdef PACKET_TIMESTAMP
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#endif
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <netinet/in.h>
@@ -39,19 +43,47 @@
 #include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "daq_api.h"
+#include "daq_flow_cache.h"
+#include "daq_retry_wheel.h"
+#include "daq_tunnel.h"
+#include "daq_xdp_shunt.h"
 #include "sfbpf.h"
 
-#define DAQ_AFPACKET_VERSION 6
+#define DAQ_AFPACKET_VERSION 11
 
 #define AF_PACKET_DEFAULT_BUFFER_SIZE   128
 #define AF_PACKET_MAX_INTERFACES    32
+#define AF_PACKET_BATCH_SIZE        32
+/* TPACKET_V3 block retirement timeout in milliseconds.  This bounds the latency added by
+    waiting for the kernel to fill a block before handing it to userspace. */
+#define AF_PACKET_V3_BLOCK_TIMEOUT  10
+/* Default maximum number of flow map entries for the XDP shunt. */
+#define AF_PACKET_DEFAULT_SHUNT_SIZE    16384
+/* Number of times the adaptive wait strategy checks the rings before giving up
+    and sleeping in poll(). */
+#define AF_PACKET_ADAPTIVE_SPIN_COUNT   8192
+/* Defaults for the RETRY verdict: how long to hold a packet copy before redelivering
+    it (milliseconds) and how many copies may be held at once. */
+#define AF_PACKET_DEFAULT_RETRY_DELAY   200
+#define AF_PACKET_DEFAULT_RETRY_QUEUE   1024
+
+typedef enum
+{
+    AF_PACKET_WAIT_POLL = 0,    /* Sleep in poll() whenever the rings are empty (default) */
+    AF_PACKET_WAIT_SPIN,        /* Busy-poll the ring status words, never sleeping */
+    AF_PACKET_WAIT_ADAPTIVE,    /* Spin briefly, then fall back to sleeping in poll() */
+} AFPacketWaitStrategy;
 
 union thdr
 {
     struct tpacket2_hdr *h2;
+#ifdef TPACKET_V3
+    struct tpacket_block_desc *bd;
+#endif
     uint8_t *raw;
 };
 
@@ -59,8 +91,18 @@ typedef struct _af_packet_entry
 {
     struct _af_packet_entry *next;
     union thdr hdr;
+    /* Saved packet data pointer and length for frames held pending a deferred verdict. */
+    const uint8_t *pending_data;
+    uint32_t pending_len;
 } AFPacketEntry;
 
+/* Deferred verdict tokens encode the ordinal of the instance in the context's instance
+    list in the top byte and the index of the frame entry in the instance's RX ring in
+    the remaining 24 bits. */
+#define AF_PACKET_TOKEN(ordinal, frame) (((uint32_t) (ordinal) << 24) | (frame))
+#define AF_PACKET_TOKEN_ORDINAL(token)  ((token) >> 24)
+#define AF_PACKET_TOKEN_FRAME(token)    ((token) & 0xffffff)
+
 typedef struct _af_packet_ring
 {
     struct tpacket_req layout;
@@ -79,10 +121,16 @@ typedef struct _af_packet_instance
     void *buffer;
     AFPacketRing rx_ring;
     AFPacketRing tx_ring;
+    uint32_t tx_pending;        /* frames staged in the TX ring awaiting a kernel kick */
+    uint32_t tx_flush_limit;    /* kick early once this many are staged */
     char *name;
     int index;
     struct _af_packet_instance *peer;
     struct sockaddr_ll sll;
+#ifdef TPACKET_V3
+    struct tpacket3_hdr *v3_pkt;    /* Next packet within the currently open RX block */
+    uint32_t v3_pkts_left;          /* Packets remaining in the currently open RX block */
+#endif
 } AFPacketInstance;
 
 #ifdef PACKET_FANOUT
@@ -102,6 +150,11 @@ typedef struct _afpacket_context
     int timeout;
     uint32_t size;
     int debug;
+    int force_tpacket_v2;
+    bool inline_mode;
+    AFPacketWaitStrategy wait_strategy;
+    unsigned busy_poll_usecs;
+    int hw_timestamps;
     AFPacketInstance *instances;
     uint32_t intf_count;
     struct sfbpf_program fcode;
@@ -112,6 +165,12 @@ typedef struct _afpacket_context
 #ifdef PACKET_FANOUT
     AFPacketFanoutCfg fanout_cfg;
 #endif
+    DAQ_FlowCache_t flow_cache;
+    DAQ_XdpShunt_t xdp_shunt;
+    bool xdp_shunt_enabled;
+    DAQ_RetryWheel_t retry_wheel;
+    bool retry_enabled;
+    DAQ_PerfStats_t *perf;
 } AFPacket_Context_t;
 
 /* VLAN defintions stolen from LibPCAP's vlan.h. */
@@ -155,6 +214,30 @@ static int set_up_ring(AFPacket_Context_t *afpc, AFPacketInstance *instance, AFP
 {
     unsigned int idx, block, block_offset, frame, frame_offset;
 
+#ifdef TPACKET_V3
+    /* In TPACKET_V3 block mode, the ring entries track whole blocks rather than
+        individual frames. */
+    if (instance->tp_version == TPACKET_V3 && ring == &instance->rx_ring)
+    {
+        ring->entries = calloc(ring->layout.tp_block_nr, sizeof(AFPacketEntry));
+        if (!ring->entries)
+        {
+            DPE(afpc->errbuf, "%s: Could not allocate ring buffer entries for device %s!", __func__, instance->name);
+            return DAQ_ERROR_NOMEM;
+        }
+
+        for (block = 0; block < ring->layout.tp_block_nr; block++)
+        {
+            ring->entries[block].hdr.raw = (uint8_t *) ring->start + block * ring->layout.tp_block_size;
+            ring->entries[block].next = &ring->entries[block + 1];
+        }
+        ring->entries[ring->layout.tp_block_nr - 1].next = &ring->entries[0];
+        ring->cursor = &ring->entries[0];
+
+        return DAQ_SUCCESS;
+    }
+#endif /* TPACKET_V3 */
+
     /* Allocate a ring to hold packet pointers. */
     ring->entries = calloc(ring->layout.tp_frame_nr, sizeof(AFPacketEntry));
     if (!ring->entries)
@@ -302,6 +385,38 @@ static int determine_version(AFPacket_Context_t *afpc, AFPacketInstance *instanc
     socklen_t len;
     int val;
 
+#ifdef TPACKET_V3
+    /* Prefer TPACKET_V3 block mode for passive instances - the kernel retires whole
+        blocks of packets at a time, so the acquire loop pays one wakeup per block
+        instead of one per frame.  V3 has no usable TX ring semantics for our inline
+        forwarding, so bridged instances stay on V2. */
+    if (!instance->peer && !afpc->force_tpacket_v2)
+    {
+        val = TPACKET_V3;
+        len = sizeof(val);
+        if (getsockopt(instance->fd, SOL_PACKET, PACKET_HDRLEN, &val, &len) >= 0)
+        {
+            instance->tp_hdrlen = val;
+            val = TPACKET_V3;
+            if (setsockopt(instance->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)) < 0)
+            {
+                DPE(afpc->errbuf, "Couldn't activate TPACKET_V3 on packet socket: %s", strerror(errno));
+                return -1;
+            }
+            instance->tp_version = TPACKET_V3;
+
+            if (afpc->debug)
+            {
+                printf("Version: %u\n", instance->tp_version);
+                printf("Header Length: %u\n", instance->tp_hdrlen);
+            }
+
+            return DAQ_SUCCESS;
+        }
+        /* Fall through and try TPACKET_V2 on older kernels. */
+    }
+#endif /* TPACKET_V3 */
+
     /* Probe whether kernel supports TPACKET_V2 */
     val = TPACKET_V2;
     len = sizeof(val);
@@ -387,6 +502,21 @@ static int create_ring(AFPacket_Context_t *afpc, AFPacketInstance *instance, AFP
             return DAQ_ERROR;
 
         /* Ask the kernel to create the ring. */
+#ifdef TPACKET_V3
+        if (instance->tp_version == TPACKET_V3 && optname == PACKET_RX_RING)
+        {
+            struct tpacket_req3 req3;
+
+            memset(&req3, 0, sizeof(req3));
+            req3.tp_block_size = ring->layout.tp_block_size;
+            req3.tp_block_nr = ring->layout.tp_block_nr;
+            req3.tp_frame_size = ring->layout.tp_frame_size;
+            req3.tp_frame_nr = ring->layout.tp_frame_nr;
+            req3.tp_retire_blk_tov = AF_PACKET_V3_BLOCK_TIMEOUT;
+            rc = setsockopt(instance->fd, SOL_PACKET, optname, (void*) &req3, sizeof(req3));
+        }
+        else
+#endif
         rc = setsockopt(instance->fd, SOL_PACKET, optname, (void*) &ring->layout, sizeof(struct tpacket_req));
         if (rc)
         {
@@ -465,6 +595,50 @@ static int start_instance(AFPacket_Context_t *afpc, AFPacketInstance *instance)
         return -1;
     }
 
+#ifdef SO_BUSY_POLL
+    /* Ask the kernel to busy-poll the device driver for this long (in microseconds)
+        before a blocking receive actually sleeps. */
+    if (afpc->busy_poll_usecs)
+    {
+        int busy_poll = afpc->busy_poll_usecs;
+        if (setsockopt(instance->fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1)
+        {
+            DPE(afpc->errbuf, "%s: Could not enable SO_BUSY_POLL: %s", __func__, strerror(errno));
+            return -1;
+        }
+    }
+#endif
+
+#ifdef PACKET_TIMESTAMP
+    /* Have the NIC stamp received frames and the ring report its stamps in
+        tp_sec/tp_nsec instead of the kernel's software ones. */
+    if (afpc->hw_timestamps)
+    {
+        struct hwtstamp_config hwts;
+        struct ifreq ifr;
+        int req = SOF_TIMESTAMPING_RAW_HARDWARE;
+
+        memset(&hwts, 0, sizeof(hwts));
+        hwts.tx_type = HWTSTAMP_TX_OFF;
+        hwts.rx_filter = HWTSTAMP_FILTER_ALL;
+        memset(&ifr, 0, sizeof(ifr));
+        snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", instance->name);
+        ifr.ifr_data = (void *) &hwts;
+        if (ioctl(instance->fd, SIOCSHWTSTAMP, &ifr) == -1)
+        {
+            DPE(afpc->errbuf, "%s: Could not enable hardware timestamping on %s: %s",
+                    __func__, instance->name, strerror(errno));
+            return -1;
+        }
+        if (setsockopt(instance->fd, SOL_PACKET, PACKET_TIMESTAMP, &req, sizeof(req)) == -1)
+        {
+            DPE(afpc->errbuf, "%s: Could not request hardware ring timestamps: %s",
+                    __func__, strerror(errno));
+            return -1;
+        }
+    }
+#endif
+
     /* Get the link-layer type. */
     arptype = iface_get_arptype(instance);
     if (arptype < 0)
@@ -500,6 +674,13 @@ static int start_instance(AFPacket_Context_t *afpc, AFPacketInstance *instance)
     /* ...as well as one for the TX ring if we're in inline mode... */
     if (instance->peer && set_up_ring(afpc, instance, &instance->tx_ring) != DAQ_SUCCESS)
         return -1;
+    if (instance->peer)
+    {
+        /* Kick the kernel early if a TX batch ever covers half the ring. */
+        instance->tx_flush_limit = instance->tx_ring.layout.tp_frame_nr / 2;
+        if (!instance->tx_flush_limit)
+            instance->tx_flush_limit = 1;
+    }
 #ifdef PACKET_FANOUT
     /* ...and configure packet fanout if requested. */
     if (afpc->fanout_cfg.enabled && configure_fanout(afpc, instance) != DAQ_SUCCESS)
@@ -509,23 +690,34 @@ static int start_instance(AFPacket_Context_t *afpc, AFPacketInstance *instance)
     return 0;
 }
 
+/* The v2 and v3 kernel stats structures share their leading tp_packets/tp_drops members,
+    so the v2 member is used to read both. */
+union kstats
+{
+    struct tpacket_stats v2;
+#ifdef TPACKET_V3
+    struct tpacket_stats_v3 v3;
+#endif
+};
+
 static void update_hw_stats(AFPacket_Context_t *afpc)
 {
     AFPacketInstance *instance;
-    struct tpacket_stats kstats;
-    socklen_t len = sizeof (struct tpacket_stats);
+    union kstats kstats;
+    socklen_t len;
 
     if (afpc->state != DAQ_STATE_STARTED)
         return;
 
     for (instance = afpc->instances; instance; instance = instance->next)
     {
+        len = sizeof(kstats);
         memset(&kstats, 0, len);
         if (getsockopt(instance->fd, SOL_PACKET, PACKET_STATISTICS, &kstats, &len) > -1)
         {
             /* The IOCTL adds tp_drops to tp_packets in the returned structure for some mind-boggling reason... */
-            afpc->stats.hw_packets_received += kstats.tp_packets - kstats.tp_drops;
-            afpc->stats.hw_packets_dropped += kstats.tp_drops;
+            afpc->stats.hw_packets_received += kstats.v2.tp_packets - kstats.v2.tp_drops;
+            afpc->stats.hw_packets_dropped += kstats.v2.tp_drops;
         }
         else
             fprintf(stderr, "Failed to get stats for %s: %d %s\n", instance->name, errno, strerror(errno));
@@ -548,6 +740,20 @@ static int af_packet_close(AFPacket_Context_t *afpc)
         destroy_instance(instance);
     }
 
+    daq_xdp_shunt_detach_all(&afpc->xdp_shunt);
+
+    /* Held packet copies don't survive a stop - drop them back into the pool. */
+    if (afpc->retry_enabled)
+    {
+        DAQ_RetryEntry_t *entry, *next;
+
+        for (entry = daq_retry_wheel_drain(&afpc->retry_wheel); entry; entry = next)
+        {
+            next = entry->next;
+            daq_retry_wheel_release(&afpc->retry_wheel, entry);
+        }
+    }
+
     sfbpf_freecode(&afpc->fcode);
 
     afpc->state = DAQ_STATE_STOPPED;
@@ -555,12 +761,12 @@ static int af_packet_close(AFPacket_Context_t *afpc)
     return 0;
 }
 
-static int create_bridge(AFPacket_Context_t *afpc, const char *device_name1, const char *device_name2)
+static int create_bridge(AFPacketInstance *instances, const char *device_name1, const char *device_name2)
 {
     AFPacketInstance *instance, *peer1, *peer2;
 
     peer1 = peer2 = NULL;
-    for (instance = afpc->instances; instance; instance = instance->next)
+    for (instance = instances; instance; instance = instance->next)
     {
         if (!strcmp(instance->name, device_name1))
             peer1 = instance;
@@ -577,52 +783,20 @@ static int create_bridge(AFPacket_Context_t *afpc, const char *device_name1, con
     return DAQ_SUCCESS;
 }
 
-static void reset_stats(AFPacket_Context_t *afpc)
-{
-    AFPacketInstance *instance;
-    struct tpacket_stats kstats;
-    socklen_t len = sizeof (struct tpacket_stats);
-
-    memset(&afpc->stats, 0, sizeof(DAQ_Stats_t));
-    /* Just call PACKET_STATISTICS to clear each instance's stats. */
-    for (instance = afpc->instances; instance; instance = instance->next)
-        getsockopt(instance->fd, SOL_PACKET, PACKET_STATISTICS, &kstats, &len);
-}
-
-static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char *errbuf, size_t errlen)
+/* Parse the context's device specification into a freshly created list of instances,
+    bridging interface pairs when in inline mode.  Used both at initialization time and
+    to build the replacement instances for a hot config swap. */
+static int create_instance_list(AFPacket_Context_t *afpc, bool inline_mode, AFPacketInstance **list_ptr, char *errbuf, size_t errlen)
 {
-    AFPacket_Context_t *afpc;
-    AFPacketInstance *instance;
-    const char *size_str = NULL;
-    char *name1, *name2, *dev;
+    AFPacketInstance *instance, *list = NULL;
     char intf[IFNAMSIZ];
-    uint32_t size;
+    char *name1, *name2, *dev;
     size_t len;
-    int num_rings, num_intfs = 0;
-    int rval = DAQ_ERROR;
-    DAQ_Dict *entry;
-
-    afpc = calloc(1, sizeof(AFPacket_Context_t));
-    if (!afpc)
-    {
-        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the new AFPacket context!", __func__);
-        rval = DAQ_ERROR_NOMEM;
-        goto err;
-    }
-
-    afpc->device = strdup(config->name);
-    if (!afpc->device)
-    {
-        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the device string!", __func__);
-        rval = DAQ_ERROR_NOMEM;
-        goto err;
-    }
-
-    afpc->snaplen = config->snaplen;
-    afpc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
+    uint32_t intf_count = 0;
+    int num_intfs = 0;
 
     dev = afpc->device;
-    if (*dev == ':' || ((len = strlen(dev)) > 0 && *(dev + len - 1) == ':') || (config->mode == DAQ_MODE_PASSIVE && strstr(dev, "::")))
+    if (*dev == ':' || ((len = strlen(dev)) > 0 && *(dev + len - 1) == ':') || (!inline_mode && strstr(dev, "::")))
     {
         snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __func__, afpc->device);
         goto err;
@@ -638,8 +812,8 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
         }
         if (len != 0)
         {
-            afpc->intf_count++;
-            if (afpc->intf_count >= AF_PACKET_MAX_INTERFACES)
+            intf_count++;
+            if (intf_count >= AF_PACKET_MAX_INTERFACES)
             {
                 snprintf(errbuf, errlen, "%s: Using more than %d interfaces is not supported!", __func__, AF_PACKET_MAX_INTERFACES);
                 goto err;
@@ -649,17 +823,17 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
             if (!instance)
                 goto err;
 
-            instance->next = afpc->instances;
-            afpc->instances = instance;
+            instance->next = list;
+            list = instance;
             num_intfs++;
-            if (config->mode != DAQ_MODE_PASSIVE)
+            if (inline_mode)
             {
                 if (num_intfs == 2)
                 {
-                    name1 = afpc->instances->next->name;
-                    name2 = afpc->instances->name;
+                    name1 = list->next->name;
+                    name2 = list->name;
 
-                    if (create_bridge(afpc, name1, name2) != DAQ_SUCCESS)
+                    if (create_bridge(list, name1, name2) != DAQ_SUCCESS)
                     {
                         snprintf(errbuf, errlen, "%s: Couldn't create the bridge between %s and %s!", __func__, name1, name2);
                         goto err;
@@ -676,12 +850,75 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
     }
 
     /* If there are any leftover unbridged interfaces and we're not in Passive mode, error out. */
-    if (!afpc->instances || (config->mode != DAQ_MODE_PASSIVE && num_intfs != 0))
+    if (!list || (inline_mode && num_intfs != 0))
     {
         snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __func__, afpc->device);
         goto err;
     }
 
+    afpc->intf_count = intf_count;
+    *list_ptr = list;
+
+    return DAQ_SUCCESS;
+
+err:
+    while ((instance = list) != NULL)
+    {
+        list = instance->next;
+        destroy_instance(instance);
+    }
+    return DAQ_ERROR;
+}
+
+static void reset_stats(AFPacket_Context_t *afpc)
+{
+    AFPacketInstance *instance;
+    union kstats kstats;
+    socklen_t len = sizeof(kstats);
+
+    memset(&afpc->stats, 0, sizeof(DAQ_Stats_t));
+    /* Just call PACKET_STATISTICS to clear each instance's stats. */
+    for (instance = afpc->instances; instance; instance = instance->next)
+        getsockopt(instance->fd, SOL_PACKET, PACKET_STATISTICS, &kstats, &len);
+}
+
+static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char *errbuf, size_t errlen)
+{
+    AFPacket_Context_t *afpc;
+    AFPacketInstance *instance;
+    const char *size_str = NULL;
+    uint32_t size;
+    uint32_t flow_cache_size = 0;
+    uint32_t xdp_shunt_size = AF_PACKET_DEFAULT_SHUNT_SIZE;
+    uint32_t retry_delay = AF_PACKET_DEFAULT_RETRY_DELAY;
+    uint32_t retry_queue_size = AF_PACKET_DEFAULT_RETRY_QUEUE;
+    int num_rings;
+    int rval = DAQ_ERROR;
+    DAQ_Dict *entry;
+
+    afpc = calloc(1, sizeof(AFPacket_Context_t));
+    if (!afpc)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the new AFPacket context!", __func__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
+    afpc->device = strdup(config->name);
+    if (!afpc->device)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the device string!", __func__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
+    afpc->snaplen = config->snaplen;
+    afpc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
+    afpc->inline_mode = (config->mode != DAQ_MODE_PASSIVE);
+
+    if (create_instance_list(afpc, afpc->inline_mode, &afpc->instances, errbuf, errlen) != DAQ_SUCCESS)
+        goto err;
+
     /*
      * Determine the dimensions of the kernel RX ring(s) to request.
      */
@@ -692,6 +929,101 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
             size_str = entry->value;
         else if (!strcmp(entry->key, "debug"))
             afpc->debug = 1;
+        else if (!strcmp(entry->key, "tpacket_v2"))
+            afpc->force_tpacket_v2 = 1;
+        else if (!strcmp(entry->key, "wait_strategy"))
+        {
+            if (!entry->value)
+            {
+                snprintf(errbuf, errlen, "%s: %s requires an argument!", __func__, entry->key);
+                goto err;
+            }
+            if (!strcmp(entry->value, "poll"))
+                afpc->wait_strategy = AF_PACKET_WAIT_POLL;
+            else if (!strcmp(entry->value, "spin"))
+                afpc->wait_strategy = AF_PACKET_WAIT_SPIN;
+            else if (!strcmp(entry->value, "adaptive"))
+                afpc->wait_strategy = AF_PACKET_WAIT_ADAPTIVE;
+            else
+            {
+                snprintf(errbuf, errlen, "%s: Unrecognized argument for %s: '%s'!", __func__, entry->key, entry->value);
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "busy_poll"))
+        {
+#ifdef SO_BUSY_POLL
+            if (!entry->value)
+            {
+                snprintf(errbuf, errlen, "%s: %s requires an argument!", __func__, entry->key);
+                goto err;
+            }
+            afpc->busy_poll_usecs = strtoul(entry->value, NULL, 10);
+#else
+            snprintf(errbuf, errlen, "%s: SO_BUSY_POLL is not supported on this system!", __func__);
+            goto err;
+#endif
+        }
+        else if (!strcmp(entry->key, "hw_timestamps"))
+        {
+#ifdef PACKET_TIMESTAMP
+            afpc->hw_timestamps = 1;
+#else
+            snprintf(errbuf, errlen, "%s: PACKET_TIMESTAMP is not supported on this system!", __func__);
+            goto err;
+#endif
+        }
+        else if (!strcmp(entry->key, "perf_stats"))
+        {
+            afpc->perf = calloc(1, sizeof(*afpc->perf));
+            if (!afpc->perf)
+            {
+                snprintf(errbuf, errlen, "%s: Couldn't allocate the performance statistics!", __func__);
+                rval = DAQ_ERROR_NOMEM;
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "flow_cache_size"))
+        {
+            if (!entry->value)
+            {
+                snprintf(errbuf, errlen, "%s: %s requires an argument!", __func__, entry->key);
+                goto err;
+            }
+            flow_cache_size = strtoul(entry->value, NULL, 10);
+        }
+        else if (!strcmp(entry->key, "xdp_shunt"))
+            afpc->xdp_shunt_enabled = true;
+        else if (!strcmp(entry->key, "xdp_shunt_size"))
+        {
+            if (!entry->value)
+            {
+                snprintf(errbuf, errlen, "%s: %s requires an argument!", __func__, entry->key);
+                goto err;
+            }
+            xdp_shunt_size = strtoul(entry->value, NULL, 10);
+        }
+        else if (!strcmp(entry->key, "retry"))
+            afpc->retry_enabled = true;
+        else if (!strcmp(entry->key, "retry_delay"))
+        {
+            if (!entry->value)
+            {
+                snprintf(errbuf, errlen, "%s: %s requires an argument!", __func__, entry->key);
+                goto err;
+            }
+            retry_delay = strtoul(entry->value, NULL, 10);
+            afpc->retry_enabled = true;
+        }
+        else if (!strcmp(entry->key, "retry_queue_size"))
+        {
+            if (!entry->value)
+            {
+                snprintf(errbuf, errlen, "%s: %s requires an argument!", __func__, entry->key);
+                goto err;
+            }
+            retry_queue_size = strtoul(entry->value, NULL, 10);
+        }
 #ifdef PACKET_FANOUT
         else if (!strcmp(entry->key, "fanout_type"))
         {
@@ -759,6 +1091,32 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
         num_rings += instance->peer ? 2 : 1;
     afpc->size = size / num_rings;
 
+    if (flow_cache_size && daq_flow_cache_init(&afpc->flow_cache, flow_cache_size) != 0)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate the software flow cache!", __func__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
+    afpc->xdp_shunt.map_fd = -1;
+    afpc->xdp_shunt.prog_fd = -1;
+    if (afpc->xdp_shunt_enabled)
+    {
+        rval = daq_xdp_shunt_create(&afpc->xdp_shunt, xdp_shunt_size, errbuf, errlen);
+        if (rval != DAQ_SUCCESS)
+            goto err;
+        rval = DAQ_ERROR;
+    }
+
+    /* Pad the held copies for the VLAN tag that may get reconstructed into them. */
+    if (afpc->retry_enabled &&
+        daq_retry_wheel_init(&afpc->retry_wheel, retry_queue_size, afpc->snaplen + VLAN_TAG_LEN, retry_delay) != 0)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate the retry packet pool!", __func__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
     afpc->state = DAQ_STATE_INITIALIZED;
 
     *ctxt_ptr = afpc;
@@ -768,6 +1126,8 @@ err:
     if (afpc)
     {
         af_packet_close(afpc);
+        if (afpc->perf)
+            free(afpc->perf);
         if (afpc->device)
             free(afpc->device);
         free(afpc);
@@ -814,6 +1174,15 @@ static int afpacket_daq_start(void *handle)
             return DAQ_ERROR;
     }
 
+    if (afpc->xdp_shunt_enabled)
+    {
+        for (instance = afpc->instances; instance; instance = instance->next)
+        {
+            if (daq_xdp_shunt_attach(&afpc->xdp_shunt, instance->index, afpc->errbuf, sizeof(afpc->errbuf)) != DAQ_SUCCESS)
+                return DAQ_ERROR;
+        }
+    }
+
     reset_stats(afpc);
 
     afpc->state = DAQ_STATE_STARTED;
@@ -821,43 +1190,406 @@ static int afpacket_daq_start(void *handle)
     return DAQ_SUCCESS;
 }
 
-static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
-    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_PASS */
-    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLOCK */
-    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_REPLACE */
-    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_WHITELIST */
-    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLACKLIST */
-    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_IGNORE */
-    DAQ_VERDICT_BLOCK       /* DAQ_VERDICT_RETRY */
-};
+/* Pause hint for busy-wait loops. */
+#if defined(__x86_64__) || defined(__i386__)
+#define AF_PACKET_CPU_RELAX()   __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define AF_PACKET_CPU_RELAX()   __asm__ __volatile__("yield" ::: "memory")
+#else
+#define AF_PACKET_CPU_RELAX()   do { } while (0)
+#endif
 
-static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+static inline int instance_ring_ready(AFPacketInstance *instance)
+{
+#ifdef TPACKET_V3
+    if (instance->tp_version == TPACKET_V3)
+        return instance->v3_pkts_left || (instance->rx_ring.cursor->hdr.bd->hdr.bh1.block_status & TP_STATUS_USER);
+#endif
+    return (instance->rx_ring.cursor->hdr.h2->tp_status & TP_STATUS_USER) != 0;
+}
+
+/* Wait for any instance's RX ring to become readable according to the configured wait
+    strategy.  Returns 1 if the acquire loop should recheck the rings, 0 if it should
+    return control to the caller (timeout), or DAQ_ERROR on a socket error. */
+static int afpacket_wait_for_packets(AFPacket_Context_t *afpc)
 {
-    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
     AFPacketInstance *instance;
-    DAQ_PktHdr_t daqhdr;
-    DAQ_Verdict verdict;
-    union thdr hdr;
     struct pollfd pfd[AF_PACKET_MAX_INTERFACES];
-    const uint8_t *data;
+    struct timespec ts;
+    uint64_t deadline = 0, now;
+    unsigned int spins;
     uint32_t i;
-    int got_one, ignored_one;
-    int ret, c = 0;
-    unsigned int tp_len, tp_mac, tp_snaplen, tp_sec, tp_usec;
+    int ret, timeout;
 
-    while (c < cnt || cnt <= 0)
+    /* Don't sleep past the redelivery time of any held RETRY packets. */
+    timeout = afpc->timeout;
+    if (afpc->retry_enabled)
+        timeout = daq_retry_wheel_timeout(&afpc->retry_wheel, timeout);
+
+    if (afpc->wait_strategy != AF_PACKET_WAIT_POLL)
     {
-        got_one = 0;
+        /* A pure spin still has to honor the configured timeout so that control
+            periodically returns to the caller. */
+        if (afpc->wait_strategy == AF_PACKET_WAIT_SPIN && timeout > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            deadline = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + (uint64_t) timeout * 1000;
+        }
+        spins = 0;
+        for (;;)
+        {
+            for (instance = afpc->instances; instance; instance = instance->next)
+            {
+                if (instance_ring_ready(instance))
+                    return 1;
+            }
+            if (afpc->break_loop)
+                return 1;
+            if (afpc->wait_strategy == AF_PACKET_WAIT_ADAPTIVE && ++spins >= AF_PACKET_ADAPTIVE_SPIN_COUNT)
+                break;
+            if (deadline)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+                if (now >= deadline)
+                    return 0;
+            }
+            AF_PACKET_CPU_RELAX();
+        }
+    }
+
+    for (i = 0, instance = afpc->instances; instance; i++, instance = instance->next)
+    {
+        pfd[i].fd = instance->fd;
+        pfd[i].revents = 0;
+        pfd[i].events = POLLIN;
+    }
+    ret = poll(pfd, afpc->intf_count, timeout);
+    /* If we were interrupted by a signal, start the loop over.  The user should call daq_breakloop to actually exit. */
+    if (ret < 0)
+    {
+        if (errno == EINTR)
+            return 1;
+        DPE(afpc->errbuf, "%s: Poll failed: %s (%d)", __func__, strerror(errno), errno);
+        return DAQ_ERROR;
+    }
+    /* If the poll times out, return control to the caller. */
+    if (ret == 0)
+        return 0;
+    /* If some number of of sockets have events returned, check them all for badness. */
+    for (i = 0; i < afpc->intf_count; i++)
+    {
+        if (pfd[i].revents & (POLLHUP | POLLRDHUP | POLLERR | POLLNVAL))
+        {
+            if (pfd[i].revents & (POLLHUP | POLLRDHUP))
+                DPE(afpc->errbuf, "%s: Hang-up on a packet socket", __func__);
+            else if (pfd[i].revents & POLLERR)
+                DPE(afpc->errbuf, "%s: Encountered error condition on a packet socket", __func__);
+            else if (pfd[i].revents & POLLNVAL)
+                DPE(afpc->errbuf, "%s: Invalid polling request on a packet socket", __func__);
+            return DAQ_ERROR;
+        }
+    }
+
+    return 1;
+}
+
+static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_PASS */
+    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLOCK */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_REPLACE */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_WHITELIST */
+    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLACKLIST */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_IGNORE */
+    DAQ_VERDICT_BLOCK       /* DAQ_VERDICT_RETRY */
+};
+
+/* Process the final verdict for a redelivered RETRY packet.  The original frame was
+    already dropped when the copy was queued, so a PASS on a bridged interface has to
+    forward the copy out the peer here; a second RETRY re-queues the copy for another
+    round trip (or drops it if the pool is exhausted, which is what BLOCK would have
+    done anyway). */
+/* Kick the kernel to transmit everything staged in an instance's TX ring. */
+static inline void afpacket_tx_flush(AFPacketInstance *instance)
+{
+    if (instance->tx_pending)
+    {
+        instance->tx_pending = 0;
+        sendto(instance->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+/* Stage a frame in the peer's TX ring without kicking the kernel.  The RX side
+    already amortizes wakeups across whole rings of packets; batching the TX
+    kicks the same way halves the syscalls on the forwarding path.  Flushes
+    happen once per acquire pass, or here if the staged batch ever covers half
+    the ring. */
+static inline void afpacket_tx_stage(AFPacketInstance *peer, const uint8_t *data, uint32_t len)
+{
+    AFPacketEntry *entry = peer->tx_ring.cursor;
+
+    if (entry->hdr.h2->tp_status == TP_STATUS_AVAILABLE)
+    {
+        memcpy(entry->hdr.raw + TPACKET_ALIGN(peer->tp_hdrlen), data, len);
+        entry->hdr.h2->tp_len = len;
+        entry->hdr.h2->tp_status = TP_STATUS_SEND_REQUEST;
+        peer->tx_ring.cursor = entry->next;
+        if (++peer->tx_pending >= peer->tx_flush_limit)
+            afpacket_tx_flush(peer);
+    }
+    /* Else, don't forward the packet... */
+}
+
+/* Flush every instance's staged TX frames.  Called once per acquire pass and
+    on the breakloop exits, so frames staged just before a breakloop aren't
+    stranded unkicked if the application stops afterwards. */
+static inline void afpacket_tx_flush_all(AFPacket_Context_t *afpc)
+{
+    AFPacketInstance *instance;
+
+    for (instance = afpc->instances; instance; instance = instance->next)
+        afpacket_tx_flush(instance);
+}
+
+static void afpacket_retry_finalize(AFPacket_Context_t *afpc, DAQ_RetryEntry_t *entry, DAQ_Verdict verdict)
+{
+    AFPacketInstance *instance;
+
+    if (verdict >= MAX_DAQ_VERDICT)
+        verdict = DAQ_VERDICT_PASS;
+    afpc->stats.verdicts[verdict]++;
+    afpc->stats.packets_received++;
+
+    if (verdict == DAQ_VERDICT_RETRY)
+    {
+        daq_retry_wheel_queue(&afpc->retry_wheel, &entry->hdr, entry->data, entry->token);
+        daq_retry_wheel_release(&afpc->retry_wheel, entry);
+        return;
+    }
+
+    if (afpc->flow_cache.entries)
+        daq_tunnel_flow_cache_update(&afpc->flow_cache, entry->data, entry->hdr.caplen, verdict);
+    if (afpc->xdp_shunt_enabled)
+        daq_xdp_shunt_update(&afpc->xdp_shunt, entry->data, entry->hdr.caplen, verdict, !afpc->inline_mode);
+
+    if (verdict_translation_table[verdict] == DAQ_VERDICT_PASS)
+    {
+        for (instance = afpc->instances; instance; instance = instance->next)
+        {
+            if (instance->index == (int) entry->token)
+                break;
+        }
+        if (instance && instance->peer)
+            afpacket_tx_stage(instance->peer, entry->data, entry->hdr.caplen);
+    }
+
+    daq_retry_wheel_release(&afpc->retry_wheel, entry);
+}
+
+/* Redeliver any held RETRY packets that have come due through the single-packet callback. */
+static void afpacket_deliver_retries(AFPacket_Context_t *afpc, DAQ_Analysis_Func_t callback, void *user, int *c)
+{
+    DAQ_RetryEntry_t *entry, *next;
+    DAQ_Verdict verdict;
+
+    entry = daq_retry_wheel_expire(&afpc->retry_wheel, daq_retry_wheel_now());
+    for (; entry; entry = next)
+    {
+        next = entry->next;
+        verdict = callback ? callback(user, &entry->hdr, entry->data) : DAQ_VERDICT_PASS;
+        afpacket_retry_finalize(afpc, entry, verdict);
+        (*c)++;
+    }
+}
+
+/* As above, but through the batch callback. */
+static void afpacket_deliver_retries_batch(AFPacket_Context_t *afpc, DAQ_Analysis_Batch_Func_t callback, void *user, int *c)
+{
+    const DAQ_PktHdr_t *hdrs[AF_PACKET_BATCH_SIZE];
+    const uint8_t *pktdata[AF_PACKET_BATCH_SIZE];
+    DAQ_Verdict verdicts[AF_PACKET_BATCH_SIZE];
+    DAQ_RetryEntry_t *entries[AF_PACKET_BATCH_SIZE];
+    DAQ_RetryEntry_t *entry, *next;
+    uint32_t i, batched;
+
+    entry = daq_retry_wheel_expire(&afpc->retry_wheel, daq_retry_wheel_now());
+    while (entry)
+    {
+        for (batched = 0; entry && batched < AF_PACKET_BATCH_SIZE; entry = next)
+        {
+            next = entry->next;
+            entries[batched] = entry;
+            hdrs[batched] = &entry->hdr;
+            pktdata[batched] = entry->data;
+            verdicts[batched] = DAQ_VERDICT_PASS;
+            batched++;
+        }
+        if (callback)
+            callback(user, hdrs, pktdata, batched, verdicts);
+        for (i = 0; i < batched; i++)
+            afpacket_retry_finalize(afpc, entries[i], verdicts[i]);
+        *c += batched;
+    }
+}
+
+static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    AFPacketInstance *instance;
+    DAQ_PktHdr_t daqhdr;
+    DAQ_Verdict verdict;
+    union thdr hdr;
+    const uint8_t *data;
+    int got_one, ignored_one;
+    int ret, c = 0;
+    unsigned int tp_len, tp_mac, tp_snaplen, tp_sec, tp_usec;
+    uint64_t perf_t0 = 0;
+
+    while (c < cnt || cnt <= 0)
+    {
+        got_one = 0;
         ignored_one = 0;
+        if (afpc->retry_enabled && afpc->retry_wheel.held)
+            afpacket_deliver_retries(afpc, callback, user, &c);
         for (instance = afpc->instances; instance; instance = instance->next)
         {
             /* Has breakloop() been called? */
             if (afpc->break_loop)
             {
                 afpc->break_loop = 0;
+                afpacket_tx_flush_all(afpc);
                 return 0;
             }
 
+#ifdef TPACKET_V3
+            if (instance->tp_version == TPACKET_V3)
+            {
+                struct tpacket3_hdr *h3;
+
+                /* Open the next retired block if we aren't already walking one. */
+                if (!instance->v3_pkts_left)
+                {
+                    hdr = instance->rx_ring.cursor->hdr;
+                    if (!(hdr.bd->hdr.bh1.block_status & TP_STATUS_USER))
+                        continue;
+                    instance->v3_pkts_left = hdr.bd->hdr.bh1.num_pkts;
+                    instance->v3_pkt = (struct tpacket3_hdr *) (hdr.raw + hdr.bd->hdr.bh1.offset_to_first_pkt);
+                }
+
+                /* Walk the whole block of packets on this one wakeup. */
+                while (instance->v3_pkts_left && (c < cnt || cnt <= 0))
+                {
+                    h3 = instance->v3_pkt;
+                    tp_len = h3->tp_len;
+                    tp_mac = h3->tp_mac;
+                    tp_snaplen = h3->tp_snaplen;
+                    tp_sec = h3->tp_sec;
+                    tp_usec = h3->tp_nsec / 1000;
+                    data = (uint8_t *) h3 + tp_mac;
+
+                    /* Make a valiant attempt at reconstructing the VLAN tag if it has been stripped.  This really sucks. :( */
+                    if (
+#if defined(TP_STATUS_VLAN_VALID)
+                        (h3->hv1.tp_vlan_tci || (h3->tp_status & TP_STATUS_VLAN_VALID)) &&
+#else
+                        h3->hv1.tp_vlan_tci &&
+#endif
+                        tp_snaplen >= (unsigned int) vlan_offset)
+                    {
+                        struct vlan_tag *tag;
+
+                        data -= VLAN_TAG_LEN;
+                        memmove((void *) data, data + VLAN_TAG_LEN, vlan_offset);
+
+                        tag = (struct vlan_tag *) (data + vlan_offset);
+#if defined(TP_STATUS_VLAN_TPID_VALID)
+                        if (h3->hv1.tp_vlan_tpid && (h3->tp_status & TP_STATUS_VLAN_TPID_VALID))
+                            tag->vlan_tpid = htons(h3->hv1.tp_vlan_tpid);
+                        else
+#endif
+                            tag->vlan_tpid = htons(ETH_P_8021Q);
+                        tag->vlan_tci = htons(h3->hv1.tp_vlan_tci);
+
+                        tp_snaplen += VLAN_TAG_LEN;
+                        tp_len += VLAN_TAG_LEN;
+                    }
+
+                    instance->v3_pkt = (struct tpacket3_hdr *) ((uint8_t *) h3 + h3->tp_next_offset);
+                    instance->v3_pkts_left--;
+
+                    if (afpc->fcode.bf_insns)
+                    {
+                        if (afpc->perf)
+                            perf_t0 = daq_perf_cycles();
+                        ret = sfbpf_filter(afpc->fcode.bf_insns, data, tp_len, tp_snaplen);
+                        if (afpc->perf)
+                            daq_perf_record(afpc->perf, DAQ_PERF_STAGE_FILTER, daq_perf_cycles() - perf_t0);
+                        if (ret == 0)
+                        {
+                            ignored_one = 1;
+                            afpc->stats.packets_filtered++;
+                            continue;
+                        }
+                    }
+
+                    /* Short-circuit flows with a cached flow-wide verdict before the callback. */
+                    if (afpc->flow_cache.entries &&
+                        daq_tunnel_flow_cache_check(&afpc->flow_cache, data, tp_snaplen, &verdict))
+                    {
+                        got_one = 1;
+                        afpc->stats.verdicts[verdict]++;
+                        afpc->stats.packets_received++;
+                        c++;
+                        continue;
+                    }
+                    got_one = 1;
+
+                    daqhdr.ts.tv_sec = tp_sec;
+                    daqhdr.ts.tv_usec = tp_usec;
+                    daqhdr.caplen = tp_snaplen;
+                    daqhdr.pktlen = tp_len;
+                    daqhdr.ingress_index = instance->index;
+                    daqhdr.egress_index = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr.flags = 0;
+                    daqhdr.opaque = 0;
+                    daqhdr.priv_ptr = NULL;
+                    daqhdr.address_space_id = 0;
+                    daq_tunnel_annotate(&daqhdr, data, tp_snaplen);
+
+                    if (callback)
+                    {
+                        if (afpc->perf)
+                            perf_t0 = daq_perf_cycles();
+                        verdict = callback(user, &daqhdr, data);
+                        if (afpc->perf)
+                            daq_perf_record(afpc->perf, DAQ_PERF_STAGE_CALLBACK, daq_perf_cycles() - perf_t0);
+                        if (verdict >= MAX_DAQ_VERDICT)
+                            verdict = DAQ_VERDICT_PASS;
+                        afpc->stats.verdicts[verdict]++;
+                        if (afpc->flow_cache.entries)
+                            daq_tunnel_flow_cache_update(&afpc->flow_cache, data, tp_snaplen, verdict);
+                        if (afpc->xdp_shunt_enabled)
+                            daq_xdp_shunt_update(&afpc->xdp_shunt, data, tp_snaplen, verdict, !afpc->inline_mode);
+                        if (afpc->retry_enabled && verdict == DAQ_VERDICT_RETRY)
+                            daq_retry_wheel_queue(&afpc->retry_wheel, &daqhdr, data, instance->index);
+                        /* V3 instances are never bridged, so there is nothing to forward. */
+                    }
+                    afpc->stats.packets_received++;
+                    c++;
+                }
+
+                /* Release the block back to the kernel once it has been fully walked. */
+                if (!instance->v3_pkts_left)
+                {
+                    instance->rx_ring.cursor->hdr.bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+                    instance->rx_ring.cursor = instance->rx_ring.cursor->next;
+                }
+                continue;
+            }
+#endif /* TPACKET_V3 */
+
             hdr = instance->rx_ring.cursor->hdr;
             if (instance->tp_version == TPACKET_V2 && (hdr.h2->tp_status & TP_STATUS_USER))
             {
@@ -911,10 +1643,30 @@ static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                 }
 
                 verdict = DAQ_VERDICT_PASS;
-                if (afpc->fcode.bf_insns && sfbpf_filter(afpc->fcode.bf_insns, data, tp_len, tp_snaplen) == 0)
+                if (afpc->fcode.bf_insns)
                 {
-                    ignored_one = 1;
-                    afpc->stats.packets_filtered++;
+                    if (afpc->perf)
+                        perf_t0 = daq_perf_cycles();
+                    ret = sfbpf_filter(afpc->fcode.bf_insns, data, tp_len, tp_snaplen);
+                    if (afpc->perf)
+                        daq_perf_record(afpc->perf, DAQ_PERF_STAGE_FILTER, daq_perf_cycles() - perf_t0);
+                    if (ret == 0)
+                    {
+                        ignored_one = 1;
+                        afpc->stats.packets_filtered++;
+                        goto send_packet;
+                    }
+                }
+
+                /* Short-circuit flows with a cached flow-wide verdict before the callback. */
+                if (afpc->flow_cache.entries &&
+                    daq_tunnel_flow_cache_check(&afpc->flow_cache, data, tp_snaplen, &verdict))
+                {
+                    got_one = 1;
+                    afpc->stats.verdicts[verdict]++;
+                    afpc->stats.packets_received++;
+                    c++;
+                    verdict = verdict_translation_table[verdict];
                     goto send_packet;
                 }
                 got_one = 1;
@@ -931,33 +1683,33 @@ static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                 daqhdr.opaque = 0;
                 daqhdr.priv_ptr = NULL;
                 daqhdr.address_space_id = 0;
+                daq_tunnel_annotate(&daqhdr, data, tp_snaplen);
 
                 if (callback)
                 {
+                    if (afpc->perf)
+                        perf_t0 = daq_perf_cycles();
                     verdict = callback(user, &daqhdr, data);
+                    if (afpc->perf)
+                        daq_perf_record(afpc->perf, DAQ_PERF_STAGE_CALLBACK, daq_perf_cycles() - perf_t0);
                     if (verdict >= MAX_DAQ_VERDICT)
                         verdict = DAQ_VERDICT_PASS;
                     afpc->stats.verdicts[verdict]++;
+                    if (afpc->flow_cache.entries)
+                        daq_tunnel_flow_cache_update(&afpc->flow_cache, data, tp_snaplen, verdict);
+                    if (afpc->xdp_shunt_enabled)
+                        daq_xdp_shunt_update(&afpc->xdp_shunt, data, tp_snaplen, verdict, !afpc->inline_mode);
+                    if (afpc->retry_enabled && verdict == DAQ_VERDICT_RETRY)
+                        daq_retry_wheel_queue(&afpc->retry_wheel, &daqhdr, data, instance->index);
                     verdict = verdict_translation_table[verdict];
                 }
                 afpc->stats.packets_received++;
                 c++;
 send_packet:
+                if (afpc->perf)
+                    perf_t0 = daq_perf_cycles();
                 if (verdict == DAQ_VERDICT_PASS && instance->peer)
-                {
-                    AFPacketEntry *entry = instance->peer->tx_ring.cursor;
-                    int rc;
-
-                    if (entry->hdr.h2->tp_status == TP_STATUS_AVAILABLE)
-                    {
-                        memcpy(entry->hdr.raw + TPACKET_ALIGN(instance->peer->tp_hdrlen), data, tp_snaplen);
-                        entry->hdr.h2->tp_len = tp_snaplen;
-                        entry->hdr.h2->tp_status = TP_STATUS_SEND_REQUEST;
-                        rc = send(instance->peer->fd, NULL, 0, 0);
-                        instance->peer->tx_ring.cursor = entry->next;
-                    }
-                    /* Else, don't forward the packet... */
-                }
+                    afpacket_tx_stage(instance->peer, data, tp_snaplen);
                 /* Release the TPACKET buffer back to the kernel. */
                 switch (instance->tp_version)
                 {
@@ -966,48 +1718,563 @@ send_packet:
                         break;
                 }
                 instance->rx_ring.cursor = instance->rx_ring.cursor->next;
+                if (afpc->perf)
+                    daq_perf_record(afpc->perf, DAQ_PERF_STAGE_VERDICT, daq_perf_cycles() - perf_t0);
             }
         }
+        /* One kernel kick per pass covers everything staged for forwarding. */
+        afpacket_tx_flush_all(afpc);
+
         if (!got_one && !ignored_one)
         {
-            for (i = 0, instance = afpc->instances; instance; i++, instance = instance->next)
+            if (afpc->perf)
+                perf_t0 = daq_perf_cycles();
+            ret = afpacket_wait_for_packets(afpc);
+            if (afpc->perf)
+                daq_perf_record(afpc->perf, DAQ_PERF_STAGE_WAIT, daq_perf_cycles() - perf_t0);
+            if (ret < 0)
+                return ret;
+            if (ret == 0)
+                break;
+        }
+    }
+    return 0;
+}
+
+/* Forward a packet to the peer of the instance it was received on and release its frame
+    back to the kernel ring. */
+static inline void afpacket_transmit_release(AFPacketInstance *instance, AFPacketEntry *rxentry,
+                                             const uint8_t *data, uint32_t tp_snaplen, DAQ_Verdict verdict)
+{
+    if (verdict == DAQ_VERDICT_PASS && instance->peer)
+        afpacket_tx_stage(instance->peer, data, tp_snaplen);
+    /* Release the TPACKET buffer back to the kernel. */
+    rxentry->hdr.h2->tp_status = TP_STATUS_KERNEL;
+}
+
+static int afpacket_daq_acquire_batch(void *handle, int cnt, DAQ_Analysis_Batch_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    AFPacketInstance *instance;
+    DAQ_PktHdr_t daqhdrs[AF_PACKET_BATCH_SIZE];
+    const DAQ_PktHdr_t *hdrs[AF_PACKET_BATCH_SIZE];
+    const uint8_t *pktdata[AF_PACKET_BATCH_SIZE];
+    DAQ_Verdict verdicts[AF_PACKET_BATCH_SIZE];
+    AFPacketEntry *entries[AF_PACKET_BATCH_SIZE];
+    uint32_t snaplens[AF_PACKET_BATCH_SIZE];
+    u_int wirelens[AF_PACKET_BATCH_SIZE];
+    u_int fres[AF_PACKET_BATCH_SIZE];
+    uint32_t tp_secs[AF_PACKET_BATCH_SIZE];
+    uint32_t tp_usecs[AF_PACKET_BATCH_SIZE];
+    uint32_t kept;
+    DAQ_PktHdr_t *daqhdr;
+    DAQ_Verdict verdict;
+    union thdr hdr;
+    const uint8_t *data;
+    uint32_t i, batched;
+    int got_one, ignored_one;
+    int ret, c = 0;
+    unsigned int tp_len, tp_mac, tp_snaplen, tp_sec, tp_usec;
+
+    while (c < cnt || cnt <= 0)
+    {
+        got_one = 0;
+        ignored_one = 0;
+        if (afpc->retry_enabled && afpc->retry_wheel.held)
+            afpacket_deliver_retries_batch(afpc, callback, user, &c);
+        for (instance = afpc->instances; instance; instance = instance->next)
+        {
+            /* Has breakloop() been called? */
+            if (afpc->break_loop)
             {
-                pfd[i].fd = instance->fd;
-                pfd[i].revents = 0;
-                pfd[i].events = POLLIN;
+                afpc->break_loop = 0;
+                afpacket_tx_flush_all(afpc);
+                return 0;
             }
-            ret = poll(pfd, afpc->intf_count, afpc->timeout);
-            /* If we were interrupted by a signal, start the loop over.  The user should call daq_breakloop to actually exit. */
-            if (ret < 0 && errno != EINTR)
+
+#ifdef TPACKET_V3
+            if (instance->tp_version == TPACKET_V3)
             {
-                DPE(afpc->errbuf, "%s: Poll failed: %s (%d)", __func__, strerror(errno), errno);
-                return DAQ_ERROR;
+                struct tpacket3_hdr *h3;
+
+                /* Open the next retired block if we aren't already walking one. */
+                if (!instance->v3_pkts_left)
+                {
+                    hdr = instance->rx_ring.cursor->hdr;
+                    if (!(hdr.bd->hdr.bh1.block_status & TP_STATUS_USER))
+                        continue;
+                    instance->v3_pkts_left = hdr.bd->hdr.bh1.num_pkts;
+                    instance->v3_pkt = (struct tpacket3_hdr *) (hdr.raw + hdr.bd->hdr.bh1.offset_to_first_pkt);
+                }
+
+                /* Gather a batch of packets from the block; the block isn't released until
+                    it has been fully walked, so the packet data stays valid for the callback. */
+                batched = 0;
+                while (instance->v3_pkts_left && batched < AF_PACKET_BATCH_SIZE &&
+                       (cnt <= 0 || c + (int) batched < cnt))
+                {
+                    h3 = instance->v3_pkt;
+                    tp_len = h3->tp_len;
+                    tp_mac = h3->tp_mac;
+                    tp_snaplen = h3->tp_snaplen;
+                    tp_sec = h3->tp_sec;
+                    tp_usec = h3->tp_nsec / 1000;
+                    data = (uint8_t *) h3 + tp_mac;
+
+                    /* Make a valiant attempt at reconstructing the VLAN tag if it has been stripped.  This really sucks. :( */
+                    if (
+#if defined(TP_STATUS_VLAN_VALID)
+                        (h3->hv1.tp_vlan_tci || (h3->tp_status & TP_STATUS_VLAN_VALID)) &&
+#else
+                        h3->hv1.tp_vlan_tci &&
+#endif
+                        tp_snaplen >= (unsigned int) vlan_offset)
+                    {
+                        struct vlan_tag *tag;
+
+                        data -= VLAN_TAG_LEN;
+                        memmove((void *) data, data + VLAN_TAG_LEN, vlan_offset);
+
+                        tag = (struct vlan_tag *) (data + vlan_offset);
+#if defined(TP_STATUS_VLAN_TPID_VALID)
+                        if (h3->hv1.tp_vlan_tpid && (h3->tp_status & TP_STATUS_VLAN_TPID_VALID))
+                            tag->vlan_tpid = htons(h3->hv1.tp_vlan_tpid);
+                        else
+#endif
+                            tag->vlan_tpid = htons(ETH_P_8021Q);
+                        tag->vlan_tci = htons(h3->hv1.tp_vlan_tci);
+
+                        tp_snaplen += VLAN_TAG_LEN;
+                        tp_len += VLAN_TAG_LEN;
+                    }
+
+                    instance->v3_pkt = (struct tpacket3_hdr *) ((uint8_t *) h3 + h3->tp_next_offset);
+                    instance->v3_pkts_left--;
+
+                    pktdata[batched] = data;
+                    wirelens[batched] = tp_len;
+                    snaplens[batched] = tp_snaplen;
+                    tp_secs[batched] = tp_sec;
+                    tp_usecs[batched] = tp_usec;
+                    batched++;
+                }
+
+                /* Evaluate the filter over the whole gathered batch at once; the
+                    pipelined batch entry point overlaps the packets' header fetches. */
+                if (batched && afpc->fcode.bf_insns)
+                    sfbpf_filter_batch(afpc->fcode.bf_insns, pktdata, wirelens, snaplens, fres, batched);
+
+                kept = 0;
+                for (i = 0; i < batched; i++)
+                {
+                    if (afpc->fcode.bf_insns && fres[i] == 0)
+                    {
+                        ignored_one = 1;
+                        afpc->stats.packets_filtered++;
+                        continue;
+                    }
+
+                    /* Short-circuit flows with a cached flow-wide verdict before the callback. */
+                    if (afpc->flow_cache.entries &&
+                        daq_tunnel_flow_cache_check(&afpc->flow_cache, pktdata[i], snaplens[i], &verdict))
+                    {
+                        got_one = 1;
+                        afpc->stats.verdicts[verdict]++;
+                        afpc->stats.packets_received++;
+                        c++;
+                        continue;
+                    }
+
+                    daqhdr = &daqhdrs[kept];
+                    daqhdr->ts.tv_sec = tp_secs[i];
+                    daqhdr->ts.tv_usec = tp_usecs[i];
+                    daqhdr->caplen = snaplens[i];
+                    daqhdr->pktlen = wirelens[i];
+                    daqhdr->ingress_index = instance->index;
+                    daqhdr->egress_index = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr->ingress_group = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr->egress_group = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr->flags = 0;
+                    daqhdr->opaque = 0;
+                    daqhdr->priv_ptr = NULL;
+                    daqhdr->address_space_id = 0;
+                    daq_tunnel_annotate(daqhdr, pktdata[i], snaplens[i]);
+
+                    hdrs[kept] = daqhdr;
+                    pktdata[kept] = pktdata[i];
+                    snaplens[kept] = snaplens[i];
+                    verdicts[kept] = DAQ_VERDICT_PASS;
+                    kept++;
+                }
+
+                if (kept)
+                {
+                    got_one = 1;
+
+                    if (callback)
+                        callback(user, hdrs, pktdata, kept, verdicts);
+
+                    for (i = 0; i < kept; i++)
+                    {
+                        verdict = verdicts[i];
+                        if (verdict >= MAX_DAQ_VERDICT)
+                            verdict = DAQ_VERDICT_PASS;
+                        afpc->stats.verdicts[verdict]++;
+                        afpc->stats.packets_received++;
+                        if (afpc->flow_cache.entries)
+                            daq_tunnel_flow_cache_update(&afpc->flow_cache, pktdata[i], snaplens[i], verdict);
+                        if (afpc->xdp_shunt_enabled)
+                            daq_xdp_shunt_update(&afpc->xdp_shunt, pktdata[i], snaplens[i], verdict, !afpc->inline_mode);
+                        if (afpc->retry_enabled && verdict == DAQ_VERDICT_RETRY)
+                            daq_retry_wheel_queue(&afpc->retry_wheel, hdrs[i], pktdata[i], instance->index);
+                        /* V3 instances are never bridged, so there is nothing to forward. */
+                    }
+                    c += kept;
+                }
+
+                /* Release the block back to the kernel once it has been fully walked. */
+                if (!instance->v3_pkts_left)
+                {
+                    instance->rx_ring.cursor->hdr.bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+                    instance->rx_ring.cursor = instance->rx_ring.cursor->next;
+                }
+                continue;
+            }
+#endif /* TPACKET_V3 */
+
+            /* Gather a batch of frames from this instance's ring without releasing them,
+                so that all of their headers and data remain valid for the callback. */
+            batched = 0;
+            while (batched < AF_PACKET_BATCH_SIZE && (cnt <= 0 || c + (int) batched < cnt))
+            {
+                hdr = instance->rx_ring.cursor->hdr;
+                if (instance->tp_version != TPACKET_V2 || !(hdr.h2->tp_status & TP_STATUS_USER))
+                    break;
+
+                tp_len = hdr.h2->tp_len;
+                tp_mac = hdr.h2->tp_mac;
+                tp_snaplen = hdr.h2->tp_snaplen;
+                tp_sec = hdr.h2->tp_sec;
+                tp_usec = hdr.h2->tp_nsec / 1000;
+                if (tp_mac + tp_snaplen > instance->rx_ring.layout.tp_frame_size)
+                {
+                    DPE(afpc->errbuf, "%s: Corrupted frame on kernel ring (MAC offset %u + CapLen %u > FrameSize %d)",
+                        __func__, tp_mac, tp_snaplen, instance->rx_ring.layout.tp_frame_size);
+                    return DAQ_ERROR;
+                }
+                data = instance->rx_ring.cursor->hdr.raw + tp_mac;
+
+                /* Make a valiant attempt at reconstructing the VLAN tag if it has been stripped.  This really sucks. :( */
+                if (
+#if defined(TP_STATUS_VLAN_VALID)
+                    (hdr.h2->tp_vlan_tci || (hdr.h2->tp_status & TP_STATUS_VLAN_VALID)) &&
+#else
+                    hdr.h2->tp_vlan_tci &&
+#endif
+                    tp_snaplen >= (unsigned int) vlan_offset)
+                {
+                    struct vlan_tag *tag;
+
+                    data -= VLAN_TAG_LEN;
+                    memmove((void *) data, data + VLAN_TAG_LEN, vlan_offset);
+
+                    tag = (struct vlan_tag *) (data + vlan_offset);
+#if defined(TP_STATUS_VLAN_TPID_VALID)
+                    if (hdr.h2->tp_vlan_tpid && (hdr.h2->tp_status & TP_STATUS_VLAN_TPID_VALID))
+                        tag->vlan_tpid = htons(hdr.h2->tp_vlan_tpid);
+                    else
+#endif
+                        tag->vlan_tpid = htons(ETH_P_8021Q);
+                    tag->vlan_tci = htons(hdr.h2->tp_vlan_tci);
+
+                    tp_snaplen += VLAN_TAG_LEN;
+                    tp_len += VLAN_TAG_LEN;
+                }
+
+                pktdata[batched] = data;
+                wirelens[batched] = tp_len;
+                snaplens[batched] = tp_snaplen;
+                tp_secs[batched] = tp_sec;
+                tp_usecs[batched] = tp_usec;
+                entries[batched] = instance->rx_ring.cursor;
+                batched++;
+
+                instance->rx_ring.cursor = instance->rx_ring.cursor->next;
             }
-            /* If the poll times out, return control to the caller. */
+
+            /* Evaluate the filter over the whole gathered batch at once; the
+                pipelined batch entry point overlaps the packets' header fetches. */
+            if (batched && afpc->fcode.bf_insns)
+                sfbpf_filter_batch(afpc->fcode.bf_insns, pktdata, wirelens, snaplens, fres, batched);
+
+            kept = 0;
+            for (i = 0; i < batched; i++)
+            {
+                if (afpc->fcode.bf_insns && fres[i] == 0)
+                {
+                    /* Filtered packets never reach the callback - forward and release them immediately. */
+                    ignored_one = 1;
+                    afpc->stats.packets_filtered++;
+                    afpacket_transmit_release(instance, entries[i], pktdata[i], snaplens[i], DAQ_VERDICT_PASS);
+                    continue;
+                }
+
+                /* Short-circuit flows with a cached flow-wide verdict before the callback. */
+                if (afpc->flow_cache.entries &&
+                    daq_tunnel_flow_cache_check(&afpc->flow_cache, pktdata[i], snaplens[i], &verdict))
+                {
+                    got_one = 1;
+                    afpc->stats.verdicts[verdict]++;
+                    afpc->stats.packets_received++;
+                    c++;
+                    afpacket_transmit_release(instance, entries[i], pktdata[i], snaplens[i],
+                                              verdict_translation_table[verdict]);
+                    continue;
+                }
+
+                daqhdr = &daqhdrs[kept];
+                daqhdr->ts.tv_sec = tp_secs[i];
+                daqhdr->ts.tv_usec = tp_usecs[i];
+                daqhdr->caplen = snaplens[i];
+                daqhdr->pktlen = wirelens[i];
+                daqhdr->ingress_index = instance->index;
+                daqhdr->egress_index = instance->peer ? instance->peer->index : DAQ_PKTHDR_UNKNOWN;
+                daqhdr->ingress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr->egress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr->flags = 0;
+                daqhdr->opaque = 0;
+                daqhdr->priv_ptr = NULL;
+                daqhdr->address_space_id = 0;
+                daq_tunnel_annotate(daqhdr, pktdata[i], snaplens[i]);
+
+                hdrs[kept] = daqhdr;
+                pktdata[kept] = pktdata[i];
+                verdicts[kept] = DAQ_VERDICT_PASS;
+                entries[kept] = entries[i];
+                snaplens[kept] = snaplens[i];
+                kept++;
+            }
+
+            if (kept)
+            {
+                got_one = 1;
+
+                if (callback)
+                    callback(user, hdrs, pktdata, kept, verdicts);
+
+                for (i = 0; i < kept; i++)
+                {
+                    verdict = verdicts[i];
+                    if (verdict >= MAX_DAQ_VERDICT)
+                        verdict = DAQ_VERDICT_PASS;
+                    afpc->stats.verdicts[verdict]++;
+                    afpc->stats.packets_received++;
+                    if (afpc->flow_cache.entries)
+                        daq_tunnel_flow_cache_update(&afpc->flow_cache, pktdata[i], snaplens[i], verdict);
+                    if (afpc->xdp_shunt_enabled)
+                        daq_xdp_shunt_update(&afpc->xdp_shunt, pktdata[i], snaplens[i], verdict, !afpc->inline_mode);
+                    if (afpc->retry_enabled && verdict == DAQ_VERDICT_RETRY)
+                        daq_retry_wheel_queue(&afpc->retry_wheel, hdrs[i], pktdata[i], instance->index);
+                    verdict = verdict_translation_table[verdict];
+                    afpacket_transmit_release(instance, entries[i], pktdata[i], snaplens[i], verdict);
+                }
+                c += kept;
+            }
+        }
+        /* One kernel kick per pass covers everything staged for forwarding. */
+        afpacket_tx_flush_all(afpc);
+
+        if (!got_one && !ignored_one)
+        {
+            ret = afpacket_wait_for_packets(afpc);
+            if (ret < 0)
+                return ret;
             if (ret == 0)
                 break;
-            /* If some number of of sockets have events returned, check them all for badness. */
-            if (ret > 0)
+        }
+    }
+    return 0;
+}
+
+static int afpacket_daq_acquire_deferred(void *handle, int cnt, DAQ_Analysis_Deferred_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    AFPacketInstance *instance;
+    AFPacketEntry *entry;
+    DAQ_PktHdr_t daqhdr;
+    union thdr hdr;
+    const uint8_t *data;
+    uint32_t ordinal;
+    int got_one, ignored_one;
+    int ret, c = 0;
+    unsigned int tp_len, tp_mac, tp_snaplen, tp_sec, tp_usec;
+
+#ifdef TPACKET_V3
+    /* Deferred verdicts hold individual frames, which doesn't mesh with V3's block-based
+        release model.  Force V2 with the tpacket_v2 config key to use this mode. */
+    for (instance = afpc->instances; instance; instance = instance->next)
+    {
+        if (instance->tp_version == TPACKET_V3)
+        {
+            DPE(afpc->errbuf, "%s: Deferred verdicts require TPACKET_V2 (set the tpacket_v2 config key)!", __func__);
+            return DAQ_ERROR;
+        }
+    }
+#endif
+
+    while (c < cnt || cnt <= 0)
+    {
+        got_one = 0;
+        ignored_one = 0;
+        ordinal = 0;
+        for (instance = afpc->instances; instance; instance = instance->next, ordinal++)
+        {
+            /* Has breakloop() been called? */
+            if (afpc->break_loop)
             {
-                for (i = 0; i < afpc->intf_count; i++)
+                afpc->break_loop = 0;
+                afpacket_tx_flush_all(afpc);
+                return 0;
+            }
+
+            entry = instance->rx_ring.cursor;
+            hdr = entry->hdr;
+            /* A held frame keeps TP_STATUS_USER until set_verdict() releases it, so once
+                the cursor wraps onto one with its verdict still outstanding, treat the ring
+                as empty rather than delivering (and re-shifting) the same frame again. */
+            if (instance->tp_version == TPACKET_V2 && (hdr.h2->tp_status & TP_STATUS_USER) &&
+                !entry->pending_data)
+            {
+                tp_len = hdr.h2->tp_len;
+                tp_mac = hdr.h2->tp_mac;
+                tp_snaplen = hdr.h2->tp_snaplen;
+                tp_sec = hdr.h2->tp_sec;
+                tp_usec = hdr.h2->tp_nsec / 1000;
+                if (tp_mac + tp_snaplen > instance->rx_ring.layout.tp_frame_size)
                 {
-                    if (pfd[i].revents & (POLLHUP | POLLRDHUP | POLLERR | POLLNVAL))
-                    {
-                        if (pfd[i].revents & (POLLHUP | POLLRDHUP))
-                            DPE(afpc->errbuf, "%s: Hang-up on a packet socket", __func__);
-                        else if (pfd[i].revents & POLLERR)
-                            DPE(afpc->errbuf, "%s: Encountered error condition on a packet socket", __func__);
-                        else if (pfd[i].revents & POLLNVAL)
-                            DPE(afpc->errbuf, "%s: Invalid polling request on a packet socket", __func__);
-                        return DAQ_ERROR;
-                    }
+                    DPE(afpc->errbuf, "%s: Corrupted frame on kernel ring (MAC offset %u + CapLen %u > FrameSize %d)",
+                        __func__, tp_mac, tp_snaplen, instance->rx_ring.layout.tp_frame_size);
+                    return DAQ_ERROR;
                 }
+                data = entry->hdr.raw + tp_mac;
+
+                /* Make a valiant attempt at reconstructing the VLAN tag if it has been stripped.  This really sucks. :( */
+                if (
+#if defined(TP_STATUS_VLAN_VALID)
+                    (hdr.h2->tp_vlan_tci || (hdr.h2->tp_status & TP_STATUS_VLAN_VALID)) &&
+#else
+                    hdr.h2->tp_vlan_tci &&
+#endif
+                    tp_snaplen >= (unsigned int) vlan_offset)
+                {
+                    struct vlan_tag *tag;
+
+                    data -= VLAN_TAG_LEN;
+                    memmove((void *) data, data + VLAN_TAG_LEN, vlan_offset);
+
+                    tag = (struct vlan_tag *) (data + vlan_offset);
+#if defined(TP_STATUS_VLAN_TPID_VALID)
+                    if (hdr.h2->tp_vlan_tpid && (hdr.h2->tp_status & TP_STATUS_VLAN_TPID_VALID))
+                        tag->vlan_tpid = htons(hdr.h2->tp_vlan_tpid);
+                    else
+#endif
+                        tag->vlan_tpid = htons(ETH_P_8021Q);
+                    tag->vlan_tci = htons(hdr.h2->tp_vlan_tci);
+
+                    tp_snaplen += VLAN_TAG_LEN;
+                    tp_len += VLAN_TAG_LEN;
+                }
+
+                if (afpc->fcode.bf_insns && sfbpf_filter(afpc->fcode.bf_insns, data, tp_len, tp_snaplen) == 0)
+                {
+                    /* Filtered packets never reach the callback - forward and release them immediately. */
+                    ignored_one = 1;
+                    afpc->stats.packets_filtered++;
+                    afpacket_transmit_release(instance, entry, data, tp_snaplen, DAQ_VERDICT_PASS);
+                    instance->rx_ring.cursor = entry->next;
+                    continue;
+                }
+                got_one = 1;
+
+                daqhdr.ts.tv_sec = tp_sec;
+                daqhdr.ts.tv_usec = tp_usec;
+                daqhdr.caplen = tp_snaplen;
+                daqhdr.pktlen = tp_len;
+                daqhdr.ingress_index = instance->index;
+                daqhdr.egress_index = instance->peer ? instance->peer->index : DAQ_PKTHDR_UNKNOWN;
+                daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.flags = 0;
+                daqhdr.opaque = 0;
+                daqhdr.priv_ptr = NULL;
+                daqhdr.address_space_id = 0;
+                daq_tunnel_annotate(&daqhdr, data, tp_snaplen);
+
+                /* Hold the frame until the application posts a verdict for its token;
+                    the ring entry index makes a natural token. */
+                entry->pending_data = data;
+                entry->pending_len = tp_snaplen;
+                afpc->stats.packets_received++;
+                c++;
+
+                if (callback)
+                    callback(user, &daqhdr, data, AF_PACKET_TOKEN(ordinal, (uint32_t) (entry - instance->rx_ring.entries)));
+
+                instance->rx_ring.cursor = entry->next;
             }
         }
+        /* One kernel kick per pass covers everything staged for forwarding. */
+        afpacket_tx_flush_all(afpc);
+
+        if (!got_one && !ignored_one)
+        {
+            ret = afpacket_wait_for_packets(afpc);
+            if (ret < 0)
+                return ret;
+            if (ret == 0)
+                break;
+        }
     }
     return 0;
 }
 
+static int afpacket_daq_set_verdict(void *handle, uint32_t token, DAQ_Verdict verdict)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    AFPacketInstance *instance;
+    AFPacketEntry *entry;
+    uint32_t ordinal, frame;
+
+    ordinal = AF_PACKET_TOKEN_ORDINAL(token);
+    frame = AF_PACKET_TOKEN_FRAME(token);
+
+    for (instance = afpc->instances; instance && ordinal; instance = instance->next, ordinal--);
+    if (!instance || frame >= instance->rx_ring.layout.tp_frame_nr)
+    {
+        DPE(afpc->errbuf, "%s: Invalid verdict token: 0x%x!", __func__, token);
+        return DAQ_ERROR_INVAL;
+    }
+    entry = &instance->rx_ring.entries[frame];
+    if (!entry->pending_data)
+    {
+        DPE(afpc->errbuf, "%s: No pending packet for verdict token: 0x%x!", __func__, token);
+        return DAQ_ERROR_INVAL;
+    }
+
+    if (verdict >= MAX_DAQ_VERDICT)
+        verdict = DAQ_VERDICT_PASS;
+    afpc->stats.verdicts[verdict]++;
+    verdict = verdict_translation_table[verdict];
+
+    afpacket_transmit_release(instance, entry, entry->pending_data, entry->pending_len, verdict);
+    if (instance->peer)
+        afpacket_tx_flush(instance->peer);
+    entry->pending_data = NULL;
+    entry->pending_len = 0;
+
+    return DAQ_SUCCESS;
+}
+
 static int afpacket_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse)
 {
     AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
@@ -1033,6 +2300,7 @@ static int afpacket_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint
             entry->hdr.h2->tp_len = len;
             entry->hdr.h2->tp_status = TP_STATUS_SEND_REQUEST;
             instance->tx_ring.cursor = entry->next;
+            instance->tx_pending = 0;   /* this kick also covers any staged forwards */
             if (send(instance->fd, NULL, 0, 0) < 0)
             {
                 DPE(afpc->errbuf, "%s: Error sending packet: %s (%d)", __func__, strerror(errno), errno);
@@ -1084,6 +2352,13 @@ static void afpacket_daq_shutdown(void *handle)
     AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
 
     af_packet_close(afpc);
+    daq_xdp_shunt_cleanup(&afpc->xdp_shunt);
+    if (afpc->flow_cache.entries)
+        daq_flow_cache_cleanup(&afpc->flow_cache);
+    if (afpc->retry_enabled)
+        daq_retry_wheel_cleanup(&afpc->retry_wheel);
+    if (afpc->perf)
+        free(afpc->perf);
     if (afpc->device)
         free(afpc->device);
     if (afpc->filter)
@@ -1103,7 +2378,19 @@ static int afpacket_daq_get_stats(void *handle, DAQ_Stats_t *stats)
     AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
 
     update_hw_stats(afpc);
-    memcpy(stats, &afpc->stats, sizeof(DAQ_Stats_t));
+    daq_stats_snapshot(&afpc->stats, stats);
+
+    return DAQ_SUCCESS;
+}
+
+static int afpacket_daq_get_perf_stats(void *handle, DAQ_PerfStats_t *perf_stats)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+
+    if (!afpc->perf)
+        return DAQ_ERROR_NOTSUP;
+
+    memcpy(perf_stats, afpc->perf, sizeof(*perf_stats));
 
     return DAQ_SUCCESS;
 }
@@ -1124,7 +2411,20 @@ static int afpacket_daq_get_snaplen(void *handle)
 
 static uint32_t afpacket_daq_get_capabilities(void *handle)
 {
-    return DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT | DAQ_CAPA_UNPRIV_START | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF | DAQ_CAPA_DEVICE_INDEX;
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    uint32_t caps = DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT | DAQ_CAPA_UNPRIV_START | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF | DAQ_CAPA_DEVICE_INDEX;
+
+    /* Flow verdicts are only meaningful to us when we can act on them. */
+    if (afpc->xdp_shunt_enabled || afpc->flow_cache.entries)
+        caps |= DAQ_CAPA_WHITELIST | DAQ_CAPA_BLACKLIST;
+
+    if (afpc->retry_enabled)
+        caps |= DAQ_CAPA_RETRY;
+
+    /* The tunnel decoder runs unconditionally in the acquire loops. */
+    caps |= DAQ_CAPA_DECODE_GTP | DAQ_CAPA_DECODE_GRE | DAQ_CAPA_DECODE_TEREDO;
+
+    return caps;
 }
 
 static int afpacket_daq_get_datalink_type(void *handle)
@@ -1163,6 +2463,98 @@ static int afpacket_daq_get_device_index(void *handle, const char *device)
     return DAQ_ERROR_NODEV;
 }
 
+static int afpacket_daq_hup_prep(void *handle, void **new_config)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    AFPacketInstance *instance, *new_instances = NULL;
+
+    /* Build and fully start a complete replacement set of instances while the current
+        rings keep capturing, so that the swap in hup_apply() is nothing more than a
+        pointer exchange.  Both generations of sockets see traffic during this window,
+        trading a few duplicated packets for a reload with zero loss. */
+    if (create_instance_list(afpc, afpc->inline_mode, &new_instances, afpc->errbuf, sizeof(afpc->errbuf)) != DAQ_SUCCESS)
+        return DAQ_ERROR;
+
+    if (afpc->state == DAQ_STATE_STARTED)
+    {
+        for (instance = new_instances; instance; instance = instance->next)
+        {
+            if (start_instance(afpc, instance) != 0)
+            {
+                while ((instance = new_instances) != NULL)
+                {
+                    new_instances = instance->next;
+                    destroy_instance(instance);
+                }
+                return DAQ_ERROR;
+            }
+        }
+    }
+
+    *new_config = new_instances;
+
+    return DAQ_SUCCESS;
+}
+
+static int afpacket_daq_hup_apply(void *handle, void *new_config, void **old_config)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+
+    *old_config = afpc->instances;
+    afpc->instances = (AFPacketInstance *) new_config;
+
+    return DAQ_SUCCESS;
+}
+
+static int afpacket_daq_hup_post(void *handle, void *old_config)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    AFPacketInstance *instance, *instances = (AFPacketInstance *) old_config;
+    AFPacketEntry *entry;
+    union kstats kstats;
+    socklen_t len;
+    uint32_t i;
+
+    /* Release any frames still held for deferred verdicts before tearing the old
+        rings down so an inline reload doesn't drop them.  Only V2 instances can
+        have pending frames - deferred mode rejects V3. */
+    for (instance = instances; instance; instance = instance->next)
+    {
+        if (instance->tp_version != TPACKET_V2 || !instance->rx_ring.entries)
+            continue;
+        for (i = 0; i < instance->rx_ring.layout.tp_frame_nr; i++)
+        {
+            entry = &instance->rx_ring.entries[i];
+            if (entry->pending_data)
+            {
+                afpacket_transmit_release(instance, entry, entry->pending_data, entry->pending_len, DAQ_VERDICT_PASS);
+                entry->pending_data = NULL;
+                entry->pending_len = 0;
+            }
+        }
+    }
+
+    for (instance = instances; instance; instance = instance->next)
+        afpacket_tx_flush(instance);
+
+    while ((instance = instances) != NULL)
+    {
+        instances = instance->next;
+        /* Fold the final kernel counters for the old socket into our stats before
+            it disappears. */
+        len = sizeof(kstats);
+        memset(&kstats, 0, len);
+        if (getsockopt(instance->fd, SOL_PACKET, PACKET_STATISTICS, &kstats, &len) > -1)
+        {
+            afpc->stats.hw_packets_received += kstats.v2.tp_packets - kstats.v2.tp_drops;
+            afpc->stats.hw_packets_dropped += kstats.v2.tp_drops;
+        }
+        destroy_instance(instance);
+    }
+
+    return DAQ_SUCCESS;
+}
+
 #ifdef BUILDING_SO
 DAQ_SO_PUBLIC const DAQ_Module_t DAQ_MODULE_DATA =
 #else
@@ -1191,7 +2583,11 @@ const DAQ_Module_t afpacket_daq_module_data =
     .set_errbuf = afpacket_daq_set_errbuf,
     .get_device_index = afpacket_daq_get_device_index,
     .modify_flow = NULL,
-    .hup_prep = NULL,
-    .hup_apply = NULL,
-    .hup_post = NULL,
+    .hup_prep = afpacket_daq_hup_prep,
+    .hup_apply = afpacket_daq_hup_apply,
+    .hup_post = afpacket_daq_hup_post,
+    .acquire_batch = afpacket_daq_acquire_batch,
+    .acquire_deferred = afpacket_daq_acquire_deferred,
+    .set_verdict = afpacket_daq_set_verdict,
+    .get_perf_stats = afpacket_daq_get_perf_stats,
 };
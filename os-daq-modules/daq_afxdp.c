@@ -0,0 +1,849 @@
+/*
+** Copyright (C) 2014-2015 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * AF_XDP DAQ module.  Packets are received through XDP sockets bound to a
+ * single hardware queue per interface, with the UMEM registered for zero-copy
+ * operation where the driver supports it (transparently falling back to copy
+ * mode where it doesn't).  Interface specification and bridging semantics
+ * match the afpacket module: "eth0:eth1" bridges a pair inline, additional
+ * pairs are separated by "::", and each instance forwards passed packets out
+ * of its peer.  Each socket owns its own UMEM, so inline forwarding copies
+ * the frame into a free transmit frame of the peer's UMEM.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <bpf/xsk.h>
+
+#include "daq_api.h"
+#include "sfbpf.h"
+
+#define DAQ_AFXDP_VERSION 1
+
+#define AF_XDP_MAX_INTERFACES   32
+#define AF_XDP_BATCH_SIZE       64
+
+/* UMEM geometry per instance.  The frame count is split evenly between the
+   fill ring (receive) and the transmit free list. */
+#define AF_XDP_NUM_FRAMES       4096
+#define AF_XDP_FRAME_SIZE       XSK_UMEM__DEFAULT_FRAME_SIZE
+#define AF_XDP_FRAME_MASK       (~((uint64_t) AF_XDP_FRAME_SIZE - 1))
+
+typedef struct _af_xdp_instance
+{
+    struct _af_xdp_instance *next;
+    int fd;
+    char *name;
+    int index;
+    uint32_t queue_id;
+    struct _af_xdp_instance *peer;
+    /* UMEM and its rings */
+    void *umem_area;
+    size_t umem_size;
+    struct xsk_umem *umem;
+    struct xsk_ring_prod fq;
+    struct xsk_ring_cons cq;
+    /* The socket and its rings */
+    struct xsk_socket *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    /* Stack of UMEM frame addresses available for transmission */
+    uint64_t *tx_addrs;
+    uint32_t tx_addr_count;
+    uint32_t tx_outstanding;
+    /* XDP_STATISTICS drop counter baseline captured at the last stats reset. */
+    uint64_t hw_dropped_base;
+} AFXdpInstance;
+
+typedef struct _af_xdp_context
+{
+    char *device;
+    char *filter;
+    int snaplen;
+    int timeout;
+    int debug;
+    uint32_t queue_id;
+    uint16_t bind_flags;
+    AFXdpInstance *instances;
+    uint32_t intf_count;
+    struct sfbpf_program fcode;
+    volatile int break_loop;
+    DAQ_Stats_t stats;
+    DAQ_State state;
+    char errbuf[256];
+} AFXdp_Context_t;
+
+static void destroy_instance(AFXdpInstance *instance)
+{
+    if (instance)
+    {
+        if (instance->xsk)
+        {
+            xsk_socket__delete(instance->xsk);
+            instance->xsk = NULL;
+        }
+        if (instance->umem)
+        {
+            xsk_umem__delete(instance->umem);
+            instance->umem = NULL;
+        }
+        if (instance->umem_area != MAP_FAILED && instance->umem_area != NULL)
+        {
+            munmap(instance->umem_area, instance->umem_size);
+            instance->umem_area = MAP_FAILED;
+        }
+        if (instance->tx_addrs)
+        {
+            free(instance->tx_addrs);
+            instance->tx_addrs = NULL;
+        }
+        instance->fd = -1;
+        if (instance->name)
+        {
+            free(instance->name);
+            instance->name = NULL;
+        }
+        free(instance);
+    }
+}
+
+static AFXdpInstance *create_instance(const char *device, char *errbuf, size_t errlen)
+{
+    AFXdpInstance *instance = NULL;
+
+    instance = calloc(1, sizeof(AFXdpInstance));
+    if (!instance)
+    {
+        snprintf(errbuf, errlen, "%s: Could not allocate a new instance structure.", __func__);
+        goto err;
+    }
+    instance->umem_area = MAP_FAILED;
+    instance->fd = -1;
+
+    if ((instance->name = strdup(device)) == NULL)
+    {
+        snprintf(errbuf, errlen, "%s: Could not allocate a copy of the device name.", __func__);
+        goto err;
+    }
+
+    /* Resolve the interface's index for the DAQ packet header. */
+    instance->index = if_nametoindex(device);
+    if (instance->index == 0)
+    {
+        snprintf(errbuf, errlen, "%s: Could not find index for device %s", __func__, instance->name);
+        goto err;
+    }
+
+    return instance;
+
+err:
+    destroy_instance(instance);
+    return NULL;
+}
+
+static int start_instance(AFXdp_Context_t *afxc, AFXdpInstance *instance)
+{
+    struct xsk_socket_config cfg;
+    uint32_t idx, i;
+    int rval;
+
+    /* Create the UMEM and register it with the kernel. */
+    instance->umem_size = (size_t) AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE;
+    instance->umem_area = mmap(NULL, instance->umem_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (instance->umem_area == MAP_FAILED)
+    {
+        DPE(afxc->errbuf, "%s: Could not allocate %zu bytes of UMEM for device %s: %s",
+            __func__, instance->umem_size, instance->name, strerror(errno));
+        return DAQ_ERROR_NOMEM;
+    }
+
+    rval = xsk_umem__create(&instance->umem, instance->umem_area, instance->umem_size,
+                            &instance->fq, &instance->cq, NULL);
+    if (rval)
+    {
+        DPE(afxc->errbuf, "%s: Could not create UMEM for device %s: %s",
+            __func__, instance->name, strerror(-rval));
+        return DAQ_ERROR;
+    }
+
+    /* Give the first half of the UMEM frames to the fill ring and stack up
+       the second half as transmit frames. */
+    instance->tx_addrs = calloc(AF_XDP_NUM_FRAMES / 2, sizeof(uint64_t));
+    if (!instance->tx_addrs)
+    {
+        DPE(afxc->errbuf, "%s: Could not allocate the TX frame stack for device %s!",
+            __func__, instance->name);
+        return DAQ_ERROR_NOMEM;
+    }
+    for (i = 0; i < AF_XDP_NUM_FRAMES / 2; i++)
+        instance->tx_addrs[instance->tx_addr_count++] = (uint64_t) (AF_XDP_NUM_FRAMES / 2 + i) * AF_XDP_FRAME_SIZE;
+
+    if (xsk_ring_prod__reserve(&instance->fq, AF_XDP_NUM_FRAMES / 2, &idx) != AF_XDP_NUM_FRAMES / 2)
+    {
+        DPE(afxc->errbuf, "%s: Could not populate the fill ring for device %s!",
+            __func__, instance->name);
+        return DAQ_ERROR;
+    }
+    for (i = 0; i < AF_XDP_NUM_FRAMES / 2; i++)
+        *xsk_ring_prod__fill_addr(&instance->fq, idx++) = (uint64_t) i * AF_XDP_FRAME_SIZE;
+    xsk_ring_prod__submit(&instance->fq, AF_XDP_NUM_FRAMES / 2);
+
+    /* Create the XDP socket bound to the configured queue. */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    cfg.libbpf_flags = 0;
+    cfg.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST;
+    cfg.bind_flags = afxc->bind_flags;
+
+    rval = xsk_socket__create(&instance->xsk, instance->name, afxc->queue_id,
+                              instance->umem, &instance->rx, &instance->tx, &cfg);
+    if (rval)
+    {
+        DPE(afxc->errbuf, "%s: Could not create XDP socket on device %s queue %u: %s",
+            __func__, instance->name, afxc->queue_id, strerror(-rval));
+        return DAQ_ERROR;
+    }
+    instance->queue_id = afxc->queue_id;
+    instance->fd = xsk_socket__fd(instance->xsk);
+
+    if (afxc->debug)
+    {
+        printf("[%s] UMEM: %zu bytes in %u frames\n", instance->name, instance->umem_size, AF_XDP_NUM_FRAMES);
+        printf("[%s] Bound to queue %u (bind flags 0x%hx)\n", instance->name, instance->queue_id, afxc->bind_flags);
+    }
+
+    return DAQ_SUCCESS;
+}
+
+/* Reap completed transmissions and return their frames to the TX stack. */
+static inline void reclaim_tx_frames(AFXdpInstance *instance)
+{
+    uint32_t idx, n, i;
+
+    n = xsk_ring_cons__peek(&instance->cq, AF_XDP_NUM_FRAMES / 2, &idx);
+    if (n)
+    {
+        for (i = 0; i < n; i++)
+            instance->tx_addrs[instance->tx_addr_count++] = *xsk_ring_cons__comp_addr(&instance->cq, idx++);
+        xsk_ring_cons__release(&instance->cq, n);
+        instance->tx_outstanding -= n;
+    }
+}
+
+/* Copy a packet into a free transmit frame of 'instance' and queue it for
+   transmission.  The packet is dropped if no frame or ring slot is available,
+   like the other inline modules drop under TX pressure. */
+static int transmit_packet(AFXdpInstance *instance, const uint8_t *data, uint32_t len)
+{
+    struct xdp_desc *desc;
+    uint64_t addr;
+    uint32_t idx;
+
+    reclaim_tx_frames(instance);
+
+    if (instance->tx_addr_count == 0 || len > AF_XDP_FRAME_SIZE)
+        return DAQ_ERROR_AGAIN;
+    if (xsk_ring_prod__reserve(&instance->tx, 1, &idx) != 1)
+        return DAQ_ERROR_AGAIN;
+
+    addr = instance->tx_addrs[--instance->tx_addr_count];
+    memcpy(xsk_umem__get_data(instance->umem_area, addr), data, len);
+    desc = xsk_ring_prod__tx_desc(&instance->tx, idx);
+    desc->addr = addr;
+    desc->len = len;
+    xsk_ring_prod__submit(&instance->tx, 1);
+    instance->tx_outstanding++;
+
+    if (xsk_ring_prod__needs_wakeup(&instance->tx))
+        sendto(instance->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+
+    return DAQ_SUCCESS;
+}
+
+static void af_xdp_close(AFXdp_Context_t *afxc)
+{
+    AFXdpInstance *instance;
+
+    if (!afxc)
+        return;
+
+    /* Close all of the XDP socket instances. */
+    while ((instance = afxc->instances) != NULL)
+    {
+        afxc->instances = instance->next;
+        destroy_instance(instance);
+    }
+
+    sfbpf_freecode(&afxc->fcode);
+
+    afxc->state = DAQ_STATE_STOPPED;
+}
+
+static int create_bridge(AFXdp_Context_t *afxc, const char *device_name1, const char *device_name2)
+{
+    AFXdpInstance *instance, *peer1, *peer2;
+
+    peer1 = peer2 = NULL;
+    for (instance = afxc->instances; instance; instance = instance->next)
+    {
+        if (!strcmp(instance->name, device_name1))
+            peer1 = instance;
+        else if (!strcmp(instance->name, device_name2))
+            peer2 = instance;
+    }
+
+    if (!peer1 || !peer2)
+        return DAQ_ERROR_NODEV;
+
+    peer1->peer = peer2;
+    peer2->peer = peer1;
+
+    return DAQ_SUCCESS;
+}
+
+/* Fold the kernel's XDP socket drop counters into a stats snapshot.  The
+   counters are cumulative since socket creation and do not reset on read, so
+   only the delta against the baseline captured at the last stats reset is
+   added, and the persistent context stats are left untouched. */
+static void add_hw_stats(AFXdp_Context_t *afxc, DAQ_Stats_t *stats)
+{
+    AFXdpInstance *instance;
+    struct xdp_statistics xstats;
+    socklen_t len;
+
+    for (instance = afxc->instances; instance; instance = instance->next)
+    {
+        if (instance->fd == -1)
+            continue;
+        len = sizeof(xstats);
+        if (getsockopt(instance->fd, SOL_XDP, XDP_STATISTICS, &xstats, &len) == 0)
+            stats->hw_packets_dropped += xstats.rx_dropped - instance->hw_dropped_base;
+    }
+}
+
+static int afxdp_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char *errbuf, size_t errlen)
+{
+    AFXdp_Context_t *afxc;
+    AFXdpInstance *instance;
+    char *name1, *name2, *dev;
+    char intf[IFNAMSIZ];
+    size_t len;
+    int num_intfs = 0;
+    int rval = DAQ_ERROR;
+    DAQ_Dict *entry;
+
+    afxc = calloc(1, sizeof(AFXdp_Context_t));
+    if (!afxc)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the new AF_XDP context!", __func__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
+    afxc->device = strdup(config->name);
+    if (!afxc->device)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the device string!", __func__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
+    afxc->snaplen = config->snaplen;
+    afxc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
+    afxc->bind_flags = XDP_USE_NEED_WAKEUP;
+
+    dev = afxc->device;
+    if (*dev == ':' || ((len = strlen(dev)) > 0 && *(dev + len - 1) == ':') || (config->mode == DAQ_MODE_PASSIVE && strstr(dev, "::")))
+    {
+        snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __func__, afxc->device);
+        goto err;
+    }
+
+    while (*dev != '\0')
+    {
+        len = strcspn(dev, ":");
+        if (len >= IFNAMSIZ)
+        {
+            snprintf(errbuf, errlen, "%s: Interface name too long! (%zu)", __func__, len);
+            goto err;
+        }
+        if (len != 0)
+        {
+            afxc->intf_count++;
+            if (afxc->intf_count >= AF_XDP_MAX_INTERFACES)
+            {
+                snprintf(errbuf, errlen, "%s: Using more than %d interfaces is not supported!", __func__, AF_XDP_MAX_INTERFACES);
+                goto err;
+            }
+            snprintf(intf, len + 1, "%s", dev);
+            instance = create_instance(intf, errbuf, errlen);
+            if (!instance)
+                goto err;
+
+            instance->next = afxc->instances;
+            afxc->instances = instance;
+            num_intfs++;
+            if (config->mode != DAQ_MODE_PASSIVE)
+            {
+                if (num_intfs == 2)
+                {
+                    name1 = afxc->instances->next->name;
+                    name2 = afxc->instances->name;
+
+                    if (create_bridge(afxc, name1, name2) != DAQ_SUCCESS)
+                    {
+                        snprintf(errbuf, errlen, "%s: Couldn't create the bridge between %s and %s!", __func__, name1, name2);
+                        goto err;
+                    }
+                    num_intfs = 0;
+                }
+                else if (num_intfs > 2)
+                    break;
+            }
+        }
+        else
+            len = 1;
+        dev += len;
+    }
+
+    /* If there are any leftover unbridged interfaces and we're not in Passive mode, error out. */
+    if (!afxc->instances || (config->mode != DAQ_MODE_PASSIVE && num_intfs != 0))
+    {
+        snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __func__, afxc->device);
+        goto err;
+    }
+
+    for (entry = config->values; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->key, "debug"))
+            afxc->debug = 1;
+        else if (!strcmp(entry->key, "queue"))
+        {
+            if (!entry->value)
+            {
+                snprintf(errbuf, errlen, "%s: %s requires an argument!", __func__, entry->key);
+                goto err;
+            }
+            afxc->queue_id = strtoul(entry->value, NULL, 10);
+        }
+        else if (!strcmp(entry->key, "zerocopy"))
+            afxc->bind_flags |= XDP_ZEROCOPY;
+        else if (!strcmp(entry->key, "copy"))
+            afxc->bind_flags |= XDP_COPY;
+    }
+
+    afxc->state = DAQ_STATE_INITIALIZED;
+
+    *ctxt_ptr = afxc;
+    return DAQ_SUCCESS;
+
+err:
+    if (afxc)
+    {
+        af_xdp_close(afxc);
+        if (afxc->device)
+            free(afxc->device);
+        free(afxc);
+    }
+    return rval;
+}
+
+static int afxdp_daq_set_filter(void *handle, const char *filter)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+    struct sfbpf_program fcode;
+
+    if (afxc->filter)
+        free(afxc->filter);
+
+    afxc->filter = strdup(filter);
+    if (!afxc->filter)
+    {
+        DPE(afxc->errbuf, "%s: Couldn't allocate memory for the filter string!", __func__);
+        return DAQ_ERROR;
+    }
+
+    if (sfbpf_compile(afxc->snaplen, DLT_EN10MB, &fcode, afxc->filter, 1, 0) < 0)
+    {
+        DPE(afxc->errbuf, "%s: BPF state machine compilation failed!", __func__);
+        return DAQ_ERROR;
+    }
+
+    sfbpf_freecode(&afxc->fcode);
+    afxc->fcode.bf_len = fcode.bf_len;
+    afxc->fcode.bf_insns = fcode.bf_insns;
+
+    return DAQ_SUCCESS;
+}
+
+static int afxdp_daq_start(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+    AFXdpInstance *instance;
+
+    for (instance = afxc->instances; instance; instance = instance->next)
+    {
+        if (start_instance(afxc, instance) != DAQ_SUCCESS)
+            return DAQ_ERROR;
+    }
+
+    memset(&afxc->stats, 0, sizeof(DAQ_Stats_t));
+
+    afxc->state = DAQ_STATE_STARTED;
+
+    return DAQ_SUCCESS;
+}
+
+static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_PASS */
+    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLOCK */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_REPLACE */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_WHITELIST */
+    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLACKLIST */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_IGNORE */
+    DAQ_VERDICT_BLOCK       /* DAQ_VERDICT_RETRY */
+};
+
+static int afxdp_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+    AFXdpInstance *instance;
+    DAQ_PktHdr_t daqhdr;
+    DAQ_Verdict verdict;
+    const struct xdp_desc *desc;
+    struct pollfd pfd[AF_XDP_MAX_INTERFACES];
+    struct timeval tv;
+    const uint8_t *data;
+    uint64_t addr;
+    uint32_t idx_rx, idx_fq, rcvd, i;
+    int got_one, ignored_one;
+    int ret, c = 0;
+
+    while (c < cnt || cnt <= 0)
+    {
+        got_one = 0;
+        ignored_one = 0;
+        for (instance = afxc->instances; instance; instance = instance->next)
+        {
+            /* Has breakloop() been called? */
+            if (afxc->break_loop)
+            {
+                afxc->break_loop = 0;
+                return 0;
+            }
+
+            rcvd = xsk_ring_cons__peek(&instance->rx, AF_XDP_BATCH_SIZE, &idx_rx);
+            if (!rcvd)
+            {
+                /* Poke the kernel if the fill ring ran dry while we were away. */
+                if (xsk_ring_prod__needs_wakeup(&instance->fq))
+                    recvfrom(instance->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+                continue;
+            }
+
+            gettimeofday(&tv, NULL);
+
+            for (i = 0; i < rcvd; i++)
+            {
+                desc = xsk_ring_cons__rx_desc(&instance->rx, idx_rx + i);
+                data = xsk_umem__get_data(instance->umem_area, desc->addr);
+
+                verdict = DAQ_VERDICT_PASS;
+                if (afxc->fcode.bf_insns && sfbpf_filter(afxc->fcode.bf_insns, data, desc->len, desc->len) == 0)
+                {
+                    ignored_one = 1;
+                    afxc->stats.packets_filtered++;
+                    goto send_packet;
+                }
+                got_one = 1;
+
+                daqhdr.ts = tv;
+                daqhdr.caplen = (desc->len > (uint32_t) afxc->snaplen) ? (uint32_t) afxc->snaplen : desc->len;
+                daqhdr.pktlen = desc->len;
+                daqhdr.ingress_index = instance->index;
+                daqhdr.egress_index = instance->peer ? instance->peer->index : DAQ_PKTHDR_UNKNOWN;
+                daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.flags = 0;
+                daqhdr.opaque = 0;
+                daqhdr.priv_ptr = NULL;
+                daqhdr.address_space_id = 0;
+
+                if (callback)
+                {
+                    verdict = callback(user, &daqhdr, data);
+                    if (verdict >= MAX_DAQ_VERDICT)
+                        verdict = DAQ_VERDICT_PASS;
+                    afxc->stats.verdicts[verdict]++;
+                    verdict = verdict_translation_table[verdict];
+                }
+                afxc->stats.packets_received++;
+                c++;
+send_packet:
+                if (verdict == DAQ_VERDICT_PASS && instance->peer)
+                    transmit_packet(instance->peer, data, desc->len);
+
+                /* Return the frame to our fill ring. */
+                addr = desc->addr & AF_XDP_FRAME_MASK;
+                if (xsk_ring_prod__reserve(&instance->fq, 1, &idx_fq) == 1)
+                {
+                    *xsk_ring_prod__fill_addr(&instance->fq, idx_fq) = addr;
+                    xsk_ring_prod__submit(&instance->fq, 1);
+                }
+            }
+            xsk_ring_cons__release(&instance->rx, rcvd);
+        }
+        if (!got_one && !ignored_one)
+        {
+            for (i = 0, instance = afxc->instances; instance; i++, instance = instance->next)
+            {
+                pfd[i].fd = instance->fd;
+                pfd[i].revents = 0;
+                pfd[i].events = POLLIN;
+            }
+            ret = poll(pfd, afxc->intf_count, afxc->timeout);
+            /* If we were interrupted by a signal, start the loop over.  The user should call daq_breakloop to actually exit. */
+            if (ret < 0 && errno != EINTR)
+            {
+                DPE(afxc->errbuf, "%s: Poll failed: %s (%d)", __func__, strerror(errno), errno);
+                return DAQ_ERROR;
+            }
+            /* If the poll times out, return control to the caller. */
+            if (ret == 0)
+                break;
+            /* If some number of of sockets have events returned, check them all for badness. */
+            if (ret > 0)
+            {
+                for (i = 0; i < afxc->intf_count; i++)
+                {
+                    if (pfd[i].revents & (POLLHUP | POLLRDHUP | POLLERR | POLLNVAL))
+                    {
+                        if (pfd[i].revents & (POLLHUP | POLLRDHUP))
+                            DPE(afxc->errbuf, "%s: Hang-up on an XDP socket", __func__);
+                        else if (pfd[i].revents & POLLERR)
+                            DPE(afxc->errbuf, "%s: Encountered error condition on an XDP socket", __func__);
+                        else if (pfd[i].revents & POLLNVAL)
+                            DPE(afxc->errbuf, "%s: Invalid polling request on an XDP socket", __func__);
+                        return DAQ_ERROR;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int afxdp_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+    AFXdpInstance *instance;
+
+    /* Find the instance that the packet was received on and send the packet
+       out of it (reverse) or its peer (forward). */
+    for (instance = afxc->instances; instance; instance = instance->next)
+    {
+        if (instance->index == hdr->ingress_index)
+            break;
+    }
+    if (!instance || (!reverse && !(instance = instance->peer)))
+    {
+        DPE(afxc->errbuf, "%s: Unrecognized interface specified!", __func__);
+        return DAQ_ERROR_NODEV;
+    }
+
+    if (transmit_packet(instance, packet_data, len) != DAQ_SUCCESS)
+    {
+        DPE(afxc->errbuf, "%s: No transmit frames available!", __func__);
+        return DAQ_ERROR_AGAIN;
+    }
+
+    afxc->stats.packets_injected++;
+    return DAQ_SUCCESS;
+}
+
+static int afxdp_daq_breakloop(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    afxc->break_loop = 1;
+
+    return DAQ_SUCCESS;
+}
+
+static int afxdp_daq_stop(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    af_xdp_close(afxc);
+
+    return DAQ_SUCCESS;
+}
+
+static void afxdp_daq_shutdown(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    af_xdp_close(afxc);
+    if (afxc->device)
+        free(afxc->device);
+    if (afxc->filter)
+        free(afxc->filter);
+    free(afxc);
+}
+
+static DAQ_State afxdp_daq_check_status(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    return afxc->state;
+}
+
+static int afxdp_daq_get_stats(void *handle, DAQ_Stats_t *stats)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    daq_stats_snapshot(&afxc->stats, stats);
+    add_hw_stats(afxc, stats);
+
+    return DAQ_SUCCESS;
+}
+
+static void afxdp_daq_reset_stats(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+    AFXdpInstance *instance;
+    struct xdp_statistics xstats;
+    socklen_t len;
+
+    memset(&afxc->stats, 0, sizeof(DAQ_Stats_t));
+
+    /* Rebaseline the cumulative XDP socket counters (see add_hw_stats()). */
+    for (instance = afxc->instances; instance; instance = instance->next)
+    {
+        if (instance->fd == -1)
+            continue;
+        len = sizeof(xstats);
+        if (getsockopt(instance->fd, SOL_XDP, XDP_STATISTICS, &xstats, &len) == 0)
+            instance->hw_dropped_base = xstats.rx_dropped;
+    }
+}
+
+static int afxdp_daq_get_snaplen(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    return afxc->snaplen;
+}
+
+static uint32_t afxdp_daq_get_capabilities(void *handle)
+{
+    return DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF | DAQ_CAPA_DEVICE_INDEX;
+}
+
+static int afxdp_daq_get_datalink_type(void *handle)
+{
+    return DLT_EN10MB;
+}
+
+static const char *afxdp_daq_get_errbuf(void *handle)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    return afxc->errbuf;
+}
+
+static void afxdp_daq_set_errbuf(void *handle, const char *string)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+
+    if (!string)
+        return;
+
+    DPE(afxc->errbuf, "%s", string);
+}
+
+static int afxdp_daq_get_device_index(void *handle, const char *device)
+{
+    AFXdp_Context_t *afxc = (AFXdp_Context_t *) handle;
+    AFXdpInstance *instance;
+
+    for (instance = afxc->instances; instance; instance = instance->next)
+    {
+        if (!strcmp(device, instance->name))
+            return instance->index;
+    }
+
+    return DAQ_ERROR_NODEV;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC const DAQ_Module_t DAQ_MODULE_DATA =
+#else
+const DAQ_Module_t afxdp_daq_module_data =
+#endif
+{
+    .api_version = DAQ_API_VERSION,
+    .module_version = DAQ_AFXDP_VERSION,
+    .name = "afxdp",
+    .type = DAQ_TYPE_INTF_CAPABLE | DAQ_TYPE_INLINE_CAPABLE | DAQ_TYPE_MULTI_INSTANCE,
+    .initialize = afxdp_daq_initialize,
+    .set_filter = afxdp_daq_set_filter,
+    .start = afxdp_daq_start,
+    .acquire = afxdp_daq_acquire,
+    .inject = afxdp_daq_inject,
+    .breakloop = afxdp_daq_breakloop,
+    .stop = afxdp_daq_stop,
+    .shutdown = afxdp_daq_shutdown,
+    .check_status = afxdp_daq_check_status,
+    .get_stats = afxdp_daq_get_stats,
+    .reset_stats = afxdp_daq_reset_stats,
+    .get_snaplen = afxdp_daq_get_snaplen,
+    .get_capabilities = afxdp_daq_get_capabilities,
+    .get_datalink_type = afxdp_daq_get_datalink_type,
+    .get_errbuf = afxdp_daq_get_errbuf,
+    .set_errbuf = afxdp_daq_set_errbuf,
+    .get_device_index = afxdp_daq_get_device_index,
+    .modify_flow = NULL,
+    .hup_prep = NULL,
+    .hup_apply = NULL,
+    .hup_post = NULL,
+};
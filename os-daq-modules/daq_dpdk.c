@@ -36,12 +36,26 @@
 #include <string.h>
 
 #include <daq_api.h>
+#include <daq_timestamp.h>
+#include <daq_tunnel.h>
 #include <sfbpf.h>
 #include <sfbpf_dlt.h>
 
 #include <rte_config.h>
 #include <rte_eal.h>
 #include <rte_ethdev.h>
+#include <rte_version.h>
+
+/* Generic flow API (rte_flow) first appeared in DPDK 17.02 */
+#if RTE_VERSION >= RTE_VERSION_NUM(17, 2, 0, 0)
+#define HAVE_RTE_FLOW
+#include <netinet/in.h>
+#include <rte_ether.h>
+#include <rte_flow.h>
+#include <rte_ip.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+#endif
 
 #define DAQ_DPDK_VERSION 16.07
 
@@ -65,6 +79,9 @@
 #define MBUF_PKT_SIZE  RTE_MBUF_DEFAULT_BUF_SIZE
 #endif
 
+/* Upper bound the adaptive RX burst sizing grows toward under sustained load. */
+#define MAX_BURST_SIZE 256
+
 #define MODULUS(a,b) (b)?(a % b):0
 
 #define TAKE_LOCK(lck) \
@@ -121,11 +138,19 @@ typedef struct _dpdk_device
     int index;
     int ref_cnt;
     pthread_t tid;
+    /* NIC counter baseline captured at the last stats reset. */
+    struct rte_eth_stats hw_base;
 
 #ifdef DEBUG_SHOW_LOCAL_STATISTICS
 	uint64_t rx_pkts[MAX_RX_QUEUES];
 	uint64_t tx_pkts[MAX_TX_QUEUES];
 #endif
+
+#ifdef HAVE_RTE_FLOW
+#define MAX_OFFLOAD_RULES      256
+    struct rte_flow *offload_rules[MAX_OFFLOAD_RULES];
+    uint16_t num_offload_rules;
+#endif
 } DpdkDevice;
 
 static DpdkDevice *dpdk_devices[MAX_DPDK_DEVICES];
@@ -153,6 +178,10 @@ typedef struct _dpdk_interface
     int snaplen;
     int timeout;
     int debug;
+    int flow_offload;
+    uint16_t cur_burst_size;
+    DAQ_PerfStats_t *perf;
+    DAQ_TsSource_t ts_src;
 
 #define DEV_IDX 0
 #define PEER_IDX 1
@@ -177,6 +206,29 @@ static Dpdk_Interface_t *base_intf;
 #ifdef USE_RX_TX_LOCKING
 static pthread_mutex_t rx_mutex[MAX_DPDK_DEVICES][MAX_RX_QUEUES];
 static pthread_mutex_t tx_mutex[MAX_DPDK_DEVICES][MAX_TX_QUEUES];
+
+/* In run-to-completion mode every instance exclusively owns its RX/TX queue
+ * pair (enforced while the devices are created), so the per-burst mutexes -
+ * and the cross-core cache-line bouncing they cause at high rates - are
+ * skipped entirely. */
+static int run_to_completion = 0;
+
+#define RX_QUEUE_LOCK(port,queue) \
+		{if (!run_to_completion) pthread_mutex_lock(&rx_mutex[port][queue]);}
+#define RX_QUEUE_UNLOCK(port,queue) \
+		{if (!run_to_completion) pthread_mutex_unlock(&rx_mutex[port][queue]);}
+#define TX_QUEUE_LOCK(port,queue) \
+		{if (!run_to_completion) pthread_mutex_lock(&tx_mutex[port][queue]);}
+#define TX_QUEUE_UNLOCK(port,queue) \
+		{if (!run_to_completion) pthread_mutex_unlock(&tx_mutex[port][queue]);}
+
+#define QUEUE_SHARING_ALLOWED() (!run_to_completion)
+#else
+#define RX_QUEUE_LOCK(port,queue)
+#define RX_QUEUE_UNLOCK(port,queue)
+#define TX_QUEUE_LOCK(port,queue)
+#define TX_QUEUE_UNLOCK(port,queue)
+#define QUEUE_SHARING_ALLOWED() 0
 #endif
 
 static void dpdk_daq_reset_stats(void *handle);
@@ -298,6 +350,115 @@ err:
   return DAQ_ERROR;
 }
 
+#ifdef HAVE_RTE_FLOW
+/*
+ * Translate the 5-tuple of a packet that just received a WHITELIST or
+ * BLACKLIST verdict into an rte_flow DROP rule, so the rest of the flow is
+ * discarded by the NIC instead of burning acquire-loop cycles.  Only plain
+ * IPv4 TCP/UDP packets are offloaded; everything else stays on the software
+ * path.  Failures are harmless - the flow simply keeps hitting the callback.
+ */
+static int dpdk_offload_flow(DpdkDevice *device, const uint8_t *data, uint32_t len)
+{
+    struct rte_flow_attr attr;
+    struct rte_flow_item pattern[4];
+    struct rte_flow_action action[2];
+    struct rte_flow_item_ipv4 ip_spec, ip_mask;
+    struct rte_flow_item_tcp tcp_spec, tcp_mask;
+    struct rte_flow_item_udp udp_spec, udp_mask;
+    struct rte_flow_error error;
+    struct rte_flow *flow;
+    const struct ether_hdr *eth;
+    const struct ipv4_hdr *ip;
+    const uint16_t *ports;
+    uint32_t hlen;
+
+    if (len < sizeof(*eth) + sizeof(*ip))
+        return DAQ_ERROR;
+
+    eth = (const struct ether_hdr *) data;
+    if (eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4))
+        return DAQ_ERROR;
+
+    ip = (const struct ipv4_hdr *) (eth + 1);
+    hlen = (ip->version_ihl & 0x0f) << 2;
+    if ((ip->version_ihl >> 4) != 4 || len < sizeof(*eth) + hlen + 4)
+        return DAQ_ERROR;
+
+    if (ip->next_proto_id != IPPROTO_TCP && ip->next_proto_id != IPPROTO_UDP)
+        return DAQ_ERROR;
+
+    /* Source and destination port lie in the first 4 bytes of both headers */
+    ports = (const uint16_t *) (data + sizeof(*eth) + hlen);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.ingress = 1;
+
+    memset(pattern, 0, sizeof(pattern));
+    pattern[0].type = RTE_FLOW_ITEM_TYPE_ETH;
+
+    memset(&ip_spec, 0, sizeof(ip_spec));
+    memset(&ip_mask, 0, sizeof(ip_mask));
+    ip_spec.hdr.src_addr = ip->src_addr;
+    ip_spec.hdr.dst_addr = ip->dst_addr;
+    ip_mask.hdr.src_addr = 0xffffffff;
+    ip_mask.hdr.dst_addr = 0xffffffff;
+    pattern[1].type = RTE_FLOW_ITEM_TYPE_IPV4;
+    pattern[1].spec = &ip_spec;
+    pattern[1].mask = &ip_mask;
+
+    if (ip->next_proto_id == IPPROTO_TCP)
+    {
+        memset(&tcp_spec, 0, sizeof(tcp_spec));
+        memset(&tcp_mask, 0, sizeof(tcp_mask));
+        tcp_spec.hdr.src_port = ports[0];
+        tcp_spec.hdr.dst_port = ports[1];
+        tcp_mask.hdr.src_port = 0xffff;
+        tcp_mask.hdr.dst_port = 0xffff;
+        pattern[2].type = RTE_FLOW_ITEM_TYPE_TCP;
+        pattern[2].spec = &tcp_spec;
+        pattern[2].mask = &tcp_mask;
+    }
+    else
+    {
+        memset(&udp_spec, 0, sizeof(udp_spec));
+        memset(&udp_mask, 0, sizeof(udp_mask));
+        udp_spec.hdr.src_port = ports[0];
+        udp_spec.hdr.dst_port = ports[1];
+        udp_mask.hdr.src_port = 0xffff;
+        udp_mask.hdr.dst_port = 0xffff;
+        pattern[2].type = RTE_FLOW_ITEM_TYPE_UDP;
+        pattern[2].spec = &udp_spec;
+        pattern[2].mask = &udp_mask;
+    }
+    pattern[3].type = RTE_FLOW_ITEM_TYPE_END;
+
+    memset(action, 0, sizeof(action));
+    action[0].type = RTE_FLOW_ACTION_TYPE_DROP;
+    action[1].type = RTE_FLOW_ACTION_TYPE_END;
+
+    TAKE_LOCK(&port_lock[device->port]);
+
+    if (device->num_offload_rules >= MAX_OFFLOAD_RULES ||
+        rte_flow_validate(device->port, &attr, pattern, action, &error) != 0)
+    {
+        RELEASE_LOCK(&port_lock[device->port]);
+        return DAQ_ERROR;
+    }
+
+    flow = rte_flow_create(device->port, &attr, pattern, action, &error);
+    if (!flow)
+    {
+        RELEASE_LOCK(&port_lock[device->port]);
+        return DAQ_ERROR;
+    }
+    device->offload_rules[device->num_offload_rules++] = flow;
+
+    RELEASE_LOCK(&port_lock[device->port]);
+    return DAQ_SUCCESS;
+}
+#endif /* HAVE_RTE_FLOW */
+
 static void destroy_device(DpdkDevice **device)
 {
 	if (!device) return;
@@ -306,6 +467,13 @@ static void destroy_device(DpdkDevice **device)
         if (--(*device)->ref_cnt == 0)
         {
             (*device)->flags &= ~DPDKINST_STARTED;
+#ifdef HAVE_RTE_FLOW
+            if ((*device)->num_offload_rules > 0)
+            {
+                rte_flow_flush((*device)->port, NULL);
+                (*device)->num_offload_rules = 0;
+            }
+#endif
             rte_eth_dev_stop((*device)->port);
             rte_eth_dev_close((*device)->port);
             free(*device);
@@ -314,6 +482,76 @@ static void destroy_device(DpdkDevice **device)
     }
 }
 
+/* Dump the full set of NIC extended statistics (xstats) for a port.  Only
+ * ever called outside the burst loop (on the final close of a port with
+ * debugging enabled), so the name lookups and allocations are harmless. */
+static void dump_port_xstats(uint8_t port)
+{
+#if RTE_VERSION >= RTE_VERSION_NUM(16, 11, 0, 0)
+    struct rte_eth_xstat *xstats;
+    struct rte_eth_xstat_name *names;
+    int cnt, i;
+
+    cnt = rte_eth_xstats_get(port, NULL, 0);
+    if (cnt <= 0)
+        return;
+
+    xstats = malloc(cnt * sizeof(*xstats));
+    names = malloc(cnt * sizeof(*names));
+    if (xstats && names &&
+        rte_eth_xstats_get(port, xstats, cnt) == cnt &&
+        rte_eth_xstats_get_names(port, names, cnt) == cnt)
+    {
+        printf("DPDK xstats for port %i:\n", port);
+        for (i = 0; i < cnt; i++)
+        {
+            if (xstats[i].value)
+                printf("  %s: %lu\n", names[xstats[i].id].name, (unsigned long) xstats[i].value);
+        }
+    }
+    free(xstats);
+    free(names);
+#else
+    struct rte_eth_xstats *xstats;
+    int cnt, i;
+
+    cnt = rte_eth_xstats_get(port, NULL, 0);
+    if (cnt <= 0)
+        return;
+
+    xstats = malloc(cnt * sizeof(*xstats));
+    if (xstats && rte_eth_xstats_get(port, xstats, cnt) == cnt)
+    {
+        printf("DPDK xstats for port %i:\n", port);
+        for (i = 0; i < cnt; i++)
+        {
+            if (xstats[i].value)
+                printf("  %s: %lu\n", xstats[i].name, (unsigned long) xstats[i].value);
+        }
+    }
+    free(xstats);
+#endif
+}
+
+/* Allocate queue mempools on the NUMA node the port is attached to rather
+ * than whichever node the configuring thread happens to run on, so that the
+ * descriptors and packet buffers stay local to the polling core. */
+static int dpdk_pool_socket_id(int port)
+{
+    int socket = rte_eth_dev_socket_id(port);
+
+    return (socket >= 0) ? socket : (int) rte_socket_id();
+}
+
+/* With shared queues the NUM_MBUFS budget is carved up between the queues;
+ * an exclusively owned queue gets a full-sized pool of its own. */
+static unsigned dpdk_pool_mbufs(const DpdkDevice *device)
+{
+    if (QUEUE_SHARING_ALLOWED())
+        return NUM_MBUFS / device->max_rx_queues;
+    return NUM_MBUFS;
+}
+
 /* NOTE this function must be mutex protected */
 static DpdkDevice *create_rx_device(const char *port_name, uint16_t *rx_queue, char *errbuf,
 		size_t errlen, int queues, int debug)
@@ -336,10 +574,13 @@ static DpdkDevice *create_rx_device(const char *port_name, uint16_t *rx_queue, c
     {
     	if (port == dpdk_devices[i]->port)
     	{
-#ifndef USE_RX_TX_LOCKING
-    		if (dpdk_devices[i]->num_rx_queues >= dpdk_devices[i]->max_rx_queues)
+    		if (!QUEUE_SHARING_ALLOWED() &&
+    			dpdk_devices[i]->num_rx_queues >= dpdk_devices[i]->max_rx_queues)
+    		{
+    			snprintf(errbuf, errlen, "%s: No free RX queue on port %d for an exclusive instance!",
+    					__FUNCTION__, port);
     			return NULL;
-#endif
+    		}
     		// dpdk device already created - add a queue
     		if (debug)
     	        printf("DPDK - device found with port = %i, number of queues %i\n",
@@ -360,8 +601,8 @@ static DpdkDevice *create_rx_device(const char *port_name, uint16_t *rx_queue, c
 			{
 				snprintf(poolname, sizeof(poolname), "MBUF_POOL%d:%d", port, *rx_queue);
 				dpdk_devices[i]->mbuf_pool[*rx_queue] = rte_pktmbuf_pool_create(poolname,
-						NUM_MBUFS / dpdk_devices[i]->max_rx_queues,
-						MBUF_CACHE_SIZE, 0, MBUF_PKT_SIZE, rte_socket_id());
+						dpdk_pool_mbufs(dpdk_devices[i]),
+						MBUF_CACHE_SIZE, 0, MBUF_PKT_SIZE, dpdk_pool_socket_id(port));
 				if (dpdk_devices[i]->mbuf_pool[*rx_queue] == NULL)
 				{
 					snprintf(errbuf, errlen, "%s: Couldn't create mbuf pool!\n", __FUNCTION__);
@@ -407,8 +648,8 @@ static DpdkDevice *create_rx_device(const char *port_name, uint16_t *rx_queue, c
 	device->num_rx_queues = 1;
 
     snprintf(poolname, sizeof(poolname), "MBUF_POOL%d:0", port);
-    device->mbuf_pool[0] = rte_pktmbuf_pool_create(poolname, NUM_MBUFS / device->max_rx_queues,
-                MBUF_CACHE_SIZE, 0, MBUF_PKT_SIZE, rte_socket_id());
+    device->mbuf_pool[0] = rte_pktmbuf_pool_create(poolname, dpdk_pool_mbufs(device),
+                MBUF_CACHE_SIZE, 0, MBUF_PKT_SIZE, dpdk_pool_socket_id(port));
     if (device->mbuf_pool[0] == NULL)
     {
         snprintf(errbuf, errlen, "%s: Couldn't create mbuf pool!\n", __FUNCTION__);
@@ -439,10 +680,9 @@ static int create_bridge(Dpdk_Interface_t *dpdk_intf)
 	/* Add Tx functionality for inline on both devices */
 	for (i = 0; i < LINK_NUM_DEVS; i++)
 	{
-#ifndef USE_RX_TX_LOCKING
-		if (dpdk_intf->link[i].dev->num_tx_queues >= dpdk_intf->link[i].dev->max_tx_queues)
+		if (!QUEUE_SHARING_ALLOWED() &&
+			dpdk_intf->link[i].dev->num_tx_queues >= dpdk_intf->link[i].dev->max_tx_queues)
 			return DAQ_ERROR_NODEV;
-#endif
 		dpdk_intf->link[i].tx_queue = MODULUS(dpdk_intf->link[i].dev->num_tx_queues, dpdk_intf->link[i].dev->max_tx_queues);
 		dpdk_intf->link[i].dev->num_tx_queues++;
 	}
@@ -470,6 +710,10 @@ static int dpdk_close(Dpdk_Interface_t *dpdk_intf)
 	{
 		if (dpdk_intf->link[i].dev)
 		{
+			/* Last reference to the port - dump the NIC extended statistics
+			   before it is stopped, while the counters are still readable. */
+			if (dpdk_intf->debug && dpdk_intf->link[i].dev->ref_cnt == 1)
+				dump_port_xstats(dpdk_intf->link[i].dev->port);
 			destroy_device(&dpdk_intf->link[i].dev);
 		}
 	}
@@ -512,6 +756,9 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
     static char interface_name[1024] = "";
     static uint16_t dev_idx = 0;
     static int debug = 0;
+    static int flow_offload = 0;
+    static int perf_stats = 0;
+    static char ts_source[16] = "";
 	static int first = 1, ports = 0, dpdk_queues = 1;
 	static volatile uint32_t threads_in = 0;
 
@@ -552,6 +799,7 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
 
     dpdk_intf->snaplen = config->snaplen;
     dpdk_intf->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
+    dpdk_intf->cur_burst_size = BURST_SIZE;
     dpdk_intf->promisc_flag = (config->flags & DAQ_CFG_PROMISC);
 
 
@@ -572,6 +820,28 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
 						dpdk_queues = atoi(entry->value);
 						if (dpdk_queues < 1) dpdk_queues = 1;
 					}
+					else
+					{
+						if (!strcmp(entry->key, "flow_offload"))
+							flow_offload = 1;
+						else
+						{
+							if (!strcmp(entry->key, "perf_stats"))
+								perf_stats = 1;
+							else if (!strcmp(entry->key, "timestamp"))
+							{
+								strncpy(ts_source, entry->value, sizeof(ts_source) - 1);
+								ts_source[sizeof(ts_source) - 1] = '\0';
+							}
+#ifdef USE_RX_TX_LOCKING
+							else
+							{
+								if (!strcmp(entry->key, "run_to_completion"))
+									run_to_completion = 1;
+							}
+#endif
+						}
+					}
 				}
 			}
 		}
@@ -600,6 +870,23 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
     dev = dpdk_intf->descr;
 
     dpdk_intf->debug = debug;
+    dpdk_intf->flow_offload = flow_offload;
+    if (daq_ts_source_init(&dpdk_intf->ts_src, ts_source[0] ? ts_source : NULL))
+    {
+        snprintf(errbuf, errlen, "%s: Bad timestamp source '%s'!", __FUNCTION__, ts_source);
+        rval = DAQ_ERROR_INVAL;
+        goto err;
+    }
+    if (perf_stats)
+    {
+        dpdk_intf->perf = calloc(1, sizeof(*dpdk_intf->perf));
+        if (!dpdk_intf->perf)
+        {
+            snprintf(errbuf, errlen, "%s: Couldn't allocate the performance statistics!\n", __FUNCTION__);
+            rval = DAQ_ERROR_NOMEM;
+            goto err;
+        }
+    }
 
 
     while (dev[dev_idx] != '\0')
@@ -707,6 +994,8 @@ err:
         dpdk_close(dpdk_intf);
         if (dpdk_intf->descr)
             free(dpdk_intf->descr);
+        if (dpdk_intf->perf)
+            free(dpdk_intf->perf);
         free(dpdk_intf);
     }
 
@@ -760,6 +1049,18 @@ static int dpdk_daq_start(void *handle)
     return DAQ_SUCCESS;
 }
 
+/* Adapt the RX burst size to the offered load: a completely filled burst
+ * means the ring had more waiting, so double the next request (up to
+ * MAX_BURST_SIZE) to amortize the per-burst overhead; an empty poll halves
+ * it back toward BURST_SIZE so an idle link keeps its latency bounded. */
+static inline void dpdk_adapt_burst_size(Dpdk_Interface_t *dpdk_intf, uint16_t nb_rx)
+{
+    if (nb_rx == dpdk_intf->cur_burst_size && dpdk_intf->cur_burst_size < MAX_BURST_SIZE)
+        dpdk_intf->cur_burst_size <<= 1;
+    else if (nb_rx == 0 && dpdk_intf->cur_burst_size > BURST_SIZE)
+        dpdk_intf->cur_burst_size >>= 1;
+}
+
 static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
     DAQ_VERDICT_PASS,       /* DAQ_VERDICT_PASS */
     DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLOCK */
@@ -784,8 +1085,9 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
     int i, got_one, ignored_one, sent_one;
     int alt;
     struct timeval ts;
-    struct rte_mbuf *tx_burst[BURST_SIZE];
+    struct rte_mbuf *tx_burst[MAX_BURST_SIZE];
     uint32_t tx_num;
+    uint64_t perf_t0 = 0;
 
 #ifdef DEBUG_SHOW_LOCAL_STATISTICS
     if (dpdk_intf->debug) {
@@ -835,7 +1137,7 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
 
     while (c < cnt || cnt <= 0)
     {
-        struct rte_mbuf *bufs[BURST_SIZE];
+        struct rte_mbuf *bufs[MAX_BURST_SIZE];
 
         got_one = 0;
         ignored_one = 0;
@@ -857,23 +1159,28 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
             }
 
             {
-                gettimeofday(&ts, NULL);
+                daq_ts_stamp(&dpdk_intf->ts_src, &ts);
 
-                if (cnt <= 0 || cnt - c >= BURST_SIZE)
-                    burst_size = BURST_SIZE;
+                if (cnt <= 0 || cnt - c >= dpdk_intf->cur_burst_size)
+                    burst_size = dpdk_intf->cur_burst_size;
                 else
                     burst_size = cnt - c;
 
-#ifdef USE_RX_TX_LOCKING
-                pthread_mutex_lock(&rx_mutex[device->port][dev_queue]);
-#endif
+                if (dpdk_intf->perf)
+                    perf_t0 = daq_perf_cycles();
+
+                RX_QUEUE_LOCK(device->port, dev_queue);
+
                 const uint16_t nb_rx =
                     rte_eth_rx_burst(device->port, dev_queue,
                             bufs, burst_size);
 
-#ifdef USE_RX_TX_LOCKING
-                pthread_mutex_unlock(&rx_mutex[device->port][dev_queue]);
-#endif
+                RX_QUEUE_UNLOCK(device->port, dev_queue);
+
+                if (dpdk_intf->perf)
+                    daq_perf_record(dpdk_intf->perf, DAQ_PERF_STAGE_WAIT, daq_perf_cycles() - perf_t0);
+
+                dpdk_adapt_burst_size(dpdk_intf, nb_rx);
 
                 if (unlikely(nb_rx == 0))
                     continue;
@@ -903,8 +1210,6 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
 							data = rte_pktmbuf_mtod(&pkt, void *);
 							len = pkt.data_len;
 
-							dpdk_intf->stats.hw_packets_received++;
-
 							if (dpdk_intf->fcode.bf_insns && sfbpf_filter(dpdk_intf->fcode.bf_insns, data, len, len) == 0)
 							{
 								ignored_one = 1;
@@ -924,6 +1229,7 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
 							daqhdr.opaque = 0;
 							daqhdr.priv_ptr = NULL;
 							daqhdr.address_space_id = 0;
+							daq_tunnel_annotate(&daqhdr, data, len);
 
 							if (callback)
 							{
@@ -931,6 +1237,15 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
 								if (verdict >= MAX_DAQ_VERDICT)
 									verdict = DAQ_VERDICT_PASS;
 								dpdk_intf->stats.verdicts[verdict]++;
+#ifdef HAVE_RTE_FLOW
+								/* Blacklisted flows can always be dropped at the NIC; whitelisted
+								 * ones only when running passively, as the NIC drop would also
+								 * stop the flow from being forwarded to the peer. */
+								if (dpdk_intf->flow_offload &&
+									(verdict == DAQ_VERDICT_BLACKLIST ||
+									 (verdict == DAQ_VERDICT_WHITELIST && !peer)))
+									dpdk_offload_flow(device, data, len);
+#endif
 								verdict = verdict_translation_table[verdict];
 							}
 							dpdk_intf->stats.packets_received++;
@@ -962,13 +1277,21 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
                         data = rte_pktmbuf_mtod(bufs[i], void *);
                         len = rte_pktmbuf_data_len(bufs[i]);
 
-                        dpdk_intf->stats.hw_packets_received++;
-
-                        if (dpdk_intf->fcode.bf_insns && sfbpf_filter(dpdk_intf->fcode.bf_insns, data, len, len) == 0)
+                        if (dpdk_intf->fcode.bf_insns)
                         {
-                            ignored_one = 1;
-                            dpdk_intf->stats.packets_filtered++;
-                            goto send_packet;
+                            int bpf_match;
+
+                            if (dpdk_intf->perf)
+                                perf_t0 = daq_perf_cycles();
+                            bpf_match = sfbpf_filter(dpdk_intf->fcode.bf_insns, data, len, len);
+                            if (dpdk_intf->perf)
+                                daq_perf_record(dpdk_intf->perf, DAQ_PERF_STAGE_FILTER, daq_perf_cycles() - perf_t0);
+                            if (bpf_match == 0)
+                            {
+                                ignored_one = 1;
+                                dpdk_intf->stats.packets_filtered++;
+                                goto send_packet;
+                            }
                         }
                         got_one = 1;
 
@@ -983,13 +1306,27 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
                         daqhdr.opaque = 0;
                         daqhdr.priv_ptr = NULL;
                         daqhdr.address_space_id = 0;
+                        daq_tunnel_annotate(&daqhdr, data, len);
 
                         if (callback)
                         {
+                            if (dpdk_intf->perf)
+                                perf_t0 = daq_perf_cycles();
                             verdict = callback(user, &daqhdr, data);
+                            if (dpdk_intf->perf)
+                                daq_perf_record(dpdk_intf->perf, DAQ_PERF_STAGE_CALLBACK, daq_perf_cycles() - perf_t0);
                             if (verdict >= MAX_DAQ_VERDICT)
                                 verdict = DAQ_VERDICT_PASS;
                             dpdk_intf->stats.verdicts[verdict]++;
+#ifdef HAVE_RTE_FLOW
+                            /* Blacklisted flows can always be dropped at the NIC; whitelisted
+                             * ones only when running passively, as the NIC drop would also
+                             * stop the flow from being forwarded to the peer. */
+                            if (dpdk_intf->flow_offload &&
+                                (verdict == DAQ_VERDICT_BLACKLIST ||
+                                 (verdict == DAQ_VERDICT_WHITELIST && !peer)))
+                                dpdk_offload_flow(device, data, len);
+#endif
                             verdict = verdict_translation_table[verdict];
                         }
                         dpdk_intf->stats.packets_received++;
@@ -1017,9 +1354,11 @@ send_packet:
                 if (unlikely(tx_num == 0))
                     continue;
 
-#ifdef USE_RX_TX_LOCKING
-                pthread_mutex_lock(&tx_mutex[peer->port][peer_queue]);
-#endif
+                if (dpdk_intf->perf)
+                    perf_t0 = daq_perf_cycles();
+
+                TX_QUEUE_LOCK(peer->port, peer_queue);
+
 				do
 				{
                     uint16_t nb_tx;
@@ -1027,9 +1366,10 @@ send_packet:
                     nbidx += nb_tx;
 				} while (nbidx < tx_num && ++cnt < 100);
 
-#ifdef USE_RX_TX_LOCKING
-                pthread_mutex_unlock(&tx_mutex[peer->port][peer_queue]);
-#endif
+                TX_QUEUE_UNLOCK(peer->port, peer_queue);
+
+                if (dpdk_intf->perf)
+                    daq_perf_record(dpdk_intf->perf, DAQ_PERF_STAGE_VERDICT, daq_perf_cycles() - perf_t0);
 
 #ifdef DEBUG_SHOW_LOCAL_STATISTICS
                 if (dpdk_intf->debug)
@@ -1064,7 +1404,214 @@ send_packet:
         }
         else
         {
-            gettimeofday(&ts, NULL);
+            daq_ts_stamp(&dpdk_intf->ts_src, &ts);
+        }
+    }
+
+    return 0;
+}
+
+static int dpdk_daq_acquire_batch(void *handle, int cnt, DAQ_Analysis_Batch_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    Dpdk_Interface_t *dpdk_intf = (Dpdk_Interface_t *) handle;
+    DpdkLink *link = (DpdkLink *)&dpdk_intf->link;
+    DpdkDevice *device, *peer;
+    DAQ_PktHdr_t daqhdrs[MAX_BURST_SIZE];
+    const DAQ_PktHdr_t *hdrs[MAX_BURST_SIZE];
+    const uint8_t *pktdata[MAX_BURST_SIZE];
+    DAQ_Verdict verdicts[MAX_BURST_SIZE];
+    struct rte_mbuf *batch_bufs[MAX_BURST_SIZE];
+    DAQ_PktHdr_t *daqhdr;
+    DAQ_Verdict verdict;
+    const uint8_t *data;
+    uint16_t len, dev_queue = 0, peer_queue = 0;
+    int c = 0, burst_size;
+    int i, got_one, ignored_one, sent_one;
+    int alt;
+    struct timeval ts;
+    struct rte_mbuf *tx_burst[MAX_BURST_SIZE];
+    uint32_t tx_num, batched;
+
+    while (c < cnt || cnt <= 0)
+    {
+        struct rte_mbuf *bufs[MAX_BURST_SIZE];
+
+        got_one = 0;
+        ignored_one = 0;
+        sent_one = 0;
+
+        for (alt = 0; alt < LINK_NUM_DEVS; alt++)
+        {
+            if (link[alt].dev == NULL) continue;
+            device = link[alt].dev;
+            dev_queue = link[alt].rx_queue;
+            peer = link[alt^1].dev;
+            peer_queue = link[alt^1].tx_queue;
+            tx_num = 0;
+            /* Has breakloop() been called? */
+            if (dpdk_intf->break_loop)
+            {
+                dpdk_intf->break_loop = 0;
+                return 0;
+            }
+
+            daq_ts_stamp(&dpdk_intf->ts_src, &ts);
+
+            if (cnt <= 0 || cnt - c >= dpdk_intf->cur_burst_size)
+                burst_size = dpdk_intf->cur_burst_size;
+            else
+                burst_size = cnt - c;
+
+            RX_QUEUE_LOCK(device->port, dev_queue);
+
+            const uint16_t nb_rx =
+                rte_eth_rx_burst(device->port, dev_queue,
+                        bufs, burst_size);
+
+            RX_QUEUE_UNLOCK(device->port, dev_queue);
+
+            dpdk_adapt_burst_size(dpdk_intf, nb_rx);
+
+            if (unlikely(nb_rx == 0))
+                continue;
+
+#ifdef DEBUG_SHOW_LOCAL_STATISTICS
+            if (dpdk_intf->debug)
+            {
+                device->rx_pkts[dev_queue] += nb_rx;
+                link[alt].rx_pkts += nb_rx;
+            }
+#endif
+
+            /* Packets already arrive in bursts here, so just convert the burst into
+                parallel header/data arrays and hand it to the callback in one call. */
+            batched = 0;
+            for (i = 0; i < nb_rx; i++)
+            {
+                data = rte_pktmbuf_mtod(bufs[i], void *);
+                len = rte_pktmbuf_data_len(bufs[i]);
+
+                if (dpdk_intf->fcode.bf_insns && sfbpf_filter(dpdk_intf->fcode.bf_insns, data, len, len) == 0)
+                {
+                    ignored_one = 1;
+                    dpdk_intf->stats.packets_filtered++;
+                    if (peer)
+                    {
+                        tx_burst[tx_num] = bufs[i];
+                        tx_num++;
+                    }
+                    else
+                    {
+                        rte_pktmbuf_free(bufs[i]);
+                    }
+                    continue;
+                }
+                got_one = 1;
+
+                daqhdr = &daqhdrs[batched];
+                daqhdr->ts = ts;
+                daqhdr->caplen = len;
+                daqhdr->pktlen = len;
+                daqhdr->ingress_index = device->index;
+                daqhdr->egress_index = peer ? peer->index : DAQ_PKTHDR_UNKNOWN;
+                daqhdr->ingress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr->egress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr->flags = 0;
+                daqhdr->opaque = 0;
+                daqhdr->priv_ptr = NULL;
+                daqhdr->address_space_id = 0;
+                daq_tunnel_annotate(daqhdr, data, len);
+
+                hdrs[batched] = daqhdr;
+                pktdata[batched] = data;
+                verdicts[batched] = DAQ_VERDICT_PASS;
+                batch_bufs[batched] = bufs[i];
+                batched++;
+            }
+
+            if (batched)
+            {
+                if (callback)
+                    callback(user, hdrs, pktdata, batched, verdicts);
+
+                for (i = 0; i < (int) batched; i++)
+                {
+                    verdict = verdicts[i];
+                    if (verdict >= MAX_DAQ_VERDICT)
+                        verdict = DAQ_VERDICT_PASS;
+                    dpdk_intf->stats.verdicts[verdict]++;
+                    dpdk_intf->stats.packets_received++;
+#ifdef HAVE_RTE_FLOW
+                    if (dpdk_intf->flow_offload &&
+                        (verdict == DAQ_VERDICT_BLACKLIST ||
+                         (verdict == DAQ_VERDICT_WHITELIST && !peer)))
+                        dpdk_offload_flow(device, pktdata[i], hdrs[i]->caplen);
+#endif
+                    verdict = verdict_translation_table[verdict];
+                    if (verdict == DAQ_VERDICT_PASS && peer)
+                    {
+                        tx_burst[tx_num] = batch_bufs[i];
+                        tx_num++;
+                    }
+                    else
+                    {
+                        rte_pktmbuf_free(batch_bufs[i]);
+                    }
+                }
+                c += batched;
+            }
+
+            if (peer)
+            {
+                uint32_t nbidx = 0, n, loops = 0;
+                if (unlikely(tx_num == 0))
+                    continue;
+
+                TX_QUEUE_LOCK(peer->port, peer_queue);
+
+                do
+                {
+                    uint16_t nb_tx;
+                    nb_tx = rte_eth_tx_burst(peer->port, peer_queue, &tx_burst[nbidx], tx_num - nbidx);
+                    nbidx += nb_tx;
+                } while (nbidx < tx_num && ++loops < 100);
+
+                TX_QUEUE_UNLOCK(peer->port, peer_queue);
+
+#ifdef DEBUG_SHOW_LOCAL_STATISTICS
+                if (dpdk_intf->debug)
+                {
+                    peer->tx_pkts[peer_queue] += nbidx;
+                    link[alt^1].tx_pkts += nbidx;
+                }
+#endif
+                if (unlikely(nbidx < tx_num))
+                {
+                    for (n = nbidx; n < tx_num; n++)
+                    {
+                        rte_pktmbuf_free(tx_burst[n]);
+                    }
+                }
+                sent_one = 1;
+            }
+        }
+
+        if ((!got_one && !ignored_one && !sent_one))
+        {
+            struct timeval now;
+
+            if (dpdk_intf->timeout == -1)
+                continue;
+
+            /* If time out, return control to the caller. */
+            gettimeofday(&now, NULL);
+            if (now.tv_sec > ts.tv_sec ||
+                    (now.tv_usec - ts.tv_usec) > dpdk_intf->timeout * 1000)
+                return 0;
+        }
+        else
+        {
+            daq_ts_stamp(&dpdk_intf->ts_src, &ts);
         }
     }
 
@@ -1122,15 +1669,11 @@ static int dpdk_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t
     rte_memcpy(rte_pktmbuf_mtod(m, void *), packet_data, len);
     rte_pktmbuf_data_len(m) = len;
 
-#ifdef USE_RX_TX_LOCKING
-    pthread_mutex_lock(&tx_mutex[device->port][tx_queue]);
-#endif
+    TX_QUEUE_LOCK(device->port, tx_queue);
 
     const uint16_t nb_tx = rte_eth_tx_burst(device->port, tx_queue, &m, 1);
 
-#ifdef USE_RX_TX_LOCKING
-    pthread_mutex_unlock(&tx_mutex[device->port][tx_queue]);
-#endif
+    TX_QUEUE_UNLOCK(device->port, tx_queue);
 
     if (unlikely(nb_tx == 0))
     {
@@ -1173,6 +1716,8 @@ static void dpdk_daq_shutdown(void *handle)
         free(dpdk_intf->descr);
     if (dpdk_intf->filter)
         free(dpdk_intf->filter);
+    if (dpdk_intf->perf)
+        free(dpdk_intf->perf);
     free(dpdk_intf);
     RELEASE_LOCK(&port_lock[MAX_PORTS]);
 }
@@ -1187,8 +1732,42 @@ static DAQ_State dpdk_daq_check_status(void *handle)
 static int dpdk_daq_get_stats(void *handle, DAQ_Stats_t *stats)
 {
     Dpdk_Interface_t *dpdk_intf = (Dpdk_Interface_t *) handle;
+    struct rte_eth_stats eth_stats;
+    DpdkDevice *device;
+    int i;
+
+    daq_stats_snapshot(&dpdk_intf->stats, stats);
 
-    rte_memcpy(stats, &dpdk_intf->stats, sizeof(DAQ_Stats_t));
+    /* Fold in the NIC-level counters so that drops in the hardware (missed
+     * frames, receive errors, mbuf allocation failures) are distinguishable
+     * from software-side drops.  Port statistics are shared between all of
+     * the instances polling the port's queues, so only the instance on RX
+     * queue 0 reports them to keep aggregated totals from multiply counting
+     * the hardware.  See dpdk_daq_reset_stats() for the baseline. */
+    for (i = 0; i < LINK_NUM_DEVS; i++)
+    {
+        device = dpdk_intf->link[i].dev;
+        if (!device || dpdk_intf->link[i].rx_queue != 0)
+            continue;
+        memset(&eth_stats, 0, sizeof(eth_stats));
+        rte_eth_stats_get(device->port, &eth_stats);
+        stats->hw_packets_received += eth_stats.ipackets - device->hw_base.ipackets;
+        stats->hw_packets_dropped += (eth_stats.imissed - device->hw_base.imissed) +
+                                     (eth_stats.ierrors - device->hw_base.ierrors) +
+                                     (eth_stats.rx_nombuf - device->hw_base.rx_nombuf);
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static int dpdk_daq_get_perf_stats(void *handle, DAQ_PerfStats_t *perf_stats)
+{
+    Dpdk_Interface_t *dpdk_intf = (Dpdk_Interface_t *) handle;
+
+    if (!dpdk_intf->perf)
+        return DAQ_ERROR_NOTSUP;
+
+    rte_memcpy(perf_stats, dpdk_intf->perf, sizeof(*perf_stats));
 
     return DAQ_SUCCESS;
 }
@@ -1196,8 +1775,17 @@ static int dpdk_daq_get_stats(void *handle, DAQ_Stats_t *stats)
 static void dpdk_daq_reset_stats(void *handle)
 {
     Dpdk_Interface_t *dpdk_intf = (Dpdk_Interface_t *) handle;
+    int i;
 
     memset(&dpdk_intf->stats, 0, sizeof(DAQ_Stats_t));
+
+    /* Rebaseline the NIC-level counters for the ports this instance reports
+     * on (see dpdk_daq_get_stats() for the RX queue 0 scoping). */
+    for (i = 0; i < LINK_NUM_DEVS; i++)
+    {
+        if (dpdk_intf->link[i].dev && dpdk_intf->link[i].rx_queue == 0)
+            rte_eth_stats_get(dpdk_intf->link[i].dev->port, &dpdk_intf->link[i].dev->hw_base);
+    }
 }
 
 static int dpdk_daq_get_snaplen(void *handle)
@@ -1211,7 +1799,8 @@ static uint32_t dpdk_daq_get_capabilities(void *handle)
 {
     return DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT |
         DAQ_CAPA_UNPRIV_START | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF |
-        DAQ_CAPA_DEVICE_INDEX;
+        DAQ_CAPA_DEVICE_INDEX | DAQ_CAPA_DECODE_GTP |
+        DAQ_CAPA_DECODE_GRE | DAQ_CAPA_DECODE_TEREDO;
 }
 
 static int dpdk_daq_get_datalink_type(void *handle)
@@ -1284,5 +1873,9 @@ const DAQ_Module_t dpdk_daq_module_data =
     /* .hup_apply = */ NULL,
     /* .hup_post = */ NULL,
     /* .dp_add_dc = */ NULL,
-	/* .query_flow = */ NULL
+	/* .query_flow = */ NULL,
+    /* .acquire_batch = */ dpdk_daq_acquire_batch,
+    /* .acquire_deferred = */ NULL,
+    /* .set_verdict = */ NULL,
+    /* .get_perf_stats = */ dpdk_daq_get_perf_stats
 };
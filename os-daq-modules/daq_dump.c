@@ -24,8 +24,14 @@
 
 #include <arpa/inet.h>
 #include <pcap.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
 #include <sys/socket.h>
@@ -43,6 +49,39 @@
 #define DAQ_DUMP_PCAP_FILE "inline-out.pcap"
 #define DAQ_DUMP_TEXT_FILE "inline-out.txt"
 
+// Asynchronous pcap writer: the capture path copies records into one of a
+// pair of swap blocks and a dedicated writer thread does the actual file
+// I/O, so page cache flushes no longer stall packet acquisition.
+#define DAQ_DUMP_BLOCK_SIZE (1 << 20)
+#define DUMP_RECORD_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+typedef struct {
+    uint8_t* data;
+    size_t used;
+} DumpBlock;
+
+// On-disk pcap structures for the self-managed writer used when rotation
+// and/or zstd compression is configured (pcap_dump() can't do either).
+typedef struct {
+    uint32_t magic_number;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} DumpPcapFileHdr;
+
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} DumpPcapRecHdr;
+
+#define DAQ_DUMP_PCAP_MAGIC 0xa1b2c3d4
+#define DAQ_DUMP_ZSTD_LEVEL 3
+
 typedef enum {
     DUMP_OUTPUT_NONE = 0x0,
     DUMP_OUTPUT_PCAP = 0x1,
@@ -59,6 +98,36 @@ typedef struct {
     pcap_dumper_t* dump;
     char* pcap_filename;
 
+    // or through the rotating (and optionally zstd-compressed) writer
+    uint64_t rotate_size;   // uncompressed bytes per file, 0 = no size rotation
+    unsigned rotate_secs;   // seconds per file, 0 = no time rotation
+    int compress;           // write a zstd-framed pcap stream
+    int compress_level;
+    FILE* out_file;
+    uint64_t out_bytes;     // uncompressed bytes in the current file
+    time_t out_opened;
+    unsigned out_seq;
+    int linktype;
+    int snaplen;
+#ifdef HAVE_LIBZSTD
+    ZSTD_CStream* zstream;
+    void* zbuf;
+    size_t zbuf_size;
+#endif
+
+    // optionally from a writer thread fed by a pair of swap blocks
+    int async;
+    size_t block_size;
+    DumpBlock blocks[2];
+    int active;             // block the capture path is filling
+    int pending;            // block waiting on the writer thread, or -1
+    int writer_exit;
+    int writer_running;
+    pthread_t writer_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t block_full;
+    pthread_cond_t block_empty;
+
     // and write other textual output here
     FILE *text_out;
     char* text_filename;
@@ -94,6 +163,47 @@ static int daq_dump_get_vars (
         {
             impl->text_filename = strdup(entry->value);
         }
+        else if ( !strcmp(entry->key, "async") )
+        {
+            impl->async = strtol(entry->value, NULL, 10) != 0;
+        }
+        else if ( !strcmp(entry->key, "async-block-size") )
+        {
+            impl->block_size = strtoul(entry->value, NULL, 10);
+        }
+        else if ( !strcmp(entry->key, "rotate-size") )
+        {
+            // megabytes of (uncompressed) packet data per output file
+            impl->rotate_size = strtoull(entry->value, NULL, 10) * 1024 * 1024;
+        }
+        else if ( !strcmp(entry->key, "rotate-time") )
+        {
+            // seconds per output file
+            impl->rotate_secs = strtoul(entry->value, NULL, 10);
+        }
+        else if ( !strcmp(entry->key, "compression") )
+        {
+            if ( !strcmp(entry->value, "none") )
+                impl->compress = 0;
+            else if ( !strcmp(entry->value, "zstd") )
+            {
+#ifdef HAVE_LIBZSTD
+                impl->compress = 1;
+#else
+                snprintf(errBuf, errMax, "zstd compression requested but not built in");
+                return 0;
+#endif
+            }
+            else
+            {
+                snprintf(errBuf, errMax, "invalid compression type (%s)", entry->value);
+                return 0;
+            }
+        }
+        else if ( !strcmp(entry->key, "compression-level") )
+        {
+            impl->compress_level = strtol(entry->value, NULL, 10);
+        }
         else if ( !strcmp(entry->key, "output") )
         {
             if ( !strcmp(entry->value, "none") )
@@ -202,6 +312,341 @@ static void dump_daq_shutdown (void* handle)
     free(impl);
 }
 
+//-------------------------------------------------------------------------
+// rotating / compressed output writer
+// used in place of pcap_dump() whenever rotation or compression is
+// configured; compression always runs here on the writer side of the
+// swap blocks, never on the capture path
+
+static int dump_out_write (DumpImpl* impl, const void* buf, size_t len)
+{
+#ifdef HAVE_LIBZSTD
+    if ( impl->compress )
+    {
+        ZSTD_inBuffer in = { buf, len, 0 };
+
+        while ( in.pos < in.size )
+        {
+            ZSTD_outBuffer out = { impl->zbuf, impl->zbuf_size, 0 };
+
+            if ( ZSTD_isError(ZSTD_compressStream2(impl->zstream, &out, &in, ZSTD_e_continue)) )
+                return -1;
+            if ( out.pos && fwrite(impl->zbuf, 1, out.pos, impl->out_file) != out.pos )
+                return -1;
+        }
+        impl->out_bytes += len;
+        return 0;
+    }
+#endif
+    if ( fwrite(buf, 1, len, impl->out_file) != len )
+        return -1;
+    impl->out_bytes += len;
+    return 0;
+}
+
+static int dump_out_open (DumpImpl* impl)
+{
+    const char* base = impl->pcap_filename ? impl->pcap_filename : DAQ_DUMP_PCAP_FILE;
+    char name[4096];
+    DumpPcapFileHdr fh;
+
+    if ( impl->rotate_size || impl->rotate_secs )
+        snprintf(name, sizeof(name), "%s.%u%s", base, impl->out_seq,
+            impl->compress ? ".zst" : "");
+    else
+        snprintf(name, sizeof(name), "%s%s", base, impl->compress ? ".zst" : "");
+
+    impl->out_file = fopen(name, "wb");
+    if ( !impl->out_file )
+        return -1;
+
+#ifdef HAVE_LIBZSTD
+    if ( impl->compress )
+    {
+        // one zstd frame per file so each rotation is independently readable
+        ZSTD_CCtx_reset(impl->zstream, ZSTD_reset_session_only);
+        ZSTD_CCtx_setParameter(impl->zstream, ZSTD_c_compressionLevel, impl->compress_level);
+    }
+#endif
+
+    fh.magic_number = DAQ_DUMP_PCAP_MAGIC;
+    fh.version_major = 2;
+    fh.version_minor = 4;
+    fh.thiszone = 0;
+    fh.sigfigs = 0;
+    fh.snaplen = impl->snaplen;
+    fh.network = impl->linktype;
+
+    impl->out_bytes = 0;
+    impl->out_opened = time(NULL);
+
+    if ( dump_out_write(impl, &fh, sizeof(fh)) )
+    {
+        fclose(impl->out_file);
+        impl->out_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void dump_out_close (DumpImpl* impl)
+{
+    if ( !impl->out_file )
+        return;
+
+#ifdef HAVE_LIBZSTD
+    if ( impl->compress )
+    {
+        ZSTD_inBuffer in = { NULL, 0, 0 };
+        size_t left;
+
+        do
+        {
+            ZSTD_outBuffer out = { impl->zbuf, impl->zbuf_size, 0 };
+
+            left = ZSTD_compressStream2(impl->zstream, &out, &in, ZSTD_e_end);
+            if ( ZSTD_isError(left) )
+                break;
+            if ( out.pos )
+                fwrite(impl->zbuf, 1, out.pos, impl->out_file);
+        } while ( left );
+    }
+#endif
+    fclose(impl->out_file);
+    impl->out_file = NULL;
+}
+
+static int dump_out_record (DumpImpl* impl, const struct pcap_pkthdr* pkth, const uint8_t* pkt)
+{
+    DumpPcapRecHdr rh;
+
+    if ( (impl->rotate_size && impl->out_bytes >= impl->rotate_size) ||
+         (impl->rotate_secs && time(NULL) - impl->out_opened >= (time_t)impl->rotate_secs) )
+    {
+        dump_out_close(impl);
+        impl->out_seq++;
+        if ( dump_out_open(impl) )
+            return -1;
+    }
+
+    rh.ts_sec = pkth->ts.tv_sec;
+    rh.ts_usec = pkth->ts.tv_usec;
+    rh.incl_len = pkth->caplen;
+    rh.orig_len = pkth->len;
+
+    if ( dump_out_write(impl, &rh, sizeof(rh)) )
+        return -1;
+    return dump_out_write(impl, pkt, pkth->caplen);
+}
+
+static void dump_emit_record (DumpImpl* impl, const struct pcap_pkthdr* pkth, const uint8_t* pkt)
+{
+    if ( impl->out_file )
+        dump_out_record(impl, pkth, pkt);
+    else
+        pcap_dump((u_char*)impl->dump, pkth, pkt);
+}
+
+static void dump_out_stop (DumpImpl* impl)
+{
+    dump_out_close(impl);
+#ifdef HAVE_LIBZSTD
+    if ( impl->zstream )
+    {
+        ZSTD_freeCStream(impl->zstream);
+        impl->zstream = NULL;
+    }
+    if ( impl->zbuf )
+    {
+        free(impl->zbuf);
+        impl->zbuf = NULL;
+    }
+#endif
+}
+
+static int dump_out_start (DumpImpl* impl)
+{
+#ifdef HAVE_LIBZSTD
+    if ( impl->compress )
+    {
+        if ( impl->compress_level <= 0 )
+            impl->compress_level = DAQ_DUMP_ZSTD_LEVEL;
+        impl->zbuf_size = ZSTD_CStreamOutSize();
+        impl->zbuf = malloc(impl->zbuf_size);
+        impl->zstream = ZSTD_createCStream();
+        if ( !impl->zbuf || !impl->zstream )
+        {
+            dump_out_stop(impl);
+            return DAQ_ERROR_NOMEM;
+        }
+    }
+#endif
+    impl->out_seq = 0;
+    if ( dump_out_open(impl) )
+    {
+        dump_out_stop(impl);
+        return DAQ_ERROR;
+    }
+    return DAQ_SUCCESS;
+}
+
+//-------------------------------------------------------------------------
+// asynchronous writer thread
+
+static void dump_write_block (DumpImpl* impl, DumpBlock* block)
+{
+    size_t offset = 0;
+
+    while ( offset < block->used )
+    {
+        struct pcap_pkthdr* pkth = (struct pcap_pkthdr*)(block->data + offset);
+        dump_emit_record(impl, pkth, block->data + offset + sizeof(*pkth));
+        offset += DUMP_RECORD_ALIGN(sizeof(*pkth) + pkth->caplen);
+    }
+    block->used = 0;
+    // push each block out of stdio in one batch so writeback happens in
+    // block-sized chunks instead of trickling out record by record
+    if ( impl->out_file )
+        fflush(impl->out_file);
+    else
+        pcap_dump_flush(impl->dump);
+}
+
+static void* dump_writer_thread (void* arg)
+{
+    DumpImpl* impl = (DumpImpl*)arg;
+    DumpBlock* block;
+
+    pthread_mutex_lock(&impl->mutex);
+    while ( 1 )
+    {
+        while ( impl->pending < 0 && !impl->writer_exit )
+            pthread_cond_wait(&impl->block_full, &impl->mutex);
+        if ( impl->pending < 0 )
+            break;
+        block = &impl->blocks[impl->pending];
+        pthread_mutex_unlock(&impl->mutex);
+        dump_write_block(impl, block);
+        pthread_mutex_lock(&impl->mutex);
+        impl->pending = -1;
+        pthread_cond_signal(&impl->block_empty);
+    }
+    pthread_mutex_unlock(&impl->mutex);
+    return NULL;
+}
+
+static void dump_queue_packet (
+    DumpImpl* impl, const struct pcap_pkthdr* pkth, const uint8_t* pkt)
+{
+    size_t needed = DUMP_RECORD_ALIGN(sizeof(*pkth) + pkth->caplen);
+    DumpBlock* block;
+
+    pthread_mutex_lock(&impl->mutex);
+    block = &impl->blocks[impl->active];
+    if ( block->used + needed > impl->block_size )
+    {
+        // hand the full block to the writer, waiting out the (rare) case
+        // where it is still busy with the other one
+        while ( impl->pending >= 0 )
+            pthread_cond_wait(&impl->block_empty, &impl->mutex);
+        impl->pending = impl->active;
+        impl->active = !impl->active;
+        pthread_cond_signal(&impl->block_full);
+        block = &impl->blocks[impl->active];
+    }
+    memcpy(block->data + block->used, pkth, sizeof(*pkth));
+    memcpy(block->data + block->used + sizeof(*pkth), pkt, pkth->caplen);
+    block->used += needed;
+    pthread_mutex_unlock(&impl->mutex);
+}
+
+static void dump_write_packet (
+    DumpImpl* impl, const struct pcap_pkthdr* pkth, const uint8_t* pkt)
+{
+    if ( impl->writer_running )
+        dump_queue_packet(impl, pkth, pkt);
+    else
+        dump_emit_record(impl, pkth, pkt);
+}
+
+static int dump_start_writer (DumpImpl* impl, int snaplen)
+{
+    size_t max_record = DUMP_RECORD_ALIGN(sizeof(struct pcap_pkthdr) + snaplen);
+    int i;
+
+    if ( !impl->block_size )
+        impl->block_size = DAQ_DUMP_BLOCK_SIZE;
+    // make sure a full-sized record always fits in an empty block
+    if ( impl->block_size < max_record )
+        impl->block_size = max_record;
+
+    for ( i = 0; i < 2; i++ )
+    {
+        impl->blocks[i].data = malloc(impl->block_size);
+        impl->blocks[i].used = 0;
+        if ( !impl->blocks[i].data )
+        {
+            while ( i-- )
+            {
+                free(impl->blocks[i].data);
+                impl->blocks[i].data = NULL;
+            }
+            return DAQ_ERROR_NOMEM;
+        }
+    }
+    impl->active = 0;
+    impl->pending = -1;
+    impl->writer_exit = 0;
+    pthread_mutex_init(&impl->mutex, NULL);
+    pthread_cond_init(&impl->block_full, NULL);
+    pthread_cond_init(&impl->block_empty, NULL);
+
+    if ( pthread_create(&impl->writer_thread, NULL, dump_writer_thread, impl) )
+    {
+        pthread_mutex_destroy(&impl->mutex);
+        pthread_cond_destroy(&impl->block_full);
+        pthread_cond_destroy(&impl->block_empty);
+        for ( i = 0; i < 2; i++ )
+        {
+            free(impl->blocks[i].data);
+            impl->blocks[i].data = NULL;
+        }
+        return DAQ_ERROR;
+    }
+    impl->writer_running = 1;
+
+    return DAQ_SUCCESS;
+}
+
+static void dump_stop_writer (DumpImpl* impl)
+{
+    int i;
+
+    if ( !impl->writer_running )
+        return;
+
+    pthread_mutex_lock(&impl->mutex);
+    while ( impl->pending >= 0 )
+        pthread_cond_wait(&impl->block_empty, &impl->mutex);
+    impl->writer_exit = 1;
+    pthread_cond_signal(&impl->block_full);
+    pthread_mutex_unlock(&impl->mutex);
+    pthread_join(impl->writer_thread, NULL);
+
+    // flush whatever is left in the block the capture path was filling
+    dump_write_block(impl, &impl->blocks[impl->active]);
+
+    pthread_mutex_destroy(&impl->mutex);
+    pthread_cond_destroy(&impl->block_full);
+    pthread_cond_destroy(&impl->block_empty);
+    for ( i = 0; i < 2; i++ )
+    {
+        free(impl->blocks[i].data);
+        impl->blocks[i].data = NULL;
+    }
+    impl->writer_running = 0;
+}
+
 //-------------------------------------------------------------------------
 // packet processing functions:
 // forward all but blocks, retries and blacklists:
@@ -229,8 +674,8 @@ static DAQ_Verdict daq_dump_capture (
 
     impl->stats.verdicts[verdict]++;
 
-    if ( impl->dump && s_fwd[verdict] )
-        pcap_dump((u_char*)impl->dump, (struct pcap_pkthdr*)hdr, pkt);
+    if ( (impl->dump || impl->out_file) && s_fwd[verdict] )
+        dump_write_packet(impl, (struct pcap_pkthdr*)hdr, pkt);
 
     if (impl->text_out)
     {
@@ -266,14 +711,14 @@ static int dump_daq_inject (
         fprintf(impl->text_out, "\n");
     }
 
-    if (impl->dump)
+    if (impl->dump || impl->out_file)
     {
         // copy the original header to get the same
         // timestamps but overwrite the lengths
         DAQ_PktHdr_t h = *hdr;
         h.pktlen = h.caplen = len;
-        pcap_dump((u_char*)impl->dump, (struct pcap_pkthdr*)&h, data);
-        if ( ferror(pcap_dump_file(impl->dump)) )
+        dump_write_packet(impl, (struct pcap_pkthdr*)&h, data);
+        if ( !impl->writer_running && impl->dump && ferror(pcap_dump_file(impl->dump)) )
         {
             impl->module->set_errbuf(impl->handle, "inject can't write to dump file");
             return DAQ_ERROR;
@@ -302,18 +747,45 @@ static int dump_daq_start (void* handle)
 
     if ( impl->output_type & DUMP_OUTPUT_PCAP )
     {
-        const char* pcap_filename = impl->pcap_filename ? impl->pcap_filename : DAQ_DUMP_PCAP_FILE;
-        pcap_t* pcap;
+        if ( impl->rotate_size || impl->rotate_secs || impl->compress )
+        {
+            impl->linktype = dlt;
+            impl->snaplen = snap;
+            if ( dump_out_start(impl) != DAQ_SUCCESS )
+            {
+                impl->module->stop(impl->handle);
+                impl->module->set_errbuf(impl->handle, "can't open rotating dump output");
+                return DAQ_ERROR;
+            }
+        }
+        else
+        {
+            const char* pcap_filename = impl->pcap_filename ? impl->pcap_filename : DAQ_DUMP_PCAP_FILE;
+            pcap_t* pcap;
+
+            pcap = pcap_open_dead(dlt, snap);
+            impl->dump = pcap ? pcap_dump_open(pcap, pcap_filename) : NULL;
+            if ( !impl->dump )
+            {
+                impl->module->stop(impl->handle);
+                impl->module->set_errbuf(impl->handle, "can't open dump file");
+                return DAQ_ERROR;
+            }
+            pcap_close(pcap);
+        }
 
-        pcap = pcap_open_dead(dlt, snap);
-        impl->dump = pcap ? pcap_dump_open(pcap, pcap_filename) : NULL;
-        if ( !impl->dump )
+        if ( impl->async && dump_start_writer(impl, snap) != DAQ_SUCCESS )
         {
+            if ( impl->dump )
+            {
+                pcap_dump_close(impl->dump);
+                impl->dump = NULL;
+            }
+            dump_out_stop(impl);
             impl->module->stop(impl->handle);
-            impl->module->set_errbuf(impl->handle, "can't open dump file");
+            impl->module->set_errbuf(impl->handle, "can't start dump writer thread");
             return DAQ_ERROR;
         }
-        pcap_close(pcap);
     }
 
     if ( impl->output_type & DUMP_OUTPUT_TEXT )
@@ -340,10 +812,15 @@ static int dump_daq_stop (void* handle)
     if ( err )
         return err;
 
-    if ( impl->dump )
+    if ( impl->dump || impl->out_file )
     {
-        pcap_dump_close(impl->dump);
-        impl->dump = NULL;
+        dump_stop_writer(impl);
+        if ( impl->dump )
+        {
+            pcap_dump_close(impl->dump);
+            impl->dump = NULL;
+        }
+        dump_out_stop(impl);
     }
 
     if ( impl->text_out )
@@ -20,6 +20,7 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -34,13 +35,17 @@
 #include <netinet/ip.h>
 
 #include "daq_api.h"
+#include "daq_timestamp.h"
 #include "sfbpf.h"
 
 #ifndef IPPROTO_DIVERT
 #define IPPROTO_DIVERT 254
 #endif
 
-#define DAQ_MOD_VERSION 3
+#define DAQ_MOD_VERSION 5
+
+// packets drained from the divert socket per select() wakeup
+#define IPFW_BATCH_SIZE 16
 
 #define DAQ_NAME "ipfw"
 #define DAQ_TYPE (DAQ_TYPE_INTF_CAPABLE | DAQ_TYPE_INLINE_CAPABLE | \
@@ -56,13 +61,19 @@ typedef struct {
     unsigned timeout;
     unsigned snaplen;
 
-    uint8_t* buf;
+    uint8_t* buf;               // arena of IPFW_BATCH_SIZE snaplen-sized slots
     char* filter;
     char error[DAQ_ERRBUF_SIZE];
 
     struct sfbpf_program fcode;
     struct sockaddr_in sin;
 
+    DAQ_TsSource_t ts_src;
+
+    // per-slot reinjection points and lengths for the receive batch
+    struct sockaddr_in psin[IPFW_BATCH_SIZE];
+    ssize_t plen[IPFW_BATCH_SIZE];
+
     DAQ_State state;
     DAQ_Stats_t stats;
 } IpfwImpl;
@@ -103,6 +114,15 @@ static int ipfw_daq_get_setup (
                 return DAQ_ERROR;
             }
         }
+        else if ( !strcmp(entry->key, "timestamp") )
+        {
+            if ( daq_ts_source_init(&impl->ts_src, entry->value) )
+            {
+                snprintf(errBuf, errMax, "%s: bad timestamp source (%s)\n",
+                    __func__, entry->value);
+                return DAQ_ERROR;
+            }
+        }
         else
         {
             snprintf(errBuf, errMax,
@@ -143,7 +163,7 @@ static int ipfw_daq_initialize (
         ipfw_daq_shutdown(impl);
         return DAQ_ERROR;
     }
-    impl->buf = malloc(impl->snaplen);
+    impl->buf = malloc((size_t)impl->snaplen * IPFW_BATCH_SIZE);
 
     if ( !impl->buf )
     {
@@ -219,6 +239,14 @@ static int ipfw_daq_start (void* handle)
         return DAQ_ERROR;
     }
 
+    // non-blocking so the acquire loop can drain until EWOULDBLOCK
+    if ( fcntl(impl->sock, F_SETFL, O_NONBLOCK) == -1 )
+    {
+        DPE(impl->error, "%s: can't set divert socket non-blocking (%s)\n",
+            __func__, strerror(errno));
+        return DAQ_ERROR;
+    }
+
     impl->state = DAQ_STATE_STARTED;
     return DAQ_SUCCESS;
 }
@@ -235,12 +263,12 @@ static int ipfw_daq_stop (void* handle)
 //-------------------------------------------------------------------------
 
 static int ipfw_daq_forward (
-    IpfwImpl* impl, const DAQ_PktHdr_t* hdr, const uint8_t* buf, uint32_t len,
-    int reverse)
+    IpfwImpl* impl, const struct sockaddr_in* sin, const uint8_t* buf,
+    uint32_t len)
 {
     int status = sendto(
         impl->sock, buf, len, 0,
-        (struct sockaddr*)&impl->sin, sizeof(impl->sin));
+        (struct sockaddr*)sin, sizeof(*sin));
 
     if ( status == -1 )
     {
@@ -256,7 +284,7 @@ static int ipfw_daq_inject (
     int reverse)
 {
     IpfwImpl* impl = (IpfwImpl*)handle;
-    int status = ipfw_daq_forward(impl, hdr, buf, len, 0);
+    int status = ipfw_daq_forward(impl, &impl->sin, buf, len);
 
     if ( status == DAQ_SUCCESS )
         impl->stats.packets_injected++;
@@ -264,13 +292,9 @@ static int ipfw_daq_inject (
     return status;
 }
 
-static void SetPktHdr(DAQ_PktHdr_t* phdr, ssize_t len)
+static void SetPktHdr(IpfwImpl* impl, DAQ_PktHdr_t* phdr, ssize_t len)
 {
-    static struct timeval t;
-    memset (&t, 0, sizeof(struct timeval));
-    gettimeofday(&t, NULL);
-    phdr->ts.tv_sec = t.tv_sec;
-    phdr->ts.tv_usec = t.tv_usec;
+    daq_ts_stamp(&impl->ts_src, &phdr->ts);
     phdr->caplen = len;
     phdr->pktlen = len;
     phdr->ingress_index = -1;
@@ -319,48 +343,70 @@ static int ipfw_daq_acquire (
 
         if (FD_ISSET(impl->sock, &fdset))
         {
-            socklen_t sinlen = sizeof(impl->sin);
-            ssize_t pktlen;
+            int nrecv = 0;
+            int i;
 
-            DAQ_PktHdr_t hdr;
-            DAQ_Verdict verdict;
-
-            if ((pktlen = recvfrom(impl->sock, impl->buf, impl->snaplen, 0,
-                (struct sockaddr *)&impl->sin, &sinlen)) == -1)
+            // drain the socket into the arena so one select() wakeup is
+            // amortized over everything the kernel has queued
+            while ( nrecv < IPFW_BATCH_SIZE &&
+                (impl->count < 0 || n + nrecv < impl->count) )
             {
-                if (errno != EINTR)
+                socklen_t sinlen = sizeof(impl->psin[0]);
+                ssize_t pktlen = recvfrom(impl->sock,
+                    impl->buf + (size_t)nrecv * impl->snaplen, impl->snaplen, 0,
+                    (struct sockaddr *)&impl->psin[nrecv], &sinlen);
+
+                if ( pktlen == -1 )
                 {
+                    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+                        break;
                     DPE(impl->error, "%s: can't readfrom divert socket (%s)\n",
                         __func__, strerror(errno));
                     return DAQ_ERROR;
                 }
+                impl->plen[nrecv++] = pktlen;
             }
 
-            SetPktHdr(&hdr, pktlen);
-            impl->stats.hw_packets_received++;
-
-            if (
-                impl->fcode.bf_insns &&
-                sfbpf_filter(impl->fcode.bf_insns, impl->buf,
-                    hdr.caplen, hdr.caplen) == 0
-            ) {
-                verdict = DAQ_VERDICT_PASS;
-                impl->stats.packets_filtered++;
-            }
-            else
+            for ( i = 0; i < nrecv; i++ )
             {
-                verdict = callback(NULL, &hdr, impl->buf);
+                const uint8_t* buf = impl->buf + (size_t)i * impl->snaplen;
+
+                DAQ_PktHdr_t hdr;
+                DAQ_Verdict verdict;
 
-                if ( verdict >= MAX_DAQ_VERDICT )
-                    verdict = DAQ_VERDICT_BLOCK;
+                SetPktHdr(impl, &hdr, impl->plen[i]);
+                impl->stats.hw_packets_received++;
+
+                if (
+                    impl->fcode.bf_insns &&
+                    sfbpf_filter(impl->fcode.bf_insns, buf,
+                        hdr.caplen, hdr.caplen) == 0
+                ) {
+                    verdict = DAQ_VERDICT_PASS;
+                    impl->stats.packets_filtered++;
+                }
+                else
+                {
+                    verdict = callback(NULL, &hdr, buf);
+
+                    if ( verdict >= MAX_DAQ_VERDICT )
+                        verdict = DAQ_VERDICT_BLOCK;
+
+                    impl->stats.verdicts[verdict]++;
+                    impl->stats.packets_received++;
+                }
+                // passed packets from one batch reinject back to back at
+                // their own divert points, so the writes coalesce instead
+                // of interleaving with receives
+                if ( impl->passive || s_fwd[verdict] )
+                    ipfw_daq_forward(impl, &impl->psin[i], buf, hdr.pktlen);
 
-                impl->stats.verdicts[verdict]++;
-                impl->stats.packets_received++;
+                n++;
             }
-            if ( impl->passive || s_fwd[verdict] )
-                ipfw_daq_forward(impl, &hdr, impl->buf, hdr.pktlen, 0);
 
-            n++;
+            // keep inject() reinjecting at the most recent divert point
+            if ( nrecv )
+                impl->sin = impl->psin[nrecv - 1];
         }
     }
     return 0;
@@ -384,7 +430,7 @@ static DAQ_State ipfw_daq_check_status (void* handle)
 static int ipfw_daq_get_stats (void* handle, DAQ_Stats_t* stats)
 {
     IpfwImpl* impl = (IpfwImpl*)handle;
-    *stats = impl->stats;
+    daq_stats_snapshot(&impl->stats, stats);
     return DAQ_SUCCESS;
 }
 
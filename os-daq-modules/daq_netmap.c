@@ -33,17 +33,22 @@
 #include <sys/poll.h>
 
 #include <daq_api.h>
+#include <daq_flow_cache.h>
+#include <daq_tunnel.h>
 #include <sfbpf.h>
 #include <sfbpf_dlt.h>
 
 #include <net/netmap.h>
 #include <net/netmap_user.h>
 
-#define DAQ_NETMAP_VERSION      3
+#define DAQ_NETMAP_VERSION      6
 
 /* Hi! I'm completely arbitrary! */
 #define NETMAP_MAX_INTERFACES       32
 
+/* So am I! */
+#define NETMAP_MAX_FANOUT_PIPES     64
+
 /* FreeBSD 10.0 uses an old version of netmap, so work around it accordingly. */
 #if NETMAP_API < 10
 #define nm_ring_next(r, i)      NETMAP_RING_NEXT(r, i)
@@ -57,6 +62,7 @@ typedef struct _netmap_instance
     int fd;
 #define NMINST_FWD_BLOCKED     0x1
 #define NMINST_TX_BLOCKED      0x2
+#define NMINST_TX_DIRTY        0x4
     uint32_t flags;
     int index;
     struct netmap_if *nifp;
@@ -73,6 +79,7 @@ typedef struct _netmap_instance
     uint32_t memsize;
     struct nmreq req;
     unsigned long long fwd_tx_blocked;
+    unsigned long long fanout_drops;
 } NetmapInstance;
 
 typedef struct _netmap_context
@@ -84,10 +91,15 @@ typedef struct _netmap_context
     int debug;
     NetmapInstance *instances;
     uint32_t intf_count;
+    NetmapInstance **pipes;
+    uint32_t fanout_pipe_count;
+    int pipe_id;
+    uint32_t fanout_rr;
     struct sfbpf_program fcode;
     volatile int break_loop;
     DAQ_Stats_t stats;
     DAQ_State state;
+    DAQ_FlowCache_t flow_cache;
     char errbuf[256];
 } Netmap_Context_t;
 
@@ -131,6 +143,7 @@ static void destroy_instance(NetmapInstance *instance)
 static int netmap_close(Netmap_Context_t *nmc)
 {
     NetmapInstance *instance;
+    uint32_t i;
 
     if (!nmc)
         return -1;
@@ -147,6 +160,23 @@ static int netmap_close(Netmap_Context_t *nmc)
         destroy_instance(instance);
     }
 
+    /* Free any fan-out pipe master endpoints. */
+    if (nmc->pipes)
+    {
+        for (i = 0; i < nmc->fanout_pipe_count; i++)
+        {
+            if (nmc->debug && nmc->pipes[i])
+            {
+                printf("Netmap pipe %u dropped %llu packets due to a full ring.\n",
+                        i, nmc->pipes[i]->fanout_drops);
+            }
+            destroy_instance(nmc->pipes[i]);
+        }
+        free(nmc->pipes);
+        nmc->pipes = NULL;
+        nmc->fanout_pipe_count = 0;
+    }
+
     sfbpf_freecode(&nmc->fcode);
 
     nmc->state = DAQ_STATE_STOPPED;
@@ -385,13 +415,101 @@ static int netmap_daq_initialize(const DAQ_Config_t * config, void **ctxt_ptr, c
 
     /* Initialize other default configuration values. */
     nmc->debug = 0;
+    nmc->pipe_id = -1;
 
     /* Import the configuration dictionary requests. */
     for (entry = config->values; entry; entry = entry->next)
     {
         if (!strcmp(entry->key, "debug"))
             nmc->debug = 1;
+        else if (!strcmp(entry->key, "flow_cache_size") && entry->value)
+        {
+            if (daq_flow_cache_init(&nmc->flow_cache, strtoul(entry->value, NULL, 10)) != 0)
+            {
+                snprintf(errbuf, errlen, "%s: Couldn't allocate the software flow cache!", __func__);
+                rval = DAQ_ERROR_NOMEM;
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "fanout_pipes") && entry->value)
+        {
+#if NETMAP_API >= 11
+            nmc->fanout_pipe_count = strtoul(entry->value, NULL, 10);
+            if (nmc->fanout_pipe_count == 0 || nmc->fanout_pipe_count > NETMAP_MAX_FANOUT_PIPES)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid fan-out pipe count specified: '%s'!",
+                            __func__, entry->value);
+                goto err;
+            }
+#else
+            snprintf(errbuf, errlen, "%s: Netmap pipes require netmap API version 11 or greater!", __func__);
+            goto err;
+#endif
+        }
+        else if (!strcmp(entry->key, "pipe") && entry->value)
+        {
+#if NETMAP_API >= 11
+            nmc->pipe_id = strtol(entry->value, NULL, 10);
+            if (nmc->pipe_id < 0 || nmc->pipe_id >= NETMAP_MAX_FANOUT_PIPES)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid pipe ID specified: '%s'!",
+                            __func__, entry->value);
+                goto err;
+            }
+#else
+            snprintf(errbuf, errlen, "%s: Netmap pipes require netmap API version 11 or greater!", __func__);
+            goto err;
+#endif
+        }
+    }
+
+#if NETMAP_API >= 11
+    /* Set up netmap pipe fan-out.  A master instance (fanout_pipes=<count>) captures
+        from the interface's hardware rings and distributes packets across <count> pipe
+        master endpoints by flow hash, while worker instances (pipe=<id>) each register
+        against one of the corresponding pipe slave endpoints. */
+    if (nmc->fanout_pipe_count || nmc->pipe_id >= 0)
+    {
+        if (nmc->fanout_pipe_count && nmc->pipe_id >= 0)
+        {
+            snprintf(errbuf, errlen, "%s: The fanout_pipes and pipe variables are mutually exclusive!", __func__);
+            goto err;
+        }
+        if (config->mode != DAQ_MODE_PASSIVE || nmc->intf_count != 1)
+        {
+            snprintf(errbuf, errlen, "%s: Netmap pipe fan-out requires passive mode and a single interface!", __func__);
+            goto err;
+        }
+        if (nmc->pipe_id >= 0)
+        {
+            /* Register against one of the interface's pipe slave endpoints instead of
+                its hardware rings. */
+            nmc->instances->req.nr_flags = NR_REG_PIPE_SLAVE;
+            nmc->instances->req.nr_ringid = nmc->pipe_id;
+        }
+        else
+        {
+            uint32_t i;
+
+            nmc->pipes = calloc(nmc->fanout_pipe_count, sizeof(NetmapInstance *));
+            if (!nmc->pipes)
+            {
+                snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the fan-out pipe array!", __func__);
+                rval = DAQ_ERROR_NOMEM;
+                goto err;
+            }
+            for (i = 0; i < nmc->fanout_pipe_count; i++)
+            {
+                instance = create_instance(nmc->instances->req.nr_name, NULL, errbuf, errlen);
+                if (!instance)
+                    goto err;
+                instance->req.nr_flags = NR_REG_PIPE_MASTER;
+                instance->req.nr_ringid = i;
+                nmc->pipes[i] = instance;
+            }
+        }
     }
+#endif
 
     nmc->state = DAQ_STATE_INITIALIZED;
 
@@ -441,6 +559,7 @@ static int netmap_daq_start(void *handle)
 {
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
     NetmapInstance *instance;
+    uint32_t i;
 
     for (instance = nmc->instances; instance; instance = instance->next)
     {
@@ -448,6 +567,12 @@ static int netmap_daq_start(void *handle)
             return DAQ_ERROR;
     }
 
+    for (i = 0; i < nmc->fanout_pipe_count; i++)
+    {
+        if (start_instance(nmc, nmc->pipes[i]) != DAQ_SUCCESS)
+            return DAQ_ERROR;
+    }
+
     memset(&nmc->stats, 0, sizeof(DAQ_Stats_t));;
 
     nmc->state = DAQ_STATE_STARTED;
@@ -465,6 +590,176 @@ static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
     DAQ_VERDICT_BLOCK       /* DAQ_VERDICT_RETRY */
 };
 
+#if NETMAP_API >= 11
+/* Distribution loop for a fan-out master instance.  Packets read from the
+    interface's hardware rings are hashed on their canonicalized flow key and
+    forwarded into the matching pipe's TX ring, by zero-copy buffer swap when
+    the pipe shares the interface's memory region.  The analysis callback is
+    never invoked here; that happens in the worker instances reading from the
+    pipe slave endpoints. */
+static int netmap_fanout_acquire(Netmap_Context_t *nmc, int cnt)
+{
+    struct pollfd pfd;
+    struct netmap_ring *rx_ring, *tx_ring;
+    struct netmap_slot *rx_slot, *tx_slot;
+    NetmapInstance *instance, *pipe;
+    DAQ_FlowKey_t key;
+    const uint8_t *data;
+    uint32_t i, hash, rx_cur, tx_cur, tx_buf_idx;
+    uint16_t len, start_rx_ring, start_tx_ring;
+    int got_one, ignored_one, sent;
+    int ret, c = 0;
+
+    instance = nmc->instances;
+    while (c < cnt || cnt <= 0)
+    {
+        got_one = 0;
+        ignored_one = 0;
+
+        start_rx_ring = instance->cur_rx_ring;
+        do
+        {
+            /* Has breakloop() been called? */
+            if (nmc->break_loop)
+            {
+                nmc->break_loop = 0;
+                return 0;
+            }
+
+            rx_ring = NETMAP_RXRING(instance->nifp, instance->cur_rx_ring);
+            if (nm_ring_empty(rx_ring))
+            {
+                nminst_inc_rx_ring(instance);
+                continue;
+            }
+
+            rx_cur = rx_ring->cur;
+            rx_slot = &rx_ring->slot[rx_cur];
+            len = rx_slot->len;
+            data = (uint8_t *) NETMAP_BUF(rx_ring, rx_slot->buf_idx);
+
+            nmc->stats.hw_packets_received++;
+
+            if (nmc->fcode.bf_insns && sfbpf_filter(nmc->fcode.bf_insns, data, len, len) == 0)
+            {
+                ignored_one = 1;
+                nmc->stats.packets_filtered++;
+                goto next_packet;
+            }
+
+            /* Hash the flow key so that both directions of a flow land on the
+                same pipe; tunneled traffic hashes on its inner flow so one
+                GTP-U bearer does not pin every subscriber to a single pipe.
+                Spray non-IP traffic round-robin instead. */
+            if (daq_tunnel_flow_key(data, len, &key) >= 0)
+                hash = daq_flow_key_hash(&key);
+            else
+                hash = nmc->fanout_rr++;
+            pipe = nmc->pipes[hash % nmc->fanout_pipe_count];
+
+            sent = 0;
+            start_tx_ring = pipe->cur_tx_ring;
+            do
+            {
+                tx_ring = NETMAP_TXRING(pipe->nifp, pipe->cur_tx_ring);
+                nminst_inc_tx_ring(pipe);
+                if (nm_ring_empty(tx_ring))
+                    continue;
+                tx_cur = tx_ring->cur;
+                tx_slot = &tx_ring->slot[tx_cur];
+                tx_slot->len = len;
+                if (instance->mem == pipe->mem)
+                {
+                    /* Swap the RX buffer we want to forward with the next
+                       unused buffer in the pipe's TX ring. */
+                    tx_buf_idx = tx_slot->buf_idx;
+                    tx_slot->buf_idx = rx_slot->buf_idx;
+                    rx_slot->buf_idx = tx_buf_idx;
+                    /* Report the buffer change. */
+                    tx_slot->flags |= NS_BUF_CHANGED;
+                    rx_slot->flags |= NS_BUF_CHANGED;
+                }
+                else
+                {
+                    /* The pipe was allocated from a different netmap memory
+                       region, so the frame has to be copied instead. */
+                    memcpy(NETMAP_BUF(tx_ring, tx_slot->buf_idx), data, len);
+                }
+                tx_ring->cur = nm_ring_next(tx_ring, tx_cur);
+                tx_ring->head = tx_ring->cur;
+                sent = 1;
+            } while (pipe->cur_tx_ring != start_tx_ring && !sent);
+
+            /* Unlike inline forwarding, never stall the whole fan-out on one
+                slow consumer - drop the packet if its pipe is full. */
+            if (sent)
+            {
+                pipe->flags |= NMINST_TX_DIRTY;
+                got_one = 1;
+                nmc->stats.packets_received++;
+                c++;
+            }
+            else
+            {
+                pipe->fanout_drops++;
+                nmc->stats.hw_packets_dropped++;
+            }
+
+next_packet:
+            rx_ring->cur = nm_ring_next(rx_ring, rx_cur);
+            rx_ring->head = rx_ring->cur;
+
+            /* Increment the current RX ring pointer on successfully completed processing. */
+            nminst_inc_rx_ring(instance);
+
+        } while (instance->cur_rx_ring != start_rx_ring);
+
+        /* Sync any pipes that had packets queued onto them during this sweep. */
+        for (i = 0; i < nmc->fanout_pipe_count; i++)
+        {
+            pipe = nmc->pipes[i];
+            if (pipe->flags & NMINST_TX_DIRTY)
+            {
+                pipe->flags &= ~NMINST_TX_DIRTY;
+                ioctl(pipe->fd, NIOCTXSYNC, NULL);
+            }
+        }
+
+        if (!got_one && !ignored_one)
+        {
+            pfd.fd = instance->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            ret = poll(&pfd, 1, nmc->timeout);
+
+            /* If we were interrupted by a signal, start the loop over.
+                The user should call daq_breakloop to actually exit. */
+            if (ret < 0 && errno != EINTR)
+            {
+                DPE(nmc->errbuf, "%s: Poll failed: %s (%d)", __func__, strerror(errno), errno);
+                return DAQ_ERROR;
+            }
+            /* If the poll times out, return control to the caller. */
+            if (ret == 0)
+                break;
+            if (ret > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+            {
+                if (pfd.revents & POLLHUP)
+                    DPE(nmc->errbuf, "%s: Hang-up on a packet socket", __func__);
+                else if (pfd.revents & POLLERR)
+                    DPE(nmc->errbuf, "%s: Encountered error condition on a packet socket", __func__);
+                else if (pfd.revents & POLLNVAL)
+                    DPE(nmc->errbuf, "%s: Invalid polling request on a packet socket", __func__);
+                return DAQ_ERROR;
+            }
+        }
+    }
+
+    return 0;
+}
+#endif /* NETMAP_API >= 11 */
+
 static int netmap_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
 {
     struct pollfd pfd[NETMAP_MAX_INTERFACES];
@@ -480,6 +775,11 @@ static int netmap_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callbac
     int got_one, ignored_one;
     int ret, c = 0;
 
+#if NETMAP_API >= 11
+    if (nmc->fanout_pipe_count)
+        return netmap_fanout_acquire(nmc, cnt);
+#endif
+
     while (c < cnt || cnt <= 0)
     {
         got_one = 0;
@@ -530,6 +830,18 @@ static int netmap_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callbac
                     nmc->stats.packets_filtered++;
                     goto send_packet;
                 }
+
+                /* Short-circuit flows with a cached flow-wide verdict before the callback. */
+                if (nmc->flow_cache.entries &&
+                    daq_tunnel_flow_cache_check(&nmc->flow_cache, data, len, &verdict))
+                {
+                    got_one = 1;
+                    nmc->stats.verdicts[verdict]++;
+                    nmc->stats.packets_received++;
+                    c++;
+                    verdict = verdict_translation_table[verdict];
+                    goto send_packet;
+                }
                 got_one = 1;
 
                 daqhdr.ts = rx_ring->ts;
@@ -543,6 +855,7 @@ static int netmap_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callbac
                 daqhdr.opaque = 0;
                 daqhdr.priv_ptr = NULL;
                 daqhdr.address_space_id = 0;
+                daq_tunnel_annotate(&daqhdr, data, len);
 
                 if (callback)
                 {
@@ -550,6 +863,8 @@ static int netmap_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callbac
                     if (verdict >= MAX_DAQ_VERDICT)
                         verdict = DAQ_VERDICT_PASS;
                     nmc->stats.verdicts[verdict]++;
+                    if (nmc->flow_cache.entries)
+                        daq_tunnel_flow_cache_update(&nmc->flow_cache, data, len, verdict);
                     verdict = verdict_translation_table[verdict];
                 }
                 nmc->stats.packets_received++;
@@ -569,17 +884,27 @@ send_packet:
                         nminst_inc_tx_ring(peer);
                         if (nm_ring_empty(tx_ring))
                             continue;
-                        /* Swap the RX buffer we want to forward with the next
-                           unused buffer in the peer's TX ring. */
                         tx_cur = tx_ring->cur;
                         tx_slot = &tx_ring->slot[tx_cur];
-                        tx_buf_idx = tx_slot->buf_idx;
                         tx_slot->len = len;
-                        tx_slot->buf_idx = rx_slot->buf_idx;
-                        rx_slot->buf_idx = tx_buf_idx;
-                        /* Report the buffer change. */
-                        tx_slot->flags |= NS_BUF_CHANGED;
-                        rx_slot->flags |= NS_BUF_CHANGED;
+                        if (instance->mem == peer->mem)
+                        {
+                            /* Swap the RX buffer we want to forward with the next
+                               unused buffer in the peer's TX ring. */
+                            tx_buf_idx = tx_slot->buf_idx;
+                            tx_slot->buf_idx = rx_slot->buf_idx;
+                            rx_slot->buf_idx = tx_buf_idx;
+                            /* Report the buffer change. */
+                            tx_slot->flags |= NS_BUF_CHANGED;
+                            rx_slot->flags |= NS_BUF_CHANGED;
+                        }
+                        else
+                        {
+                            /* Buffer indices are only meaningful within a single netmap
+                               memory region, so peers registered against different
+                               regions have to copy the frame instead of swapping. */
+                            memcpy(NETMAP_BUF(tx_ring, tx_slot->buf_idx), data, len);
+                        }
 
                         tx_ring->cur = nm_ring_next(tx_ring, tx_cur);
 #if NETMAP_API >= 10
@@ -753,6 +1078,8 @@ static void netmap_daq_shutdown(void *handle)
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
 
     netmap_close(nmc);
+    if (nmc->flow_cache.entries)
+        daq_flow_cache_cleanup(&nmc->flow_cache);
     if (nmc->device)
         free(nmc->device);
     if (nmc->filter)
@@ -771,7 +1098,7 @@ static int netmap_daq_get_stats(void *handle, DAQ_Stats_t * stats)
 {
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
 
-    memcpy(stats, &nmc->stats, sizeof(DAQ_Stats_t));
+    daq_stats_snapshot(&nmc->stats, stats);
 
     return DAQ_SUCCESS;
 }
@@ -794,7 +1121,8 @@ static uint32_t netmap_daq_get_capabilities(void *handle)
 {
     return DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT |
             DAQ_CAPA_UNPRIV_START | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF |
-            DAQ_CAPA_DEVICE_INDEX;
+            DAQ_CAPA_DEVICE_INDEX | DAQ_CAPA_DECODE_GTP |
+            DAQ_CAPA_DECODE_GRE | DAQ_CAPA_DECODE_TEREDO;
 }
 
 static int netmap_daq_get_datalink_type(void *handle)
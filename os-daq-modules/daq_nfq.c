@@ -20,12 +20,15 @@
 #include "config.h"
 #endif
 
+#define _GNU_SOURCE     // for recvmmsg()
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/unistd.h>
 
@@ -40,9 +43,11 @@
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
 #include "daq_api.h"
+#include "daq_retry_wheel.h"
+#include "daq_timestamp.h"
 #include "sfbpf.h"
 
-#define DAQ_MOD_VERSION  7
+#define DAQ_MOD_VERSION  9
 
 #define DAQ_NAME "nfq"
 #define DAQ_TYPE (DAQ_TYPE_INTF_CAPABLE | DAQ_TYPE_INLINE_CAPABLE | \
@@ -55,6 +60,16 @@
 
 #define MSG_BUF_SIZE META_DATA_SIZE + IP_MAXPACKET
 
+// number of netlink messages drained per recvmmsg() call; everything needed
+// to receive and describe a batch is preallocated at initialize time so the
+// verdict path never touches the allocator.
+#define MSG_BATCH_SIZE 16
+
+// defaults for the RETRY verdict: how long to sit on a packet before
+// redelivering it (ms) and how many may be held at once
+#define DEFAULT_RETRY_DELAY 200
+#define DEFAULT_RETRY_QUEUE 1024
+
 typedef struct
 {
     int protos, sock, qid;
@@ -70,9 +85,37 @@ typedef struct
     ip_t* net;
     eth_t* link;
 
-    uint8_t* buf;
+    uint8_t* buf;                           // MSG_BATCH_SIZE message buffers
+    struct mmsghdr msgs[MSG_BATCH_SIZE];
+    struct iovec iovs[MSG_BATCH_SIZE];
+    DAQ_PktHdr_t hdrs[MSG_BATCH_SIZE];      // packet header slots
+    int cur_msg;                            // batch slot being handled
+
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+    // verdict coalescing (verdict_batch config key)
+    int vd_max;                             // flush after this many held
+    unsigned vd_usecs;                      // ... or this many microseconds
+    int vd_pending;                         // verdicts currently held
+    int vd_verdict;                         // the nf verdict they all share
+    uint32_t vd_last_id;                    // highest packet id held
+    struct timeval vd_since;                // when the oldest was held
+#endif
+
+    // RETRY verdict support (retry_delay / retry_queue_size config keys);
+    // held packets keep their kernel verdict pending until redelivery
+    DAQ_RetryWheel_t retry_wheel;
+    int retry_enabled;
+    unsigned retry_delay;                   // hold time in ms
+    uint32_t retry_queue;                   // max held packet copies
+
+    // timestamp source for packets the kernel did not stamp (or always,
+    // when the timestamp config key overrides the kernel stamps)
+    DAQ_TsSource_t ts_src;
+    int ts_override;
+
     void* user_data;
     DAQ_Analysis_Func_t user_func;
+    DAQ_Analysis_Deferred_Func_t user_func_deferred;
 
     volatile int count;
     int passive;
@@ -121,6 +164,12 @@ static int nfq_daq_get_setup (
     impl->protos = 0x1;
     impl->qid = DEFAULT_Q;
     impl->qlen = 0;
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+    impl->vd_max = 0;       // coalescing off unless verdict_batch is given
+    impl->vd_usecs = 1000;
+#endif
+    impl->retry_delay = DEFAULT_RETRY_DELAY;
+    impl->retry_queue = DEFAULT_RETRY_QUEUE;
 
     for ( entry = cfg->values; entry; entry = entry->next)
     {
@@ -176,6 +225,71 @@ static int nfq_daq_get_setup (
                 return DAQ_ERROR;
             }
         }
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+        else if ( !strcmp(entry->key, "verdict_batch") )
+        {
+            char* end = entry->value;
+            impl->vd_max = (int)strtol(entry->value, &end, 0);
+
+            if ( *end || impl->vd_max < 1 || impl->vd_max > 65535 )
+            {
+                snprintf(errBuf, errMax, "%s: bad verdict batch size (%s)\n",
+                        __func__, entry->value);
+                return DAQ_ERROR;
+            }
+        }
+        else if ( !strcmp(entry->key, "verdict_batch_usecs") )
+        {
+            char* end = entry->value;
+            impl->vd_usecs = (unsigned)strtol(entry->value, &end, 0);
+
+            if ( *end )
+            {
+                snprintf(errBuf, errMax, "%s: bad verdict batch latency (%s)\n",
+                        __func__, entry->value);
+                return DAQ_ERROR;
+            }
+        }
+#endif
+        else if ( !strcmp(entry->key, "retry_delay") )
+        {
+            char* end = entry->value;
+            impl->retry_delay = (unsigned)strtol(entry->value, &end, 0);
+
+            if ( *end || !impl->retry_delay )
+            {
+                snprintf(errBuf, errMax, "%s: bad retry delay (%s)\n",
+                        __func__, entry->value);
+                return DAQ_ERROR;
+            }
+            impl->retry_enabled = 1;
+        }
+        else if ( !strcmp(entry->key, "timestamp") )
+        {
+            if ( !strcmp(entry->value, "kernel") )
+                impl->ts_override = 0;
+            else if ( daq_ts_source_init(&impl->ts_src, entry->value) )
+            {
+                snprintf(errBuf, errMax, "%s: bad timestamp source (%s)\n",
+                        __func__, entry->value);
+                return DAQ_ERROR;
+            }
+            else
+                impl->ts_override = 1;
+        }
+        else if ( !strcmp(entry->key, "retry_queue_size") )
+        {
+            char* end = entry->value;
+            impl->retry_queue = (uint32_t)strtol(entry->value, &end, 0);
+
+            if ( *end || !impl->retry_queue )
+            {
+                snprintf(errBuf, errMax, "%s: bad retry queue size (%s)\n",
+                        __func__, entry->value);
+                return DAQ_ERROR;
+            }
+            impl->retry_enabled = 1;
+        }
         else
         {
             snprintf(errBuf, errMax,
@@ -218,9 +332,30 @@ static int nfq_daq_initialize (
         return DAQ_ERROR;
     }
 
-    if ( (impl->buf = malloc(MSG_BUF_SIZE)) == NULL )
+    if ( (impl->buf = malloc((size_t)MSG_BUF_SIZE * MSG_BATCH_SIZE)) == NULL )
+    {
+        snprintf(errBuf, errMax, "%s: failed to allocate nfq buffers\n",
+            __func__);
+        nfq_daq_shutdown(impl);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    // wire each batch slot to its slice of the arena once, up front
+    {
+        int i;
+        for ( i = 0; i < MSG_BATCH_SIZE; i++ )
+        {
+            impl->iovs[i].iov_base = impl->buf + (size_t)i * MSG_BUF_SIZE;
+            impl->iovs[i].iov_len = MSG_BUF_SIZE;
+            impl->msgs[i].msg_hdr.msg_iov = &impl->iovs[i];
+            impl->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    if ( impl->retry_enabled && daq_retry_wheel_init(&impl->retry_wheel,
+        impl->retry_queue, impl->snaplen, impl->retry_delay) )
     {
-        snprintf(errBuf, errMax, "%s: failed to allocate nfq buffer\n",
+        snprintf(errBuf, errMax, "%s: failed to allocate retry packet pool\n",
             __func__);
         nfq_daq_shutdown(impl);
         return DAQ_ERROR_NOMEM;
@@ -380,6 +515,9 @@ static void nfq_daq_shutdown (void* handle)
     if ( impl->buf )
         free(impl->buf);
 
+    if ( impl->retry_enabled )
+        daq_retry_wheel_cleanup(&impl->retry_wheel);
+
     free(impl);
 }
 
@@ -401,9 +539,10 @@ static inline int SetPktHdr (
     hdr->flags = 0;
     hdr->address_space_id = 0;
 
-    // if nfq fails to provide a timestamp, we fall back on tod
-    if ( nfq_get_timestamp(nfad, &hdr->ts) )
-        gettimeofday(&hdr->ts, NULL);
+    // stamp from the configured source; by default the kernel's stamp
+    // with a tod fallback, as before
+    if ( impl->ts_override || nfq_get_timestamp(nfad, &hdr->ts) )
+        daq_ts_stamp(&impl->ts_src, &hdr->ts);
 
     hdr->ingress_index = nfq_get_physindev(nfad);
     hdr->egress_index = -1;
@@ -415,6 +554,28 @@ static inline int SetPktHdr (
 
 //-------------------------------------------------------------------------
 
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+// a batch verdict acknowledges every packet up to and including the given
+// id, so a run of consecutive identical verdicts collapses into a single
+// netlink send.
+static void nfq_flush_verdicts (NfqImpl* impl)
+{
+    if ( !impl->vd_pending )
+        return;
+
+    if ( impl->vd_pending == 1 )
+        nfq_set_verdict(
+            impl->nf_queue, impl->vd_last_id, impl->vd_verdict, 0, NULL);
+    else
+        nfq_set_verdict_batch(
+            impl->nf_queue, impl->vd_last_id, impl->vd_verdict);
+
+    impl->vd_pending = 0;
+}
+#endif
+
+//-------------------------------------------------------------------------
+
 // forward all but blocks, retries and blacklists:
 static const int s_fwd[MAX_DAQ_VERDICT] = { 1, 0, 1, 1, 0, 1, 0 };
 
@@ -427,8 +588,10 @@ static int daq_nfq_callback(
     NfqImpl *impl = (NfqImpl*)data;
     struct nfqnl_msg_packet_hdr* ph = nfq_get_msg_packet_hdr(nfad);
 
+    // use the preallocated header slot for this batch position
+    DAQ_PktHdr_t* hdr = &impl->hdrs[impl->cur_msg];
+
     DAQ_Verdict verdict;
-    DAQ_PktHdr_t hdr;
     uint8_t* pkt;
     int nf_verdict;
     uint32_t data_len;
@@ -436,7 +599,7 @@ static int daq_nfq_callback(
     if ( impl->state != DAQ_STATE_STARTED )
         return -1;
 
-    if ( !ph || SetPktHdr(impl, nfad, &hdr, &pkt) )
+    if ( !ph || SetPktHdr(impl, nfad, hdr, &pkt) )
     {
         DPE(impl->error, "%s: can't setup packet header",
             __func__);
@@ -445,23 +608,71 @@ static int daq_nfq_callback(
 
     if (
         impl->fcode.bf_insns &&
-        sfbpf_filter(impl->fcode.bf_insns, pkt, hdr.caplen, hdr.caplen) == 0
+        sfbpf_filter(impl->fcode.bf_insns, pkt, hdr->caplen, hdr->caplen) == 0
     ) {
         verdict = DAQ_VERDICT_PASS;
         impl->stats.packets_filtered++;
     }
+    else if ( impl->user_func_deferred )
+    {
+        // nfq packet ids are already usable tokens; hand the packet off and
+        // let the application post the verdict later via set_verdict().
+        impl->stats.packets_received++;
+        impl->user_func_deferred(
+            impl->user_data, hdr, pkt, ntohl(ph->packet_id));
+        return 0;
+    }
     else
     {
-        verdict = impl->user_func(impl->user_data, &hdr, pkt);
+        verdict = impl->user_func(impl->user_data, hdr, pkt);
 
         if ( verdict >= MAX_DAQ_VERDICT )
             verdict = DAQ_VERDICT_BLOCK;
 
         impl->stats.verdicts[verdict]++;
         impl->stats.packets_received++;
+
+        // hold a copy and leave the kernel verdict pending; the copy is
+        // redelivered when it comes due.  if the pool is exhausted, fall
+        // through and the RETRY becomes a drop.
+        if ( impl->retry_enabled && verdict == DAQ_VERDICT_RETRY &&
+            daq_retry_wheel_queue(
+                &impl->retry_wheel, hdr, pkt, ntohl(ph->packet_id)) )
+            return 0;
     }
     nf_verdict = ( impl->passive || s_fwd[verdict] ) ? NF_ACCEPT : NF_DROP;
-    data_len = ( verdict == DAQ_VERDICT_REPLACE ) ? hdr.caplen : 0;
+    data_len = ( verdict == DAQ_VERDICT_REPLACE ) ? hdr->caplen : 0;
+
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+    // coalesce runs of identical plain verdicts.  a batch verdict sweeps
+    // every id up to the latest one, so never coalesce in deferred or retry
+    // mode where older ids may still be awaiting their verdict.
+    if ( impl->vd_max && !impl->user_func_deferred && !impl->retry_enabled
+        && !data_len )
+    {
+        uint32_t id = ntohl(ph->packet_id);
+
+        if ( impl->vd_pending &&
+            ( impl->vd_verdict != nf_verdict ||
+              (int32_t)(id - impl->vd_last_id) <= 0 ) )
+            nfq_flush_verdicts(impl);
+
+        if ( !impl->vd_pending )
+        {
+            impl->vd_verdict = nf_verdict;
+            gettimeofday(&impl->vd_since, NULL);
+        }
+        impl->vd_last_id = id;
+        impl->vd_pending++;
+
+        if ( impl->vd_pending >= impl->vd_max )
+            nfq_flush_verdicts(impl);
+
+        return 0;
+    }
+    // a replace (or deferred-mode) verdict must not jump the queue
+    nfq_flush_verdicts(impl);
+#endif
 
     nfq_set_verdict(
         impl->nf_queue, ntohl(ph->packet_id),
@@ -470,6 +681,41 @@ static int daq_nfq_callback(
     return 0;
 }
 
+//-------------------------------------------------------------------------
+
+// redeliver a held RETRY packet (flagged DAQ_PKT_FLAG_RETRY_PACKET) and
+// post the verdict the kernel has been waiting on.  another RETRY re-queues
+// the copy for one more round trip; if the pool is exhausted it becomes a
+// drop like any other failed retry.
+static void nfq_deliver_retry (NfqImpl* impl, DAQ_RetryEntry_t* e)
+{
+    DAQ_Verdict verdict = DAQ_VERDICT_PASS;
+    int nf_verdict;
+
+    if ( impl->user_func )
+    {
+        verdict = impl->user_func(impl->user_data, &e->hdr, e->data);
+
+        if ( verdict >= MAX_DAQ_VERDICT )
+            verdict = DAQ_VERDICT_BLOCK;
+
+        impl->stats.verdicts[verdict]++;
+        impl->stats.packets_received++;
+    }
+
+    if ( verdict == DAQ_VERDICT_RETRY && daq_retry_wheel_queue(
+        &impl->retry_wheel, &e->hdr, e->data, e->token) )
+    {
+        daq_retry_wheel_release(&impl->retry_wheel, e);
+        return;
+    }
+
+    nf_verdict = ( impl->passive || s_fwd[verdict] ) ? NF_ACCEPT : NF_DROP;
+    nfq_set_verdict(impl->nf_queue, e->token, nf_verdict, 0, NULL);
+
+    daq_retry_wheel_release(&impl->retry_wheel, e);
+}
+
 //-------------------------------------------------------------------------
 // 0. we open the queue and supply our internal callback,
 //    daq_nfq_callback.
@@ -486,11 +732,8 @@ static int daq_nfq_callback(
 //    a pass / drop verdict to the nfq.
 // 7. this unwinds and we repeat back at step 2.
 
-static int nfq_daq_acquire (
-    void* handle, int c, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void* user)
+static int nfq_daq_acquire_loop (NfqImpl* impl, int c)
 {
-    NfqImpl *impl = (NfqImpl*)handle;
-
     int n = 0;
     fd_set fdset;
     struct timeval tv;
@@ -499,8 +742,6 @@ static int nfq_daq_acquire (
     // If c is <= 0, don't limit the packets acquired.  However,
     // impl->count = 0 has a special meaning, so interpret accordingly.
     impl->count = (c == 0) ? -1 : c;
-    impl->user_data = user;
-    impl->user_func = callback;
 
     while ( (impl->count < 0) || (n < impl->count) )
     {
@@ -511,6 +752,29 @@ static int nfq_daq_acquire (
         tv.tv_sec = impl->timeout;
         tv.tv_usec = 0;
 
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+        // don't let held verdicts outlive the latency bound
+        if ( impl->vd_pending )
+        {
+            tv.tv_sec = 0;
+            tv.tv_usec = impl->vd_usecs;
+        }
+#endif
+
+        // wake up in time to redeliver any held RETRY packets
+        if ( impl->retry_enabled && impl->retry_wheel.held )
+        {
+            long cur = tv.tv_sec * 1000000L + tv.tv_usec;
+            long rem = (long)daq_retry_wheel_timeout(&impl->retry_wheel, -1)
+                * 1000L;
+
+            if ( rem < cur )
+            {
+                tv.tv_sec = rem / 1000000L;
+                tv.tv_usec = rem % 1000000L;
+            }
+        }
+
         // at least ipq had a timeout!
         if ( select(impl->sock+1, &fdset, NULL, NULL, &tv) < 0 )
         {
@@ -523,12 +787,30 @@ static int nfq_daq_acquire (
 
         if (FD_ISSET(impl->sock, &fdset))
         {
-            int len = recv(impl->sock, impl->buf, MSG_BUF_SIZE, 0);
+            // drain up to a batch of queued packets with a single syscall
+            int i, batch = MSG_BATCH_SIZE;
+
+            if ( impl->count > 0 && impl->count - n < batch )
+                batch = impl->count - n;
+
+            int nmsgs = recvmmsg(impl->sock, impl->msgs, batch,
+                MSG_DONTWAIT, NULL);
+
+            if ( nmsgs < 0 )
+            {
+                if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+                    continue;
+                DPE(impl->error, "%s: recvmmsg = %s",
+                    __func__, strerror(errno));
+                return DAQ_ERROR;
+            }
 
-            if ( len > 0)
+            for ( i = 0; i < nmsgs; i++ )
             {
-                int stat = nfq_handle_packet(
-                    impl->nf_handle, (char*)impl->buf, len);
+                impl->cur_msg = i;
+
+                int stat = nfq_handle_packet(impl->nf_handle,
+                    (char*)impl->iovs[i].iov_base, impl->msgs[i].msg_len);
 
                 impl->stats.hw_packets_received++;
 
@@ -541,10 +823,88 @@ static int nfq_daq_acquire (
                 n++;
             }
         }
+
+        // redeliver any held RETRY packets that have come due
+        if ( impl->retry_enabled && impl->retry_wheel.held )
+        {
+            DAQ_RetryEntry_t* e =
+                daq_retry_wheel_expire(&impl->retry_wheel, daq_retry_wheel_now());
+
+            while ( e )
+            {
+                DAQ_RetryEntry_t* next = e->next;
+                nfq_deliver_retry(impl, e);
+                e = next;
+                n++;
+            }
+        }
+
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+        if ( impl->vd_pending )
+        {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+
+            if ( (now.tv_sec - impl->vd_since.tv_sec) * 1000000 +
+                 (now.tv_usec - impl->vd_since.tv_usec) >= (long)impl->vd_usecs )
+                nfq_flush_verdicts(impl);
+        }
+#endif
     }
+
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+    nfq_flush_verdicts(impl);
+#endif
     return 0;
 }
 
+static int nfq_daq_acquire (
+    void* handle, int c, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void* user)
+{
+    NfqImpl *impl = (NfqImpl*)handle;
+
+    impl->user_data = user;
+    impl->user_func = callback;
+    impl->user_func_deferred = NULL;
+
+    return nfq_daq_acquire_loop(impl, c);
+}
+
+static int nfq_daq_acquire_deferred (
+    void* handle, int c, DAQ_Analysis_Deferred_Func_t callback, DAQ_Meta_Func_t metaback, void* user)
+{
+    NfqImpl *impl = (NfqImpl*)handle;
+
+    impl->user_data = user;
+    impl->user_func = NULL;
+    impl->user_func_deferred = callback;
+
+    return nfq_daq_acquire_loop(impl, c);
+}
+
+static int nfq_daq_set_verdict (void* handle, uint32_t token, DAQ_Verdict verdict)
+{
+    NfqImpl *impl = (NfqImpl*)handle;
+    int nf_verdict;
+
+    if ( verdict >= MAX_DAQ_VERDICT )
+        verdict = DAQ_VERDICT_BLOCK;
+
+    impl->stats.verdicts[verdict]++;
+
+    // the original payload is long gone by now, so REPLACE
+    // degenerates to PASS here (data_len = 0).
+    nf_verdict = ( impl->passive || s_fwd[verdict] ) ? NF_ACCEPT : NF_DROP;
+
+    if ( nfq_set_verdict(impl->nf_queue, token, nf_verdict, 0, NULL) < 0 )
+    {
+        DPE(impl->error, "%s: nfq_set_verdict = %s",
+            __func__, strerror(errno));
+        return DAQ_ERROR;
+    }
+    return DAQ_SUCCESS;
+}
+
 //-------------------------------------------------------------------------
 
 static int nfq_daq_inject (
@@ -616,6 +976,22 @@ static int nfq_daq_breakloop (void* handle)
 static int nfq_daq_stop (void* handle)
 {
     NfqImpl* impl = (NfqImpl*)handle;
+#ifdef HAVE_NFQ_SET_VERDICT_BATCH
+    nfq_flush_verdicts(impl);
+#endif
+    // resolve any still-held RETRY packets; they won't get another chance
+    if ( impl->retry_enabled )
+    {
+        DAQ_RetryEntry_t* e = daq_retry_wheel_drain(&impl->retry_wheel);
+
+        while ( e )
+        {
+            DAQ_RetryEntry_t* next = e->next;
+            nfq_set_verdict(impl->nf_queue, e->token, NF_DROP, 0, NULL);
+            daq_retry_wheel_release(&impl->retry_wheel, e);
+            e = next;
+        }
+    }
     impl->state = DAQ_STATE_STOPPED;
     return DAQ_SUCCESS;
 }
@@ -629,7 +1005,7 @@ static DAQ_State nfq_daq_check_status (void* handle)
 static int nfq_daq_get_stats (void* handle, DAQ_Stats_t* stats)
 {
     NfqImpl* impl = (NfqImpl*)handle;
-    *stats = impl->stats;
+    daq_stats_snapshot(&impl->stats, stats);
     return DAQ_SUCCESS;
 }
 
@@ -651,6 +1027,7 @@ static uint32_t nfq_daq_get_capabilities (void* handle)
     uint32_t caps = DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT
         | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_UNPRIV_START | DAQ_CAPA_BPF;
     if ( impl->net ) caps |= DAQ_CAPA_INJECT_RAW;
+    if ( impl->retry_enabled ) caps |= DAQ_CAPA_RETRY;
     return caps;
 }
 
@@ -711,5 +1088,7 @@ DAQ_Module_t nfq_daq_module_data =
     .hup_prep = NULL,
     .hup_apply = NULL,
     .hup_post = NULL,
+    .acquire_deferred = nfq_daq_acquire_deferred,
+    .set_verdict = nfq_daq_set_verdict,
 };
 
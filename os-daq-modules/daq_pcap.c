@@ -30,6 +30,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pcap.h>
 #ifndef PCAP_OLDSTYLE
 # ifdef HAVE_LINUX_IF_PACKET_H
@@ -39,10 +44,37 @@
 #endif /* PCAP_OLDSTYLE */
 
 #include "daq_api.h"
+#include "daq_flow_cache.h"
 
 #define DAQ_PCAP_VERSION 4
 #define DAQ_PCAP_ROLLOVER_LIM 1000000000 //Check for rollover every billionth packet
 
+/* Native memory-mapped reader for plain pcap files in READ_FILE mode.
+   Packet data is served straight out of the mapping (zero-copy) instead of
+   going through libpcap's buffered stdio path; anything that isn't a plain
+   pcap file (pcapng, compressed captures) falls back to pcap_open_offline(). */
+#define PCAP_FILE_MAGIC                 0xa1b2c3d4
+#define PCAP_FILE_MAGIC_SWAPPED         0xd4c3b2a1
+#define PCAP_FILE_MAGIC_NSEC            0xa1b23c4d
+#define PCAP_FILE_MAGIC_NSEC_SWAPPED    0x4d3cb2a1
+
+typedef struct {
+    uint32_t magic_number;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} PcapFileHeader;
+
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_frac;   /* microseconds or nanoseconds, depending on magic */
+    uint32_t incl_len;
+    uint32_t orig_len;
+} PcapRecHeader;
+
 typedef struct _pcap_context
 {
     char *device;
@@ -69,6 +101,22 @@ typedef struct _pcap_context
     uint32_t wrap_drop;
     DAQ_State state;
     uint32_t hwupdate_count;
+    DAQ_FlowCache_t flow_cache;
+    /* native mmap file reader state */
+    uint8_t *map;
+    size_t map_size;
+    size_t map_offset;
+    int map_swapped;
+    int map_nsec;
+    int map_linktype;
+    volatile int map_break;
+    struct bpf_program fcode;
+    int fcode_valid;
+    /* multi-file replay state */
+    char **files;
+    unsigned file_count;
+    unsigned file_cur;
+    char *files_filter;
 } Pcap_Context_t;
 
 static void pcap_daq_reset_stats(void *handle);
@@ -106,6 +154,148 @@ static int translate_PCAP_FRAMES(int snaplen)
 }
 #endif /* PCAP_OLDSTYLE */
 
+static uint32_t pcap_file_swap32(uint32_t x)
+{
+    return ((x & 0x000000ff) << 24) | ((x & 0x0000ff00) << 8) |
+           ((x & 0x00ff0000) >> 8) | ((x & 0xff000000) >> 24);
+}
+
+static int pcap_daq_open_file_mmap(Pcap_Context_t *context)
+{
+    const PcapFileHeader *hdr;
+    struct stat st;
+    int fd;
+
+    fd = open(context->file, O_RDONLY);
+    if (fd < 0)
+        return DAQ_ERROR;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(PcapFileHeader))
+    {
+        close(fd);
+        return DAQ_ERROR;
+    }
+
+    context->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (context->map == MAP_FAILED)
+    {
+        context->map = NULL;
+        return DAQ_ERROR;
+    }
+    context->map_size = st.st_size;
+
+    hdr = (const PcapFileHeader *) context->map;
+    switch (hdr->magic_number)
+    {
+        case PCAP_FILE_MAGIC:
+            break;
+        case PCAP_FILE_MAGIC_NSEC:
+            context->map_nsec = 1;
+            break;
+        case PCAP_FILE_MAGIC_SWAPPED:
+            context->map_swapped = 1;
+            break;
+        case PCAP_FILE_MAGIC_NSEC_SWAPPED:
+            context->map_swapped = 1;
+            context->map_nsec = 1;
+            break;
+        default:
+            /* Not a plain pcap file - let libpcap have a go at it. */
+            munmap(context->map, context->map_size);
+            context->map = NULL;
+            return DAQ_ERROR;
+    }
+
+    context->map_linktype = context->map_swapped ? pcap_file_swap32(hdr->network) : hdr->network;
+    context->map_offset = sizeof(PcapFileHeader);
+    madvise(context->map, context->map_size, MADV_SEQUENTIAL);
+
+    return DAQ_SUCCESS;
+}
+
+static void pcap_daq_close_file_mmap(Pcap_Context_t *context)
+{
+    if (context->map)
+    {
+        munmap(context->map, context->map_size);
+        context->map = NULL;
+        context->map_size = 0;
+    }
+    if (context->fcode_valid)
+    {
+        pcap_freecode(&context->fcode);
+        context->fcode_valid = 0;
+    }
+}
+
+/* Expand a comma-separated list of filenames/globs and keep the subset of
+   files belonging to this reader instance (every Nth file, round-robin).
+   Each file is still replayed start-to-finish by a single reader, so
+   per-file packet order is preserved. */
+static int pcap_daq_build_file_list(Pcap_Context_t *context, const char *spec,
+                                    unsigned instances, unsigned id,
+                                    char *errbuf, size_t len)
+{
+    char *copy, *tok, *save = NULL;
+    unsigned idx = 0;
+    size_t i;
+    glob_t g;
+
+    copy = strdup(spec);
+    if (!copy)
+    {
+        snprintf(errbuf, len, "%s: Couldn't allocate memory for the file list!", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        memset(&g, 0, sizeof(g));
+        /* GLOB_NOCHECK keeps plain filenames working as literals. */
+        if (glob(tok, GLOB_NOCHECK, NULL, &g) != 0)
+        {
+            globfree(&g);
+            continue;
+        }
+        for (i = 0; i < g.gl_pathc; i++)
+        {
+            char **tmp;
+
+            if (idx++ % instances != id)
+                continue;
+            tmp = realloc(context->files, (context->file_count + 1) * sizeof(*context->files));
+            if (!tmp)
+            {
+                globfree(&g);
+                free(copy);
+                snprintf(errbuf, len, "%s: Couldn't allocate memory for the file list!", __func__);
+                return DAQ_ERROR_NOMEM;
+            }
+            context->files = tmp;
+            context->files[context->file_count] = strdup(g.gl_pathv[i]);
+            if (!context->files[context->file_count])
+            {
+                globfree(&g);
+                free(copy);
+                snprintf(errbuf, len, "%s: Couldn't allocate memory for the file list!", __func__);
+                return DAQ_ERROR_NOMEM;
+            }
+            context->file_count++;
+        }
+        globfree(&g);
+    }
+    free(copy);
+
+    if (!context->file_count)
+    {
+        snprintf(errbuf, len, "%s: No files in the list for reader %u of %u!", __func__, id, instances);
+        return DAQ_ERROR;
+    }
+
+    return DAQ_SUCCESS;
+}
+
 static int pcap_daq_open(Pcap_Context_t *context)
 {
     uint32_t localnet, netmask;
@@ -114,7 +304,7 @@ static int pcap_daq_open(Pcap_Context_t *context)
     int status;
 #endif /* PCAP_OLDSTYLE */
 
-    if (context->handle)
+    if (context->handle || context->map)
         return DAQ_SUCCESS;
 
     if (context->device)
@@ -146,9 +336,13 @@ static int pcap_daq_open(Pcap_Context_t *context)
     }
     else
     {
-        context->handle = pcap_open_offline(context->file, context->errbuf);
-        if (!context->handle)
-            return DAQ_ERROR;
+        /* Prefer the zero-copy mmap reader for plain pcap files. */
+        if (pcap_daq_open_file_mmap(context) != DAQ_SUCCESS)
+        {
+            context->handle = pcap_open_offline(context->file, context->errbuf);
+            if (!context->handle)
+                return DAQ_ERROR;
+        }
 
         netmask = htonl(defaultnet);
     }
@@ -204,7 +398,14 @@ static int pcap_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
 {
     Pcap_Context_t *context;
 #ifndef PCAP_OLDSTYLE
+    /* Instances created without an explicit reader-id take the next slot in
+       round-robin order; module initialization is single-threaded in practice. */
+    static unsigned next_reader_id = 0;
     DAQ_Dict *entry;
+    uint32_t flow_cache_size = 0;
+    const char *files_spec = NULL;
+    unsigned reader_instances = 0;
+    long reader_id = -1;
 #endif
 
     context = calloc(1, sizeof(Pcap_Context_t));
@@ -226,14 +427,58 @@ static int pcap_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
             context->buffer_size = strtol(entry->value, NULL, 10);
         else if (!strcmp(entry->key,  "immediate"))
             context->immediate_flag = strtol(entry->value, NULL, 10);
+        else if (!strcmp(entry->key, "flow_cache_size"))
+            flow_cache_size = strtoul(entry->value, NULL, 10);
+        else if (!strcmp(entry->key, "files"))
+            files_spec = entry->value;
+        else if (!strcmp(entry->key, "reader-instances"))
+            reader_instances = strtoul(entry->value, NULL, 10);
+        else if (!strcmp(entry->key, "reader-id"))
+            reader_id = strtol(entry->value, NULL, 10);
     }
     /* Try to account for legacy PCAP_FRAMES environment variable if we weren't passed a buffer size. */
     if (context->buffer_size == 0)
         context->buffer_size = translate_PCAP_FRAMES(context->snaplen);
+
+    /* Optionally stand up the software flow fastpath cache. */
+    if (flow_cache_size && daq_flow_cache_init(&context->flow_cache, flow_cache_size) != 0)
+    {
+        snprintf(errbuf, len, "%s: Couldn't allocate memory for the flow cache!", __func__);
+        free(context);
+        return DAQ_ERROR_NOMEM;
+    }
 #endif
 
     if (config->mode == DAQ_MODE_READ_FILE)
     {
+#ifndef PCAP_OLDSTYLE
+        if (files_spec)
+        {
+            unsigned id;
+            int rval;
+
+            if (!reader_instances)
+                reader_instances = 1;
+            if (reader_id >= 0)
+                id = (unsigned) reader_id % reader_instances;
+            else
+                id = next_reader_id++ % reader_instances;
+
+            rval = pcap_daq_build_file_list(context, files_spec, reader_instances, id, errbuf, len);
+            if (rval != DAQ_SUCCESS)
+            {
+                while (context->file_count)
+                    free(context->files[--context->file_count]);
+                free(context->files);
+                if (context->flow_cache.entries)
+                    daq_flow_cache_cleanup(&context->flow_cache);
+                free(context);
+                return rval;
+            }
+            context->file = strdup(context->files[0]);
+        }
+        else
+#endif
         context->file = strdup(config->name);
         if (!context->file)
         {
@@ -279,6 +524,44 @@ static int pcap_daq_set_filter(void *handle, const char *filter)
     struct bpf_program fcode;
     pcap_t *dead_handle;
 
+    /* In multi-file mode, keep a copy to reapply when advancing files. */
+    if (context->files && filter != context->files_filter)
+    {
+        char *copy = strdup(filter);
+
+        if (copy)
+        {
+            free(context->files_filter);
+            context->files_filter = copy;
+        }
+    }
+
+    if (context->map)
+    {
+        /* The mmap reader applies the compiled filter itself via
+           pcap_offline_filter(), so compile and hang on to it here. */
+        dead_handle = pcap_open_dead(context->map_linktype, context->snaplen);
+        if (!dead_handle)
+        {
+            DPE(context->errbuf, "%s: Could not allocate a dead PCAP handle!", __func__);
+            return DAQ_ERROR_NOMEM;
+        }
+        if (pcap_compile(dead_handle, &fcode, (char *)filter, 1, context->netmask) < 0)
+        {
+            DPE(context->errbuf, "%s: pcap_compile: %s", __func__, pcap_geterr(dead_handle));
+            pcap_close(dead_handle);
+            return DAQ_ERROR;
+        }
+        pcap_close(dead_handle);
+
+        if (context->fcode_valid)
+            pcap_freecode(&context->fcode);
+        context->fcode = fcode;
+        context->fcode_valid = 1;
+
+        return DAQ_SUCCESS;
+    }
+
     if (context->handle)
     {
         if (pcap_compile(context->handle, &fcode, (char *)filter, 1, context->netmask) < 0)
@@ -373,10 +656,92 @@ static void pcap_process_loop(u_char *user, const struct pcap_pkthdr *pkth, cons
     if (context->hwupdate_count++ == DAQ_PCAP_ROLLOVER_LIM)
         update_hw_stats(context);
 
+    /* Short-circuit flows with a cached flow-wide verdict before the callback. */
+    if (context->flow_cache.entries && daq_flow_cache_check(&context->flow_cache, data, pkth->caplen, &verdict))
+    {
+        context->stats.verdicts[verdict]++;
+        return;
+    }
+
     verdict = context->analysis_func(context->user_data, &hdr, data);
     if (verdict >= MAX_DAQ_VERDICT)
         verdict = DAQ_VERDICT_PASS;
     context->stats.verdicts[verdict]++;
+    if (context->flow_cache.entries)
+        daq_flow_cache_update(&context->flow_cache, data, pkth->caplen, verdict);
+}
+
+/* Close out the current capture file and open the next one in this reader's
+   list, reapplying the stored filter to the new handle. */
+static int pcap_daq_advance_file(Pcap_Context_t *context)
+{
+    if (!context->files || context->file_cur + 1 >= context->file_count)
+        return DAQ_READFILE_EOF;
+
+    if (context->handle)
+    {
+        pcap_close(context->handle);
+        context->handle = NULL;
+    }
+    pcap_daq_close_file_mmap(context);
+
+    context->file_cur++;
+    free(context->file);
+    context->file = strdup(context->files[context->file_cur]);
+    if (!context->file)
+        return DAQ_ERROR;
+
+    if (pcap_daq_open(context) != DAQ_SUCCESS)
+        return DAQ_ERROR;
+
+    if (context->files_filter && pcap_daq_set_filter(context, context->files_filter) != DAQ_SUCCESS)
+        return DAQ_ERROR;
+
+    return DAQ_SUCCESS;
+}
+
+static int pcap_daq_acquire_mmap(Pcap_Context_t *context, int cnt)
+{
+    const PcapRecHeader *rec;
+    struct pcap_pkthdr pkth;
+    const uint8_t *data;
+    uint32_t caplen, frac;
+
+    context->map_break = 0;
+    while (context->packets < cnt || cnt <= 0)
+    {
+        if (context->map_break)
+            return 0;
+
+        if (context->map_offset + sizeof(*rec) > context->map_size)
+            return DAQ_READFILE_EOF;
+        rec = (const PcapRecHeader *) (context->map + context->map_offset);
+
+        caplen = context->map_swapped ? pcap_file_swap32(rec->incl_len) : rec->incl_len;
+        if (caplen > context->map_size - context->map_offset - sizeof(*rec))
+        {
+            /* Truncated or corrupt trailing record - treat it as EOF. */
+            return DAQ_READFILE_EOF;
+        }
+        data = context->map + context->map_offset + sizeof(*rec);
+        context->map_offset += sizeof(*rec) + caplen;
+
+        frac = context->map_swapped ? pcap_file_swap32(rec->ts_frac) : rec->ts_frac;
+        pkth.ts.tv_sec = context->map_swapped ? pcap_file_swap32(rec->ts_sec) : rec->ts_sec;
+        pkth.ts.tv_usec = context->map_nsec ? frac / 1000 : frac;
+        pkth.caplen = caplen;
+        pkth.len = context->map_swapped ? pcap_file_swap32(rec->orig_len) : rec->orig_len;
+
+        if (context->fcode_valid && !pcap_offline_filter(&context->fcode, &pkth, data))
+        {
+            context->stats.packets_filtered++;
+            continue;
+        }
+
+        pcap_process_loop((u_char *) context, &pkth, data);
+    }
+
+    return 0;
 }
 
 static int pcap_daq_acquire(
@@ -389,30 +754,60 @@ static int pcap_daq_acquire(
     context->user_data = user;
 
     context->packets = 0;
-    while (context->packets < cnt || cnt <= 0)
+    for (;;)
     {
-        ret = pcap_dispatch(
-            context->handle, (cnt <= 0) ? -1 : cnt-context->packets, pcap_process_loop, (void *) context);
-        if (ret == -1)
+        if (context->map)
+            ret = pcap_daq_acquire_mmap(context, cnt);
+        else
         {
-            DPE(context->errbuf, "%s", pcap_geterr(context->handle));
-            return ret;
+            ret = 0;
+            while (context->packets < cnt || cnt <= 0)
+            {
+                ret = pcap_dispatch(
+                    context->handle, (cnt <= 0) ? -1 : cnt-context->packets, pcap_process_loop, (void *) context);
+                if (ret == -1)
+                {
+                    DPE(context->errbuf, "%s", pcap_geterr(context->handle));
+                    return ret;
+                }
+                /* In read-file mode, PCAP returns 0 when it hits the end of the file. */
+                else if (context->file && ret == 0)
+                {
+                    ret = DAQ_READFILE_EOF;
+                    break;
+                }
+                /* If we hit a breakloop call or timed out without reading any packets, break out. */
+                else if (ret == -2 || ret == 0)
+                {
+                    ret = 0;
+                    break;
+                }
+                ret = 0;
+            }
         }
-        /* In read-file mode, PCAP returns 0 when it hits the end of the file. */
-        else if (context->file && ret == 0)
-            return DAQ_READFILE_EOF;
-        /* If we hit a breakloop call or timed out without reading any packets, break out. */
-        else if (ret == -2 || ret == 0)
-            break;
-    }
 
-    return 0;
+        if (ret != DAQ_READFILE_EOF)
+            return ret;
+
+        /* End of the current file - move on to the next one in this reader's list. */
+        ret = pcap_daq_advance_file(context);
+        if (ret != DAQ_SUCCESS)
+            return ret;
+        if (cnt > 0 && context->packets >= cnt)
+            return 0;
+    }
 }
 
 static int pcap_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse)
 {
     Pcap_Context_t *context = (Pcap_Context_t *) handle;
 
+    if (!context->handle)
+    {
+        DPE(context->errbuf, "%s: Injection requires a live PCAP handle!", __func__);
+        return DAQ_ERROR;
+    }
+
     if (pcap_inject(context->handle, packet_data, len) < 0)
     {
         DPE(context->errbuf, "%s", pcap_geterr(context->handle));
@@ -427,6 +822,12 @@ static int pcap_daq_breakloop(void *handle)
 {
     Pcap_Context_t *context = (Pcap_Context_t *) handle;
 
+    if (context->map)
+    {
+        context->map_break = 1;
+        return DAQ_SUCCESS;
+    }
+
     if (!context->handle)
         return DAQ_ERROR;
 
@@ -446,6 +847,7 @@ static int pcap_daq_stop(void *handle)
         pcap_close(context->handle);
         context->handle = NULL;
     }
+    pcap_daq_close_file_mmap(context);
 
     context->state = DAQ_STATE_STOPPED;
 
@@ -458,12 +860,21 @@ static void pcap_daq_shutdown(void *handle)
 
     if (context->handle)
         pcap_close(context->handle);
+    pcap_daq_close_file_mmap(context);
     if (context->device)
         free(context->device);
     if (context->file)
         free(context->file);
     if (context->filter_string)
         free(context->filter_string);
+    if (context->flow_cache.entries)
+        daq_flow_cache_cleanup(&context->flow_cache);
+    while (context->file_count)
+        free(context->files[--context->file_count]);
+    if (context->files)
+        free(context->files);
+    if (context->files_filter)
+        free(context->files_filter);
     free(context);
 }
 
@@ -481,7 +892,7 @@ static int pcap_daq_get_stats(void *handle, DAQ_Stats_t *stats)
     if (update_hw_stats(context) != DAQ_SUCCESS)
         return DAQ_ERROR;
 
-    memcpy(stats, &context->stats, sizeof(DAQ_Stats_t));
+    daq_stats_snapshot(&context->stats, stats);
 
     return DAQ_SUCCESS;
 }
@@ -534,6 +945,9 @@ static int pcap_daq_get_datalink_type(void *handle)
 {
     Pcap_Context_t *context = (Pcap_Context_t *) handle;
 
+    if (context->map)
+        return context->map_linktype;
+
     if (context->handle)
         return pcap_datalink(context->handle);
 
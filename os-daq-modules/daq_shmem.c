@@ -0,0 +1,409 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+** Copyright (C) 2010-2013 Sourcefire, Inc.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Shared-memory DAQ module: the consumer side of the transport defined in
+ * daq_shmem.h.  A separate capture process owns the actual packet source and
+ * publishes into a named POSIX shared memory ring (typically by passing
+ * daq_shmem_producer_callback() to daq_acquire() on any other DAQ module);
+ * this module reads the packets in place - no per-packet copies or syscalls -
+ * and posts verdicts back through the companion ring, where the producer
+ * applies WHITELIST/BLACKLIST at flow granularity.
+ *
+ * Because the ring indices live in the shared region, an analysis process
+ * that crashes or restarts reattaches and resumes at the exact slot it left
+ * off; packets captured in the interim are waiting in the ring.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "daq_api.h"
+#include "daq_shmem.h"
+#include "sfbpf.h"
+
+#define DAQ_SHMEM_MOD_VERSION 1
+
+/* Number of times the acquire loop rechecks an empty ring before sleeping. */
+#define SHMEM_SPIN_COUNT    8192
+/* How long to sleep between rechecks once spinning gives up (microseconds). */
+#define SHMEM_SLEEP_USECS   100
+
+typedef struct _shmem_context
+{
+    char *name;
+    char *filter;
+    struct sfbpf_program fcode;
+    int snaplen;
+    int timeout;
+    int debug;
+    DAQ_ShmemHeader_t *shm;
+    size_t map_size;
+    volatile int break_loop;
+    DAQ_Stats_t stats;
+    DAQ_State state;
+    char errbuf[256];
+} Shmem_Context_t;
+
+static void shmem_daq_shutdown(void *handle);
+
+static int shmem_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char *errbuf, size_t errlen)
+{
+    Shmem_Context_t *sc;
+    DAQ_Dict *entry;
+
+    if (!config->name || !*config->name)
+    {
+        snprintf(errbuf, errlen, "%s: No shared memory region name specified!", __func__);
+        return DAQ_ERROR_INVAL;
+    }
+
+    sc = calloc(1, sizeof(Shmem_Context_t));
+    if (!sc)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the new Shmem context!", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    sc->name = strdup(config->name);
+    if (!sc->name)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the region name!", __func__);
+        free(sc);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    sc->snaplen = config->snaplen;
+    sc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
+
+    for (entry = config->values; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->key, "debug"))
+            sc->debug = 1;
+        else
+        {
+            snprintf(errbuf, errlen, "%s: Unrecognized variable: '%s'!", __func__, entry->key);
+            shmem_daq_shutdown(sc);
+            return DAQ_ERROR;
+        }
+    }
+
+    sc->state = DAQ_STATE_INITIALIZED;
+
+    *ctxt_ptr = sc;
+    return DAQ_SUCCESS;
+}
+
+static int shmem_daq_set_filter(void *handle, const char *filter)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+    struct sfbpf_program fcode;
+
+    if (sc->filter)
+        free(sc->filter);
+
+    sc->filter = strdup(filter);
+    if (!sc->filter)
+    {
+        DPE(sc->errbuf, "%s: Couldn't allocate memory for the filter string!", __func__);
+        return DAQ_ERROR;
+    }
+
+    if (sfbpf_compile(sc->snaplen, DLT_EN10MB, &fcode, sc->filter, 1, 0) < 0)
+    {
+        DPE(sc->errbuf, "%s: BPF state machine compilation failed!", __func__);
+        return DAQ_ERROR;
+    }
+
+    sfbpf_freecode(&sc->fcode);
+    sc->fcode.bf_len = fcode.bf_len;
+    sc->fcode.bf_insns = fcode.bf_insns;
+
+    return DAQ_SUCCESS;
+}
+
+static int shmem_daq_start(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    sc->shm = daq_shmem_attach(sc->name, &sc->map_size);
+    if (!sc->shm)
+    {
+        DPE(sc->errbuf, "%s: Couldn't attach to shared memory region %s: %s (%d)",
+            __func__, sc->name, strerror(errno), errno);
+        return DAQ_ERROR;
+    }
+    sc->snaplen = sc->shm->snaplen;
+
+    if (sc->debug)
+    {
+        printf("Attached to %s: %u slots of %u bytes (snaplen %u), %u packets waiting\n",
+               sc->name, sc->shm->num_slots, sc->shm->slot_stride, sc->shm->snaplen,
+               sc->shm->pkt_head - sc->shm->pkt_tail);
+    }
+
+    memset(&sc->stats, 0, sizeof(DAQ_Stats_t));
+
+    sc->state = DAQ_STATE_STARTED;
+
+    return DAQ_SUCCESS;
+}
+
+/* Wait for the producer to publish something.  Returns 1 if the acquire loop
+   should recheck the ring or 0 if control should return to the caller. */
+static int shmem_wait_for_packets(Shmem_Context_t *sc)
+{
+    struct timespec ts, sleep_ts = { 0, SHMEM_SLEEP_USECS * 1000 };
+    uint64_t deadline = 0, now;
+    unsigned int spins = 0;
+
+    if (sc->timeout > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        deadline = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + (uint64_t) sc->timeout * 1000;
+    }
+
+    for (;;)
+    {
+        if (daq_shmem_consumer_peek(sc->shm) || sc->break_loop)
+            return 1;
+        if (deadline)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            if (now >= deadline)
+                return 0;
+        }
+        /* Spin briefly for low latency, then back off to sleeping; there is
+           no file descriptor to block on. */
+        if (++spins >= SHMEM_SPIN_COUNT)
+            nanosleep(&sleep_ts, NULL);
+    }
+}
+
+static int shmem_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+    DAQ_ShmemSlot_t *slot;
+    DAQ_Verdict verdict;
+    int c = 0;
+
+    while (c < cnt || cnt <= 0)
+    {
+        /* Has breakloop() been called? */
+        if (sc->break_loop)
+        {
+            sc->break_loop = 0;
+            return 0;
+        }
+
+        slot = daq_shmem_consumer_peek(sc->shm);
+        if (!slot)
+        {
+            if (shmem_wait_for_packets(sc) == 0)
+                break;
+            continue;
+        }
+
+        if (sc->fcode.bf_insns &&
+            sfbpf_filter(sc->fcode.bf_insns, slot->data, slot->hdr.pktlen, slot->hdr.caplen) == 0)
+        {
+            sc->stats.packets_filtered++;
+            daq_shmem_consumer_release(sc->shm, DAQ_VERDICT_PASS);
+            continue;
+        }
+
+        verdict = DAQ_VERDICT_PASS;
+        if (callback)
+        {
+            verdict = callback(user, &slot->hdr, slot->data);
+            if (verdict >= MAX_DAQ_VERDICT)
+                verdict = DAQ_VERDICT_PASS;
+            sc->stats.verdicts[verdict]++;
+        }
+        sc->stats.packets_received++;
+        c++;
+
+        /* The packet was already forwarded (or not) by the capture process;
+           the posted verdict feeds its flow fastpath. */
+        daq_shmem_consumer_release(sc->shm, verdict);
+    }
+    return 0;
+}
+
+static int shmem_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    DPE(sc->errbuf, "%s: Injection is not possible through the shared memory ring!", __func__);
+    return DAQ_ERROR_NOTSUP;
+}
+
+static int shmem_daq_breakloop(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    sc->break_loop = 1;
+
+    return DAQ_SUCCESS;
+}
+
+static int shmem_daq_stop(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    if (sc->shm)
+    {
+        /* The region (and any backlog in it) outlives us - that's the point. */
+        daq_shmem_detach(sc->shm, sc->map_size);
+        sc->shm = NULL;
+    }
+
+    sc->state = DAQ_STATE_STOPPED;
+
+    return DAQ_SUCCESS;
+}
+
+static void shmem_daq_shutdown(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    if (sc->shm)
+        daq_shmem_detach(sc->shm, sc->map_size);
+    sfbpf_freecode(&sc->fcode);
+    if (sc->filter)
+        free(sc->filter);
+    if (sc->name)
+        free(sc->name);
+    free(sc);
+}
+
+static DAQ_State shmem_daq_check_status(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    return sc->state;
+}
+
+static int shmem_daq_get_stats(void *handle, DAQ_Stats_t *stats)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    if (sc->shm)
+    {
+        /* The free-running head is the total published; the producer counts
+           ring-full drops in the region as well. */
+        sc->stats.hw_packets_received = sc->shm->pkt_head;
+        sc->stats.hw_packets_dropped = sc->shm->drops;
+    }
+    memcpy(stats, &sc->stats, sizeof(DAQ_Stats_t));
+
+    return DAQ_SUCCESS;
+}
+
+static void shmem_daq_reset_stats(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    memset(&sc->stats, 0, sizeof(DAQ_Stats_t));
+}
+
+static int shmem_daq_get_snaplen(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    return sc->snaplen;
+}
+
+static uint32_t shmem_daq_get_capabilities(void *handle)
+{
+    /* Verdicts travel back to the capture process, which enforces
+       WHITELIST/BLACKLIST at flow granularity. */
+    return DAQ_CAPA_BLOCK | DAQ_CAPA_WHITELIST | DAQ_CAPA_BLACKLIST |
+           DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF | DAQ_CAPA_UNPRIV_START;
+}
+
+static int shmem_daq_get_datalink_type(void *handle)
+{
+    return DLT_EN10MB;
+}
+
+static const char *shmem_daq_get_errbuf(void *handle)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    return sc->errbuf;
+}
+
+static void shmem_daq_set_errbuf(void *handle, const char *string)
+{
+    Shmem_Context_t *sc = (Shmem_Context_t *) handle;
+
+    if (!string)
+        return;
+
+    DPE(sc->errbuf, "%s", string);
+}
+
+static int shmem_daq_get_device_index(void *handle, const char *device)
+{
+    return DAQ_ERROR_NOTSUP;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC const DAQ_Module_t DAQ_MODULE_DATA =
+#else
+const DAQ_Module_t shmem_daq_module_data =
+#endif
+{
+    .api_version = DAQ_API_VERSION,
+    .module_version = DAQ_SHMEM_MOD_VERSION,
+    .name = "shmem",
+    .type = DAQ_TYPE_INTF_CAPABLE | DAQ_TYPE_MULTI_INSTANCE,
+    .initialize = shmem_daq_initialize,
+    .set_filter = shmem_daq_set_filter,
+    .start = shmem_daq_start,
+    .acquire = shmem_daq_acquire,
+    .inject = shmem_daq_inject,
+    .breakloop = shmem_daq_breakloop,
+    .stop = shmem_daq_stop,
+    .shutdown = shmem_daq_shutdown,
+    .check_status = shmem_daq_check_status,
+    .get_stats = shmem_daq_get_stats,
+    .reset_stats = shmem_daq_reset_stats,
+    .get_snaplen = shmem_daq_get_snaplen,
+    .get_capabilities = shmem_daq_get_capabilities,
+    .get_datalink_type = shmem_daq_get_datalink_type,
+    .get_errbuf = shmem_daq_get_errbuf,
+    .set_errbuf = shmem_daq_set_errbuf,
+    .get_device_index = shmem_daq_get_device_index,
+    .modify_flow = NULL,
+    .hup_prep = NULL,
+    .hup_apply = NULL,
+    .hup_post = NULL,
+};
@@ -47,5 +47,11 @@ const DAQ_Module_t *static_modules[] =
 #ifdef BUILD_NETMAP_MODULE
     &netmap_daq_module_data,
 #endif
+#ifdef BUILD_AFXDP_MODULE
+    &afxdp_daq_module_data,
+#endif
+#ifdef BUILD_SHMEM_MODULE
+    &shmem_daq_module_data,
+#endif
 };
 const int num_static_modules = sizeof(static_modules) / sizeof(static_modules[0]);
@@ -45,3 +45,9 @@ extern const DAQ_Module_t dpdk_daq_module_data;
 #ifdef BUILD_NETMAP_MODULE
 extern const DAQ_Module_t netmap_daq_module_data;
 #endif
+#ifdef BUILD_AFXDP_MODULE
+extern const DAQ_Module_t afxdp_daq_module_data;
+#endif
+#ifdef BUILD_SHMEM_MODULE
+extern const DAQ_Module_t shmem_daq_module_data;
+#endif
@@ -0,0 +1,497 @@
+/*
+** Copyright (C) 2014-2015 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _DAQ_XDP_SHUNT_H
+#define _DAQ_XDP_SHUNT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <daq_common.h>
+#include <daq_tunnel.h>
+
+/*
+ * Kernel-shared flow shunt for the AFPacket module.
+ *
+ * When the application issues a WHITELIST or BLACKLIST verdict for a flow,
+ * the rest of that flow no longer needs to be seen in userspace.  This
+ * attaches a small generated XDP program to each capture interface that
+ * looks packets up in a BPF hash map keyed by the IPv4 5-tuple and drops
+ * matches before they ever reach the PACKET_MMAP ring; the map is
+ * programmed from the verdict path.  Scope is deliberately narrow: IPv4
+ * TCP/UDP only (optionally single-VLAN tagged), with both directions of a
+ * flow inserted as separate map entries so the kernel program needs no
+ * canonicalization.  Everything else falls through to userspace, including
+ * GTP-U/GRE/Teredo traffic, whose verdicts are scoped to one inner flow and
+ * must stay in the software flow cache rather than match the whole tunnel.
+ *
+ * Like the software flow cache, this is implemented as static inline
+ * functions so the module picks it up with a plain #include.  All of the
+ * BPF and netlink plumbing is done with raw syscalls to avoid a libbpf
+ * dependency.
+ */
+
+#if defined(HAVE_LINUX_BPF_H)
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __NR_bpf
+#define DAQ_XDP_SHUNT_AVAILABLE 1
+#endif
+#endif
+
+#define DAQ_XDP_SHUNT_MAX_IFS   32
+
+/* Key layout shared with the generated XDP program - fields are in network
+    byte order, exactly as they appear on the wire. */
+typedef struct _daq_xdp_shunt_key
+{
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t pad[3];
+} DAQ_XdpShuntKey_t;
+
+typedef struct _daq_xdp_shunt
+{
+    int map_fd;
+    int prog_fd;
+    uint32_t max_flows;
+    uint64_t shunted_flows;
+    int ifindices[DAQ_XDP_SHUNT_MAX_IFS];
+    unsigned num_ifindices;
+} DAQ_XdpShunt_t;
+
+#ifdef DAQ_XDP_SHUNT_AVAILABLE
+
+/* UAPI constants used below, defined locally so that building against older
+    kernel headers (which expose them only as untestable enums, if at all)
+    still works.  These values are fixed ABI. */
+#define DAQ_XDP_BPF_MAP_CREATE          0
+#define DAQ_XDP_BPF_MAP_UPDATE_ELEM     2
+#define DAQ_XDP_BPF_MAP_DELETE_ELEM     3
+#define DAQ_XDP_BPF_PROG_LOAD           5
+#define DAQ_XDP_BPF_MAP_TYPE_HASH       1
+#define DAQ_XDP_BPF_PROG_TYPE_XDP       6
+#define DAQ_XDP_BPF_FUNC_map_lookup     1
+#define DAQ_XDP_BPF_ANY                 0
+#define DAQ_XDP_BPF_PSEUDO_MAP_FD       1
+#define DAQ_XDP_ACT_DROP                1
+#define DAQ_XDP_ACT_PASS                2
+#define DAQ_XDP_IFLA_XDP                43
+#define DAQ_XDP_IFLA_XDP_FD             1
+#define DAQ_XDP_IFLA_XDP_FLAGS          3
+#define DAQ_XDP_FLAGS_UPDATE_IF_NOEXIST 1
+#define DAQ_XDP_FLAGS_SKB_MODE          2
+#define DAQ_XDP_FLAGS_DRV_MODE          4
+
+#define DAQ_XDP_INSN(CODE, DST, SRC, OFF, IMM) \
+    ((struct bpf_insn) { .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+
+static inline int daq_xdp_shunt_bpf(int cmd, union bpf_attr *attr, unsigned int size)
+{
+    return (int) syscall(__NR_bpf, cmd, attr, size);
+}
+
+/* Assemble and load the XDP pre-filter:
+
+        if (ipv4 tcp/udp non-fragment && 5-tuple in map)
+            return XDP_DROP;
+        return XDP_PASS;
+
+    The program is emitted linearly with all not-for-us branches recorded and
+    patched to the trailing PASS label afterward. */
+static inline int daq_xdp_shunt_load_prog(int map_fd, char *errbuf, size_t errlen)
+{
+    struct bpf_insn insns[96];
+    union bpf_attr attr;
+    int lbl_pass[16], num_pass = 0;
+    int lbl_vlan[2], num_vlan = 0;
+    int lbl_ip, lbl_l4;
+    int n = 0, i, fd;
+    uint16_t tpid_q = htons(0x8100), tpid_ad = htons(0x88a8);
+    uint16_t etype_ip = htons(0x0800), frag_mask = htons(0x3fff);
+
+#define DAQ_XDP_EMIT(c, d, s, o, im)    (insns[n++] = DAQ_XDP_INSN((c), (d), (s), (o), (im)))
+#define DAQ_XDP_JPASS(c, d, s, im)      do { lbl_pass[num_pass++] = n; DAQ_XDP_EMIT((c), (d), (s), 0, (im)); } while (0)
+
+    /* r6 = data, r7 = data_end (fixed offsets 0 and 4 in struct xdp_md) */
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_6, BPF_REG_1, 0, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_1, 4, 0);
+    /* Bounds-check the Ethernet header and read the ethertype. */
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_6, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_7, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_6, 12, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, 14);
+    lbl_vlan[num_vlan++] = n;
+    DAQ_XDP_EMIT(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 0, tpid_q);
+    lbl_vlan[num_vlan++] = n;
+    DAQ_XDP_EMIT(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 0, tpid_ad);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, etype_ip);
+    lbl_ip = n;     /* patched below to skip the VLAN block */
+    DAQ_XDP_EMIT(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+    /* Single VLAN tag: recheck bounds, reread the inner ethertype. */
+    for (i = 0; i < num_vlan; i++)
+        insns[lbl_vlan[i]].off = n - lbl_vlan[i] - 1;
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_6, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 18);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_7, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_6, 16, 0);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, etype_ip);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, 18);
+    insns[lbl_ip].off = n - lbl_ip - 1;
+    /* r9 = IPv4 header; check bounds, version, fragmentation, and protocol. */
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_6, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_9, BPF_REG_8, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_9, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 20);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_7, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_9, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, 0xf0);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0x40);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_9, 6, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, frag_mask);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_8, BPF_REG_9, 9, 0);
+    lbl_l4 = n;
+    DAQ_XDP_EMIT(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_8, 0, 0, 6);      /* TCP */
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_8, 0, 17);       /* UDP */
+    insns[lbl_l4].off = n - lbl_l4 - 1;
+    /* Build the lookup key on the stack at r10-16. */
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0);
+    DAQ_XDP_EMIT(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_4, -16, 0);
+    DAQ_XDP_EMIT(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_4, -8, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_9, 12, 0);
+    DAQ_XDP_EMIT(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -16, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_9, 16, 0);
+    DAQ_XDP_EMIT(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -12, 0);
+    DAQ_XDP_EMIT(BPF_STX | BPF_MEM | BPF_B, BPF_REG_10, BPF_REG_8, -4, 0);
+    /* Step past the IP options to the ports and bounds-check them. */
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0x0f);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_5, 0, 0, 2);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_9, BPF_REG_5, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_9, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 4);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_7, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_9, 0, 0);
+    DAQ_XDP_EMIT(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_4, -8, 0);
+    DAQ_XDP_EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_9, 2, 0);
+    DAQ_XDP_EMIT(BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_4, -6, 0);
+    /* r0 = bpf_map_lookup_elem(map, &key) */
+    DAQ_XDP_EMIT(BPF_LD | BPF_IMM | BPF_DW, BPF_REG_1, DAQ_XDP_BPF_PSEUDO_MAP_FD, 0, map_fd);
+    DAQ_XDP_EMIT(0, 0, 0, 0, 0);    /* second half of the 16-byte load */
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -16);
+    DAQ_XDP_EMIT(BPF_JMP | BPF_CALL, 0, 0, 0, DAQ_XDP_BPF_FUNC_map_lookup);
+    DAQ_XDP_JPASS(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0);
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, DAQ_XDP_ACT_DROP);
+    DAQ_XDP_EMIT(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    /* PASS: */
+    for (i = 0; i < num_pass; i++)
+        insns[lbl_pass[i]].off = n - lbl_pass[i] - 1;
+    DAQ_XDP_EMIT(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, DAQ_XDP_ACT_PASS);
+    DAQ_XDP_EMIT(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+#undef DAQ_XDP_EMIT
+#undef DAQ_XDP_JPASS
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = DAQ_XDP_BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = n;
+    attr.insns = (uint64_t) (unsigned long) insns;
+    attr.license = (uint64_t) (unsigned long) "GPL";
+
+    fd = daq_xdp_shunt_bpf(DAQ_XDP_BPF_PROG_LOAD, &attr, sizeof(attr));
+    if (fd < 0)
+        snprintf(errbuf, errlen, "%s: Could not load the XDP shunt program: %s", __func__, strerror(errno));
+
+    return fd;
+}
+
+static inline int daq_xdp_shunt_create(DAQ_XdpShunt_t *shunt, uint32_t max_flows, char *errbuf, size_t errlen)
+{
+    union bpf_attr attr;
+
+    memset(shunt, 0, sizeof(*shunt));
+    shunt->map_fd = -1;
+    shunt->prog_fd = -1;
+    shunt->max_flows = max_flows;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = DAQ_XDP_BPF_MAP_TYPE_HASH;
+    attr.key_size = sizeof(DAQ_XdpShuntKey_t);
+    attr.value_size = sizeof(uint8_t);
+    attr.max_entries = max_flows;
+
+    shunt->map_fd = daq_xdp_shunt_bpf(DAQ_XDP_BPF_MAP_CREATE, &attr, sizeof(attr));
+    if (shunt->map_fd < 0)
+    {
+        snprintf(errbuf, errlen, "%s: Could not create the XDP shunt flow map: %s", __func__, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    shunt->prog_fd = daq_xdp_shunt_load_prog(shunt->map_fd, errbuf, errlen);
+    if (shunt->prog_fd < 0)
+    {
+        close(shunt->map_fd);
+        shunt->map_fd = -1;
+        return DAQ_ERROR;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+/* Attach or detach (fd == -1) an XDP program on an interface via rtnetlink. */
+static inline int daq_xdp_shunt_set_link(int ifindex, int prog_fd, uint32_t flags)
+{
+    struct
+    {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifinfo;
+        char attrbuf[64];
+    } req;
+    struct nlattr *nla, *nested;
+    struct nlmsghdr *rnh;
+    char resp[1024];
+    int sock, len, ret = -1;
+
+    sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (sock < 0)
+        return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.nh.nlmsg_seq = 1;
+    req.ifinfo.ifi_family = AF_UNSPEC;
+    req.ifinfo.ifi_index = ifindex;
+
+    /* IFLA_XDP { IFLA_XDP_FD, IFLA_XDP_FLAGS } */
+    nested = (struct nlattr *) ((char *) &req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    nested->nla_type = NLA_F_NESTED | DAQ_XDP_IFLA_XDP;
+    nla = (struct nlattr *) ((char *) nested + NLA_HDRLEN);
+    nla->nla_type = DAQ_XDP_IFLA_XDP_FD;
+    nla->nla_len = NLA_HDRLEN + sizeof(int);
+    memcpy((char *) nla + NLA_HDRLEN, &prog_fd, sizeof(int));
+    nla = (struct nlattr *) ((char *) nla + NLA_ALIGN(nla->nla_len));
+    nla->nla_type = DAQ_XDP_IFLA_XDP_FLAGS;
+    nla->nla_len = NLA_HDRLEN + sizeof(uint32_t);
+    memcpy((char *) nla + NLA_HDRLEN, &flags, sizeof(uint32_t));
+    nested->nla_len = (char *) nla + NLA_ALIGN(nla->nla_len) - (char *) nested;
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + NLA_ALIGN(nested->nla_len);
+
+    if (send(sock, &req, req.nh.nlmsg_len, 0) != (ssize_t) req.nh.nlmsg_len)
+        goto done;
+
+    len = recv(sock, resp, sizeof(resp), 0);
+    if (len < (int) sizeof(struct nlmsghdr))
+        goto done;
+    rnh = (struct nlmsghdr *) resp;
+    if (rnh->nlmsg_type == NLMSG_ERROR)
+    {
+        struct nlmsgerr *nlerr = (struct nlmsgerr *) NLMSG_DATA(rnh);
+        if (nlerr->error != 0)
+        {
+            errno = -nlerr->error;
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    close(sock);
+    return ret;
+}
+
+static inline int daq_xdp_shunt_attach(DAQ_XdpShunt_t *shunt, int ifindex, char *errbuf, size_t errlen)
+{
+    unsigned i;
+
+    if (shunt->prog_fd < 0 || shunt->num_ifindices >= DAQ_XDP_SHUNT_MAX_IFS)
+        return DAQ_ERROR;
+
+    /* An interface may show up more than once (e.g. after a restart). */
+    for (i = 0; i < shunt->num_ifindices; i++)
+    {
+        if (shunt->ifindices[i] == ifindex)
+            return DAQ_SUCCESS;
+    }
+
+    /* Prefer native driver mode and fall back to the generic (SKB) hook. */
+    if (daq_xdp_shunt_set_link(ifindex, shunt->prog_fd,
+                               DAQ_XDP_FLAGS_UPDATE_IF_NOEXIST | DAQ_XDP_FLAGS_DRV_MODE) != 0 &&
+        daq_xdp_shunt_set_link(ifindex, shunt->prog_fd,
+                               DAQ_XDP_FLAGS_UPDATE_IF_NOEXIST | DAQ_XDP_FLAGS_SKB_MODE) != 0)
+    {
+        snprintf(errbuf, errlen, "%s: Could not attach the XDP shunt program to interface %d: %s",
+                __func__, ifindex, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    shunt->ifindices[shunt->num_ifindices++] = ifindex;
+
+    return DAQ_SUCCESS;
+}
+
+static inline void daq_xdp_shunt_detach_all(DAQ_XdpShunt_t *shunt)
+{
+    unsigned i;
+
+    for (i = 0; i < shunt->num_ifindices; i++)
+        daq_xdp_shunt_set_link(shunt->ifindices[i], -1, 0);
+    shunt->num_ifindices = 0;
+}
+
+/* Extract the on-the-wire IPv4 5-tuple.  Mirrors what the XDP program
+    parses - anything it would pass through is not worth inserting. */
+static inline int daq_xdp_shunt_key_extract(const uint8_t *data, uint32_t len, DAQ_XdpShuntKey_t *key)
+{
+    uint32_t offset = 12, hlen;
+    uint16_t ethertype;
+
+    if (len < 14)
+        return -1;
+    ethertype = (data[offset] << 8) | data[offset + 1];
+    if (ethertype == 0x8100 || ethertype == 0x88a8)
+    {
+        offset += 4;
+        if (len < offset + 2)
+            return -1;
+        ethertype = (data[offset] << 8) | data[offset + 1];
+    }
+    offset += 2;
+
+    if (ethertype != 0x0800 || len < offset + 20 || (data[offset] >> 4) != 4)
+        return -1;
+    if ((data[offset + 6] & 0x3f) || data[offset + 7])  /* Fragment */
+        return -1;
+
+    memset(key, 0, sizeof(*key));
+    key->proto = data[offset + 9];
+    if (key->proto != 6 && key->proto != 17)
+        return -1;
+    memcpy(&key->saddr, &data[offset + 12], 4);
+    memcpy(&key->daddr, &data[offset + 16], 4);
+
+    hlen = (data[offset] & 0x0f) * 4;
+    offset += hlen;
+    if (len < offset + 4)
+        return -1;
+    memcpy(&key->sport, &data[offset], 2);
+    memcpy(&key->dport, &data[offset + 2], 2);
+
+    return 0;
+}
+
+/* Push a flow-wide verdict down into the kernel map.  Both directions are
+    inserted so the XDP program can match without canonicalizing.  WHITELIST
+    is only shunted when allowed by the caller - an inline deployment still
+    has to forward whitelisted packets, which XDP_DROP would not do. */
+static inline void daq_xdp_shunt_update(DAQ_XdpShunt_t *shunt, const uint8_t *data, uint32_t len,
+                                        DAQ_Verdict verdict, int allow_whitelist)
+{
+    DAQ_XdpShuntKey_t key, rkey;
+    DAQ_FlowKey_t fkey;
+    union bpf_attr attr;
+    uint8_t action = 1;
+
+    if (verdict != DAQ_VERDICT_BLACKLIST && (verdict != DAQ_VERDICT_WHITELIST || !allow_whitelist))
+        return;
+
+    /* The XDP program matches on the outer 5-tuple, but verdicts for
+        encapsulated traffic are scoped to one inner flow - installing the
+        tunnel endpoints' tuple would shunt every flow sharing the tunnel.
+        Leave those to the software flow cache, which keys on the inner
+        5-tuple. */
+    if (daq_tunnel_flow_key(data, len, &fkey) != DAQ_DP_TUNNEL_TYPE_NON_TUNNEL)
+        return;
+
+    if (daq_xdp_shunt_key_extract(data, len, &key) != 0)
+        return;
+
+    memset(&rkey, 0, sizeof(rkey));
+    rkey.saddr = key.daddr;
+    rkey.daddr = key.saddr;
+    rkey.sport = key.dport;
+    rkey.dport = key.sport;
+    rkey.proto = key.proto;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = shunt->map_fd;
+    attr.key = (uint64_t) (unsigned long) &key;
+    attr.value = (uint64_t) (unsigned long) &action;
+    attr.flags = DAQ_XDP_BPF_ANY;
+    if (daq_xdp_shunt_bpf(DAQ_XDP_BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)) == 0)
+        shunt->shunted_flows++;
+    attr.key = (uint64_t) (unsigned long) &rkey;
+    daq_xdp_shunt_bpf(DAQ_XDP_BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr));
+}
+
+static inline void daq_xdp_shunt_cleanup(DAQ_XdpShunt_t *shunt)
+{
+    daq_xdp_shunt_detach_all(shunt);
+    if (shunt->prog_fd >= 0)
+    {
+        close(shunt->prog_fd);
+        shunt->prog_fd = -1;
+    }
+    if (shunt->map_fd >= 0)
+    {
+        close(shunt->map_fd);
+        shunt->map_fd = -1;
+    }
+}
+
+#else /* !DAQ_XDP_SHUNT_AVAILABLE */
+
+static inline int daq_xdp_shunt_create(DAQ_XdpShunt_t *shunt, uint32_t max_flows, char *errbuf, size_t errlen)
+{
+    memset(shunt, 0, sizeof(*shunt));
+    shunt->map_fd = -1;
+    shunt->prog_fd = -1;
+    snprintf(errbuf, errlen, "%s: XDP flow shunting is not supported on this system!", __func__);
+    return DAQ_ERROR_NOTSUP;
+}
+
+static inline int daq_xdp_shunt_attach(DAQ_XdpShunt_t *shunt, int ifindex, char *errbuf, size_t errlen)
+{
+    return DAQ_ERROR_NOTSUP;
+}
+
+static inline void daq_xdp_shunt_detach_all(DAQ_XdpShunt_t *shunt) { }
+
+static inline void daq_xdp_shunt_update(DAQ_XdpShunt_t *shunt, const uint8_t *data, uint32_t len,
+                                        DAQ_Verdict verdict, int allow_whitelist) { }
+
+static inline void daq_xdp_shunt_cleanup(DAQ_XdpShunt_t *shunt) { }
+
+#endif /* DAQ_XDP_SHUNT_AVAILABLE */
+
+#endif /* _DAQ_XDP_SHUNT_H */
@@ -331,6 +331,7 @@ __declspec(noreturn) void bpf_error(const char *, ...);
 
 void finish_parse(struct block *);
 char *sdup(const char *);
+void *newchunk(u_int);
 
 struct bpf_insn *icode_to_fcode(struct block *, int *);
 int pcap_parse(void);
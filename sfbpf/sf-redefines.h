@@ -79,6 +79,7 @@
 #define bpf_program sfbpf_program
 
 #define bpf_filter sfbpf_filter
+#define bpf_filter_batch sfbpf_filter_batch
 #define bpf_validate sfbpf_validate
 
 #define BPF_ALIGNMENT SFBPF_ALIGNMENT
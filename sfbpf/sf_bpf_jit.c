@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that: (1) source code distributions
+ * retain the above copyright notice and this paragraph in its entirety, (2)
+ * distributions including binary code include the above copyright notice and
+ * this paragraph in its entirety in the documentation or other materials
+ * provided with the distribution.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Just-in-time translation of compiled BPF programs to native x86-64 code.
+ *
+ * Programs produced by pcap_compile() are translated once and the resulting
+ * function is recorded in a small registry keyed by the instruction array
+ * pointer; bpf_filter() consults the registry and dispatches to the native
+ * code when a translation exists, falling back to the interpreter otherwise.
+ * Translation failures (unsupported opcode, out of memory, full registry) are
+ * never errors -- the interpreter remains the reference implementation.
+ *
+ * Register allocation for the generated code (System V AMD64 ABI):
+ *
+ *      rdi     packet data pointer (first argument, preserved)
+ *      r8d     wirelen
+ *      r9d     buflen
+ *      eax     accumulator (A)
+ *      ebx     index register (X, callee-saved, so saved/restored)
+ *      r10/r11 scratch for bounds checks and indirect offsets
+ *      rsp     scratch memory store (BPF_MEMWORDS words)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sfbpf-int.h"
+
+#ifdef SFBPF_JIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* One registered translation per live filter program.  Slots are claimed
+   with a compare-and-swap so registration is safe from concurrent compiles;
+   lookups are plain reads on the hot path. */
+#define BPF_JIT_REGISTRY_SIZE   64
+#define BPF_JIT_SLOT_CLAIMED    ((const struct bpf_insn *) -1)
+
+struct bpf_jit_entry
+{
+    const struct bpf_insn *insns;
+    bpf_jit_func_t func;
+    size_t size;
+};
+
+static struct bpf_jit_entry bpf_jit_registry[BPF_JIT_REGISTRY_SIZE];
+static volatile unsigned int bpf_jit_registry_end;
+
+/* Converting between executable memory and a callable function pointer is
+   not sanctioned by ISO C; launder the conversion through a union. */
+union bpf_jit_caster
+{
+    void *mem;
+    bpf_jit_func_t func;
+};
+
+/* Emission state.  The translator runs twice with identical emission logic:
+   the first pass has no output buffer and only measures, populating the
+   per-instruction offset table; the second pass writes the final bytes.
+   All jumps are emitted with 32-bit displacements so instruction sizes do
+   not depend on the (unknown) offsets during the first pass. */
+struct jit_state
+{
+    u_char *buf;
+    u_int len;
+    u_int *offsets;     /* ninsns entries plus "return 0" and epilogue labels */
+    u_int ninsns;
+};
+
+#define JIT_LABEL_RET0(j)   ((j)->ninsns)
+#define JIT_LABEL_EPI(j)    ((j)->ninsns + 1)
+
+static void emit(struct jit_state *j, const u_char *code, u_int len)
+{
+    if (j->buf != NULL)
+        memcpy(j->buf + j->len, code, len);
+    j->len += len;
+}
+
+#define EMIT(j, ...)    do {                            \
+    const u_char bytes__[] = { __VA_ARGS__ };           \
+    emit(j, bytes__, sizeof(bytes__));                  \
+} while (0)
+
+static void emit_imm32(struct jit_state *j, bpf_u_int32 imm)
+{
+    u_char b[4];
+
+    b[0] = imm & 0xff;
+    b[1] = (imm >> 8) & 0xff;
+    b[2] = (imm >> 16) & 0xff;
+    b[3] = (imm >> 24) & 0xff;
+    emit(j, b, 4);
+}
+
+/* jmp rel32 to the code for label 'target'. */
+static void emit_jmp(struct jit_state *j, u_int target)
+{
+    EMIT(j, 0xe9);
+    emit_imm32(j, j->buf ? j->offsets[target] - (j->len + 4) : 0);
+}
+
+/* jcc rel32, where 'cc' is the second opcode byte (0x84 = je, etc.). */
+static void emit_jcc(struct jit_state *j, u_char cc, u_int target)
+{
+    EMIT(j, 0x0f);
+    emit(j, &cc, 1);
+    emit_imm32(j, j->buf ? j->offsets[target] - (j->len + 4) : 0);
+}
+
+/* Load r10 with the constant offset 'k' and branch to the reject label if
+   'size' bytes at that offset are not within buflen (r9). */
+static void emit_abs_bounds_check(struct jit_state *j, bpf_u_int32 k, u_int size)
+{
+    EMIT(j, 0x41, 0xba);            /* mov r10d, k */
+    emit_imm32(j, k);
+    if (size > 1)
+    {
+        EMIT(j, 0x49, 0x83, 0xc2, size);    /* add r10, size */
+        EMIT(j, 0x4d, 0x39, 0xca);  /* cmp r10, r9 */
+        emit_jcc(j, 0x87, JIT_LABEL_RET0(j));   /* ja ret0 */
+    }
+    else
+    {
+        EMIT(j, 0x4d, 0x39, 0xca);  /* cmp r10, r9 */
+        emit_jcc(j, 0x83, JIT_LABEL_RET0(j));   /* jae ret0 */
+    }
+}
+
+/* Load r10 with X + k (32-bit wraparound, as the interpreter computes it)
+   and branch to the reject label if 'size' bytes at that offset are not
+   within buflen. */
+static void emit_ind_bounds_check(struct jit_state *j, bpf_u_int32 k, u_int size)
+{
+    EMIT(j, 0x41, 0x89, 0xda);      /* mov r10d, ebx */
+    EMIT(j, 0x41, 0x81, 0xc2);      /* add r10d, k */
+    emit_imm32(j, k);
+    if (size > 1)
+    {
+        EMIT(j, 0x4d, 0x8d, 0x5a, size);    /* lea r11, [r10 + size] */
+        EMIT(j, 0x4d, 0x39, 0xcb);  /* cmp r11, r9 */
+        emit_jcc(j, 0x87, JIT_LABEL_RET0(j));   /* ja ret0 */
+    }
+    else
+    {
+        EMIT(j, 0x4d, 0x39, 0xca);  /* cmp r10, r9 */
+        emit_jcc(j, 0x83, JIT_LABEL_RET0(j));   /* jae ret0 */
+    }
+}
+
+/* Emit a conditional jump pair for a BPF conditional after the comparison
+   flags have been set.  'cc' is the second opcode byte of the true-case
+   condition, 'icc' its inverse. */
+static void emit_cond(struct jit_state *j, const struct bpf_insn *pc, u_int i,
+                      u_char cc, u_char icc)
+{
+    if (pc->jt == 0)
+        emit_jcc(j, icc, i + 1 + pc->jf);
+    else if (pc->jf == 0)
+        emit_jcc(j, cc, i + 1 + pc->jt);
+    else
+    {
+        emit_jcc(j, cc, i + 1 + pc->jt);
+        emit_jmp(j, i + 1 + pc->jf);
+    }
+}
+
+static int jit_translate(struct jit_state *j, const struct bpf_insn *insns)
+{
+    const struct bpf_insn *pc;
+    u_int i;
+
+    j->len = 0;
+
+    /* Prologue: save X's register, carve out the scratch store, stash the
+       lengths out of the argument registers (edx is clobbered by div), and
+       clear A and X. */
+    EMIT(j, 0x53);                          /* push rbx */
+    EMIT(j, 0x48, 0x83, 0xec, BPF_MEMWORDS * 4);    /* sub rsp, 64 */
+    EMIT(j, 0x41, 0x89, 0xf0);              /* mov r8d, esi */
+    EMIT(j, 0x41, 0x89, 0xd1);              /* mov r9d, edx */
+    EMIT(j, 0x31, 0xc0);                    /* xor eax, eax */
+    EMIT(j, 0x31, 0xdb);                    /* xor ebx, ebx */
+
+    for (i = 0; i < j->ninsns; i++)
+    {
+        pc = &insns[i];
+        j->offsets[i] = j->len;
+        switch (pc->code)
+        {
+            case BPF_RET | BPF_K:
+                EMIT(j, 0xb8);              /* mov eax, k */
+                emit_imm32(j, pc->k);
+                emit_jmp(j, JIT_LABEL_EPI(j));
+                break;
+
+            case BPF_RET | BPF_A:
+                emit_jmp(j, JIT_LABEL_EPI(j));
+                break;
+
+            case BPF_LD | BPF_W | BPF_ABS:
+                emit_abs_bounds_check(j, pc->k, 4);
+                EMIT(j, 0x8b, 0x87);        /* mov eax, [rdi + k] */
+                emit_imm32(j, pc->k);
+                EMIT(j, 0x0f, 0xc8);        /* bswap eax */
+                break;
+
+            case BPF_LD | BPF_H | BPF_ABS:
+                emit_abs_bounds_check(j, pc->k, 2);
+                EMIT(j, 0x0f, 0xb7, 0x87);  /* movzx eax, word [rdi + k] */
+                emit_imm32(j, pc->k);
+                EMIT(j, 0x66, 0xc1, 0xc0, 0x08);    /* rol ax, 8 */
+                break;
+
+            case BPF_LD | BPF_B | BPF_ABS:
+                emit_abs_bounds_check(j, pc->k, 1);
+                EMIT(j, 0x0f, 0xb6, 0x87);  /* movzx eax, byte [rdi + k] */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_LD | BPF_W | BPF_IND:
+                emit_ind_bounds_check(j, pc->k, 4);
+                EMIT(j, 0x42, 0x8b, 0x04, 0x17);    /* mov eax, [rdi + r10] */
+                EMIT(j, 0x0f, 0xc8);        /* bswap eax */
+                break;
+
+            case BPF_LD | BPF_H | BPF_IND:
+                emit_ind_bounds_check(j, pc->k, 2);
+                EMIT(j, 0x42, 0x0f, 0xb7, 0x04, 0x17);  /* movzx eax, word [rdi + r10] */
+                EMIT(j, 0x66, 0xc1, 0xc0, 0x08);    /* rol ax, 8 */
+                break;
+
+            case BPF_LD | BPF_B | BPF_IND:
+                emit_ind_bounds_check(j, pc->k, 1);
+                EMIT(j, 0x42, 0x0f, 0xb6, 0x04, 0x17);  /* movzx eax, byte [rdi + r10] */
+                break;
+
+            case BPF_LDX | BPF_MSH | BPF_B:
+                emit_abs_bounds_check(j, pc->k, 1);
+                EMIT(j, 0x0f, 0xb6, 0x9f);  /* movzx ebx, byte [rdi + k] */
+                emit_imm32(j, pc->k);
+                EMIT(j, 0x83, 0xe3, 0x0f);  /* and ebx, 0xf */
+                EMIT(j, 0xc1, 0xe3, 0x02);  /* shl ebx, 2 */
+                break;
+
+            case BPF_LD | BPF_W | BPF_LEN:
+                EMIT(j, 0x44, 0x89, 0xc0);  /* mov eax, r8d */
+                break;
+
+            case BPF_LDX | BPF_W | BPF_LEN:
+                EMIT(j, 0x44, 0x89, 0xc3);  /* mov ebx, r8d */
+                break;
+
+            case BPF_LD | BPF_IMM:
+                EMIT(j, 0xb8);              /* mov eax, k */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_LDX | BPF_IMM:
+                EMIT(j, 0xbb);              /* mov ebx, k */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_LD | BPF_MEM:
+                EMIT(j, 0x8b, 0x44, 0x24, pc->k * 4);   /* mov eax, [rsp + 4k] */
+                break;
+
+            case BPF_LDX | BPF_MEM:
+                EMIT(j, 0x8b, 0x5c, 0x24, pc->k * 4);   /* mov ebx, [rsp + 4k] */
+                break;
+
+            case BPF_ST:
+                EMIT(j, 0x89, 0x44, 0x24, pc->k * 4);   /* mov [rsp + 4k], eax */
+                break;
+
+            case BPF_STX:
+                EMIT(j, 0x89, 0x5c, 0x24, pc->k * 4);   /* mov [rsp + 4k], ebx */
+                break;
+
+            case BPF_JMP | BPF_JA:
+                emit_jmp(j, i + 1 + pc->k);
+                break;
+
+            case BPF_JMP | BPF_JGT | BPF_K:
+                EMIT(j, 0x3d);              /* cmp eax, k */
+                emit_imm32(j, pc->k);
+                emit_cond(j, pc, i, 0x87, 0x86);    /* ja / jbe */
+                break;
+
+            case BPF_JMP | BPF_JGE | BPF_K:
+                EMIT(j, 0x3d);              /* cmp eax, k */
+                emit_imm32(j, pc->k);
+                emit_cond(j, pc, i, 0x83, 0x82);    /* jae / jb */
+                break;
+
+            case BPF_JMP | BPF_JEQ | BPF_K:
+                EMIT(j, 0x3d);              /* cmp eax, k */
+                emit_imm32(j, pc->k);
+                emit_cond(j, pc, i, 0x84, 0x85);    /* je / jne */
+                break;
+
+            case BPF_JMP | BPF_JSET | BPF_K:
+                EMIT(j, 0xa9);              /* test eax, k */
+                emit_imm32(j, pc->k);
+                emit_cond(j, pc, i, 0x85, 0x84);    /* jne / je */
+                break;
+
+            case BPF_JMP | BPF_JGT | BPF_X:
+                EMIT(j, 0x39, 0xd8);        /* cmp eax, ebx */
+                emit_cond(j, pc, i, 0x87, 0x86);    /* ja / jbe */
+                break;
+
+            case BPF_JMP | BPF_JGE | BPF_X:
+                EMIT(j, 0x39, 0xd8);        /* cmp eax, ebx */
+                emit_cond(j, pc, i, 0x83, 0x82);    /* jae / jb */
+                break;
+
+            case BPF_JMP | BPF_JEQ | BPF_X:
+                EMIT(j, 0x39, 0xd8);        /* cmp eax, ebx */
+                emit_cond(j, pc, i, 0x84, 0x85);    /* je / jne */
+                break;
+
+            case BPF_JMP | BPF_JSET | BPF_X:
+                EMIT(j, 0x85, 0xd8);        /* test eax, ebx */
+                emit_cond(j, pc, i, 0x85, 0x84);    /* jne / je */
+                break;
+
+            case BPF_ALU | BPF_ADD | BPF_X:
+                EMIT(j, 0x01, 0xd8);        /* add eax, ebx */
+                break;
+
+            case BPF_ALU | BPF_SUB | BPF_X:
+                EMIT(j, 0x29, 0xd8);        /* sub eax, ebx */
+                break;
+
+            case BPF_ALU | BPF_MUL | BPF_X:
+                EMIT(j, 0x0f, 0xaf, 0xc3);  /* imul eax, ebx */
+                break;
+
+            case BPF_ALU | BPF_DIV | BPF_X:
+                EMIT(j, 0x85, 0xdb);        /* test ebx, ebx */
+                emit_jcc(j, 0x84, JIT_LABEL_RET0(j));   /* je ret0 */
+                EMIT(j, 0x31, 0xd2);        /* xor edx, edx */
+                EMIT(j, 0xf7, 0xf3);        /* div ebx */
+                break;
+
+            case BPF_ALU | BPF_AND | BPF_X:
+                EMIT(j, 0x21, 0xd8);        /* and eax, ebx */
+                break;
+
+            case BPF_ALU | BPF_OR | BPF_X:
+                EMIT(j, 0x09, 0xd8);        /* or eax, ebx */
+                break;
+
+            case BPF_ALU | BPF_LSH | BPF_X:
+                EMIT(j, 0x89, 0xd9);        /* mov ecx, ebx */
+                EMIT(j, 0xd3, 0xe0);        /* shl eax, cl */
+                break;
+
+            case BPF_ALU | BPF_RSH | BPF_X:
+                EMIT(j, 0x89, 0xd9);        /* mov ecx, ebx */
+                EMIT(j, 0xd3, 0xe8);        /* shr eax, cl */
+                break;
+
+            case BPF_ALU | BPF_ADD | BPF_K:
+                EMIT(j, 0x05);              /* add eax, k */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_ALU | BPF_SUB | BPF_K:
+                EMIT(j, 0x2d);              /* sub eax, k */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_ALU | BPF_MUL | BPF_K:
+                EMIT(j, 0x69, 0xc0);        /* imul eax, eax, k */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_ALU | BPF_DIV | BPF_K:
+                /* bpf_validate() rejects constant division by zero. */
+                EMIT(j, 0x41, 0xba);        /* mov r10d, k */
+                emit_imm32(j, pc->k);
+                EMIT(j, 0x31, 0xd2);        /* xor edx, edx */
+                EMIT(j, 0x41, 0xf7, 0xf2);  /* div r10d */
+                break;
+
+            case BPF_ALU | BPF_AND | BPF_K:
+                EMIT(j, 0x25);              /* and eax, k */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_ALU | BPF_OR | BPF_K:
+                EMIT(j, 0x0d);              /* or eax, k */
+                emit_imm32(j, pc->k);
+                break;
+
+            case BPF_ALU | BPF_LSH | BPF_K:
+                EMIT(j, 0xc1, 0xe0, pc->k & 0x1f);  /* shl eax, k */
+                break;
+
+            case BPF_ALU | BPF_RSH | BPF_K:
+                EMIT(j, 0xc1, 0xe8, pc->k & 0x1f);  /* shr eax, k */
+                break;
+
+            case BPF_ALU | BPF_NEG:
+                EMIT(j, 0xf7, 0xd8);        /* neg eax */
+                break;
+
+            case BPF_MISC | BPF_TAX:
+                EMIT(j, 0x89, 0xc3);        /* mov ebx, eax */
+                break;
+
+            case BPF_MISC | BPF_TXA:
+                EMIT(j, 0x89, 0xd8);        /* mov eax, ebx */
+                break;
+
+            default:
+                return -1;
+        }
+    }
+
+    /* Shared reject path falls through into the epilogue. */
+    j->offsets[JIT_LABEL_RET0(j)] = j->len;
+    EMIT(j, 0x31, 0xc0);                    /* xor eax, eax */
+    j->offsets[JIT_LABEL_EPI(j)] = j->len;
+    EMIT(j, 0x48, 0x83, 0xc4, BPF_MEMWORDS * 4);    /* add rsp, 64 */
+    EMIT(j, 0x5b);                          /* pop rbx */
+    EMIT(j, 0xc3);                          /* ret */
+
+    return 0;
+}
+
+bpf_jit_func_t bpf_jit_compile(const struct bpf_insn *insns, u_int ninsns, size_t *size)
+{
+    struct jit_state state;
+    union bpf_jit_caster caster;
+    void *code;
+
+    if (insns == NULL || ninsns == 0 || !bpf_validate(insns, ninsns))
+        return NULL;
+
+    memset(&state, 0, sizeof(state));
+    state.ninsns = ninsns;
+    state.offsets = calloc(ninsns + 2, sizeof(*state.offsets));
+    if (state.offsets == NULL)
+        return NULL;
+
+    /* Sizing pass. */
+    if (jit_translate(&state, insns) != 0)
+    {
+        free(state.offsets);
+        return NULL;
+    }
+
+    code = mmap(NULL, state.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        free(state.offsets);
+        return NULL;
+    }
+
+    /* Emission pass with the now-final offset table. */
+    *size = state.len;
+    state.buf = code;
+    jit_translate(&state, insns);
+    free(state.offsets);
+
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, *size);
+        return NULL;
+    }
+
+    caster.mem = code;
+    return caster.func;
+}
+
+int bpf_jit_register(const struct bpf_insn *insns, u_int ninsns)
+{
+    struct bpf_jit_entry *entry;
+    union bpf_jit_caster caster;
+    bpf_jit_func_t func;
+    size_t size;
+    unsigned int i;
+
+    func = bpf_jit_compile(insns, ninsns, &size);
+    if (func == NULL)
+        return -1;
+
+    for (i = 0; i < BPF_JIT_REGISTRY_SIZE; i++)
+    {
+        entry = &bpf_jit_registry[i];
+        if (entry->insns != NULL)
+            continue;
+        if (__sync_bool_compare_and_swap(&entry->insns, NULL, BPF_JIT_SLOT_CLAIMED))
+        {
+            entry->func = func;
+            entry->size = size;
+            /* Publish the instruction pointer last so lookups never see a
+               half-initialized slot. */
+            __sync_synchronize();
+            entry->insns = insns;
+            if (i >= bpf_jit_registry_end)
+                bpf_jit_registry_end = i + 1;
+            return 0;
+        }
+    }
+
+    caster.func = func;
+    munmap(caster.mem, size);
+    return -1;
+}
+
+void bpf_jit_unregister(const struct bpf_insn *insns)
+{
+    struct bpf_jit_entry *entry;
+    union bpf_jit_caster caster;
+    unsigned int i;
+
+    if (insns == NULL)
+        return;
+
+    for (i = 0; i < bpf_jit_registry_end; i++)
+    {
+        entry = &bpf_jit_registry[i];
+        if (entry->insns != insns)
+            continue;
+        entry->insns = BPF_JIT_SLOT_CLAIMED;
+        __sync_synchronize();
+        caster.func = entry->func;
+        munmap(caster.mem, entry->size);
+        entry->func = NULL;
+        entry->size = 0;
+        __sync_synchronize();
+        entry->insns = NULL;
+        return;
+    }
+}
+
+bpf_jit_func_t bpf_jit_find(const struct bpf_insn *insns)
+{
+    unsigned int i, end;
+
+    end = bpf_jit_registry_end;
+    for (i = 0; i < end; i++)
+    {
+        if (bpf_jit_registry[i].insns == insns)
+            return bpf_jit_registry[i].func;
+    }
+    return NULL;
+}
+
+#endif /* SFBPF_JIT */
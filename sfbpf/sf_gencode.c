@@ -65,6 +65,7 @@
 #include <memory.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #ifdef MSDOS
@@ -112,6 +113,11 @@
 static jmp_buf top_ctx;
 static char bpf_error_filter[PCAP_ERRBUF_SIZE + 1];
 
+/* The code generator, optimizer, parser, and scanner all keep their state in
+   globals, so compiles are serialized internally rather than requiring every
+   caller to provide its own locking. */
+static pthread_mutex_t compile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* Hack for updating VLAN, MPLS, and PPPoE offsets. */
 #ifdef WIN32
 static u_int orig_linktype = (u_int) - 1, orig_nl = (u_int) - 1, label_stack_depth = (u_int) - 1;
@@ -189,7 +195,6 @@ struct chunk
 static struct chunk chunks[NCHUNKS];
 static int cur_chunk;
 
-static void *newchunk(u_int);
 static void freechunks(void);
 static inline struct block *new_block(int);
 static inline struct slist *new_stmt(int);
@@ -276,7 +281,7 @@ static struct block *gen_check_802_11_data_frame(void);
 static struct block *gen_ppi_dlt_check(void);
 static struct block *gen_msg_abbrev(int type);
 
-static void *newchunk(n)
+void *newchunk(n)
      u_int n;
 {
     struct chunk *cp;
@@ -298,11 +303,16 @@ static void *newchunk(n)
         if (k >= NCHUNKS)
             bpf_error("out of memory");
         size = CHUNK0SIZE << k;
-        cp->m = (void *) malloc(size);
+        /* Chunks are retained across compiles; only allocate the first time
+           the arena grows to this size. */
         if (cp->m == NULL)
-            bpf_error("out of memory");
-        memset((char *) cp->m, 0, size);
-        cp->n_left = size;
+        {
+            cp->m = (void *) malloc(size);
+            if (cp->m == NULL)
+                bpf_error("out of memory");
+            memset((char *) cp->m, 0, size);
+            cp->n_left = size;
+        }
         if (n > size)
             bpf_error("out of memory");
     }
@@ -310,16 +320,25 @@ static void *newchunk(n)
     return (void *) ((char *) cp->m + cp->n_left);
 }
 
+/*
+ * Reset the arena for the next compile.  The chunks themselves are retained
+ * and rezeroed rather than freed, so that after the first compile has grown
+ * the arena to the size of the largest expression seen, subsequent compiles
+ * make no allocator calls at all.  newchunk() hands out zeroed memory, so
+ * the rezeroing here is load-bearing.
+ */
 static void freechunks()
 {
+    size_t size;
     int i;
 
     cur_chunk = 0;
     for (i = 0; i < NCHUNKS; ++i)
         if (chunks[i].m != NULL)
         {
-            free(chunks[i].m);
-            chunks[i].m = NULL;
+            size = CHUNK0SIZE << i;
+            memset(chunks[i].m, 0, size);
+            chunks[i].n_left = size;
         }
 }
 
@@ -377,12 +396,119 @@ static bpf_u_int32 netmask;
 static int snaplen;
 int no_optimize;
 
+/*
+ * Process-wide memoization of compiled programs, keyed by everything that
+ * influences code generation.  Compiling the same expression repeatedly is
+ * the common case when one filter is applied to many DAQ instances (and
+ * again on every config reload), and a full compile of a large expression
+ * is orders of magnitude more expensive than a list walk.
+ *
+ * Cached entries share their instruction array between all holders; the
+ * reference count tracks outstanding pcap_compile() results and the cache
+ * retains its own reference, so entries (and any JIT translation keyed by
+ * the instruction pointer) live for the life of the process.  Like the rest
+ * of the compiler, this is protected by the caller serializing compiles.
+ */
+struct bpf_compile_cache_entry
+{
+    struct bpf_compile_cache_entry *next;
+    char *expr;
+    int snaplen;
+    int linktype;
+    int optimize;
+    bpf_u_int32 mask;
+    struct bpf_insn *insns;
+    u_int ninsns;
+    u_int refcnt;
+};
+
+#define BPF_COMPILE_CACHE_MAX_ENTRIES   128
+
+static struct bpf_compile_cache_entry *bpf_compile_cache;
+static u_int bpf_compile_cache_entries;
+
+static int bpf_compile_cache_lookup(int snaplen_arg, int linktype_arg, int optimize,
+                                    bpf_u_int32 mask, const char *buf, struct bpf_program *program)
+{
+    struct bpf_compile_cache_entry *entry;
+
+    for (entry = bpf_compile_cache; entry != NULL; entry = entry->next)
+    {
+        if (entry->snaplen == snaplen_arg && entry->linktype == linktype_arg &&
+            entry->optimize == optimize && entry->mask == mask &&
+            strcmp(entry->expr, buf) == 0)
+        {
+            entry->refcnt++;
+            program->bf_insns = entry->insns;
+            program->bf_len = entry->ninsns;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void bpf_compile_cache_insert(int snaplen_arg, int linktype_arg, int optimize,
+                                     bpf_u_int32 mask, const char *buf, struct bpf_program *program)
+{
+    struct bpf_compile_cache_entry *entry;
+
+    if (bpf_compile_cache_entries >= BPF_COMPILE_CACHE_MAX_ENTRIES)
+        return;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return;
+    entry->expr = strdup(buf);
+    if (entry->expr == NULL)
+    {
+        free(entry);
+        return;
+    }
+    entry->snaplen = snaplen_arg;
+    entry->linktype = linktype_arg;
+    entry->optimize = optimize;
+    entry->mask = mask;
+    entry->insns = program->bf_insns;
+    entry->ninsns = program->bf_len;
+    entry->refcnt = 1;
+    entry->next = bpf_compile_cache;
+    bpf_compile_cache = entry;
+    bpf_compile_cache_entries++;
+}
+
+/* If 'program' came out of the cache, drop its reference and return 1; the
+   caller must not free the (shared) instruction array. */
+static int bpf_compile_cache_release(struct bpf_program *program)
+{
+    struct bpf_compile_cache_entry *entry;
+
+    for (entry = bpf_compile_cache; entry != NULL; entry = entry->next)
+    {
+        if (entry->insns == program->bf_insns)
+        {
+            if (entry->refcnt > 0)
+                entry->refcnt--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
 DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_program *program, const char *buf, int optimize, bpf_u_int32 mask)
 {
     extern int n_errors;
     const char *volatile xbuf = buf;
     int len;
 
+    pthread_mutex_lock(&compile_mutex);
+
+    if (buf != NULL && snaplen_arg != 0 &&
+        bpf_compile_cache_lookup(snaplen_arg, linktype_arg, optimize, mask, buf, program))
+    {
+        pthread_mutex_unlock(&compile_mutex);
+        return (0);
+    }
+
     no_optimize = 0;
     n_errors = 0;
     root = NULL;
@@ -398,6 +524,7 @@ DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_pro
 #endif
         lex_cleanup();
         freechunks();
+        pthread_mutex_unlock(&compile_mutex);
         return (-1);
     }
 
@@ -407,6 +534,7 @@ DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_pro
     if (snaplen == 0)
     {
         snprintf(bpf_error_filter, PCAP_ERRBUF_SIZE, "snaplen of 0 rejects all packets");
+        pthread_mutex_unlock(&compile_mutex);
         return -1;
     }
 
@@ -431,6 +559,14 @@ DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_pro
 
     lex_cleanup();
     freechunks();
+    if (buf != NULL)
+        bpf_compile_cache_insert(snaplen_arg, linktype_arg, optimize, mask, buf, program);
+#ifdef SFBPF_JIT
+    /* Translate the program to native code; bpf_filter() falls back to the
+       interpreter if this fails for any reason. */
+    bpf_jit_register(program->bf_insns, program->bf_len);
+#endif
+    pthread_mutex_unlock(&compile_mutex);
     return (0);
 }
 
@@ -443,8 +579,21 @@ DAQ_SO_PUBLIC void pcap_freecode(struct bpf_program *program)
     program->bf_len = 0;
     if (program->bf_insns != NULL)
     {
+        pthread_mutex_lock(&compile_mutex);
+        /* Cached programs share their instruction array with the cache (and
+           potentially other compile results); only release our reference. */
+        if (bpf_compile_cache_release(program))
+        {
+            program->bf_insns = NULL;
+            pthread_mutex_unlock(&compile_mutex);
+            return;
+        }
+#ifdef SFBPF_JIT
+        bpf_jit_unregister(program->bf_insns);
+#endif
         free((char *) program->bf_insns);
         program->bf_insns = NULL;
+        pthread_mutex_unlock(&compile_mutex);
     }
 }
 
@@ -71,6 +71,7 @@ struct rtentry;                 /* declarations in <net/if.h> */
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 
 #include "sfbpf-int.h"
@@ -85,6 +86,199 @@ struct rtentry;                 /* declarations in <net/if.h> */
 
 static inline int xdtoi(int);
 
+/*
+ * Resolver cache for filter compilation.
+ *
+ * pcap_nametoaddr() and pcap_nametoaddrinfo() are called synchronously
+ * from sfbpf_compile(), so a filter containing hostnames stalls
+ * compilation - and therefore a config reload - for as long as DNS takes
+ * to answer.  Successful lookups are cached here, a hosts(5)-style file
+ * can be preloaded through sfbpf_resolver_preload() or the
+ * SFBPF_HOSTS_FILE environment variable, and offline mode (set through
+ * sfbpf_resolver_set_offline() or SFBPF_NO_DNS) makes compilation fail
+ * fast on any name that isn't already cached instead of going to the
+ * network, so compile time stays deterministic during reloads.
+ *
+ * No locking: these are only reached from sfbpf_compile(), which is
+ * serialized, and the preload/offline controls are setup-time calls.
+ */
+
+#define RESOLVER_HASH_SIZE 64
+
+struct resolver_entry
+{
+    char *name;
+    bpf_u_int32 *v4addrs;       /* Host byte order */
+    bpf_u_int32 **v4ptrs;       /* NULL-terminated, h_addr_list-style */
+    unsigned nv4;
+    char *literal;              /* Printable form of the first address */
+    struct resolver_entry *next;
+};
+
+static struct resolver_entry *resolver_cache[RESOLVER_HASH_SIZE];
+static int resolver_offline;
+static int resolver_initialized;
+
+static unsigned resolver_hash(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name)
+    {
+        h ^= tolower((unsigned char) *name++);
+        h *= 16777619u;
+    }
+    return h & (RESOLVER_HASH_SIZE - 1);
+}
+
+static struct resolver_entry *resolver_find(const char *name)
+{
+    struct resolver_entry *e;
+
+    for (e = resolver_cache[resolver_hash(name)]; e; e = e->next)
+    {
+        if (strcasecmp(e->name, name) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static struct resolver_entry *resolver_insert(const char *name)
+{
+    struct resolver_entry *e;
+    unsigned h;
+
+    e = resolver_find(name);
+    if (e)
+        return e;
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->name = strdup(name);
+    if (!e->name)
+    {
+        free(e);
+        return NULL;
+    }
+    h = resolver_hash(name);
+    e->next = resolver_cache[h];
+    resolver_cache[h] = e;
+    return e;
+}
+
+static int resolver_add_v4(struct resolver_entry *e, bpf_u_int32 addr)
+{
+    bpf_u_int32 *addrs;
+    bpf_u_int32 **ptrs;
+    unsigned i;
+
+    addrs = realloc(e->v4addrs, (e->nv4 + 1) * sizeof(*addrs));
+    if (addrs == NULL)
+        return -1;
+    e->v4addrs = addrs;
+    addrs[e->nv4] = addr;
+    ptrs = realloc(e->v4ptrs, (e->nv4 + 2) * sizeof(*ptrs));
+    if (ptrs == NULL)
+        return -1;
+    e->v4ptrs = ptrs;
+    /* The address array may have moved; rebuild the pointer list. */
+    for (i = 0; i <= e->nv4; i++)
+        ptrs[i] = &e->v4addrs[i];
+    ptrs[e->nv4 + 1] = NULL;
+    e->nv4++;
+    return 0;
+}
+
+static void resolver_set_literal(struct resolver_entry *e, const char *literal)
+{
+    if (e->literal == NULL)
+        e->literal = strdup(literal);
+}
+
+DAQ_SO_PUBLIC int sfbpf_resolver_preload(const char *path)
+{
+    FILE *fp;
+    char line[1024];
+    struct in_addr in4;
+    struct in6_addr in6;
+    int count = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *addr, *name, *comment, *saveptr = NULL;
+        int family;
+
+        comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        addr = strtok_r(line, " \t\r\n", &saveptr);
+        if (addr == NULL)
+            continue;
+        if (inet_pton(AF_INET, addr, &in4) == 1)
+            family = AF_INET;
+        else if (inet_pton(AF_INET6, addr, &in6) == 1)
+            family = AF_INET6;
+        else
+            continue;
+        while ((name = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL)
+        {
+            struct resolver_entry *e = resolver_insert(name);
+
+            if (e == NULL)
+                continue;
+            if (family == AF_INET && resolver_add_v4(e, ntohl(in4.s_addr)) != 0)
+                continue;
+            resolver_set_literal(e, addr);
+            count++;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+DAQ_SO_PUBLIC void sfbpf_resolver_set_offline(int offline)
+{
+    resolver_offline = offline;
+}
+
+DAQ_SO_PUBLIC void sfbpf_resolver_clear(void)
+{
+    struct resolver_entry *e, *next;
+    unsigned i;
+
+    for (i = 0; i < RESOLVER_HASH_SIZE; i++)
+    {
+        for (e = resolver_cache[i]; e; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e->v4addrs);
+            free(e->v4ptrs);
+            free(e->literal);
+            free(e);
+        }
+        resolver_cache[i] = NULL;
+    }
+}
+
+static void resolver_init(void)
+{
+    const char *val;
+
+    if (resolver_initialized)
+        return;
+    resolver_initialized = 1;
+    val = getenv("SFBPF_HOSTS_FILE");
+    if (val && *val)
+        sfbpf_resolver_preload(val);
+    val = getenv("SFBPF_NO_DNS");
+    if (val && *val && strcmp(val, "0") != 0)
+        resolver_offline = 1;
+}
+
 /*
  *  Convert host name to internet address.
  *  Return 0 upon failure.
@@ -96,6 +290,14 @@ bpf_u_int32 **pcap_nametoaddr(const char *name)
 #endif
     bpf_u_int32 **p;
     struct hostent *hp;
+    struct resolver_entry *e;
+
+    resolver_init();
+    e = resolver_find(name);
+    if (e && e->nv4)
+        return e->v4ptrs;
+    if (resolver_offline)
+        return 0;
 
     if ((hp = gethostbyname(name)) != NULL)
     {
@@ -104,6 +306,27 @@ bpf_u_int32 **pcap_nametoaddr(const char *name)
         NTOHL(hp->h_addr);
         return hlist;
 #else
+        /* Cache the result; the cached list also outlives gethostbyname()'s
+           static buffer, which the next lookup would otherwise clobber. */
+        e = resolver_insert(name);
+        if (e)
+        {
+            struct in_addr in4;
+            char literal[INET_ADDRSTRLEN];
+
+            for (p = (bpf_u_int32 **) hp->h_addr_list; *p; ++p)
+            {
+                if (resolver_add_v4(e, ntohl(**p)) != 0)
+                    break;
+            }
+            if (e->nv4)
+            {
+                in4.s_addr = htonl(e->v4addrs[0]);
+                if (inet_ntop(AF_INET, &in4, literal, sizeof(literal)))
+                    resolver_set_literal(e, literal);
+                return e->v4ptrs;
+            }
+        }
         for (p = (bpf_u_int32 **) hp->h_addr_list; *p; ++p)
             NTOHL(**p);
         return (bpf_u_int32 **) hp->h_addr_list;
@@ -117,12 +340,37 @@ bpf_u_int32 **pcap_nametoaddr(const char *name)
 struct addrinfo *pcap_nametoaddrinfo(const char *name)
 {
     struct addrinfo hints, *res;
+    struct resolver_entry *e;
     int error;
 
+    resolver_init();
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = PF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;    /*not really */
     hints.ai_protocol = IPPROTO_TCP;    /*not really */
+
+    e = resolver_find(name);
+    if (e && e->literal)
+    {
+        /* Resolve the cached literal instead of the name; AI_NUMERICHOST
+           never touches the network.  The result is a freshly allocated
+           chain, so the callers' freeaddrinfo() stays valid.  A name
+           preloaded with several addresses resolves to the first one
+           here - the full IPv4 list is honored via pcap_nametoaddr(). */
+        hints.ai_flags = AI_NUMERICHOST;
+        if (getaddrinfo(e->literal, NULL, &hints, &res) == 0)
+            return res;
+        return NULL;
+    }
+    if (resolver_offline)
+    {
+        /* Fail fast unless the name is already a numeric address. */
+        hints.ai_flags = AI_NUMERICHOST;
+        if (getaddrinfo(name, NULL, &hints, &res) == 0)
+            return res;
+        return NULL;
+    }
+
     error = getaddrinfo(name, NULL, &hints, &res);
     if (error)
         return NULL;
@@ -136,6 +136,7 @@ static void opt_blks(struct block *, int);
 static inline void link_inedge(struct edge *, struct block *);
 static void find_inedges(struct block *);
 static void opt_root(struct block **);
+static int opt_cse(struct block *);
 static void opt_loop(struct block *, int);
 static void fold_op(struct stmt *, int, int);
 static inline struct slist *this_op(struct slist *);
@@ -1767,6 +1768,196 @@ static void opt_root(b)
         (*b)->stmts = 0;
 }
 
+/*
+ * Cross-block common subexpression elimination for absolute packet loads.
+ *
+ * The value numbering in opt_blk() only removes a reload when the
+ * accumulator still holds its value along every path, which is rarely
+ * the case in the code generated for wide disjunctions: each term
+ * clobbers the accumulator with its own load, so long 'or'-chains of
+ * host/port terms fetch the same word or halfword from the packet over
+ * and over.  An absolute load's value depends only on its opcode and
+ * offset (the packet is read-only), so whenever one load dominates
+ * every other occurrence of the same (opcode, offset) pair we can park
+ * the value in a free scratch memory slot at the dominating site and
+ * turn the dominated reloads into scratch loads.  Scratch loads skip
+ * the bounds check and byte swap in both the interpreter and the JIT,
+ * and - unlike packet loads downstream of a value merge - carry a
+ * uniform value number, giving the following opt_loop() pass new
+ * value-propagation and block-merging opportunities.
+ *
+ * Returns true if any loads were rewritten.  Relies on the levels,
+ * dominator sets and block marks left behind by the preceding
+ * opt_loop() invocation.
+ */
+struct cse_site
+{
+    struct block *b;
+    struct slist *s;
+    int pos;
+};
+
+static int opt_cse(root)
+     struct block *root;
+{
+    struct cse_site *sites;
+    struct slist *s, *st;
+    struct block *b;
+    char used[BPF_MEMWORDS];
+    char *taken;
+    int *group;
+    int i, j, n, m, pos, def, slot, ok, changed;
+
+    /*
+     * Find the scratch slots the generated code already uses and count
+     * the absolute load sites.
+     */
+    memset(used, 0, sizeof(used));
+    n = 0;
+    mark_code(root);
+    for (i = 0; i < n_blocks; ++i)
+    {
+        b = blocks[i];
+        if (!isMarked(b))
+            continue;
+        for (s = b->stmts; s; s = s->next)
+        {
+            switch (s->s.code)
+            {
+                case BPF_ST:
+                case BPF_STX:
+                case BPF_LD | BPF_MEM:
+                case BPF_LDX | BPF_MEM:
+                    if (s->s.k < BPF_MEMWORDS)
+                        used[s->s.k] = 1;
+                    break;
+
+                case BPF_LD | BPF_ABS | BPF_W:
+                case BPF_LD | BPF_ABS | BPF_H:
+                case BPF_LD | BPF_ABS | BPF_B:
+                    ++n;
+                    break;
+            }
+        }
+    }
+    if (n < 2)
+        return 0;
+
+    sites = (struct cse_site *) calloc(n, sizeof(*sites));
+    taken = (char *) calloc(n, sizeof(*taken));
+    group = (int *) calloc(n, sizeof(*group));
+    if (sites == NULL || taken == NULL || group == NULL)
+    {
+        free(sites);
+        free(taken);
+        free(group);
+        bpf_error("malloc");
+    }
+    n = 0;
+    for (i = 0; i < n_blocks; ++i)
+    {
+        b = blocks[i];
+        if (!isMarked(b))
+            continue;
+        pos = 0;
+        for (s = b->stmts; s; s = s->next, ++pos)
+        {
+            switch (s->s.code)
+            {
+                case BPF_LD | BPF_ABS | BPF_W:
+                case BPF_LD | BPF_ABS | BPF_H:
+                case BPF_LD | BPF_ABS | BPF_B:
+                    sites[n].b = b;
+                    sites[n].s = s;
+                    sites[n].pos = pos;
+                    ++n;
+                    break;
+            }
+        }
+    }
+
+    changed = 0;
+    slot = 0;
+    for (i = 0; i < n; ++i)
+    {
+        if (taken[i])
+            continue;
+
+        /*
+         * Gather every occurrence of this (opcode, offset) pair.
+         */
+        m = 0;
+        for (j = i; j < n; ++j)
+        {
+            if (!taken[j] &&
+                sites[j].s->s.code == sites[i].s->s.code &&
+                sites[j].s->s.k == sites[i].s->s.k)
+            {
+                taken[j] = 1;
+                group[m++] = j;
+            }
+        }
+        if (m < 2)
+            continue;
+
+        /*
+         * Pick the candidate defining site: the occurrence with the
+         * highest level (closest to the root), breaking ties within a
+         * block in favor of the earliest statement.  Any strict
+         * dominator necessarily has a higher level, so if this site
+         * doesn't dominate the whole group, no site does.
+         */
+        def = group[0];
+        for (j = 1; j < m; ++j)
+        {
+            if (sites[group[j]].b->level > sites[def].b->level ||
+                (sites[group[j]].b == sites[def].b && sites[group[j]].pos < sites[def].pos))
+                def = group[j];
+        }
+        ok = 1;
+        for (j = 0; j < m && ok; ++j)
+        {
+            if (group[j] == def)
+                continue;
+            if (sites[group[j]].b == sites[def].b)
+                ok = sites[group[j]].pos > sites[def].pos;
+            else
+                ok = SET_MEMBER(sites[group[j]].b->dom, sites[def].b->id);
+        }
+        if (!ok)
+            continue;
+
+        while (slot < BPF_MEMWORDS && used[slot])
+            ++slot;
+        if (slot == BPF_MEMWORDS)
+            break;
+        used[slot] = 1;
+
+        /*
+         * Spill the accumulator right after the dominating load and
+         * replace the dominated reloads with scratch loads.
+         */
+        st = (struct slist *) newchunk(sizeof(*st));
+        st->s.code = BPF_ST;
+        st->s.k = slot;
+        st->next = sites[def].s->next;
+        sites[def].s->next = st;
+        for (j = 0; j < m; ++j)
+        {
+            if (group[j] == def)
+                continue;
+            sites[group[j]].s->s.code = BPF_LD | BPF_MEM;
+            sites[group[j]].s->s.k = slot;
+        }
+        changed = 1;
+    }
+
+    free(sites);
+    free(taken);
+    free(group);
+    return changed;
+}
+
 static void opt_loop(root, do_stmts)
      struct block *root;
      int do_stmts;
@@ -1811,6 +2002,8 @@ void bpf_optimize(rootp)
     opt_init(root);
     opt_loop(root, 0);
     opt_loop(root, 1);
+    if (opt_cse(root))
+        opt_loop(root, 1);
     intern_blocks(root);
 #ifdef BDEBUG
     if (dflag > 1)
@@ -48,6 +48,20 @@
 int yylex(void);
 int sfbpf_strcasecmp(const char *s1, const char *s2);
 
+/* Native code generation for compiled filter programs (sf_bpf_jit.c).
+   Only implemented for x86-64 userland; everywhere else the interpreter in
+   sf_bpf_filter.c is the only execution engine. */
+#if defined(__x86_64__) && !defined(WIN32) && !defined(KERNEL) && !defined(_KERNEL)
+#define SFBPF_JIT 1
+
+typedef u_int (*bpf_jit_func_t)(const u_char *p, u_int wirelen, u_int buflen);
+
+bpf_jit_func_t bpf_jit_compile(const struct sfbpf_insn *insns, u_int ninsns, size_t *size);
+int bpf_jit_register(const struct sfbpf_insn *insns, u_int ninsns);
+void bpf_jit_unregister(const struct sfbpf_insn *insns);
+bpf_jit_func_t bpf_jit_find(const struct sfbpf_insn *insns);
+#endif
+
 #define SFBPF_NETMASK_UNKNOWN        0xffffffff
 
 #endif /* _SFBPF_INT_H */
@@ -182,8 +182,21 @@ struct sfbpf_insn {
 int sfbpf_compile(int snaplen_arg, int linktype_arg, struct sfbpf_program *program, const char *buf, int optimize, sfbpf_u_int32 mask);
 int sfbpf_validate(const struct sfbpf_insn *f, int len);
 u_int sfbpf_filter(const struct sfbpf_insn *pc, const u_char *p, u_int wirelen, u_int buflen);
+void sfbpf_filter_batch(const struct sfbpf_insn *pc, const u_char **pkts, const u_int *wirelens,
+                        const u_int *buflens, u_int *results, u_int n);
 void sfbpf_freecode(struct sfbpf_program *program);
 void sfbpf_print(struct sfbpf_program *fp, int verbose);
+
+/*
+ * Resolver cache controls for filter compilation.  Preload a hosts(5)-style
+ * file so hostnames in filters resolve without touching DNS, and/or enable
+ * offline mode so compilation fails fast on names that aren't cached.
+ * Both can also be driven by the SFBPF_HOSTS_FILE and SFBPF_NO_DNS
+ * environment variables.
+ */
+int sfbpf_resolver_preload(const char *path);
+void sfbpf_resolver_set_offline(int offline);
+void sfbpf_resolver_clear(void);
 /*
 #else
 int sfbpf_compile();